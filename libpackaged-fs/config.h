@@ -17,6 +17,11 @@
 #define LENGTH_FSINFO    (4096)
 #define OFFSET_DATA      (LENGTH_BOOTSTRAP + LENGTH_LOOKUP + LENGTH_FSINFO)
 
+// Number of inode IDs (entries in the lookup table) and the number
+// of 64-bit words needed to hold one bit for each of them.
+#define INODE_MAX          (LENGTH_LOOKUP / 4)
+#define INODE_BITMAP_WORDS (INODE_MAX / 64)
+
 // Name of the filesystem implementation.  Must be 9 characters
 // because the automatic terminating NULL character makes it 10
 // in total (and we write out 10 bytes to our FSINFO block).
@@ -36,6 +41,87 @@
 // directory.
 #define DIRECTORY_CHILDREN_MAX 1901
 
+// Number of 4096 byte blocks held by the block cache of a
+// writable package, and the number of independently locked
+// shards they are divided between.  Set CACHE_BLOCKS to 0 to
+// disable the cache entirely.
+#define CACHE_BLOCKS 4096
+#define CACHE_SHARDS 16
+
+// Approximate number of bytes the inode cache of an open package
+// may use.  Set to 0 to disable the cache.
+#define CACHE_INODES_SIZE (4 * 1024 * 1024)
+
+// Number of path components (including ones that do not exist)
+// whose inode is remembered by the path lookup cache of an open
+// package.  Set to 0 to disable the cache.
+#define CACHE_DENTRIES 65536
+
+// The shortest run of free blocks that a multi-block allocation will
+// use; requests that can't be met from longer runs are placed at the
+// end of the package instead, so large files are not scattered over
+// many small gaps.
+#define ALLOCATE_RUN_MIN 16
+
+// When background compaction of a mounted package is enabled, the
+// number of milliseconds the package must be idle before a step of
+// compaction is run, and the number of blocks each step may move.
+#define COMPACT_IDLE_MS 250
+#define COMPACT_BUDGET  256
+
+// Number of freed blocks whose space is collected before it is given
+// back to the host filesystem by punching holes in the package, which
+// also cuts off any free blocks at the end of it.  Set to 1 to release
+// each block as soon as it is freed, or 0 to keep the space.
+#define DISCARD_BATCH 64
+
+// Largest number of 4096 byte blocks set aside in a writable package
+// for the metadata journal, which makes each group of metadata changes
+// reach the package all at once.  The journal is added the first time
+// the package is opened for writing, sized to 1/JOURNAL_RATIO of the
+// package at the time (but at least JOURNAL_BLOCKS_MIN blocks), so it
+// doesn't make small packages much bigger.  Changes are committed to
+// the journal by a mounted package every JOURNAL_COMMIT_MS milliseconds
+// (and whenever it is flushed).  Set JOURNAL_BLOCKS to 0 to write
+// metadata straight to the package; packages that already have a
+// journal keep using it.
+#define JOURNAL_BLOCKS     1024
+#define JOURNAL_BLOCKS_MIN 256
+#define JOURNAL_RATIO      64
+#define JOURNAL_COMMIT_MS  50
+
+// Number of submission queue entries in the io_uring instance used
+// for batched reads.  Set to 0 to always use pread() instead.
+#define ASYNCIO_QUEUE_DEPTH 64
+
+// Number of reader/writer locks that the inodes of an open package
+// are spread over (an inode uses the lock numbered by its ID modulo
+// this), so that file data and attributes can be accessed by several
+// threads at once.
+#define INODE_LOCKS 64
+
+// Number of seconds after which reading a file updates its access
+// time even though the file hasn't changed since it was last read
+// (like relatime, the access time is otherwise only updated when it
+// is older than the modification or change time).
+#define ATIME_INTERVAL (24 * 60 * 60)
+
+// Number of threads that serve requests for a package mounted with
+// the FUSE low-level frontend.
+#define FUSE_THREADS 8
+
+// Number of seconds the kernel may cache the attributes and directory
+// entries (including the absence of an entry) of a mounted package,
+// unless other timeouts are given when it is mounted.  Read-only
+// packages never change, so they are cached for much longer.
+#define FUSE_TIMEOUT          1.0
+#define FUSE_TIMEOUT_READONLY 86400.0
+
+// Largest number of bytes the kernel may read or write in a single
+// request to a mounted package (libfuse can't receive writes larger
+// than 128KB).
+#define FUSE_MAX_TRANSFER (128 * 1024)
+
 // The maximum file size allowed (10MB + data offset from the 32-bit
 // integer limit).
 #define MSIZE_FILE (0xFFFFFFFF - OFFSET_DATA - (1024 * 1024 * 10))
@@ -43,7 +129,9 @@
 // Define the sizes of each of the header types.
 #define HSIZE_FILE       308
 #define HSIZE_SEGINFO    8
+#define HSIZE_EXTENTS    8
 #define HSIZE_FREELIST   8
+#define HSIZE_BITMAP     8
 #define HSIZE_FSINFO     1614
 #define HSIZE_DIRECTORY  294
 
@@ -53,6 +141,13 @@
 #define LIBRARY_VERSION_MINOR 1
 #define LIBRARY_VERSION_REVISION 0
 
+// The newest version of the package format that can be opened.  Packages
+// are created with the library version and are raised to this version
+// when the first file addressed by an extent tree is written to them,
+// since older readers would take the tree for a list of segments.
+#define FORMAT_VERSION_MAJOR 0
+#define FORMAT_VERSION_MINOR 2
+
 #if defined(_MSC_VER)
 typedef signed __int8 int8_t;
 typedef signed __int16 int16_t;
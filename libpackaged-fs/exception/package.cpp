@@ -61,6 +61,16 @@ namespace AppLib
         {
             return "The specified file can not be increased to the required size.";
         }
+
+        const char* ReadOnlyFilesystem::what() const throw()
+        {
+            return "The package was opened read-only and can not be modified.";
+        }
+
+        const char* FileStale::what() const throw()
+        {
+            return "The file was deleted while it was open.";
+        }
     }
 }
 
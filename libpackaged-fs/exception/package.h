@@ -63,6 +63,16 @@ namespace AppLib
         {
             virtual const char* what() const throw();
         };
+
+        class ReadOnlyFilesystem : public std::exception
+        {
+            virtual const char* what() const throw();
+        };
+
+        class FileStale : public std::exception
+        {
+            virtual const char* what() const throw();
+        };
     }
 }
 
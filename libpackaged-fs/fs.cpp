@@ -1,21 +1,106 @@
 /* vim: set ts=4 sw=4 tw=0 :*/
 
+#include <algorithm>
 #include <exception>
 #include <cstdlib>
 #include <libpackaged-fs/fs.h>
 #include <libpackaged-fs/exception/package.h>
 #include <libpackaged-fs/lowlevel/util.h>
+#include <libpackaged-fs/lowlevel/inodelayout.h>
+#include <libpackaged-fs/logging.h>
 #include <linux/kdev_t.h>
+#include <assert.h>
 
 namespace AppLib
 {
-    FS::FS(std::string path, uid_t uid, gid_t gid)
-        : uid(uid), gid(gid)
+    namespace
     {
-        this->stream = new LowLevel::BlockStream(path.c_str());
+        // The context set by setuid and setgid on each thread, and
+        // the package it was set for.
+        struct Context
+        {
+            const FS * owner;
+            uid_t uid;
+            gid_t gid;
+        };
+        thread_local Context context = { NULL, 0, 0 };
+
+        // The tree lock held by the thread, if any, and how.
+        thread_local pthread_rwlock_t * held = NULL;
+        thread_local bool heldExclusive = false;
+
+        // Holds the tree lock of a package until the end of the scope.
+        // Operations call each other, so only the outermost one on the
+        // thread takes it (and must take it in the strongest mode that
+        // any of them need).
+        class TreeLock
+        {
+        public:
+            TreeLock(pthread_rwlock_t * lock, bool exclusive)
+                : lock(NULL)
+            {
+                if (held == lock)
+                {
+                    assert(heldExclusive || !exclusive);
+                    return;
+                }
+                if (exclusive)
+                    pthread_rwlock_wrlock(lock);
+                else
+                    pthread_rwlock_rdlock(lock);
+                held = lock;
+                heldExclusive = exclusive;
+                this->lock = lock;
+            }
+
+            ~TreeLock()
+            {
+                if (this->lock == NULL)
+                    return;
+                held = NULL;
+                heldExclusive = false;
+                pthread_rwlock_unlock(this->lock);
+            }
+
+        private:
+            pthread_rwlock_t * lock;
+        };
+
+        // Holds the lock of an inode until the end of the scope.  Not
+        // needed (and not taken) while the tree lock is held exclusively.
+        class INodeLock
+        {
+        public:
+            INodeLock(LowLevel::FS * filesystem, uint16_t id, bool exclusive)
+                : filesystem(NULL), id(id)
+            {
+                if (heldExclusive)
+                    return;
+                filesystem->lockINode(id, exclusive);
+                this->filesystem = filesystem;
+            }
+
+            ~INodeLock()
+            {
+                if (this->filesystem != NULL)
+                    this->filesystem->unlockINode(this->id);
+            }
+
+        private:
+            LowLevel::FS * filesystem;
+            uint16_t id;
+        };
+    }
+
+    FS::FS(std::string path, uid_t uid, gid_t gid, bool readOnly)
+        : uid(uid), gid(gid), readOnly(readOnly)
+    {
+        pthread_rwlock_init(&this->tree, NULL);
+        this->stream = new LowLevel::BlockStream(path.c_str(), readOnly);
         if (!this->stream->is_open())
         {
             delete this->stream;
+            pthread_rwlock_destroy(&this->tree);
             throw Exception::PackageNotFound();
         }
         this->filesystem = new LowLevel::FS(this->stream);
@@ -24,29 +109,82 @@ namespace AppLib
             this->stream->close();
             delete this->stream;
             delete this->filesystem;
+            pthread_rwlock_destroy(&this->tree);
             throw Exception::PackageNotValid();
         }
+        this->dentries = new LowLevel::DentryCache();
+
+        // Metadata changes are committed as a group every so often, so
+        // that many operations share each write to the journal.
+        this->committing = false;
+        this->stopping = false;
+        pthread_mutex_init(&this->commitMutex, NULL);
+        pthread_cond_init(&this->commitCond, NULL);
+        if (!readOnly && this->stream->hasJournal())
+        {
+            this->committing = (pthread_create(&this->committer, NULL, &FS::runCommitter, this) == 0);
+            if (!this->committing)
+                Logging::showWarningW("Unable to start committing the journal in the background.");
+            else
+            {
+                // Commit early when a burst of operations would
+                // otherwise not fit in the journal.
+                this->stream->setCommitHandler([this]()
+                {
+                    pthread_mutex_lock(&this->commitMutex);
+                    pthread_cond_signal(&this->commitCond);
+                    pthread_mutex_unlock(&this->commitMutex);
+                });
+            }
+        }
+    }
+
+    FS::~FS()
+    {
+        if (this->committing)
+        {
+            this->stream->setCommitHandler(nullptr);
+            pthread_mutex_lock(&this->commitMutex);
+            this->stopping = true;
+            pthread_cond_signal(&this->commitCond);
+            pthread_mutex_unlock(&this->commitMutex);
+            pthread_join(this->committer, NULL);
+        }
+        pthread_cond_destroy(&this->commitCond);
+        pthread_mutex_destroy(&this->commitMutex);
+
+        LowLevel::DentryCacheStatistics stats = this->dentries->getStatistics();
+        Logging::showDebugW("DENTRYCACHE: %llu hits, %llu misses.",
+                (unsigned long long) stats.hits, (unsigned long long) stats.misses);
+        delete this->dentries;
+        this->filesystem->close();
+        delete this->filesystem;
+        delete this->stream;
+        pthread_rwlock_destroy(&this->tree);
     }
 
     void FS::getattr(std::string path, struct stat& stbufOut) const
     {
+        TreeLock lock(&this->tree, false);
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+        this->getattr(buf.inodeid, stbufOut);
+    }
 
-        // Ensure that the inode is also one of the
-        // accepted types.
-        if (buf.type != LowLevel::INodeType::INT_DIRECTORY &&
-                buf.type != LowLevel::INodeType::INT_FILEINFO &&
-                buf.type != LowLevel::INodeType::INT_SYMLINK &&
-                buf.type != LowLevel::INodeType::INT_DEVICE &&
-                buf.type != LowLevel::INodeType::INT_HARDLINK)
+    void FS::getattr(uint16_t id, struct stat& stbufOut) const
+    {
+        TreeLock lock(&this->tree, false);
+        // Only the accepted types are returned by retrieveINode
+        // (hardlinks are already resolved).
+        LowLevel::INode buf;
+        if (!this->retrieveINode(id, buf))
             throw Exception::FileNotFound();
+        this->statINode(buf, stbufOut);
+    }
 
-        // Resolve hardlink if needed.
-        if (buf.type == LowLevel::INodeType::INT_HARDLINK)
-            buf = buf.resolve(this->filesystem);
-
+    void FS::statINode(const LowLevel::INode& buf, struct stat& stbufOut) const
+    {
         // Set the values into the stat structure.
         stbufOut.st_ino = buf.inodeid;
         stbufOut.st_dev = buf.dev;
@@ -86,9 +224,20 @@ namespace AppLib
 
     std::string FS::readlink(std::string path) const
     {
+        TreeLock lock(&this->tree, false);
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+        return this->readlink(buf.inodeid);
+    }
+
+    std::string FS::readlink(uint16_t id) const
+    {
+        TreeLock lock(&this->tree, false);
+        INodeLock ilock(this->filesystem, id, false);
+        LowLevel::INode buf;
+        if (!this->retrieveINode(id, buf))
+            throw Exception::FileNotFound();
 
         if (buf.type == LowLevel::INodeType::INT_SYMLINK)
         {
@@ -116,6 +265,10 @@ namespace AppLib
 
     void FS::mknod(std::string path, mode_t mode, dev_t devid)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        this->ensureWritable();
+
         auto configuration = [&](LowLevel::INode& buf)
         {
             buf.dev = MINOR(devid);
@@ -126,6 +279,10 @@ namespace AppLib
 
     void FS::mkdir(std::string path, mode_t mode)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        this->ensureWritable();
+
         auto configuration = [&](LowLevel::INode& buf)
         {
         };
@@ -134,6 +291,10 @@ namespace AppLib
 
     void FS::unlink(std::string path)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        this->ensureWritable();
+
         LowLevel::INode child, parent;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
@@ -165,6 +326,7 @@ namespace AppLib
             throw Exception::FileNotFound();
         else if (res != LowLevel::FSResult::E_SUCCESS)
             throw Exception::InternalInconsistency();
+        this->forgetEntry(parent.inodeid, LowLevel::Util::extractBasenameFromPath(path));
 
         // If the real inode is a hardlink, we need to reset
         // the hardlink block
@@ -190,6 +352,7 @@ namespace AppLib
                 throw Exception::InternalInconsistency();
             if (this->filesystem->setINodePositionByID(child.inodeid, 0) != LowLevel::FSResult::E_SUCCESS)
                 throw Exception::InternalInconsistency();
+            this->notifyINode(child.inodeid);
         }
         else
         {
@@ -200,6 +363,10 @@ namespace AppLib
 
     void FS::rmdir(std::string path)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        this->ensureWritable();
+
         LowLevel::INode child, parent;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
@@ -227,16 +394,23 @@ namespace AppLib
             throw Exception::FileNotFound();
         else if (res != LowLevel::FSResult::E_SUCCESS)
             throw Exception::InternalInconsistency();
+        this->forgetEntry(parent.inodeid, LowLevel::Util::extractBasenameFromPath(path));
+        this->dentries->removeDirectory(child.inodeid);
 
         // Now reset the block and release the inode ID.
         if (this->filesystem->resetBlock(pos) != LowLevel::FSResult::E_SUCCESS)
             throw Exception::InternalInconsistency();
         if (this->filesystem->setINodePositionByID(child.inodeid, 0) != LowLevel::FSResult::E_SUCCESS)
             throw Exception::InternalInconsistency();
+        this->notifyINode(child.inodeid);
     }
 
     void FS::symlink(std::string linkPath, std::string targetPath)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        this->ensureWritable();
+
         auto configuration = [&](LowLevel::INode& buf)
         {
         };
@@ -269,7 +443,11 @@ namespace AppLib
 
     void FS::rename(std::string srcPath, std::string destPath)
     {
-        this->ensurePathRenamability(destPath, this->uid);
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        this->ensureWritable();
+
+        this->ensurePathRenamability(destPath, this->getContextUID());
         this->ensurePathExists(srcPath);
 
         LowLevel::INode child, srcParent, destParent;
@@ -320,10 +498,16 @@ namespace AppLib
         child.setFilename(LowLevel::Util::extractBasenameFromPath(destPath).c_str());
         this->touchINode(child, "c");
         this->saveINode(child);
+        this->forgetEntry(srcParent.inodeid, LowLevel::Util::extractBasenameFromPath(srcPath));
+        this->forgetEntry(destParent.inodeid, LowLevel::Util::extractBasenameFromPath(destPath));
     }
 
     void FS::link(std::string linkPath, std::string targetPath)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        this->ensureWritable();
+
         this->ensurePathIsAvailable(linkPath);
         this->ensurePathExists(targetPath);
 
@@ -358,9 +542,26 @@ namespace AppLib
 
     void FS::chmod(std::string path, mode_t mode)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        this->ensureWritable();
+
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
+        this->chmod(child.inodeid, mode);
+    }
+
+    void FS::chmod(uint16_t id, mode_t mode)
+    {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        INodeLock ilock(this->filesystem, id, true);
+        this->ensureWritable();
+
+        LowLevel::INode child;
+        if (!this->retrieveINode(id, child))
+            throw Exception::FileNotFound();
         child.mask = this->extractMaskFromMode(mode);
         this->touchINode(child, "ca");
         this->saveINode(child);
@@ -368,9 +569,26 @@ namespace AppLib
 
     void FS::chown(std::string path, uid_t uid, gid_t gid)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        this->ensureWritable();
+
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
+        this->chown(child.inodeid, uid, gid);
+    }
+
+    void FS::chown(uint16_t id, uid_t uid, gid_t gid)
+    {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        INodeLock ilock(this->filesystem, id, true);
+        this->ensureWritable();
+
+        LowLevel::INode child;
+        if (!this->retrieveINode(id, child))
+            throw Exception::FileNotFound();
         if (uid != -1)
             child.uid = uid;
         if (gid != -1)
@@ -381,13 +599,32 @@ namespace AppLib
 
     void FS::truncate(std::string path, off_t size)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        this->ensureWritable();
+
         if (size > MSIZE_FILE)
             throw Exception::FileTooBig();
-        this->ensurePathExists(path);
 
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+        this->truncate(buf.inodeid, size);
+    }
+
+    void FS::truncate(uint16_t id, off_t size)
+    {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        INodeLock ilock(this->filesystem, id, true);
+        this->ensureWritable();
+
+        if (size > MSIZE_FILE)
+            throw Exception::FileTooBig();
+
+        LowLevel::INode buf;
+        if (!this->retrieveINode(id, buf))
+            throw Exception::FileNotFound();
         this->touchINode(buf, "cma");
         this->saveINode(buf);
 
@@ -402,11 +639,19 @@ namespace AppLib
 
     FSFile FS::open(std::string path)
     {
-        this->ensurePathExists(path);
-
+        TreeLock lock(&this->tree, false);
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+        return this->open(buf.inodeid);
+    }
+
+    FSFile FS::open(uint16_t id)
+    {
+        TreeLock lock(&this->tree, false);
+        LowLevel::INode buf;
+        if (!this->retrieveINode(id, buf))
+            throw Exception::FileNotFound();
 
         // Open the file and return it.
         FSFile file = this->filesystem->getFile(buf.inodeid);
@@ -416,25 +661,118 @@ namespace AppLib
 
     std::vector<std::string> FS::readdir(std::string path)
     {
-        this->ensurePathExists(path);
-
+        TreeLock lock(&this->tree, false);
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+
+        // Copy the filenames out of the full entries.
+        std::vector<std::string> result;
+        std::vector<DirectoryEntry> entries = this->readdir(buf.inodeid);
+        result.reserve(entries.size());
+        for (unsigned int i = 0; i < entries.size(); i++)
+            result.push_back(entries[i].name);
+        return result;
+    }
+
+    std::vector<DirectoryEntry> FS::readdir(uint16_t id)
+    {
+        TreeLock lock(&this->tree, false);
+        LowLevel::INode buf;
+        if (!this->retrieveINode(id, buf))
+            throw Exception::FileNotFound();
         if (buf.type != LowLevel::INodeType::INT_DIRECTORY)
             throw Exception::NotADirectory();
 
-        // Copy the filename results from getChildrenOfDirectory.
-        std::vector<std::string> result;
+        // Copy the filename and inode ID of each child returned by
+        // getChildrenOfDirectory (hardlinks are already resolved).
+        std::vector<DirectoryEntry> result;
         std::vector<LowLevel::INode> children =
             this->filesystem->getChildrenOfDirectory(buf.inodeid);
-        for (int i = 0; i < children.size(); i++)
-            result.insert(result.end(), children[i].filename);
+        result.resize(children.size());
+        for (unsigned int i = 0; i < children.size(); i++)
+        {
+            result[i].name = children[i].filename;
+            result[i].inodeid = children[i].inodeid;
+        }
         return result;
     }
 
+    void FS::readdir(std::string path, off_t cookie,
+            std::function<bool(const DirectoryEntry&, const struct stat&, off_t)> filler)
+    {
+        TreeLock lock(&this->tree, false);
+        LowLevel::INode buf;
+        if (!this->retrievePathToINode(path, buf))
+            throw Exception::FileNotFound();
+        this->readdir(buf.inodeid, cookie, filler);
+    }
+
+    void FS::readdir(uint16_t id, off_t cookie,
+            std::function<bool(const DirectoryEntry&, const struct stat&, off_t)> filler)
+    {
+        TreeLock lock(&this->tree, false);
+        LowLevel::INode buf;
+        if (!this->retrieveINode(id, buf))
+            throw Exception::FileNotFound();
+        if (buf.type != LowLevel::INodeType::INT_DIRECTORY)
+            throw Exception::NotADirectory();
+        if (cookie < 0 || cookie >= DIRECTORY_CHILDREN_MAX)
+            return;
+
+        // The cookie of an entry is one past the slot it is in, so
+        // only the slots after it need to be read.
+        std::vector<uint16_t> slots =
+            this->filesystem->getChildSlotsOfDirectory(buf.inodeid, cookie);
+        for (unsigned int i = 0; i < slots.size(); i++)
+        {
+            LowLevel::INode child;
+            if (slots[i] == 0 || !this->retrieveINode(slots[i], child))
+                continue;
+
+            DirectoryEntry entry;
+            entry.name = child.filename;
+            entry.inodeid = child.inodeid;
+            struct stat stbuf;
+            memset(&stbuf, 0, sizeof(struct stat));
+            this->statINode(child, stbuf);
+            if (!filler(entry, stbuf, cookie + i + 1))
+                break;
+        }
+    }
+
+    uint16_t FS::lookup(uint16_t parentid, const std::string& name) const
+    {
+        TreeLock lock(&this->tree, false);
+        LowLevel::INode parent;
+        if (!this->retrieveINode(parentid, parent))
+            throw Exception::FileNotFound();
+        if (parent.type != LowLevel::INodeType::INT_DIRECTORY)
+            throw Exception::NotADirectory();
+        if (name.length() > 255)
+            throw Exception::FilenameTooLong();
+
+        // Resolve the entry (and any hardlink) to the inode it refers to.
+        uint16_t id = this->retrieveChildINodeID(parentid, name);
+        if (id == 0)
+            throw Exception::FileNotFound();
+        LowLevel::INode child = this->filesystem->getINodeByID(id);
+        if (child.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        return child.inodeid;
+    }
+
+    uint32_t FS::getGeneration(uint16_t id) const
+    {
+        return this->filesystem->getINodeGeneration(id);
+    }
+
     void FS::create(std::string path, mode_t mode)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        this->ensureWritable();
+
         auto configuration = [&](LowLevel::INode& buf)
         {
         };
@@ -443,42 +781,265 @@ namespace AppLib
 
     void FS::utimens(std::string path, time_t access, time_t modification)
     {
-        this->ensurePathExists(path);
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        this->ensureWritable();
 
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+        this->utimens(buf.inodeid, access, modification);
+    }
+
+    void FS::utimens(uint16_t id, time_t access, time_t modification)
+    {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        INodeLock ilock(this->filesystem, id, true);
+        this->ensureWritable();
+
+        LowLevel::INode buf;
+        if (!this->retrieveINode(id, buf))
+            throw Exception::FileNotFound();
         buf.atime = access;
         buf.mtime = modification;
         this->saveINode(buf);
     }
 
+    void FS::flush()
+    {
+        // Committing the journal must not see an operation half done.
+        TreeLock lock(&this->tree, true);
+        if (!this->readOnly)
+            this->filesystem->discardFreeBlocks();
+        if (!this->stream->flush())
+            throw Exception::InternalInconsistency();
+    }
+
+    void FS::checkpoint()
+    {
+        TreeLock lock(&this->tree, true);
+        if (!this->readOnly)
+            this->filesystem->discardFreeBlocks();
+        if (!this->stream->checkpoint())
+            throw Exception::InternalInconsistency();
+    }
+
+    void * FS::runCommitter(void * fs)
+    {
+        FS * self = static_cast < FS * >(fs);
+        pthread_mutex_lock(&self->commitMutex);
+        while (!self->stopping)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += JOURNAL_COMMIT_MS / 1000;
+            deadline.tv_nsec += (JOURNAL_COMMIT_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&self->commitCond, &self->commitMutex, &deadline);
+            if (self->stopping)
+                break;
+
+            pthread_mutex_unlock(&self->commitMutex);
+            self->commitJournal();
+            pthread_mutex_lock(&self->commitMutex);
+        }
+        pthread_mutex_unlock(&self->commitMutex);
+        return NULL;
+    }
+
+    void FS::commitJournal()
+    {
+        if (!this->stream->hasPendingChanges())
+            return;
+
+        TreeLock lock(&this->tree, true);
+        this->filesystem->discardFreeBlocks();
+        bool success = this->stream->commit();
+
+        // Writing the journal home before it fills up means commits
+        // rarely have to wait for that.
+        if (success && this->stream->getJournalUsage() >= 50)
+            success = this->stream->checkpoint();
+        if (!success)
+            Logging::showErrorW("Unable to commit changes to the package.");
+    }
+
+    void FS::commitIfDue()
+    {
+        // Only commit between operations, so the transaction is whole.
+        if (held == NULL && this->stream->isCommitDue())
+            this->commitJournal();
+    }
+
+    bool FS::compact(uint32_t budget)
+    {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, true);
+        if (this->readOnly)
+            return true;
+
+        // Each block moved may have to be committed, so a step has to
+        // fit in the journal alongside what the other operations leave.
+        uint32_t capacity = this->stream->getJournalCapacity();
+        if (capacity > 0)
+            budget = std::max < uint32_t > (1, std::min < uint32_t > (budget, capacity / 4));
+        return this->filesystem->compact(budget);
+    }
+
+    bool FS::isReadOnly() const
+    {
+        return this->readOnly;
+    }
+
+    void FS::setChangeHandlers(std::function<void(uint16_t)> inodeChanged,
+            std::function<void(uint16_t, const std::string&)> entryChanged)
+    {
+        TreeLock lock(&this->tree, true);
+        this->inodeChanged = inodeChanged;
+        this->entryChanged = entryChanged;
+    }
+
     void FS::setuid(uid_t uid)
     {
-        this->uid = uid;
+        if (context.owner != this)
+            context.gid = this->gid;
+        context.owner = this;
+        context.uid = uid;
     }
 
     void FS::setgid(gid_t gid)
     {
-        this->gid = gid;
+        if (context.owner != this)
+            context.uid = this->uid;
+        context.owner = this;
+        context.gid = gid;
     }
 
     void FS::touch(std::string path, std::string modes)
     {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        this->ensureWritable();
+
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
+        this->touch(child.inodeid, modes);
+    }
+
+    void FS::touch(uint16_t id, std::string modes)
+    {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        INodeLock ilock(this->filesystem, id, true);
+        this->ensureWritable();
+
+        LowLevel::INode child;
+        if (!this->retrieveINode(id, child))
+            throw Exception::FileNotFound();
         this->touchINode(child, modes);
         this->saveINode(child);
     }
 
+    std::streamsize FS::read(FSFile& file, char* out, size_t length, off_t offset)
+    {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+
+        if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
+            throw Exception::FileTooBig();
+        if (file.isStale())
+            throw Exception::FileStale();
+        if (!this->readOnly && this->isAccessTimeOutdated(file.getINodeID()))
+            this->touch(file.getINodeID(), "a");
+
+        // Only the access time needs the inode to itself; readers
+        // share it for the data.
+        INodeLock ilock(this->filesystem, file.getINodeID(), false);
+        file.clear();
+        file.seekg(offset);
+        std::streamsize count = (length == 0) ? 0 : file.read(out, length);
+        if (file.fail() || file.bad())
+            throw Exception::InternalInconsistency();
+        return count;
+    }
+
+    void FS::write(FSFile& file, const char* in, size_t length, off_t offset)
+    {
+        this->commitIfDue();
+        TreeLock lock(&this->tree, false);
+        INodeLock ilock(this->filesystem, file.getINodeID(), true);
+        this->ensureWritable();
+
+        if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
+            throw Exception::FileTooBig();
+        if (file.isStale())
+            throw Exception::FileStale();
+
+        LowLevel::INode buf;
+        if (!this->retrieveINode(file.getINodeID(), buf))
+            throw Exception::FileNotFound();
+        this->touchINode(buf, "cma");
+        this->saveINode(buf);
+
+        file.clear();
+        file.seekp(offset);
+        file.write(in, length);
+        if (file.fail() || file.bad())
+            throw Exception::InternalInconsistency();
+    }
+
+    std::streamsize FS::locate(FSFile& file, size_t length, off_t offset, std::vector<FSFileRange>& ranges)
+    {
+        if (!this->readOnly || this->stream->hasOverlay())
+            return -1;
+        if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
+            throw Exception::FileTooBig();
+
+        TreeLock lock(&this->tree, false);
+        INodeLock ilock(this->filesystem, file.getINodeID(), false);
+        if (file.isStale())
+            throw Exception::FileStale();
+        file.clear();
+        std::streamsize count = file.locate(offset, length, ranges);
+        if (file.fail() || file.bad())
+            throw Exception::InternalInconsistency();
+        return count;
+    }
+
+    int FS::getDescriptor()
+    {
+        return this->stream->getDescriptor();
+    }
+
     /****
      *
      * PRIVATE METHODS!
      *
      ****/
 
-    void FS::ensurePathIsValid(std::string path) const
+    void FS::ensureWritable() const
+    {
+        if (this->readOnly)
+            throw Exception::ReadOnlyFilesystem();
+    }
+
+    uid_t FS::getContextUID() const
+    {
+        return (context.owner == this) ? context.uid : this->uid;
+    }
+
+    gid_t FS::getContextGID() const
+    {
+        return (context.owner == this) ? context.gid : this->gid;
+    }
+
+    void FS::ensurePathIsValid(const std::string& path) const
     {
         std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
         LowLevel::FSResult::FSResult res = LowLevel::Util::verifyPath(path, components);
@@ -490,34 +1051,19 @@ namespace AppLib
             throw Exception::InternalInconsistency();
     }
 
-    void FS::ensurePathExists(std::string path) const
+    void FS::ensurePathExists(const std::string& path) const
     {
-        this->ensurePathIsValid(path);
-        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
-        LowLevel::INode buf = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < components.size(); i++)
-        {
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid, components[i]);
-            if (buf.type == LowLevel::INodeType::INT_INVALID)
-                throw Exception::FileNotFound();
-        }
+        LowLevel::INode buf;
+        if (!this->retrievePathToINode(path, buf))
+            throw Exception::FileNotFound();
     }
 
     void FS::ensurePathIsAvailable(std::string path) const
     {
-        this->ensurePathIsValid(path);
-        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
-        LowLevel::INode buf = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < components.size() - 1; i++)
-        {
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid, components[i]);
-            if (buf.type == LowLevel::INodeType::INT_INVALID)
-                throw Exception::FileNotFound();
-        }
-        if (components.size() != 0)
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid,
-                    components[components.size() - 1].c_str());
-        if (buf.type == LowLevel::INodeType::INT_INVALID)
+        LowLevel::INode buf;
+        if (!this->retrievePathToINode(path, buf, -1))
+            throw Exception::FileNotFound();
+        if (!this->retrievePathToINode(path, buf))
             return;
         throw Exception::FileExists();
     }
@@ -557,14 +1103,20 @@ namespace AppLib
         return true;
     }
 
-    bool FS::retrievePathToINode(std::string path, LowLevel::INode& out, int limit) const
+    bool FS::retrievePathToINode(const std::string& path, LowLevel::INode& out, int limit) const
     {
         this->ensurePathIsValid(path);
         std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
+        int count = (limit <= 0 ? (int) components.size() + limit : limit);
         out = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < (limit <= 0 ? components.size() - (-limit) : limit); i++)
+        for (int i = 0; i < count; i++)
         {
-            out = this->filesystem->getChildOfDirectory(out.inodeid, components[i]);
+            if (out.type != LowLevel::INodeType::INT_DIRECTORY)
+                return false;
+            uint16_t id = this->retrieveChildINodeID(out.inodeid, components[i]);
+            if (id == 0)
+                return false;
+            out = this->filesystem->getINodeByID(id);
             if (out.type == LowLevel::INodeType::INT_INVALID)
                 return false;
         }
@@ -575,21 +1127,57 @@ namespace AppLib
         return true;
     }
 
-    bool FS::retrieveParentPathToINode(std::string path, LowLevel::INode& out) const
+    bool FS::retrieveParentPathToINode(const std::string& path, LowLevel::INode& out) const
     {
         return this->retrievePathToINode(path, out, -1);
     }
 
-    void FS::saveINode(LowLevel::INode& buf)
+    bool FS::retrieveINode(uint16_t id, LowLevel::INode& out) const
+    {
+        out = this->filesystem->getINodeByID(id);
+        return (out.type == LowLevel::INodeType::INT_DIRECTORY ||
+                out.type == LowLevel::INodeType::INT_FILEINFO ||
+                out.type == LowLevel::INodeType::INT_SYMLINK ||
+                out.type == LowLevel::INodeType::INT_DEVICE);
+    }
+
+    uint16_t FS::retrieveChildINodeID(uint16_t parentid, const std::string& name) const
+    {
+        uint16_t id = 0;
+        if (this->dentries->find(parentid, name, id))
+            return id;
+        id = this->filesystem->getChildIDOfDirectory(parentid, name);
+        this->dentries->put(parentid, name, id);
+        return id;
+    }
+
+    void FS::notifyINode(uint16_t id)
+    {
+        if (this->inodeChanged)
+            this->inodeChanged(id);
+    }
+
+    void FS::forgetEntry(uint16_t parentid, const std::string& name)
+    {
+        this->dentries->remove(parentid, name);
+        if (this->entryChanged)
+            this->entryChanged(parentid, name);
+
+        // Adding or removing an entry changes the directory's times.
+        this->notifyINode(parentid);
+    }
+
+    void FS::saveINode(const LowLevel::INode& buf)
     {
         if (buf.type == LowLevel::INodeType::INT_INVALID ||
                 buf.type == LowLevel::INodeType::INT_UNSET)
             throw Exception::INodeSaveInvalid();
         if (this->filesystem->updateINode(buf) != LowLevel::FSResult::E_SUCCESS)
             throw Exception::INodeSaveFailed();
+        this->notifyINode(buf.inodeid);
     }
 
-    void FS::saveNewINode(uint32_t pos, LowLevel::INode& buf)
+    void FS::saveNewINode(uint32_t pos, const LowLevel::INode& buf)
     {
         if (buf.type == LowLevel::INodeType::INT_INVALID ||
                 buf.type == LowLevel::INodeType::INT_UNSET)
@@ -610,7 +1198,7 @@ namespace AppLib
             return mode; // Keep other information.
     }
 
-    LowLevel::INode FS::assignNewINode(LowLevel::INodeType::INodeType type, uint32_t& posOut)
+    LowLevel::INode FS::assignNewINode(LowLevel::INodeType::INodeType type, uint32_t& posOut, uint32_t hint)
     {
         if (type == LowLevel::INodeType::INT_INVALID ||
                 type == LowLevel::INodeType::INT_UNSET)
@@ -622,7 +1210,7 @@ namespace AppLib
             simple = type;
 
         // Get a free block.
-        posOut = this->filesystem->getFirstFreeBlock(simple);
+        posOut = this->filesystem->getFirstFreeBlock(simple, hint);
         if (posOut == 0)
             throw Exception::NoFreeSpace();
 
@@ -640,6 +1228,7 @@ namespace AppLib
             throw Exception::INodeSaveInvalid();
         if (type != LowLevel::INodeType::INT_SEGINFO &&
                 type != LowLevel::INodeType::INT_FREELIST &&
+                type != LowLevel::INodeType::INT_BITMAP &&
                 this->filesystem->getINodePositionByID(id) != 0)
             throw Exception::INodeSaveInvalid();
 
@@ -657,6 +1246,17 @@ namespace AppLib
         return time(NULL);
     }
 
+    bool FS::isAccessTimeOutdated(uint16_t id)
+    {
+        INodeLock ilock(this->filesystem, id, false);
+
+        LowLevel::INode node;
+        if (!this->retrieveINode(id, node))
+            return false;
+        return node.atime <= node.mtime || node.atime <= node.ctime ||
+               (uint64_t) this->getTime() >= node.atime + ATIME_INTERVAL;
+    }
+
     void FS::touchINode(LowLevel::INode& node, std::string modes)
     {
         if (modes.find('a') != -1)
@@ -677,16 +1277,21 @@ namespace AppLib
         if (!this->retrieveParentPathToINode(path, parent))
             throw Exception::FileNotFound();
 
+        // Place the new inode next to its parent directory, so that
+        // the inodes of a directory can be read mostly sequentially.
         uint32_t pos;
-        LowLevel::INode child = this->assignNewINode(type, pos);
+        uint32_t ppos = this->filesystem->getINodePositionByID(parent.inodeid);
+        LowLevel::INode child = this->assignNewINode(type, pos, (ppos != 0) ? ppos + BSIZE_DIRECTORY : 0);
         try
         {
             child.mask = this->extractMaskFromMode(mode);
             child.ctime = this->getTime();
             child.mtime = this->getTime();
             child.atime = this->getTime();
-            child.uid = this->uid;
-            child.gid = this->gid;
+            child.uid = this->getContextUID();
+            child.gid = this->getContextGID();
+            if (type == LowLevel::INodeType::INT_FILEINFO || type == LowLevel::INodeType::INT_SYMLINK)
+                child.flags = LowLevel::INodeLayout::File::FLAG_EXTENTS;
             configuration(child);
             child.setFilename(LowLevel::Util::extractBasenameFromPath(path).c_str());
             this->saveNewINode(pos, child);
@@ -716,6 +1321,8 @@ namespace AppLib
             throw;
         }
 
+        // The name may have been cached as not existing.
+        this->forgetEntry(parent.inodeid, LowLevel::Util::extractBasenameFromPath(path));
         return child;
     }
 }
@@ -11,38 +11,78 @@
 #include <libpackaged-fs/fsfile.h>
 #include <libpackaged-fs/lowlevel/blockstream.h>
 #include <libpackaged-fs/lowlevel/fs.h>
+#include <libpackaged-fs/lowlevel/dentrycache.h>
 #include <libpackaged-fs/exception/package.h>
 #include <libpackaged-fs/exception/fs.h>
 #include <libpackaged-fs/exception/util.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 
 namespace AppLib
 {
+    //! An entry in a directory listing retrieved by inode ID.
+    struct DirectoryEntry
+    {
+        std::string name;
+        uint16_t inodeid;
+    };
+
     class FS
     {
     private:
         AppLib::LowLevel::BlockStream * stream;
         AppLib::LowLevel::FS * filesystem;
+        AppLib::LowLevel::DentryCache * dentries;
         uid_t uid;
         gid_t gid;
+        bool readOnly;
+
+        // Held shared by operations that only change the attributes or
+        // data of one inode (which lock that inode as well), and
+        // exclusively by operations that change directories or move
+        // blocks around.
+        mutable pthread_rwlock_t tree;
+
+        // The thread that commits the metadata journal of a writable
+        // package every JOURNAL_COMMIT_MS, and what it waits on.
+        pthread_t committer;
+        bool committing;
+        bool stopping;
+        pthread_mutex_t commitMutex;
+        pthread_cond_t commitCond;
+
+        // The functions set by setChangeHandlers.
+        std::function<void(uint16_t)> inodeChanged;
+        std::function<void(uint16_t, const std::string&)> entryChanged;
 
     public:
         //! Opens an existing package.
         /*!
          * Opens a existing package at the specified path.  The
-         * optional uid and gid parameters effectively perform
-         * setuid and setgid for you.
+         * optional uid and gid parameters are the context user and
+         * group used by threads that haven't called setuid and
+         * setgid.
+         *
+         * @note Operations may be called from several threads at
+         *       once, except for operations on the same FSFile.
+         *
+         * @note Packages opened read-only are mapped into memory
+         *       and every operation that would modify them throws
+         *       Exception::ReadOnlyFilesystem.
          *
          * @param path The path to open the package at.
          * @param uid The context user ID to set for package operations.
          * @param gid The context group ID to set for package operations.
+         * @param readOnly Whether to open the package read-only.
          *
          * @throw Exception::PackageNotFound
          * @throw Exception::PackageNotValid
          */
-        FS(std::string packagePath, uid_t uid = 0, gid_t gid = 0);
+        FS(std::string packagePath, uid_t uid = 0, gid_t gid = 0, bool readOnly = false);
+        //! Closes the package, writing back any cached modifications.
+        ~FS();
         //! Retrieves attributes on a file or directory.
         /*!
          * Retrieves attributes on a file, directory, device or
@@ -57,6 +97,39 @@ namespace AppLib
          * @throw Exception::InternalInconsistency
          */
         void getattr(std::string path, struct stat& stbufOut) const;
+        //! Retrieves attributes on an inode.
+        /*!
+         * As getattr(), but for the inode with the specified ID
+         * (for hardlinks, the ID of the file they link to).
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::InternalInconsistency
+         */
+        void getattr(uint16_t id, struct stat& stbufOut) const;
+        //! Looks up an entry in a directory by name.
+        /*!
+         * Returns the ID of the inode that the named entry in the
+         * directory with the specified ID refers to.  Hardlinks are
+         * resolved, so this is the ID used by the other inode-based
+         * operations.  The equivalent of the lookup() operation used
+         * by the kernel for standard filesystems.
+         *
+         * @param parentid The inode ID of the directory.
+         * @param name The name of the entry.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         * @throw Exception::FilenameTooLong
+         */
+        uint16_t lookup(uint16_t parentid, const std::string& name) const;
+        //! Returns the generation of an inode ID.
+        /*!
+         * The generation changes whenever the ID is freed, so that
+         * an inode that is later given the same ID can be told apart
+         * from the one that had it before (e.g. by the kernel, which
+         * keeps node IDs after they are looked up).
+         */
+        uint32_t getGeneration(uint16_t id) const;
         //! Returns the target of a symbolic link.
         /*!
          * Returns the target of a symbolic link. The equivalent
@@ -71,6 +144,8 @@ namespace AppLib
          * @throw Exception::InternalInconsistency
          */
         std::string readlink(std::string path) const;
+        //! Returns the target of a symbolic link by inode ID.
+        std::string readlink(uint16_t id) const;
         //! Creates a device node in the package.
         /*!
          * Creates a new device node in the package.  The equivalent
@@ -193,6 +268,8 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void chmod(std::string path, mode_t mask);
+        //! Changes the permissions on an inode in the package.
+        void chmod(uint16_t id, mode_t mask);
         //! Changes the ownership of a file in the package.
         /*!
          * Changes the ownership of a file, directory, device
@@ -206,6 +283,8 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void chown(std::string path, uid_t uid = -1, gid_t gid = -1);
+        //! Changes the ownership of an inode in the package.
+        void chown(uint16_t id, uid_t uid = -1, gid_t gid = -1);
         //! Truncates a file in the package to a specified size.
         /*!
          * Truncates a file in the package to a specified size.
@@ -224,6 +303,8 @@ namespace AppLib
          * @throw Exception::InternalInconsistency
          */
         void truncate(std::string path, off_t size);
+        //! Truncates a file in the package by inode ID.
+        void truncate(uint16_t id, off_t size);
         //! Opens the file in the package and returns an FSFile.
         /*!
          * Opens a file in the package and returns an FSFile which
@@ -238,6 +319,8 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         FSFile open(std::string path);
+        //! Opens a file in the package by inode ID.
+        FSFile open(uint16_t id);
         //! Lists the entries in a directory.
         /*!
          * Lists all of the entries in a directory excluding
@@ -249,6 +332,30 @@ namespace AppLib
          * @throw Exception::NotADirectory
          */
         std::vector<std::string> readdir(std::string path);
+        //! Lists the names and inode IDs of the entries in a
+        //! directory by inode ID.
+        std::vector<DirectoryEntry> readdir(uint16_t id);
+        //! Lists part of a directory along with the attributes of
+        //! each entry.
+        /*!
+         * Calls filler with each entry after the one that cookie
+         * was given for (or from the first entry when it is 0),
+         * until filler returns false or there are no entries
+         * left.  filler is given the entry, its attributes (as
+         * getattr() returns them) and the cookie to resume after
+         * it.  Cookies stay valid while other entries are added
+         * or removed, so a listing can be read a page at a time.
+         * filler is called while the package is locked, so it
+         * must not call back into it.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         */
+        void readdir(std::string path, off_t cookie,
+                std::function<bool(const DirectoryEntry&, const struct stat&, off_t)> filler);
+        //! Lists part of a directory by inode ID.
+        void readdir(uint16_t id, off_t cookie,
+                std::function<bool(const DirectoryEntry&, const struct stat&, off_t)> filler);
         //! Creates an empty file in the package.
         /*!
          * Creates a new normal, empty file.  The equivalent
@@ -275,13 +382,66 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void utimens(std::string path, time_t access, time_t modification);
+        //! Sets the access and modification times on an inode.
+        void utimens(uint16_t id, time_t access, time_t modification);
+
+        //! Writes all cached modifications back to the package.
+        /*!
+         * Package blocks are cached in memory and modifications are
+         * written back lazily.  This forces them to be written to
+         * the package, e.g. for fsync().  For packages with a metadata
+         * journal, the modifications to metadata are committed to the
+         * journal instead (which is done in the background as well),
+         * and written home later.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void flush();
 
+        //! Writes all cached modifications to their place in the package.
         /*!
-         * Sets the current context UID for package operations.
+         * Like flush(), but the metadata journal is written home as
+         * well, so that the next open has nothing to replay.  Used
+         * when the package is unmounted.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void checkpoint();
+
+        //! Performs a step of defragmenting and shrinking the package.
+        /*!
+         * At most budget blocks are moved by each call, so this can be
+         * called from time to time while the package is mounted.
+         * Returns true once a full pass over the package has been
+         * completed (or if the package is read-only).
+         */
+        bool compact(uint32_t budget);
+
+        /*!
+         * Returns whether the package was opened read-only.
+         */
+        bool isReadOnly() const;
+
+        //! Sets functions to be called when the package changes.
+        /*!
+         * inodeChanged is called with the ID of each inode whose
+         * attributes are changed (or that is removed), and entryChanged
+         * with the parent ID and name of each directory entry that is
+         * added, removed or renamed, e.g. so that a cache of the
+         * package can be kept up to date.  They are called while the
+         * package is locked, so they must not call back into it.
+         */
+        void setChangeHandlers(std::function<void(uint16_t)> inodeChanged,
+                std::function<void(uint16_t, const std::string&)> entryChanged);
+
+        /*!
+         * Sets the context UID for package operations made by the
+         * calling thread.
          */
         void setuid(uid_t uid);
         /*!
-         * Sets the current context GID for package operations.
+         * Sets the context GID for package operations made by the
+         * calling thread.
          */
         void setgid(gid_t gid);
 
@@ -298,15 +458,103 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void touch(std::string path, std::string modes);
+        /*!
+         * Touches the inode with the specified ID.
+         */
+        void touch(uint16_t id, std::string modes);
+
+        //! Reads from a file at the specified offset.
+        /*!
+         * Reads up to length bytes through a file returned by open().
+         * On writable packages, the access time is updated if it is
+         * older than the modification or change time, or more than
+         * ATIME_INTERVAL seconds old, so most reads don't write the
+         * inode (and don't need it to themselves).  Any number
+         * of threads may read the same file at once, as long as each
+         * uses its own FSFile.  Once the file has been deleted (and
+         * its inode ID may have been given to another file), it can
+         * no longer be read or written.
+         *
+         * @return The number of bytes read.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::FileStale
+         * @throw Exception::FileTooBig
+         * @throw Exception::InternalInconsistency
+         */
+        std::streamsize read(FSFile& file, char* out, size_t length, off_t offset);
+        //! Writes to a file at the specified offset.
+        /*!
+         * As read(), but writes length bytes and updates the
+         * modification and change times.
+         *
+         * @throw Exception::ReadOnlyFilesystem
+         * @throw Exception::FileNotFound
+         * @throw Exception::FileStale
+         * @throw Exception::FileTooBig
+         * @throw Exception::InternalInconsistency
+         */
+        void write(FSFile& file, const char* in, size_t length, off_t offset);
+        //! Finds where a file's data is stored in the package.
+        /*!
+         * Appends the position and length of each contiguous run
+         * of the package that holds the data read() would return
+         * for the same arguments, so that it can be read straight
+         * from getDescriptor() (or spliced) instead.  This is only
+         * possible for read-only packages; the data of a writable
+         * package may still be in the block cache, or be moved
+         * once the package is unlocked.  Nor is it possible while
+         * some blocks are read from a journal that hasn't been
+         * applied.
+         *
+         * @return The number of bytes located, or -1 if the
+         *         package is writable or has such a journal.
+         *
+         * @throw Exception::FileStale
+         * @throw Exception::FileTooBig
+         * @throw Exception::InternalInconsistency
+         */
+        std::streamsize locate(FSFile& file, size_t length, off_t offset, std::vector<FSFileRange>& ranges);
+        //! Returns the file descriptor of the package.
+        int getDescriptor();
 
     private:
+        /*!
+         * Runs the background commits of the metadata journal.
+         */
+        static void * runCommitter(void * fs);
+        /*!
+         * Commits the modifications made since the last commit, if any,
+         * releasing freed space and writing the journal home once it is
+         * half full.
+         */
+        void commitJournal();
+        /*!
+         * Commits the journal before an operation that modifies the
+         * package takes the tree lock, if enough modifications are
+         * waiting.  Commits are only made between operations, so this
+         * keeps a burst of operations (which can keep the committer
+         * from getting the tree lock) from overflowing the journal.
+         */
+        void commitIfDue();
+        /*!
+         * Ensures the package may be modified.
+         *
+         * @throw Exception::ReadOnlyFilesystem
+         */
+        void ensureWritable() const;
+        /*!
+         * Returns the context UID and GID of the calling thread.
+         */
+        uid_t getContextUID() const;
+        gid_t getContextGID() const;
         /*!
          * Ensures the specified path is valid.
          *
          * @throw Exception::PathNotValid
          * @throw Exception::FilenameTooLong
          */
-        void ensurePathIsValid(std::string path) const;
+        void ensurePathIsValid(const std::string& path) const;
         /*!
          * Ensures the specified path exists.
          *
@@ -314,7 +562,7 @@ namespace AppLib
          * @throw Exception::PathNotValid
          * @throw Exception::FilenameTooLong
          */
-        void ensurePathExists(std::string path) const;
+        void ensurePathExists(const std::string& path) const;
         /*!
          * Ensures the specified path is available, that is
          * all required parent directories exist, but the
@@ -349,26 +597,55 @@ namespace AppLib
          * indicates the number of path components to evaluate,
          * with negative values counting back from the end.
          */
-        bool retrievePathToINode(std::string path, LowLevel::INode& out, int limit = 0) const;
+        bool retrievePathToINode(const std::string& path, LowLevel::INode& out, int limit = 0) const;
         /*!
          * Retrieves the parent inode to the inode represented
          * by the path, storing the result in out.
          */
-        bool retrieveParentPathToINode(std::string path, LowLevel::INode& out) const;
+        bool retrieveParentPathToINode(const std::string& path, LowLevel::INode& out) const;
+        /*!
+         * Retrieves the ID stored in a directory for the named
+         * child (0 if it does not exist), going through the path
+         * lookup cache.
+         */
+        uint16_t retrieveChildINodeID(uint16_t parentid, const std::string& name) const;
+        /*!
+         * Passes the ID of an inode whose attributes have changed to
+         * the change handler.
+         */
+        void notifyINode(uint16_t id);
+        /*!
+         * Forgets the named entry of a directory in the path lookup
+         * cache, and passes it to the change handlers.
+         */
+        void forgetEntry(uint16_t parentid, const std::string& name);
+        /*!
+         * Retrieves the inode with the specified ID (resolving
+         * hardlinks), storing the result in out.  Returns false
+         * if it is not a file, directory, symlink or device.
+         */
+        bool retrieveINode(uint16_t id, LowLevel::INode& out) const;
+        /*!
+         * Fills in a stat structure from an inode returned by
+         * retrieveINode().
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void statINode(const LowLevel::INode& buf, struct stat& stbufOut) const;
         /*!
          * Saves an existing inode to disk.
          * 
          * @throw Exception::INodeSaveInvalid
          * @throw Exception::INodeSaveFailed
          */
-        void saveINode(LowLevel::INode& buf);
+        void saveINode(const LowLevel::INode& buf);
         /*!
          * Saves the new inode to disk.
          *
          * @throw Exception::INodeSaveInvalid
          * @throw Exception::INodeSaveFailed
          */
-        void saveNewINode(uint32_t pos, LowLevel::INode& buf);
+        void saveNewINode(uint32_t pos, const LowLevel::INode& buf);
         /*!
          * Extracts the permissions mask from the full mode
          * information.
@@ -376,18 +653,25 @@ namespace AppLib
         int extractMaskFromMode(mode_t mode) const;
         /*!
          * Assigns a new inode the specified type and stores the
-         * position of the new inode into posOut.
+         * position of the new inode into posOut.  The inode is placed
+         * as close as possible to the hint position (usually the
+         * parent directory's inode) when one is given.
          *
          * @throw Exception::INodeSaveInvalid
          * @throw Exception::INodeSaveFailed
          * @throw Exception::NoFreeSpace
          * @throw Exception::INodeExhaustion
          */
-        LowLevel::INode assignNewINode(LowLevel::INodeType::INodeType type, uint32_t& posOut);
+        LowLevel::INode assignNewINode(LowLevel::INodeType::INodeType type, uint32_t& posOut, uint32_t hint = 0);
         /*!
          * Retrieves the current time on the local machine.
          */
         time_t getTime() const;
+        /*!
+         * Returns whether reading the inode with the specified ID
+         * should update its access time (see read()).
+         */
+        bool isAccessTimeOutdated(uint16_t id);
         /*!
          * Touches the specified inode, updating each of the
          * specified times to the current time on the local
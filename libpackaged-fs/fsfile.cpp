@@ -24,6 +24,9 @@ namespace AppLib
         this->posg = 0;
         this->posp = 0;
         this->state = std::ios::goodbit;
+        this->generation = 0;
+        this->mapped = false;
+        this->inodeGeneration = filesystem->getINodeGeneration(inodeid);
     }
 
     void FSFile::open(std::ios_base::openmode mode)
@@ -64,173 +67,58 @@ namespace AppLib
         if (this->bad() || this->fail())
             return;
 
-        if (this->invalid || !this->opened)
+        if (this->invalid || !this->opened || this->fd->isReadOnly())
         {
             this->clear(std::ios::badbit | std::ios::failbit);
             return;
         }
 
-        // Store the current positions.
-        std::streampos oldg = this->fd->tellg();
-        std::streampos oldp = this->fd->tellp();
-
-        // Get the base position of the specified inode.
-        uint32_t bpos = this->filesystem->getINodePositionByID(this->inodeid);
-
-        // Get the total size of the file (for detected when to EOF).
-        uint32_t fsize = this->size();
+        if (count <= 0)
+            return;
 
         // If we need to truncate the file to a new size, do so.
-        if (fsize < this->posp + count)
+        if (this->size() < this->posp + count)
         {
             if (!this->truncate(this->posp + count))
             {
                 this->clear(std::ios::badbit | std::ios::failbit);
                 return;
             }
-
-            // Re-get the size.
-            fsize = this->size();
         }
 
-        // Calculate the number of blocks we will have to write.
-        uint32_t bstart = (this->posp / 4096);
-        uint32_t bend = ((this->posp + count - 1) / 4096);
-
-        // Loop through all of the blocks in the file
-        // First we get a list of all of the segments to write, starting
-        // at this->posp until this->posp + count.
-        uint32_t bcount = 0;
-        uint32_t doff = 0;
-        uint32_t spos = 0;
-        uint32_t ipos = bpos;
-        uint32_t hsize = HSIZE_FILE;
-        while (ipos != 0)
+        // Look up the blocks we will have to write to.
+        uint32_t bstart = (this->posp / BSIZE_FILE);
+        uint32_t bend = ((this->posp + count - 1) / BSIZE_FILE);
+        if (!this->map() || bend >= this->blocks.size())
         {
-            for (int i = hsize; i < BSIZE_FILE; i += 4)
-            {
-                this->fd->seekg(bpos + i);
-                spos = 0;
-                Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-
-                if (fsize - this->posp == 0)
-                {
-                    // We've hit EOF.  Return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    this->clear(std::ios::eofbit);
-                    return;
-                }
-
-                if (spos == 0)
-                {
-                    // We've run out of segments to write to (this shouldn't
-                    // happen because we truncated the file).
-                    ipos = 0;	// Make it jump out of the while() loop.
-                    this->clear(std::ios::eofbit | std::ios::failbit);
-                    return;
-                }
-
-                if (bcount < bstart)
-                {
-                    // Before the data needs to be read.
-                    bcount += 1;
-                    continue;
-                }
-                else if (bcount == bstart)
-                {
-                    // First block to read.  Calculate how many
-                    // bytes to read (as it may not be the full block).
-                    uint32_t soff = this->posp - ((this->posp / 4096) * 4096);
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > (BSIZE_FILE - soff, fsize - this->posp));
-
-                    // Seek the correct position.
-                    this->fd->seekp(spos + soff);
-
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
-
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-
-                    if (bcount == bend)
-                    {
-                        // We're going to finish writing on this block too.
-                        this->fd->seekg(oldg);
-                        this->fd->seekp(oldp);
-                        if (this->posg == fsize)
-                            this->clear(std::ios::eofbit);
-                        return;
-                    }
-                }
-                else if (bcount > bstart && bcount < bend)
-                {
-                    // A block in the middle which must be completely
-                    // written to.
-
-                    // Calculate how many bytes to write.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posp));
-
-                    // Seek the correct position.
-                    this->fd->seekp(spos);
-
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
-
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-                }
-                else if (bcount > bstart && bcount == bend)
-                {
-                    // Last block to write to.  Calculate how many bytes
-                    // to write in the last block.
-                    uint32_t srem = count - doff;
-
-                    // Calculate how many bytes to write.
-                    uint32_t stotal = std::min < uint32_t > (srem, std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posp)));
-
-                    // Seek the correct position.
-                    this->fd->seekp(spos);
-
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
-
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-
-                    // Now that we've reached the last block, we've
-                    // written all the data and can now return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    if (this->posp == fsize)
-                        this->clear(std::ios::eofbit);
-                    return;
-                }
-                else
-                {
-                    // End of writing..  Return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    if (this->posp == fsize)
-                        this->clear(std::ios::eofbit);
-                    return;
-                }
-
-                bcount += 1;
-            }
-            hsize = HSIZE_SEGINFO;
-            INode inode = this->filesystem->getINodeByPosition(ipos);
-            ipos = inode.info_next;
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return;
         }
 
-        // Set the fail bit if we get here, because we shouldn't.
-        this->clear(std::ios::badbit | std::ios::failbit);
-        return;
+        // Build one request per block (the first one may start part
+        // way through its block) and submit them as a single batch.
+        std::vector < BlockRequest > requests;
+        requests.reserve(bend - bstart + 1);
+        std::streamsize doff = 0;
+        uint32_t soff = this->posp % BSIZE_FILE;
+        for (uint32_t i = bstart; i <= bend; i += 1)
+        {
+            BlockRequest req;
+            req.pos = this->blocks[i] + soff;
+            req.data = const_cast < char *>(data + doff);
+            req.count = std::min < std::streamsize > (BSIZE_FILE - soff, count - doff);
+            req.result = 0;
+            requests.push_back(req);
+            doff += req.count;
+            soff = 0;
+        }
+        // File data doesn't go through the metadata journal.
+        if (!this->fd->writeBatch(requests, false))
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return;
+        }
+        this->posp += count;
     }
 
     std::streamsize FSFile::read(char *out, std::streamsize count)
@@ -244,173 +132,108 @@ namespace AppLib
             return 0;
         }
 
-        // Store the current positions.
-        std::streampos oldg = this->fd->tellg();
-        std::streampos oldp = this->fd->tellp();
+        // Get the total size of the file (for detected when to EOF).
+        uint32_t fsize = this->size();
+        if (this->posg >= fsize)
+        {
+            this->clear(std::ios::eofbit);
+            return 0;
+        }
+        if (count > fsize - this->posg)
+            count = fsize - this->posg;
+        if (count <= 0)
+            return 0;
+
+        // Calculate the range of blocks we will have to read and
+        // resolve all of their positions up front.
+        uint32_t bstart = (this->posg / BSIZE_FILE);
+        uint32_t bend = ((this->posg + count - 1) / BSIZE_FILE);
+        if (!this->map() || bend >= this->blocks.size())
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return 0;
+        }
 
-        // Get the base position of the specified inode.
-        uint32_t bpos = this->filesystem->getINodePositionByID(this->inodeid);
+        // Build one request per block (the first one may start part
+        // way through its block) and submit them as a single batch.
+        std::vector < BlockRequest > requests;
+        requests.reserve(bend - bstart + 1);
+        std::streamsize doff = 0;
+        uint32_t soff = this->posg % BSIZE_FILE;
+        for (uint32_t i = bstart; i <= bend; i += 1)
+        {
+            BlockRequest req;
+            req.pos = this->blocks[i] + soff;
+            req.data = out + doff;
+            req.count = std::min < std::streamsize > (BSIZE_FILE - soff, count - doff);
+            req.result = 0;
+            requests.push_back(req);
+            doff += req.count;
+            soff = 0;
+        }
+        this->fd->readBatch(requests);
 
-        // Calculate the number of blocks we will have to read.
-        uint32_t bstart = (this->posg / 4096);
-        uint32_t bend = ((this->posg + count - 1) / 4096);
+        // Only count data up to the first short or failed block, so
+        // that the caller never sees a hole in the middle of a read.
+        doff = 0;
+        for (unsigned int i = 0; i < requests.size(); i += 1)
+        {
+            if (requests[i].result <= 0)
+                break;
+            doff += requests[i].result;
+            if (requests[i].result < requests[i].count)
+                break;
+        }
+        this->posg += doff;
 
-        // Get the total size of the file (for detected when to EOF).
+        if (this->posg == fsize || doff < count)
+            this->clear(std::ios::eofbit);
+        return doff;
+    }
+
+    std::streamsize FSFile::locate(uint32_t pos, std::streamsize count, std::vector < FSFileRange > & out)
+    {
+        if (this->bad() || this->fail())
+            return 0;
+
+        if (this->invalid || !this->opened)
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return 0;
+        }
+
+        // Clip the range to the end of the file, as read() does.
         uint32_t fsize = this->size();
+        if (pos >= fsize || count <= 0)
+            return 0;
+        if (count > fsize - pos)
+            count = fsize - pos;
 
-        // First we get a list of all of the segments to read, starting
-        // at this->posg until this->posg + count.
-        uint32_t bcount = 0;
-        uint32_t doff = 0;
-        uint32_t spos = 0;
-        uint32_t ipos = bpos;
-        uint32_t hsize = HSIZE_FILE;
-        while (ipos != 0)
+        uint32_t bstart = (pos / BSIZE_FILE);
+        uint32_t bend = ((pos + count - 1) / BSIZE_FILE);
+        if (!this->map() || bend >= this->blocks.size())
         {
-            for (int i = hsize; i < BSIZE_FILE; i += 4)
-            {
-                this->fd->seekg(bpos + i);
-                spos = 0;
-                Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-
-                if (fsize - this->posg == 0)
-                {
-                    // We've hit EOF.  Return.
-                    this->fd->seekg(oldg);
-                    this->clear(std::ios::eofbit);
-                    return doff;
-                }
-
-                if (spos == 0)
-                {
-                    // We've run out of segments to read.
-                    ipos = 0;	// Make it jump out of the while() loop.
-                    this->clear(std::ios::eofbit);
-                    return doff;
-                }
-
-                if (bcount < bstart)
-                {
-                    // Before the data needs to be read.
-                    bcount += 1;
-                    continue;
-                }
-                else if (bcount == bstart)
-                {
-                    // First block to read.  Calculate how many
-                    // bytes to read (as it may not be the full block).
-                    uint32_t soff = this->posg - ((this->posg / 4096) * 4096);
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE - soff, fsize - this->posg));
-
-                    // Seek the correct position.
-                    this->fd->seekg(spos + soff);
-
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
-
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
-
-                    if (bcount == bend)
-                    {
-                        // We're going to finish reading on this block too.
-                        this->fd->seekg(oldg);
-                        if (this->posg == fsize)
-                            this->clear(std::ios::eofbit);
-                        return doff;
-                    }
-                }
-                else if (bcount > bstart && bcount < bend)
-                {
-                    // A block in the middle which must be completely
-                    // read (up to EOF of course).
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posg));
-
-                    // Seek the correct position.
-                    this->fd->seekg(spos);
-
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
-
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
-                }
-                else if (bcount > bstart && bcount == bend)
-                {
-                    // Last block to read.  Calculate how many bytes
-                    // to read in the last block.
-                    uint32_t srem = count - doff;
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (srem, std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posg)));
-
-                    // Seek the correct position.
-                    this->fd->seekg(spos);
-
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
-
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
-
-                    // Now that we've reached the last block, we've
-                    // read all the data and can now return.
-                    this->fd->seekg(oldg);
-                    if (this->posg == fsize)
-                        this->clear(std::ios::eofbit);
-                    return doff;
-                }
-                else
-                {
-                    // End of reading..  Return.
-                    this->fd->seekg(oldg);
-                    if (this->posg == fsize)
-                        this->clear(std::ios::eofbit);
-                    return doff;
-                }
-
-                bcount += 1;
-            }
-            hsize = HSIZE_SEGINFO;
-            INode inode = this->filesystem->getINodeByPosition(ipos);
-            ipos = inode.info_next;
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return 0;
         }
 
-        // If we get here, then there wasn't any blocks to read or the original
-        // request to grab the inode based on ID failed, so we return 0 (for no
-        // data read).
-        return 0;
+        // Describe each block's part of the range, joining it to the
+        // previous range when the blocks are adjacent in the package.
+        std::streamsize doff = 0;
+        uint32_t soff = pos % BSIZE_FILE;
+        for (uint32_t i = bstart; i <= bend; i += 1)
+        {
+            FSFileRange range;
+            range.pos = this->blocks[i] + soff;
+            range.length = std::min < std::streamsize > (BSIZE_FILE - soff, count - doff);
+            if (i != bstart && out.back().pos + out.back().length == range.pos)
+                out.back().length += range.length;
+            else
+                out.push_back(range);
+            doff += range.length;
+            soff = 0;
+        }
+        return doff;
     }
 
     bool FSFile::truncate(std::streamsize len)
@@ -418,16 +241,65 @@ namespace AppLib
         if (this->bad() || this->fail())
             return false;
 
-        FSResult::FSResult fres = this->filesystem->truncateFile(this->inodeid, len);
+        if (this->fd->isReadOnly())
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return false;
+        }
+
+        // Let the filesystem update our block map as it goes, as long
+        // as it was current to begin with.
+        bool mapped = this->map();
+        FSResult::FSResult fres = this->filesystem->truncateFile(this->inodeid, len, mapped ? &this->blocks : NULL);
+        if (mapped)
+            this->generation = this->filesystem->getFileGeneration(this->inodeid);
         return (fres == FSResult::E_SUCCESS);
     }
 
+    bool FSFile::map()
+    {
+        // Another handle may have shrunk the file (or it may have been
+        // deleted and its blocks reused), in which case start again.
+        uint32_t generation = this->filesystem->getFileGeneration(this->inodeid);
+        if (!this->mapped || this->generation != generation)
+        {
+            this->blocks.clear();
+            this->generation = generation;
+            this->mapped = true;
+        }
+
+        // Fetch the positions of any blocks that have been added since
+        // we last looked.
+        uint32_t total = ceil(this->size() / (double) BSIZE_FILE);
+        if (this->blocks.size() < total)
+        {
+            FSResult::FSResult fres = this->filesystem->getFileBlocks(this->inodeid,
+                    this->blocks.size(), total - this->blocks.size(), this->blocks);
+            if (fres != FSResult::E_SUCCESS)
+            {
+                this->mapped = false;
+                return false;
+            }
+        }
+        return true;
+    }
+
     uint32_t FSFile::size()
     {
         INode fnode = this->filesystem->getINodeByID(this->inodeid);
         return fnode.dat_len;
     }
 
+    uint16_t FSFile::getINodeID()
+    {
+        return this->inodeid;
+    }
+
+    bool FSFile::isStale()
+    {
+        return (this->filesystem->getINodeGeneration(this->inodeid) != this->inodeGeneration);
+    }
+
     void FSFile::close()
     {
         this->opened = false;
@@ -6,6 +6,7 @@
 #include <libpackaged-fs/config.h>
 
 #include <iostream>
+#include <vector>
 #include <libpackaged-fs/lowlevel/blockstream.h>
 
 namespace AppLib
@@ -15,6 +16,14 @@ namespace AppLib
         class FS;
     }
 
+    //! A run of a file's data that is stored contiguously in the
+    //! package, by its position in the package and its length.
+    struct FSFileRange
+    {
+        uint32_t pos;
+        uint32_t length;
+    };
+
     class FSFile
     {
     public:
@@ -23,6 +32,7 @@ namespace AppLib
         void open(int mode); // FIXME: Workaround for Cython.
         void write(const char *data, std::streamsize count);
         std::streamsize read(char *out, std::streamsize count);
+        std::streamsize locate(uint32_t pos, std::streamsize count, std::vector < FSFileRange > & out);
         bool truncate(std::streamsize len);
         void close();
         void seekp(std::streampos pos);
@@ -30,6 +40,11 @@ namespace AppLib
         std::streampos tellp();
         std::streampos tellg();
         uint32_t size();
+        uint16_t getINodeID();
+
+        // Returns whether the inode ID has been freed (and possibly
+        // reused by another file) since the file was opened.
+        bool isStale();
 
         // State functions.
         std::ios::iostate rdstate();
@@ -49,6 +64,18 @@ namespace AppLib
         uint32_t posp;
         uint32_t posg;
         std::ios::iostate state;
+
+        // The generation of the inode ID when the file was opened.
+        uint32_t inodeGeneration;
+
+        // The positions of the file's data blocks, in order, and the
+        // file generation they were read at.
+        std::vector < uint32_t > blocks;
+        uint32_t generation;
+        bool mapped;
+
+        // Brings the block map up to date with the file.
+        bool map();
     };
 }
 
@@ -14,8 +14,23 @@ namespace AppLib
         FS * FuseLink::filesystem = NULL;
         void (*FuseLink::continuefunc) (void) = NULL;
 
+        FUSETimeouts::FUSETimeouts()
+            : attr(-1.0), entry(-1.0), negative(-1.0)
+        {
+        }
+
+        FUSETimeouts FUSETimeouts::resolve(double fallback) const
+        {
+            FUSETimeouts result;
+            result.attr = (this->attr < 0.0) ? fallback : this->attr;
+            result.entry = (this->entry < 0.0) ? fallback : this->entry;
+            result.negative = (this->negative < 0.0) ? fallback : this->negative;
+            return result;
+        }
+
         Mounter::Mounter(std::string image, std::string mount,
-                bool foreground, bool allow_other, void (*continuefunc) (void))
+                bool foreground, bool allow_other, bool read_only,
+                void (*continuefunc) (void), const FUSETimeouts& timeouts)
         {
             this->mountResult = -EALREADY;
 
@@ -35,11 +50,13 @@ namespace AppLib
             ops.truncate = &FuseLink::truncate;
             ops.open = &FuseLink::open;
             ops.read = &FuseLink::read;
+            ops.read_buf = &FuseLink::read_buf;
+            ops.write_buf = NULL;
             ops.write = &FuseLink::write;
             ops.statfs = NULL;
             ops.flush = NULL;
-            ops.release = NULL;
-            ops.fsync = NULL;
+            ops.release = &FuseLink::release;
+            ops.fsync = &FuseLink::fsync;
             ops.setxattr = NULL;
             ops.getxattr = NULL;
             ops.listxattr = NULL;
@@ -62,7 +79,7 @@ namespace AppLib
 
             // Attempt to open the package and set
             // continuation function.
-            FuseLink::filesystem = new FS(image);
+            FuseLink::filesystem = new FS(image, 0, 0, read_only);
             FuseLink::continuefunc = continuefunc;
 
             // Mounts the specified disk image at the
@@ -92,18 +109,26 @@ namespace AppLib
                 }
             }
 
-            const char *normal_opts = "default_permissions,use_ino,attr_timeout=0,entry_timeout=0";
-            const char *allow_opts = "allow_other,default_permissions,use_ino,attr_timeout=0,entry_timeout=0";
-            const char *opts = NULL;
+            FUSETimeouts resolved = timeouts.resolve(read_only ? FUSE_TIMEOUT_READONLY : 0.0);
+            char cache[128];
+            snprintf(cache, sizeof(cache), "attr_timeout=%g,entry_timeout=%g,negative_timeout=%g",
+                    resolved.attr, resolved.entry, resolved.negative);
+            std::string opts = "default_permissions,use_ino," + std::string(cache) +
+                FuseLink::getTransferOptions(read_only);
+            if (read_only)
+                opts = "kernel_cache," + opts;
             if (allow_other)
             {
                 Logging::showInfoW("Allowing other users access to filesystem.");
-                opts = allow_opts;
+                opts = "allow_other," + opts;
+            }
+            if (read_only)
+            {
+                Logging::showInfoW("Mounting filesystem read-only.");
+                opts = "ro," + opts;
             }
-            else
-                opts = normal_opts;
 
-            if (fuse_opt_add_arg(&fargs, "-s") == -1 || fuse_opt_add_arg(&fargs, "-o") || fuse_opt_add_arg(&fargs, opts) == -1 || fuse_opt_add_arg(&fargs, mount.c_str()) == -1)
+            if (fuse_opt_add_arg(&fargs, "-o") == -1 || fuse_opt_add_arg(&fargs, opts.c_str()) == -1 || fuse_opt_add_arg(&fargs, mount.c_str()) == -1)
             {
                 Logging::showErrorW("Unable to set FUSE options.");
                 fuse_opt_free_args(&fargs);
@@ -113,17 +138,33 @@ namespace AppLib
 
             FUSEData appfs_status;
             appfs_status.filesystem = FuseLink::filesystem;
-            appfs_status.readonly = false;
+            appfs_status.readonly = read_only;
             appfs_status.mount = mount;
             appfs_status.image = image;
 
             this->mountResult = fuse_main(fargs.argc, fargs.argv, &ops, &appfs_status);
+
+            // The FUSE threads have been joined, so the package can be
+            // closed, which marks its free space bitmap as up to date.
+            delete FuseLink::filesystem;
+            FuseLink::filesystem = NULL;
         }
 
         int Mounter::getResult()
         {
             return this->mountResult;
         }
+
+        FUSEFile::FUSEFile(const FSFile& file)
+            : file(file)
+        {
+            pthread_mutex_init(&this->mutex, NULL);
+        }
+
+        FUSEFile::~FUSEFile()
+        {
+            pthread_mutex_destroy(&this->mutex);
+        }
         
         void API::load(std::string image)
         {
@@ -361,11 +402,12 @@ namespace AppLib
             FuseLink::filesystem->setuid(fuse_get_context()->uid);
             FuseLink::filesystem->setgid(fuse_get_context()->gid);
 
-            // Open the file to see whether it exists.
+            // Open the file and keep the handle (with its block map)
+            // until it is released.
             try
             {
-                FSFile file = FuseLink::filesystem->open(path);
-                file.close();
+                FUSEFile * file = new FUSEFile(FuseLink::filesystem->open(path));
+                options->fh = reinterpret_cast < uintptr_t > (file);
                 return 0;
             }
             catch (std::exception& e)
@@ -374,75 +416,146 @@ namespace AppLib
             }
         }
 
-        int FuseLink::read(const char *path, char *out, size_t length,
+        int FuseLink::read(const char * /* path */, char *out, size_t length,
                 off_t offset, struct fuse_file_info *options)
         {
             FuseLink::filesystem->setuid(fuse_get_context()->uid);
             FuseLink::filesystem->setgid(fuse_get_context()->gid);
 
             // Read data from the file.
+            FUSEFile * file = reinterpret_cast < FUSEFile * > (options->fh);
+            int res;
+            pthread_mutex_lock(&file->mutex);
             try
             {
-                if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
-                    return -EFBIG;
-                FuseLink::filesystem->touch(path, "a");
-                FSFile file = FuseLink::filesystem->open(path);
-                file.seekg(offset);
-                uint32_t read = file.read(out, length);
-                file.close();
-                if (file.fail() || file.bad())
-                    return -EIO;
-                return read;
+                res = FuseLink::filesystem->read(file->file, out, length, offset);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "read");
+                res = FuseLink::handleException(e, "read");
             }
+            pthread_mutex_unlock(&file->mutex);
+            return res;
         }
 
-        int FuseLink::write(const char *path, const char *in, size_t length,
+        int FuseLink::read_buf(const char * /* path */, struct fuse_bufvec **bufp, size_t length,
+                off_t offset, struct fuse_file_info *options)
+        {
+            FuseLink::filesystem->setuid(fuse_get_context()->uid);
+            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+
+            // Point at the file's data in the package where possible, and
+            // read it into memory otherwise.
+            FUSEFile * file = reinterpret_cast < FUSEFile * > (options->fh);
+            std::vector < FSFileRange > ranges;
+            char * out = NULL;
+            int res = 0;
+            pthread_mutex_lock(&file->mutex);
+            try
+            {
+                if (FuseLink::filesystem->locate(file->file, length, offset, ranges) < 0)
+                {
+                    out = (char *) malloc(length);
+                    if (out == NULL)
+                        res = -ENOMEM;
+                    else
+                        res = FuseLink::filesystem->read(file->file, out, length, offset);
+                }
+            }
+            catch (std::exception& e)
+            {
+                res = FuseLink::handleException(e, "read_buf");
+            }
+            pthread_mutex_unlock(&file->mutex);
+            if (res < 0)
+            {
+                free(out);
+                return res;
+            }
+
+            if (out == NULL)
+                *bufp = FuseLink::createBufVec(FuseLink::filesystem->getDescriptor(), ranges);
+            else
+            {
+                *bufp = FuseLink::createBufVec(-1, ranges);
+                if (*bufp != NULL)
+                {
+                    (*bufp)->buf[0].mem = out;
+                    (*bufp)->buf[0].size = res;
+                }
+            }
+            if (*bufp == NULL)
+            {
+                free(out);
+                return -ENOMEM;
+            }
+            return 0;
+        }
+
+        int FuseLink::write(const char * /* path */, const char *in, size_t length,
                 off_t offset, struct fuse_file_info *options)
         {
             FuseLink::filesystem->setuid(fuse_get_context()->uid);
             FuseLink::filesystem->setgid(fuse_get_context()->gid);
 
             // Write data to the file.
+            FUSEFile * file = reinterpret_cast < FUSEFile * > (options->fh);
+            int res;
+            pthread_mutex_lock(&file->mutex);
             try
             {
-                if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
-                    return -EFBIG;
-                FuseLink::filesystem->touch(path, "cma");
-                FSFile file = FuseLink::filesystem->open(path);
-                file.seekp(offset);
-                file.write(in, length);
-                file.close();
-                if (file.fail() || file.bad())
-                    return -EIO;
-                return length;
+                FuseLink::filesystem->write(file->file, in, length, offset);
+                res = length;
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "write");
+                res = FuseLink::handleException(e, "write");
             }
+            pthread_mutex_unlock(&file->mutex);
+            return res;
         }
 
-        int FuseLink::readdir(const char *path, void *dbuf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+        int FuseLink::release(const char * /* path */, struct fuse_file_info *options)
+        {
+            FUSEFile * file = reinterpret_cast < FUSEFile * > (options->fh);
+            file->file.close();
+            delete file;
+            return 0;
+        }
+
+        int FuseLink::fsync(const char * /* path */, int /* datasync */, struct fuse_file_info * /* options */)
+        {
+            // Write back all cached package blocks.
+            try
+            {
+                FuseLink::filesystem->flush();
+                return 0;
+            }
+            catch (std::exception& e)
+            {
+                return FuseLink::handleException(e, "fsync");
+            }
+        }
+
+        int FuseLink::readdir(const char *path, void *dbuf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info * /* fi */)
         {
             FuseLink::filesystem->setuid(fuse_get_context()->uid);
             FuseLink::filesystem->setgid(fuse_get_context()->gid);
 
-            // List all children in a directory.
+            // List the children in a directory a buffer at a time.  The
+            // offsets of '.' and '..' are 1 and 2, and those of the
+            // children are 2 past their cookies.
             try
             {
-                // Retrieve all children.
-                std::vector<std::string> result =
-                    FuseLink::filesystem->readdir(path);
-                
-                // Use the filler() function to report back entries.
-                filler(dbuf, ".", NULL, 0);
-                filler(dbuf, "..", NULL, 0);
-                for (int i = 0; i < result.size(); i++)
-                    filler(dbuf, result[i].c_str(), NULL, 0);
+                if (offset == 0 && filler(dbuf, ".", NULL, 1) != 0)
+                    return 0;
+                if (offset <= 1 && filler(dbuf, "..", NULL, 2) != 0)
+                    return 0;
+                FuseLink::filesystem->readdir(path, (offset <= 2) ? 0 : offset - 2,
+                    [&](const DirectoryEntry& entry, const struct stat& stbuf, off_t next) -> bool
+                    {
+                        return filler(dbuf, entry.name.c_str(), &stbuf, next + 2) == 0;
+                    });
                 return 0;
             }
             catch (std::exception& e)
@@ -451,7 +564,7 @@ namespace AppLib
             }
         }
 
-        void *FuseLink::init(struct fuse_conn_info *conn)
+        void *FuseLink::init(struct fuse_conn_info * /* conn */)
         {
             if (FuseLink::continuefunc != NULL)
             {
@@ -463,7 +576,17 @@ namespace AppLib
 
         void FuseLink::destroy(void *)
         {
-            return;
+            // The filesystem is being unmounted; make sure everything
+            // in the block cache and the journal reaches its place in
+            // the package.
+            try
+            {
+                FuseLink::filesystem->checkpoint();
+            }
+            catch (std::exception& e)
+            {
+                FuseLink::handleException(e, "destroy");
+            }
         }
 
         int FuseLink::create(const char *path, mode_t mode, struct fuse_file_info *options)
@@ -475,6 +598,8 @@ namespace AppLib
             try
             {
                 FuseLink::filesystem->create(path, mode);
+                FUSEFile * file = new FUSEFile(FuseLink::filesystem->open(path));
+                options->fh = reinterpret_cast < uintptr_t > (file);
                 return 0;
             }
             catch (std::exception& e)
@@ -500,6 +625,41 @@ namespace AppLib
             }
         }
 
+        std::string FuseLink::getTransferOptions(bool readOnly)
+        {
+            // Large writes save a round trip for each page written, and
+            // file data of read-only packages can be spliced straight
+            // from the package file.
+            char opts[128];
+            snprintf(opts, sizeof(opts), ",big_writes,max_write=%d,max_read=%d",
+                    FUSE_MAX_TRANSFER, FUSE_MAX_TRANSFER);
+            if (readOnly)
+                return std::string(opts) + ",splice_write,splice_move";
+            return opts;
+        }
+
+        struct fuse_bufvec * FuseLink::createBufVec(int fd, const std::vector < FSFileRange > & ranges)
+        {
+            // struct fuse_bufvec already has room for one buffer, which
+            // is left empty if there are no ranges.
+            size_t count = ranges.empty() ? 1 : ranges.size();
+            size_t size = sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf);
+            struct fuse_bufvec * bufv = (struct fuse_bufvec *) malloc(size);
+            if (bufv == NULL)
+                return NULL;
+            memset(bufv, 0, size);
+            bufv->count = count;
+            bufv->buf[0].fd = -1;
+            for (unsigned int i = 0; i < ranges.size(); i += 1)
+            {
+                bufv->buf[i].size = ranges[i].length;
+                bufv->buf[i].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+                bufv->buf[i].fd = fd;
+                bufv->buf[i].pos = ranges[i].pos;
+            }
+            return bufv;
+        }
+
         int FuseLink::handleException(std::exception& e, std::string function)
         {
             if (typeid(e) == typeid(Exception::PathNotValid&))
@@ -526,6 +686,10 @@ namespace AppLib
                 return -ENOTSUP;
             if (typeid(e) == typeid(Exception::FilenameTooLong&))
                 return -ENAMETOOLONG;
+            if (typeid(e) == typeid(Exception::ReadOnlyFilesystem&))
+                return -EROFS;
+            if (typeid(e) == typeid(Exception::FileStale&))
+                return -ESTALE;
             if (typeid(e) == typeid(Exception::INodeSaveInvalid&) ||
                     typeid(e) == typeid(Exception::INodeSaveFailed&) ||
                     typeid(e) == typeid(Exception::INodeExhaustion&) ||
@@ -9,6 +9,7 @@
 #include <fuse.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
 #include <libpackaged-fs/fs.h>
 
 namespace AppLib
@@ -35,21 +36,68 @@ namespace AppLib
             static int open(const char *path, struct fuse_file_info *options);
             static int read(const char *path, char *out, size_t length,
                             off_t offset, struct fuse_file_info *options);
+            static int read_buf(const char *path, struct fuse_bufvec **bufp, size_t length,
+                            off_t offset, struct fuse_file_info *options);
             static int write(const char *, const char *, size_t, off_t, struct fuse_file_info *);
+            static int release(const char *, struct fuse_file_info *);
+            static int fsync(const char *, int, struct fuse_file_info *);
             static int readdir(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
             static void *init(struct fuse_conn_info *conn);
             static void destroy(void *);
             static int create(const char *, mode_t, struct fuse_file_info *);
             static int utimens(const char *, const struct timespec tv[2]);
-        private:
+
+            //! Converts an exception thrown by FS into a negated errno value.
             static int handleException(std::exception& e, std::string function);
+
+            //! Returns FUSE mount options common to both frontends.
+            static std::string getTransferOptions(bool readOnly);
+
+            //! Allocates a buffer vector that refers to each of the
+            //! ranges of the package file fd, in order.
+            /*!
+             * The vector is allocated with malloc(), as libfuse frees
+             * the ones returned by read_buf.
+             */
+            static struct fuse_bufvec * createBufVec(int fd, const std::vector < FSFileRange > & ranges);
+        };
+
+        //! How long the kernel may cache what a mounted package returns.
+        /*!
+         * The timeouts are in seconds; negative values select the
+         * default for the mount.
+         */
+        struct FUSETimeouts
+        {
+            double attr;
+            double entry;
+            double negative;
+
+            FUSETimeouts();
+
+            //! Returns the timeouts with fallback in place of any
+            //! that are negative.
+            FUSETimeouts resolve(double fallback) const;
         };
 
+        //! Mounts a package using the path-based FUSE interface.
+        /*!
+         * There is no way to tell the kernel about changes through
+         * this interface, so writable packages are not cached by
+         * default.  Read-only packages default to FUSE_TIMEOUT_READONLY
+         * and keep file data in the kernel's page cache.
+         *
+         * File data of read-only packages is returned as ranges of
+         * the package file, which the kernel splices from where it
+         * supports it rather than having it copied through libfuse.
+         */
         class Mounter
         {
         public:
             Mounter(std::string image, std::string mount,
-                    bool foreground, bool allowOther, void (*continue_func) (void));
+                    bool foreground, bool allowOther, bool readOnly,
+                    void (*continue_func) (void),
+                    const FUSETimeouts& timeouts = FUSETimeouts());
             int getResult();
 
         private:
@@ -70,6 +118,22 @@ namespace AppLib
             AppLib::FS * filesystem;
             bool readonly;
         };
+
+        //! A file opened through FUSE, stored in the file handle.
+        /*!
+         * Requests are served by several threads, and the kernel may
+         * send more than one request for the same handle at once, so
+         * the FSFile (which has a position and a block map) is only
+         * used while holding the mutex.
+         */
+        struct FUSEFile
+        {
+            FSFile file;
+            pthread_mutex_t mutex;
+
+            FUSEFile(const FSFile& file);
+            ~FUSEFile();
+        };
     }
 }
 #endif
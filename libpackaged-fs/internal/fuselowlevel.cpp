@@ -0,0 +1,861 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/config.h>
+#include <libpackaged-fs/internal/fuselowlevel.h>
+#include <libpackaged-fs/internal/fuselink.h>
+#include <libpackaged-fs/logging.h>
+#include <string>
+#include <set>
+#include <vector>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+namespace AppLib
+{
+    namespace FUSE
+    {
+        FS * FuseLowLevelLink::filesystem = NULL;
+        void (*FuseLowLevelLink::continuefunc) (void) = NULL;
+        std::unordered_map < fuse_ino_t, FuseLowLevelLink::Node > FuseLowLevelLink::nodes;
+        pthread_mutex_t FuseLowLevelLink::mutex = PTHREAD_MUTEX_INITIALIZER;
+        FUSETimeouts FuseLowLevelLink::timeouts;
+        bool FuseLowLevelLink::readonly = false;
+        std::set < fuse_ino_t > FuseLowLevelLink::staleNodes;
+        std::vector < std::pair < fuse_ino_t, std::string > > FuseLowLevelLink::staleEntries;
+        sem_t * FuseLowLevelLink::wakeup = NULL;
+
+        LowLevelMounter::LowLevelMounter(std::string image, std::string mount,
+                bool foreground, bool allow_other, bool read_only,
+                void (*continuefunc) (void), bool compact,
+                const FUSETimeouts& timeouts)
+        {
+            this->mountResult = -EALREADY;
+
+            // Define the fuse_lowlevel_ops structure.
+            static fuse_lowlevel_ops ops;
+            memset(&ops, 0, sizeof(ops));
+            ops.init = &FuseLowLevelLink::init;
+            ops.destroy = &FuseLowLevelLink::destroy;
+            ops.lookup = &FuseLowLevelLink::lookup;
+            ops.forget = &FuseLowLevelLink::forget;
+            ops.getattr = &FuseLowLevelLink::getattr;
+            ops.setattr = &FuseLowLevelLink::setattr;
+            ops.readlink = &FuseLowLevelLink::readlink;
+            ops.mknod = &FuseLowLevelLink::mknod;
+            ops.mkdir = &FuseLowLevelLink::mkdir;
+            ops.unlink = &FuseLowLevelLink::unlink;
+            ops.rmdir = &FuseLowLevelLink::rmdir;
+            ops.symlink = &FuseLowLevelLink::symlink;
+            ops.rename = &FuseLowLevelLink::rename;
+            ops.link = &FuseLowLevelLink::link;
+            ops.open = &FuseLowLevelLink::open;
+            ops.read = &FuseLowLevelLink::read;
+            ops.write = &FuseLowLevelLink::write;
+            ops.release = &FuseLowLevelLink::release;
+            ops.fsync = &FuseLowLevelLink::fsync;
+            ops.readdir = &FuseLowLevelLink::readdir;
+            ops.create = &FuseLowLevelLink::create;
+
+            // Attempt to open the package and set
+            // continuation function.
+            FuseLowLevelLink::filesystem = new FS(image, 0, 0, read_only);
+            FuseLowLevelLink::continuefunc = continuefunc;
+            FuseLowLevelLink::timeouts = timeouts.resolve(read_only ? FUSE_TIMEOUT_READONLY : FUSE_TIMEOUT);
+            FuseLowLevelLink::readonly = read_only;
+
+            // Anything the kernel has cached about a writable package
+            // is invalidated when it changes.
+            if (!read_only)
+                FuseLowLevelLink::filesystem->setChangeHandlers(
+                        &FuseLowLevelLink::queueINode, &FuseLowLevelLink::queueEntry);
+
+            // The attribute and entry timeouts are given with each reply
+            // rather than as options here.
+            struct fuse_args fargs = FUSE_ARGS_INIT(0, NULL);
+            std::string opts = "default_permissions" + FuseLink::getTransferOptions(read_only);
+            if (allow_other)
+            {
+                Logging::showInfoW("Allowing other users access to filesystem.");
+                opts = "allow_other," + opts;
+            }
+            if (read_only)
+            {
+                Logging::showInfoW("Mounting filesystem read-only.");
+                opts = "ro," + opts;
+            }
+
+            if (fuse_opt_add_arg(&fargs, "appfs") == -1 ||
+#ifdef DEBUG
+                    fuse_opt_add_arg(&fargs, "-d") == -1 ||
+#endif
+                    fuse_opt_add_arg(&fargs, "-o") == -1 || fuse_opt_add_arg(&fargs, opts.c_str()) == -1)
+            {
+                Logging::showErrorW("Unable to set FUSE options.");
+                fuse_opt_free_args(&fargs);
+                this->mountResult = -5;
+                return;
+            }
+
+            FUSEData appfs_status;
+            appfs_status.filesystem = FuseLowLevelLink::filesystem;
+            appfs_status.readonly = read_only;
+            appfs_status.mount = mount;
+            appfs_status.image = image;
+
+            // Mount the filesystem and run the session loop until it
+            // is unmounted.
+            this->mountResult = 1;
+            struct fuse_chan * ch = fuse_mount(mount.c_str(), &fargs);
+            if (ch != NULL)
+            {
+                struct fuse_session * se = fuse_lowlevel_new(&fargs, &ops, sizeof(ops), &appfs_status);
+                if (se != NULL)
+                {
+                    if (fuse_daemonize(foreground ? 1 : 0) != -1 &&
+                            fuse_set_signal_handlers(se) != -1)
+                    {
+                        fuse_session_add_chan(se, ch);
+                        this->mountResult = LowLevelMounter::loop(se, ch, compact && !read_only) == -1 ? 1 : 0;
+                        fuse_remove_signal_handlers(se);
+                        fuse_session_remove_chan(ch);
+                    }
+                    fuse_session_destroy(se);
+                }
+                fuse_unmount(mount.c_str(), ch);
+            }
+            fuse_opt_free_args(&fargs);
+
+            // The FUSE threads have been joined, so the package can be
+            // closed, which marks its free space bitmap as up to date.
+            delete FuseLowLevelLink::filesystem;
+            FuseLowLevelLink::filesystem = NULL;
+        }
+
+        int LowLevelMounter::getResult()
+        {
+            return this->mountResult;
+        }
+
+        int LowLevelMounter::loop(struct fuse_session * se, struct fuse_chan * ch, bool compact)
+        {
+            // This is fuse_session_loop_mt, except that the calling thread
+            // runs compaction when no requests arrive.  Once a pass
+            // completes, we wait until the package has been used again
+            // before starting the next one.
+            Session session;
+            session.se = se;
+            session.ch = ch;
+            session.requests = 0;
+            session.result = 0;
+            sem_init(&session.wakeup, 0, 0);
+            FuseLowLevelLink::setWakeup(&session.wakeup);
+
+            std::vector < pthread_t > threads;
+            for (unsigned int i = 0; i < FUSE_THREADS; i += 1)
+            {
+                pthread_t thread;
+                if (pthread_create(&thread, NULL, &LowLevelMounter::serve, &session) != 0)
+                {
+                    Logging::showErrorW("Unable to start FUSE thread.");
+                    break;
+                }
+                threads.push_back(thread);
+            }
+            if (threads.empty())
+                session.result = -1;
+
+            bool compacting = compact;
+            uint64_t seen = 0;
+            while (!threads.empty() && !fuse_session_exited(se))
+            {
+                if (!compact)
+                {
+                    if (sem_wait(&session.wakeup) == 0)
+                        FuseLowLevelLink::sendInvalidations(ch);
+                    continue;
+                }
+
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += COMPACT_IDLE_MS / 1000;
+                deadline.tv_nsec += (COMPACT_IDLE_MS % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L)
+                {
+                    deadline.tv_sec += 1;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                if (sem_timedwait(&session.wakeup, &deadline) == 0)
+                {
+                    FuseLowLevelLink::sendInvalidations(ch);
+                    continue;
+                }
+                if (errno != ETIMEDOUT)
+                    continue;
+
+                // Any request in the last COMPACT_IDLE_MS means the
+                // package isn't idle yet.
+                uint64_t requests = __atomic_load_n(&session.requests, __ATOMIC_RELAXED);
+                if (requests != seen)
+                {
+                    seen = requests;
+                    compacting = true;
+                    continue;
+                }
+                if (!compacting)
+                    continue;
+                try
+                {
+                    compacting = !FuseLowLevelLink::filesystem->compact(COMPACT_BUDGET);
+                }
+                catch (std::exception& e)
+                {
+                    FuseLink::handleException(e, "compact");
+                    compacting = false;
+                }
+            }
+
+            // Threads still waiting for a request are cancelled; the
+            // others finish the request they are processing first.
+            for (unsigned int i = 0; i < threads.size(); i += 1)
+                pthread_cancel(threads[i]);
+            for (unsigned int i = 0; i < threads.size(); i += 1)
+                pthread_join(threads[i], NULL);
+            FuseLowLevelLink::setWakeup(NULL);
+            sem_destroy(&session.wakeup);
+            fuse_session_reset(se);
+            return session.result;
+        }
+
+        void * LowLevelMounter::serve(void * data)
+        {
+            Session * session = static_cast < Session * > (data);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+            size_t bufsize = fuse_chan_bufsize(session->ch);
+            std::vector < char > buf(bufsize);
+            while (!fuse_session_exited(session->se))
+            {
+                struct fuse_chan * tmpch = session->ch;
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+                int res = fuse_chan_recv(&tmpch, &buf[0], bufsize);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+                if (res == -EINTR)
+                    continue;
+                if (res <= 0)
+                {
+                    if (res < 0)
+                        __atomic_store_n(&session->result, -1, __ATOMIC_RELAXED);
+                    break;
+                }
+                __atomic_add_fetch(&session->requests, 1, __ATOMIC_RELAXED);
+                fuse_session_process(session->se, &buf[0], res, tmpch);
+            }
+
+            // Wake up the mounting thread so that it stops the others.
+            fuse_session_exit(session->se);
+            sem_post(&session->wakeup);
+            return NULL;
+        }
+
+        void FuseLowLevelLink::init(void * /* userdata */, struct fuse_conn_info * /* conn */)
+        {
+            if (FuseLowLevelLink::continuefunc != NULL)
+            {
+                FuseLowLevelLink::continuefunc();
+            }
+        }
+
+        void FuseLowLevelLink::destroy(void * /* userdata */)
+        {
+            // The filesystem is being unmounted; make sure everything
+            // in the block cache and the journal reaches its place in
+            // the package.
+            try
+            {
+                FuseLowLevelLink::filesystem->checkpoint();
+            }
+            catch (std::exception& e)
+            {
+                FuseLink::handleException(e, "destroy");
+            }
+
+            pthread_mutex_lock(&FuseLowLevelLink::mutex);
+            FuseLowLevelLink::nodes.clear();
+            FuseLowLevelLink::staleNodes.clear();
+            FuseLowLevelLink::staleEntries.clear();
+            pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+        }
+
+        void FuseLowLevelLink::lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                struct fuse_entry_param e;
+                FuseLowLevelLink::lookupEntry(parent, name, e);
+                FuseLowLevelLink::replyEntry(req, e);
+            }
+            catch (Exception::FileNotFound& e)
+            {
+                // Let the kernel remember that the entry doesn't exist;
+                // a zero inode number isn't counted as a lookup.
+                if (FuseLowLevelLink::timeouts.negative <= 0.0)
+                {
+                    FuseLowLevelLink::replyException(req, e, "lookup");
+                    return;
+                }
+                struct fuse_entry_param ne;
+                memset(&ne, 0, sizeof(struct fuse_entry_param));
+                ne.entry_timeout = FuseLowLevelLink::timeouts.negative;
+                fuse_reply_entry(req, &ne);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "lookup");
+            }
+        }
+
+        void FuseLowLevelLink::forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+        {
+            FuseLowLevelLink::forgetNode(ino, nlookup);
+            fuse_reply_none(req);
+        }
+
+        void FuseLowLevelLink::getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * /* fi */)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(struct stat));
+                FuseLowLevelLink::filesystem->getattr(FuseLowLevelLink::toINodeID(ino), stbuf);
+                fuse_reply_attr(req, &stbuf, FuseLowLevelLink::timeouts.attr);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "getattr");
+            }
+        }
+
+        void FuseLowLevelLink::setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info * /* fi */)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                uint16_t id = FuseLowLevelLink::toINodeID(ino);
+                if (to_set & FUSE_SET_ATTR_MODE)
+                    FuseLowLevelLink::filesystem->chmod(id, attr->st_mode);
+                if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+                    FuseLowLevelLink::filesystem->chown(id,
+                            (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+                            (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1);
+                if (to_set & FUSE_SET_ATTR_SIZE)
+                    FuseLowLevelLink::filesystem->truncate(id, attr->st_size);
+
+                // Times that are not being set keep their current value.
+                int times = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+                times |= FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+#endif
+                if (to_set & times)
+                {
+                    struct stat current;
+                    memset(&current, 0, sizeof(struct stat));
+                    FuseLowLevelLink::filesystem->getattr(id, current);
+                    time_t atime = current.st_atime;
+                    time_t mtime = current.st_mtime;
+                    if (to_set & FUSE_SET_ATTR_ATIME)
+                        atime = attr->st_atime;
+                    if (to_set & FUSE_SET_ATTR_MTIME)
+                        mtime = attr->st_mtime;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+                    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                        atime = time(NULL);
+                    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                        mtime = time(NULL);
+#endif
+                    FuseLowLevelLink::filesystem->utimens(id, atime, mtime);
+                }
+
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(struct stat));
+                FuseLowLevelLink::filesystem->getattr(id, stbuf);
+                fuse_reply_attr(req, &stbuf, FuseLowLevelLink::timeouts.attr);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "setattr");
+            }
+        }
+
+        void FuseLowLevelLink::readlink(fuse_req_t req, fuse_ino_t ino)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                std::string result = FuseLowLevelLink::filesystem->readlink(FuseLowLevelLink::toINodeID(ino));
+                fuse_reply_readlink(req, result.c_str());
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "readlink");
+            }
+        }
+
+        void FuseLowLevelLink::mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FuseLowLevelLink::filesystem->mknod(FuseLowLevelLink::getChildPath(parent, name), mode, rdev);
+                struct fuse_entry_param e;
+                FuseLowLevelLink::lookupEntry(parent, name, e);
+                FuseLowLevelLink::replyEntry(req, e);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "mknod");
+            }
+        }
+
+        void FuseLowLevelLink::mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FuseLowLevelLink::filesystem->mkdir(FuseLowLevelLink::getChildPath(parent, name), mode);
+                struct fuse_entry_param e;
+                FuseLowLevelLink::lookupEntry(parent, name, e);
+                FuseLowLevelLink::replyEntry(req, e);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "mkdir");
+            }
+        }
+
+        void FuseLowLevelLink::unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FuseLowLevelLink::filesystem->unlink(FuseLowLevelLink::getChildPath(parent, name));
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "unlink");
+            }
+        }
+
+        void FuseLowLevelLink::rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FuseLowLevelLink::filesystem->rmdir(FuseLowLevelLink::getChildPath(parent, name));
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "rmdir");
+            }
+        }
+
+        void FuseLowLevelLink::symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FuseLowLevelLink::filesystem->symlink(FuseLowLevelLink::getChildPath(parent, name), link);
+                struct fuse_entry_param e;
+                FuseLowLevelLink::lookupEntry(parent, name, e);
+                FuseLowLevelLink::replyEntry(req, e);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "symlink");
+            }
+        }
+
+        void FuseLowLevelLink::rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FuseLowLevelLink::filesystem->rename(
+                        FuseLowLevelLink::getChildPath(parent, name),
+                        FuseLowLevelLink::getChildPath(newparent, newname));
+
+                // Keep the path of the node up to date if the kernel
+                // holds a reference to it.
+                uint16_t id = FuseLowLevelLink::filesystem->lookup(FuseLowLevelLink::toINodeID(newparent), newname);
+                pthread_mutex_lock(&FuseLowLevelLink::mutex);
+                std::unordered_map < fuse_ino_t, Node >::iterator it =
+                    FuseLowLevelLink::nodes.find(FuseLowLevelLink::toNodeID(id));
+                if (it != FuseLowLevelLink::nodes.end())
+                {
+                    it->second.parent = newparent;
+                    it->second.name = newname;
+                }
+                pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "rename");
+            }
+        }
+
+        void FuseLowLevelLink::link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FuseLowLevelLink::filesystem->link(
+                        FuseLowLevelLink::getChildPath(newparent, newname),
+                        FuseLowLevelLink::getPath(ino));
+                struct fuse_entry_param e;
+                FuseLowLevelLink::lookupEntry(newparent, newname, e);
+                FuseLowLevelLink::replyEntry(req, e);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "link");
+            }
+        }
+
+        void FuseLowLevelLink::open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FUSEFile * file = new FUSEFile(FuseLowLevelLink::filesystem->open(FuseLowLevelLink::toINodeID(ino)));
+                fi->fh = reinterpret_cast < uintptr_t > (file);
+
+                // The data of a read-only package can't change, so the
+                // kernel can keep it cached between opens.
+                if (FuseLowLevelLink::readonly)
+                    fi->keep_cache = 1;
+                if (fuse_reply_open(req, fi) != 0)
+                    delete file;
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "open");
+            }
+        }
+
+        void FuseLowLevelLink::read(fuse_req_t req, fuse_ino_t /* ino */, size_t size, off_t off, struct fuse_file_info *fi)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            // Read data from the file, pointing the kernel at where it
+            // is in a read-only package rather than copying it (unless
+            // some of it is still in the journal).
+            FUSEFile * file = reinterpret_cast < FUSEFile * > (fi->fh);
+            pthread_mutex_lock(&file->mutex);
+            try
+            {
+                std::vector < FSFileRange > ranges;
+                if (FuseLowLevelLink::readonly &&
+                        FuseLowLevelLink::filesystem->locate(file->file, size, off, ranges) >= 0)
+                {
+                    pthread_mutex_unlock(&file->mutex);
+                    struct fuse_bufvec * bufv = FuseLink::createBufVec(
+                            FuseLowLevelLink::filesystem->getDescriptor(), ranges);
+                    if (bufv == NULL)
+                        fuse_reply_err(req, ENOMEM);
+                    else
+                        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+                    free(bufv);
+                    return;
+                }
+
+                std::vector < char > buf(size);
+                std::streamsize count = FuseLowLevelLink::filesystem->read(file->file, buf.data(), size, off);
+                pthread_mutex_unlock(&file->mutex);
+                fuse_reply_buf(req, buf.data(), count);
+            }
+            catch (std::exception& e)
+            {
+                pthread_mutex_unlock(&file->mutex);
+                FuseLowLevelLink::replyException(req, e, "read");
+            }
+        }
+
+        void FuseLowLevelLink::write(fuse_req_t req, fuse_ino_t /* ino */, const char *in, size_t size, off_t off, struct fuse_file_info *fi)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            // Write data to the file.
+            FUSEFile * file = reinterpret_cast < FUSEFile * > (fi->fh);
+            pthread_mutex_lock(&file->mutex);
+            try
+            {
+                FuseLowLevelLink::filesystem->write(file->file, in, size, off);
+                pthread_mutex_unlock(&file->mutex);
+                fuse_reply_write(req, size);
+            }
+            catch (std::exception& e)
+            {
+                pthread_mutex_unlock(&file->mutex);
+                FuseLowLevelLink::replyException(req, e, "write");
+            }
+        }
+
+        void FuseLowLevelLink::release(fuse_req_t req, fuse_ino_t /* ino */, struct fuse_file_info *fi)
+        {
+            FUSEFile * file = reinterpret_cast < FUSEFile * > (fi->fh);
+            file->file.close();
+            delete file;
+            fuse_reply_err(req, 0);
+        }
+
+        void FuseLowLevelLink::fsync(fuse_req_t req, fuse_ino_t /* ino */, int /* datasync */, struct fuse_file_info * /* fi */)
+        {
+            // Write back all cached package blocks.
+            try
+            {
+                FuseLowLevelLink::filesystem->flush();
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "fsync");
+            }
+        }
+
+        void FuseLowLevelLink::readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info * /* fi */)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            // List the children of the directory from the offset the
+            // kernel resumes at until the buffer is full.  The offsets of
+            // '.' and '..' are 1 and 2, and those of the children are 2
+            // past their cookies.
+            try
+            {
+                uint16_t id = FuseLowLevelLink::toINodeID(ino);
+                std::vector < char > buf(size);
+                size_t used = 0;
+                auto add = [&](const char * name, const struct stat& stbuf, off_t next) -> bool
+                {
+                    size_t length = fuse_add_direntry(req, buf.data() + used, size - used, name, &stbuf, next);
+                    if (length > size - used)
+                        return false;
+                    used += length;
+                    return true;
+                };
+
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(struct stat));
+                stbuf.st_mode = S_IFDIR;
+                stbuf.st_ino = id;
+                bool more = (off > 0 || add(".", stbuf, 1));
+                stbuf.st_ino = 0;
+                more = more && (off > 1 || add("..", stbuf, 2));
+                if (more)
+                    FuseLowLevelLink::filesystem->readdir(id, (off <= 2) ? 0 : off - 2,
+                        [&](const DirectoryEntry& entry, const struct stat& attr, off_t next) -> bool
+                        {
+                            return add(entry.name.c_str(), attr, next + 2);
+                        });
+                fuse_reply_buf(req, buf.data(), used);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "readdir");
+            }
+        }
+
+        void FuseLowLevelLink::create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+        {
+            FuseLowLevelLink::setContext(req);
+
+            try
+            {
+                FuseLowLevelLink::filesystem->create(FuseLowLevelLink::getChildPath(parent, name), mode);
+                struct fuse_entry_param e;
+                FuseLowLevelLink::lookupEntry(parent, name, e);
+                FUSEFile * file = new FUSEFile(FuseLowLevelLink::filesystem->open(FuseLowLevelLink::toINodeID(e.ino)));
+                fi->fh = reinterpret_cast < uintptr_t > (file);
+                if (fuse_reply_create(req, &e, fi) != 0)
+                {
+                    delete file;
+                    FuseLowLevelLink::forgetNode(e.ino, 1);
+                }
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevelLink::replyException(req, e, "create");
+            }
+        }
+
+        void FuseLowLevelLink::setContext(fuse_req_t req)
+        {
+            // The context is kept per thread, so this only affects the
+            // request being processed.
+            const struct fuse_ctx * ctx = fuse_req_ctx(req);
+            FuseLowLevelLink::filesystem->setuid(ctx->uid);
+            FuseLowLevelLink::filesystem->setgid(ctx->gid);
+        }
+
+        uint16_t FuseLowLevelLink::toINodeID(fuse_ino_t ino)
+        {
+            if (ino < FUSE_ROOT_ID || ino > INODE_MAX)
+                throw Exception::FileNotFound();
+            return (uint16_t) (ino - FUSE_ROOT_ID);
+        }
+
+        fuse_ino_t FuseLowLevelLink::toNodeID(uint16_t id)
+        {
+            return (fuse_ino_t) id + FUSE_ROOT_ID;
+        }
+
+        std::string FuseLowLevelLink::getPath(fuse_ino_t ino)
+        {
+            std::string path;
+            pthread_mutex_lock(&FuseLowLevelLink::mutex);
+            while (ino != FUSE_ROOT_ID)
+            {
+                std::unordered_map < fuse_ino_t, Node >::iterator it = FuseLowLevelLink::nodes.find(ino);
+                if (it == FuseLowLevelLink::nodes.end())
+                {
+                    pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+                    throw Exception::FileNotFound();
+                }
+                path = "/" + it->second.name + path;
+                ino = it->second.parent;
+            }
+            pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+            return path.empty() ? "/" : path;
+        }
+
+        std::string FuseLowLevelLink::getChildPath(fuse_ino_t parent, const char *name)
+        {
+            std::string path = FuseLowLevelLink::getPath(parent);
+            if (path == "/")
+                return path + name;
+            return path + "/" + name;
+        }
+
+        void FuseLowLevelLink::lookupEntry(fuse_ino_t parent, const char *name, struct fuse_entry_param& e)
+        {
+            uint16_t id = FuseLowLevelLink::filesystem->lookup(FuseLowLevelLink::toINodeID(parent), name);
+            memset(&e, 0, sizeof(struct fuse_entry_param));
+            FuseLowLevelLink::filesystem->getattr(id, e.attr);
+            e.ino = FuseLowLevelLink::toNodeID(id);
+            e.generation = FuseLowLevelLink::filesystem->getGeneration(id);
+            e.attr_timeout = FuseLowLevelLink::timeouts.attr;
+            e.entry_timeout = FuseLowLevelLink::timeouts.entry;
+
+            pthread_mutex_lock(&FuseLowLevelLink::mutex);
+            Node & node = FuseLowLevelLink::nodes[e.ino];
+            node.parent = parent;
+            node.name = name;
+            node.nlookup += 1;
+            pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+        }
+
+        void FuseLowLevelLink::replyEntry(fuse_req_t req, const struct fuse_entry_param& e)
+        {
+            // If the reply doesn't reach the kernel, it will never
+            // forget the reference we added.
+            if (fuse_reply_entry(req, &e) != 0)
+                FuseLowLevelLink::forgetNode(e.ino, 1);
+        }
+
+        void FuseLowLevelLink::forgetNode(fuse_ino_t ino, uint64_t nlookup)
+        {
+            pthread_mutex_lock(&FuseLowLevelLink::mutex);
+            std::unordered_map < fuse_ino_t, Node >::iterator it = FuseLowLevelLink::nodes.find(ino);
+            if (it != FuseLowLevelLink::nodes.end())
+            {
+                if (it->second.nlookup <= nlookup)
+                    FuseLowLevelLink::nodes.erase(it);
+                else
+                    it->second.nlookup -= nlookup;
+            }
+            pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+        }
+
+        void FuseLowLevelLink::queueINode(uint16_t id)
+        {
+            fuse_ino_t ino = FuseLowLevelLink::toNodeID(id);
+            pthread_mutex_lock(&FuseLowLevelLink::mutex);
+            if (FuseLowLevelLink::isKnown(ino))
+            {
+                bool idle = FuseLowLevelLink::staleNodes.empty() && FuseLowLevelLink::staleEntries.empty();
+                FuseLowLevelLink::staleNodes.insert(ino);
+                if (idle && FuseLowLevelLink::wakeup != NULL)
+                    sem_post(FuseLowLevelLink::wakeup);
+            }
+            pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+        }
+
+        void FuseLowLevelLink::queueEntry(uint16_t parentid, const std::string& name)
+        {
+            fuse_ino_t parent = FuseLowLevelLink::toNodeID(parentid);
+            pthread_mutex_lock(&FuseLowLevelLink::mutex);
+            if (FuseLowLevelLink::isKnown(parent))
+            {
+                bool idle = FuseLowLevelLink::staleNodes.empty() && FuseLowLevelLink::staleEntries.empty();
+                FuseLowLevelLink::staleEntries.push_back(std::make_pair(parent, name));
+                if (idle && FuseLowLevelLink::wakeup != NULL)
+                    sem_post(FuseLowLevelLink::wakeup);
+            }
+            pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+        }
+
+        void FuseLowLevelLink::sendInvalidations(struct fuse_chan * ch)
+        {
+            std::set < fuse_ino_t > inodes;
+            std::vector < std::pair < fuse_ino_t, std::string > > entries;
+            pthread_mutex_lock(&FuseLowLevelLink::mutex);
+            inodes.swap(FuseLowLevelLink::staleNodes);
+            entries.swap(FuseLowLevelLink::staleEntries);
+            pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+
+            // Failures only mean the kernel had already dropped the
+            // node or entry (or doesn't support invalidation).
+            for (std::set < fuse_ino_t >::iterator it = inodes.begin(); it != inodes.end(); it++)
+                fuse_lowlevel_notify_inval_inode(ch, *it, -1, 0);
+            for (unsigned int i = 0; i < entries.size(); i += 1)
+                fuse_lowlevel_notify_inval_entry(ch, entries[i].first,
+                        entries[i].second.c_str(), entries[i].second.length());
+        }
+
+        void FuseLowLevelLink::setWakeup(sem_t * wakeup)
+        {
+            pthread_mutex_lock(&FuseLowLevelLink::mutex);
+            FuseLowLevelLink::wakeup = wakeup;
+            pthread_mutex_unlock(&FuseLowLevelLink::mutex);
+        }
+
+        bool FuseLowLevelLink::isKnown(fuse_ino_t ino)
+        {
+            return ino == FUSE_ROOT_ID || FuseLowLevelLink::nodes.find(ino) != FuseLowLevelLink::nodes.end();
+        }
+
+        void FuseLowLevelLink::replyException(fuse_req_t req, std::exception& e, std::string function)
+        {
+            fuse_reply_err(req, -FuseLink::handleException(e, function));
+        }
+    }
+}
@@ -0,0 +1,179 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_FUSELOWLEVEL
+#define CLASS_FUSELOWLEVEL
+
+#include <libpackaged-fs/config.h>
+
+#include <exception>
+#include <string>
+#include <set>
+#include <vector>
+#include <unordered_map>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <libpackaged-fs/fs.h>
+#include <libpackaged-fs/internal/fuselink.h>
+
+namespace AppLib
+{
+    namespace FUSE
+    {
+        //! The FUSE low-level frontend.
+        /*!
+         * Unlike FuseLink, requests are addressed by node ID rather
+         * than by path.  The node ID of an inode is its inode ID plus
+         * one (so the root inode is FUSE_ROOT_ID), with the generation
+         * of the inode ID so that the kernel can tell an inode that
+         * reuses a freed ID from the old one.  Files are read and
+         * written through an FSFile stored in the file handle, so
+         * reads and writes never resolve paths.
+         *
+         * The kernel's reference count on each node (incremented by
+         * every reply to lookup, mknod, mkdir, symlink, link and create,
+         * decremented by forget) is tracked along with the parent and
+         * name the node was last seen under.  Operations that modify
+         * directories use those to build a path and go through the
+         * path-based FS operations.
+         *
+         * Replies let the kernel cache attributes and entries for the
+         * configured timeouts.  On writable packages, every change
+         * that FS reports for a node or entry the kernel knows about
+         * is queued, and the queue is sent to the kernel as
+         * invalidations by the mounting thread (the kernel doesn't
+         * allow them from within a request).
+         */
+        class FuseLowLevelLink
+        {
+        public:
+            static FS * filesystem;
+            static void (*continuefunc) (void);
+            static FUSETimeouts timeouts;
+            static bool readonly;
+            static void init(void *userdata, struct fuse_conn_info *conn);
+            static void destroy(void *userdata);
+            static void lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+            static void getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+            static void readlink(fuse_req_t req, fuse_ino_t ino);
+            static void mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+            static void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+            static void unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name);
+            static void rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
+            static void link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname);
+            static void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+            static void write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
+            static void release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+            static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+            static void create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+
+            //! Queues an invalidation of the attributes of an inode.
+            static void queueINode(uint16_t id);
+            //! Queues an invalidation of the named entry of a directory.
+            static void queueEntry(uint16_t parentid, const std::string& name);
+            //! Sends the queued invalidations to the kernel.
+            static void sendInvalidations(struct fuse_chan * ch);
+            //! Sets the semaphore that is posted when the queue of
+            //! invalidations stops being empty.
+            static void setWakeup(sem_t * wakeup);
+
+        private:
+            struct Node
+            {
+                fuse_ino_t parent;
+                std::string name;
+                uint64_t nlookup;
+            };
+
+            static std::unordered_map < fuse_ino_t, Node > nodes;
+            static pthread_mutex_t mutex;
+
+            // The queued invalidations, guarded by the same mutex.
+            static std::set < fuse_ino_t > staleNodes;
+            static std::vector < std::pair < fuse_ino_t, std::string > > staleEntries;
+            static sem_t * wakeup;
+
+            // Returns whether the kernel may have a node cached; the
+            // mutex must be held.
+            static bool isKnown(fuse_ino_t ino);
+
+            // Sets the context UID and GID for the request.
+            static void setContext(fuse_req_t req);
+
+            // Converts between node IDs and inode IDs.
+            static uint16_t toINodeID(fuse_ino_t ino);
+            static fuse_ino_t toNodeID(uint16_t id);
+
+            // Returns the path of a node the kernel holds a reference to,
+            // or of the named child of one.
+            static std::string getPath(fuse_ino_t ino);
+            static std::string getChildPath(fuse_ino_t parent, const char *name);
+
+            // Looks up the named child and fills out an entry for it,
+            // adding a reference to its node.
+            static void lookupEntry(fuse_ino_t parent, const char *name, struct fuse_entry_param& e);
+
+            // Replies with an entry, dropping the reference added by
+            // lookupEntry if the reply fails.
+            static void replyEntry(fuse_req_t req, const struct fuse_entry_param& e);
+
+            // Drops references to a node, forgetting it once none remain.
+            static void forgetNode(fuse_ino_t ino, uint64_t nlookup);
+
+            // Replies with an error for an exception thrown by FS.
+            static void replyException(fuse_req_t req, std::exception& e, std::string function);
+        };
+
+        //! Mounts a package using the FUSE low-level frontend.
+        /*!
+         * Takes the same arguments as Mounter, which remains available
+         * as the path-based fallback.  If compact is set, the package
+         * is compacted a step at a time whenever it has been idle for
+         * COMPACT_IDLE_MS.  Requests are served by FUSE_THREADS threads.
+         *
+         * Timeouts that aren't given default to FUSE_TIMEOUT, or to
+         * FUSE_TIMEOUT_READONLY for read-only packages, which also keep
+         * file data in the kernel's page cache.
+         */
+        class LowLevelMounter
+        {
+        public:
+            LowLevelMounter(std::string image, std::string mount,
+                    bool foreground, bool allowOther, bool readOnly,
+                    void (*continue_func) (void), bool compact = false,
+                    const FUSETimeouts& timeouts = FUSETimeouts());
+            int getResult();
+
+        private:
+            int mountResult;
+
+            // The state shared by the threads serving a mounted package:
+            // a semaphore posted by each one that stops (and when there
+            // are invalidations to send), the number of requests
+            // received so far and -1 if receiving one failed.
+            struct Session
+            {
+                struct fuse_session * se;
+                struct fuse_chan * ch;
+                sem_t wakeup;
+                uint64_t requests;
+                int result;
+            };
+
+            // Serves requests on FUSE_THREADS threads until the package
+            // is unmounted, compacting it while there are no requests if
+            // requested.
+            static int loop(struct fuse_session * se, struct fuse_chan * ch, bool compact);
+
+            // Receives and processes requests until the session ends.
+            static void * serve(void * data);
+        };
+    }
+}
+#endif
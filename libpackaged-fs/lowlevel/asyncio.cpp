@@ -0,0 +1,257 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/config.h>
+
+#include <string.h>
+#include <errno.h>
+#include <libpackaged-fs/logging.h>
+#include <libpackaged-fs/lowlevel/asyncio.h>
+#ifdef HAVE_IO_URING
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+#ifdef HAVE_IO_URING
+        // There is no libc wrapper for the io_uring system calls and we
+        // don't want to depend on liburing for three functions.
+        static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+        {
+            return (int) syscall(__NR_io_uring_setup, entries, params);
+        }
+
+        static int sys_io_uring_enter(int ring, unsigned int submit, unsigned int complete, unsigned int flags)
+        {
+            return (int) syscall(__NR_io_uring_enter, ring, submit, complete, flags, NULL, 0);
+        }
+#endif
+
+        AsyncIO::AsyncIO(int fd, unsigned int depth)
+        {
+            this->fd = fd;
+            this->ring = -1;
+            this->depth = depth;
+            this->broken = false;
+            this->sqPtr = NULL;
+            this->sqSize = 0;
+            this->cqPtr = NULL;
+            this->cqSize = 0;
+            this->sqes = NULL;
+            this->sqesSize = 0;
+            pthread_mutex_init(&this->mutex, NULL);
+
+#ifdef HAVE_IO_URING
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            this->ring = sys_io_uring_setup(depth, &params);
+            if (this->ring < 0)
+            {
+                Logging::showDebugW("ASYNCIO: io_uring not available (errno %i), using pread().", errno);
+                this->ring = -1;
+                return;
+            }
+            this->depth = params.sq_entries;
+
+            // Map the submission and completion rings and the array of
+            // submission queue entries.  Newer kernels let both rings
+            // share one mapping.
+            this->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+            this->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single && this->cqSize > this->sqSize)
+                this->sqSize = this->cqSize;
+
+            this->sqPtr = mmap(NULL, this->sqSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_SQ_RING);
+            if (this->sqPtr == MAP_FAILED)
+            {
+                this->sqPtr = NULL;
+                this->cqSize = 0;
+                this->sqSize = 0;
+                ::close(this->ring);
+                this->ring = -1;
+                return;
+            }
+            if (single)
+            {
+                this->cqPtr = this->sqPtr;
+                this->cqSize = 0;
+            }
+            else
+            {
+                this->cqPtr = mmap(NULL, this->cqSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_CQ_RING);
+                if (this->cqPtr == MAP_FAILED)
+                {
+                    this->cqPtr = NULL;
+                    this->cqSize = 0;
+                    munmap(this->sqPtr, this->sqSize);
+                    this->sqPtr = NULL;
+                    this->sqSize = 0;
+                    ::close(this->ring);
+                    this->ring = -1;
+                    return;
+                }
+            }
+
+            this->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+            this->sqes = mmap(NULL, this->sqesSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, this->ring, IORING_OFF_SQES);
+            if (this->sqes == MAP_FAILED)
+            {
+                this->sqes = NULL;
+                this->sqesSize = 0;
+                if (this->cqSize != 0)
+                    munmap(this->cqPtr, this->cqSize);
+                munmap(this->sqPtr, this->sqSize);
+                this->sqPtr = this->cqPtr = NULL;
+                this->sqSize = this->cqSize = 0;
+                ::close(this->ring);
+                this->ring = -1;
+                return;
+            }
+
+            char * sq = static_cast < char *>(this->sqPtr);
+            char * cq = static_cast < char *>(this->cqPtr);
+            this->sqHead = reinterpret_cast < unsigned int *>(sq + params.sq_off.head);
+            this->sqTail = reinterpret_cast < unsigned int *>(sq + params.sq_off.tail);
+            this->sqMask = reinterpret_cast < unsigned int *>(sq + params.sq_off.ring_mask);
+            this->sqArray = reinterpret_cast < unsigned int *>(sq + params.sq_off.array);
+            this->cqHead = reinterpret_cast < unsigned int *>(cq + params.cq_off.head);
+            this->cqTail = reinterpret_cast < unsigned int *>(cq + params.cq_off.tail);
+            this->cqMask = reinterpret_cast < unsigned int *>(cq + params.cq_off.ring_mask);
+            this->cqes = cq + params.cq_off.cqes;
+#endif
+        }
+
+        AsyncIO::~AsyncIO()
+        {
+#ifdef HAVE_IO_URING
+            if (this->ring >= 0)
+            {
+                munmap(this->sqes, this->sqesSize);
+                if (this->cqSize != 0)
+                    munmap(this->cqPtr, this->cqSize);
+                munmap(this->sqPtr, this->sqSize);
+                ::close(this->ring);
+            }
+#endif
+            pthread_mutex_destroy(&this->mutex);
+        }
+
+        bool AsyncIO::isAvailable()
+        {
+            return (this->ring >= 0 && !this->broken);
+        }
+
+        bool AsyncIO::submit(std::vector < BlockRequest > & requests, bool write)
+        {
+            for (unsigned int i = 0; i < requests.size(); i += 1)
+                requests[i].result = -1;
+            if (this->ring < 0 || this->broken)
+                return false;
+
+#ifdef HAVE_IO_URING
+            std::vector < struct iovec > iov(requests.size());
+            struct io_uring_sqe * sqes = static_cast < struct io_uring_sqe *>(this->sqes);
+            struct io_uring_cqe * cqes = static_cast < struct io_uring_cqe *>(this->cqes);
+
+            pthread_mutex_lock(&this->mutex);
+
+            // Requests are submitted in chunks of at most the ring depth
+            // so the completion ring can never overflow.
+            unsigned int next = 0;
+            while (next < requests.size())
+            {
+                unsigned int chunk = std::min < unsigned int > (this->depth, requests.size() - next);
+                unsigned int tail = *this->sqTail;
+                for (unsigned int i = next; i < next + chunk; i += 1)
+                {
+                    unsigned int index = tail & *this->sqMask;
+                    struct io_uring_sqe * sqe = &sqes[index];
+                    iov[i].iov_base = requests[i].data;
+                    iov[i].iov_len = requests[i].count;
+                    memset(sqe, 0, sizeof(struct io_uring_sqe));
+                    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+                    sqe->fd = this->fd;
+                    sqe->off = (uint64_t) (std::streamoff) requests[i].pos;
+                    sqe->addr = (uint64_t) (uintptr_t) &iov[i];
+                    sqe->len = 1;
+                    sqe->user_data = i;
+                    this->sqArray[index] = index;
+                    tail += 1;
+                }
+                __atomic_store_n(this->sqTail, tail, __ATOMIC_RELEASE);
+
+                // Hand the whole chunk to the kernel and wait for all of
+                // it to complete.
+                unsigned int pending = chunk;
+                unsigned int unsubmitted = chunk;
+                while (pending > 0)
+                {
+                    int res = sys_io_uring_enter(this->ring, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+                    if (res < 0 && errno != EINTR)
+                    {
+                        Logging::showErrorW("ASYNCIO: io_uring_enter failed (errno %i), using pread() from now on.", errno);
+                        this->broken = true;
+
+                        // Requests the kernel already took still point at
+                        // iov and the caller's buffers, so wait for them
+                        // before either goes away.  The ones it didn't
+                        // take are never submitted now.
+                        unsigned int inflight = pending - unsubmitted;
+                        while (inflight > 0)
+                        {
+                            res = sys_io_uring_enter(this->ring, 0, inflight, IORING_ENTER_GETEVENTS);
+                            if (res < 0 && errno != EINTR)
+                            {
+                                Logging::showErrorW("ASYNCIO: Unable to wait for %u outstanding requests (errno %i).",
+                                        inflight, errno);
+                                break;
+                            }
+                            unsigned int head = *this->cqHead;
+                            unsigned int ctail = __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+                            while (head != ctail && inflight > 0)
+                            {
+                                head += 1;
+                                inflight -= 1;
+                            }
+                            __atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+                        }
+                        pthread_mutex_unlock(&this->mutex);
+                        for (unsigned int i = 0; i < requests.size(); i += 1)
+                            requests[i].result = -1;
+                        return false;
+                    }
+                    if (res > 0)
+                        unsubmitted -= std::min < unsigned int > (unsubmitted, res);
+
+                    unsigned int head = *this->cqHead;
+                    unsigned int ctail = __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+                    while (head != ctail)
+                    {
+                        struct io_uring_cqe * cqe = &cqes[head & *this->cqMask];
+                        requests[cqe->user_data].result = (cqe->res < 0) ? -1 : cqe->res;
+                        head += 1;
+                        pending -= 1;
+                    }
+                    __atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+                }
+
+                next += chunk;
+            }
+
+            pthread_mutex_unlock(&this->mutex);
+            return true;
+#else
+            return false;
+#endif
+        }
+    }
+}
@@ -0,0 +1,87 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_ASYNCIO
+#define CLASS_ASYNCIO
+
+#include <libpackaged-fs/config.h>
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <pthread.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! A single positional read or write in a batch.
+        struct BlockRequest
+        {
+            std::streampos pos;
+            char * data;
+            std::streamsize count;
+
+            //! Set once the batch completes to the number of bytes
+            //! transferred, or -1 if the request failed.
+            std::streamsize result;
+        };
+
+        //! Submits batches of positional reads and writes through io_uring.
+        /*!
+         * All requests in a batch are queued in the submission ring and
+         * handed to the kernel with a single system call, then reaped as
+         * they complete, so a whole batch costs roughly one round trip
+         * instead of one per request.  When io_uring is not available
+         * (old kernels, seccomp filters or builds without
+         * HAVE_IO_URING) isAvailable() returns false and the caller
+         * should fall back to synchronous I/O.
+         */
+        class AsyncIO
+        {
+        public:
+            AsyncIO(int fd, unsigned int depth = ASYNCIO_QUEUE_DEPTH);
+            ~AsyncIO();
+
+            //! Returns whether the io_uring instance was set up and has
+            //! not failed since.
+            bool isAvailable();
+
+            //! Performs all of the requests and waits for them to complete.
+            /*!
+             * Each request's result is set to what the kernel returned
+             * for it; a result shorter than count is not retried here.
+             * Returns false if the ring itself failed, in which case
+             * every result is -1 and the ring is not used again.
+             */
+            bool submit(std::vector < BlockRequest > & requests, bool write);
+
+        private:
+            int fd;
+            int ring;
+            unsigned int depth;
+            pthread_mutex_t mutex;
+
+            // Set once io_uring_enter has failed; the ring is left alone
+            // from then on and every batch falls back to pread().
+            bool broken;
+
+            void * sqPtr;
+            size_t sqSize;
+            void * cqPtr;
+            size_t cqSize;
+            void * sqes;
+            size_t sqesSize;
+
+            unsigned int * sqHead;
+            unsigned int * sqTail;
+            unsigned int * sqMask;
+            unsigned int * sqArray;
+            unsigned int * cqHead;
+            unsigned int * cqTail;
+            unsigned int * cqMask;
+            void * cqes;
+        };
+    }
+}
+
+#endif
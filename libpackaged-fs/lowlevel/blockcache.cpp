@@ -0,0 +1,548 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/config.h>
+
+#include <algorithm>
+#include <string.h>
+#include <libpackaged-fs/logging.h>
+#include <libpackaged-fs/lowlevel/blockcache.h>
+#include <libpackaged-fs/lowlevel/blockstream.h>
+#include <libpackaged-fs/lowlevel/journal.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        BlockCache::BlockCache(BlockStream * stream, std::streamsize length,
+                unsigned int capacity, unsigned int shards)
+        {
+            this->stream = stream;
+            this->journal = NULL;
+            this->pending = 0;
+            this->len = length;
+            pthread_mutex_init(&this->lengthMutex, NULL);
+
+            if (shards == 0)
+                shards = 1;
+            unsigned int per_shard = std::max < unsigned int > (1, capacity / shards);
+            for (unsigned int i = 0; i < shards; i += 1)
+            {
+                Shard * shard = new Shard();
+                pthread_mutex_init(&shard->mutex, NULL);
+                shard->buffer.resize(per_shard * BSIZE_FILE);
+                shard->entries.resize(per_shard);
+                for (unsigned int a = 0; a < per_shard; a += 1)
+                {
+                    shard->entries[a].block = 0;
+                    shard->entries[a].valid = false;
+                    shard->entries[a].dirty = false;
+                    shard->entries[a].referenced = false;
+                    shard->entries[a].pending = false;
+                    shard->entries[a].logged = false;
+                    shard->entries[a].collected = false;
+                    shard->entries[a].data = &shard->buffer[a * BSIZE_FILE];
+                }
+                shard->index.reserve(per_shard);
+                shard->hand = 0;
+                memset(&shard->stats, 0, sizeof(BlockCacheStatistics));
+                this->shards.push_back(shard);
+            }
+        }
+
+        BlockCache::~BlockCache()
+        {
+            for (unsigned int i = 0; i < this->shards.size(); i += 1)
+            {
+                pthread_mutex_destroy(&this->shards[i]->mutex);
+                delete this->shards[i];
+            }
+            this->shards.clear();
+            pthread_mutex_destroy(&this->lengthMutex);
+        }
+
+        std::streamsize BlockCache::read(std::streampos pos, char *out, std::streamsize count)
+        {
+            std::streamsize start = pos;
+            std::streamsize total = this->length();
+            if (start < 0)
+                return -1;
+            if (start >= total)
+                return 0;
+            if (count > total - start)
+                count = total - start;
+
+            std::streamsize done = 0;
+            while (done < count)
+            {
+                uint64_t block = (start + done) / BSIZE_FILE;
+                std::streamsize offset = (start + done) % BSIZE_FILE;
+                std::streamsize amount = std::min < std::streamsize > (BSIZE_FILE - offset, count - done);
+
+                Shard * shard = this->getShard(block);
+                pthread_mutex_lock(&shard->mutex);
+                Entry * entry = this->acquire(shard, block, true);
+                if (entry == NULL)
+                {
+                    pthread_mutex_unlock(&shard->mutex);
+                    return -1;
+                }
+                memcpy(out + done, entry->data + offset, amount);
+                pthread_mutex_unlock(&shard->mutex);
+
+                done += amount;
+            }
+
+            return done;
+        }
+
+        bool BlockCache::readBatch(std::vector < BlockRequest > & requests)
+        {
+            std::streamsize total = this->length();
+            std::vector < BlockRequest > misses;
+            std::vector < unsigned int > owners;
+
+            for (unsigned int i = 0; i < requests.size(); i += 1)
+            {
+                BlockRequest & req = requests[i];
+                std::streamsize start = req.pos;
+                std::streamsize count = req.count;
+                if (start < 0)
+                {
+                    req.result = -1;
+                    continue;
+                }
+                if (start >= total)
+                    count = 0;
+                else if (count > total - start)
+                    count = total - start;
+                req.result = count;
+
+                std::streamsize done = 0;
+                while (done < count)
+                {
+                    uint64_t block = (start + done) / BSIZE_FILE;
+                    std::streamsize offset = (start + done) % BSIZE_FILE;
+                    std::streamsize amount = std::min < std::streamsize > (BSIZE_FILE - offset, count - done);
+
+                    Shard * shard = this->getShard(block);
+                    pthread_mutex_lock(&shard->mutex);
+                    std::unordered_map < uint64_t, unsigned int >::iterator it = shard->index.find(block);
+                    if (it != shard->index.end())
+                    {
+                        Entry * entry = &shard->entries[it->second];
+                        entry->referenced = true;
+                        memcpy(req.data + done, entry->data + offset, amount);
+                        shard->stats.hits += 1;
+                        pthread_mutex_unlock(&shard->mutex);
+                    }
+                    else
+                    {
+                        shard->stats.misses += 1;
+                        pthread_mutex_unlock(&shard->mutex);
+
+                        // Merge with the previous miss when it is
+                        // contiguous both in the package and in memory.
+                        if (misses.size() > 0 && owners.back() == i &&
+                            (std::streamsize) misses.back().pos + misses.back().count == start + done)
+                            misses.back().count += amount;
+                        else
+                        {
+                            BlockRequest miss;
+                            miss.pos = start + done;
+                            miss.data = req.data + done;
+                            miss.count = amount;
+                            miss.result = 0;
+                            misses.push_back(miss);
+                            owners.push_back(i);
+                        }
+                    }
+
+                    done += amount;
+                }
+            }
+
+            bool success = this->stream->rawBatch(misses, false);
+            for (unsigned int i = 0; i < misses.size(); i += 1)
+            {
+                if (misses[i].result < 0)
+                {
+                    requests[owners[i]].result = -1;
+                    continue;
+                }
+
+                // The logical length may be ahead of the package on disk,
+                // in which case the unwritten tail reads as zero.
+                if (misses[i].result < misses[i].count)
+                    memset(misses[i].data + misses[i].result, 0, misses[i].count - misses[i].result);
+            }
+            for (unsigned int i = 0; i < requests.size(); i += 1)
+                if (requests[i].result < 0)
+                    success = false;
+            return success;
+        }
+
+        std::streamsize BlockCache::write(std::streampos pos, const char *data, std::streamsize count, bool journal)
+        {
+            std::streamsize start = pos;
+            if (start < 0)
+                return -1;
+
+            // Extend the logical length first, so that if one of the
+            // blocks is evicted before we return it is written back in
+            // full.
+            pthread_mutex_lock(&this->lengthMutex);
+            if (start + count > this->len)
+                this->len = start + count;
+            pthread_mutex_unlock(&this->lengthMutex);
+
+            std::streamsize done = 0;
+            while (done < count)
+            {
+                uint64_t block = (start + done) / BSIZE_FILE;
+                std::streamsize offset = (start + done) % BSIZE_FILE;
+                std::streamsize amount = std::min < std::streamsize > (BSIZE_FILE - offset, count - done);
+
+                Shard * shard = this->getShard(block);
+                pthread_mutex_lock(&shard->mutex);
+                Entry * entry = this->acquire(shard, block, amount != BSIZE_FILE);
+                if (entry == NULL)
+                {
+                    pthread_mutex_unlock(&shard->mutex);
+                    return -1;
+                }
+                memcpy(entry->data + offset, data + done, amount);
+                entry->dirty = true;
+                entry->logged = false;
+                entry->collected = false;
+
+                // Hold metadata for the journal, along with anything that
+                // is written over a block the journal has an image of.
+                if (this->journal != NULL && !entry->pending &&
+                    (journal || this->journal->isLive((uint32_t) (block * BSIZE_FILE))))
+                {
+                    entry->pending = true;
+                    __atomic_add_fetch(&this->pending, 1, __ATOMIC_RELAXED);
+                }
+                pthread_mutex_unlock(&shard->mutex);
+
+                done += amount;
+            }
+
+            return done;
+        }
+
+        bool BlockCache::flush(FlushMode mode, unsigned int * written)
+        {
+            bool success = true;
+            for (unsigned int i = 0; i < this->shards.size(); i += 1)
+            {
+                Shard * shard = this->shards[i];
+                pthread_mutex_lock(&shard->mutex);
+
+                // Write the dirty blocks back in package order so the
+                // host filesystem sees mostly sequential writes, and
+                // submit them as a single batch.
+                std::vector < std::pair < uint64_t, unsigned int > > dirty;
+                for (unsigned int a = 0; a < shard->entries.size(); a += 1)
+                {
+                    Entry * entry = &shard->entries[a];
+                    if (!entry->valid || !entry->dirty)
+                        continue;
+                    if (mode != FLUSH_ALL && entry->pending)
+                        continue;
+                    if (mode == FLUSH_DATA && entry->logged)
+                        continue;
+                    dirty.push_back(std::pair < uint64_t, unsigned int > (entry->block, a));
+                }
+                std::sort(dirty.begin(), dirty.end());
+
+                std::streamsize total = this->length();
+                std::vector < BlockRequest > batch;
+                std::vector < unsigned int > slots;
+                for (unsigned int a = 0; a < dirty.size(); a += 1)
+                {
+                    // Don't write past the logical end of the package.
+                    Entry * entry = &shard->entries[dirty[a].second];
+                    std::streamsize start = entry->block * BSIZE_FILE;
+                    std::streamsize amount = std::min < std::streamsize > (BSIZE_FILE, total - start);
+                    if (amount <= 0)
+                    {
+                        this->drop(shard, entry);
+                        continue;
+                    }
+                    BlockRequest req;
+                    req.pos = start;
+                    req.data = entry->data;
+                    req.count = amount;
+                    req.result = 0;
+                    batch.push_back(req);
+                    slots.push_back(dirty[a].second);
+                }
+
+                this->stream->rawBatch(batch, true);
+                for (unsigned int a = 0; a < batch.size(); a += 1)
+                {
+                    if (batch[a].result != batch[a].count)
+                    {
+                        Logging::showErrorW("BLOCKCACHE: Unable to write back block at %lli.", (long long) (std::streamsize) batch[a].pos);
+                        success = false;
+                        continue;
+                    }
+                    Entry * entry = &shard->entries[slots[a]];
+                    if (entry->pending)
+                        __atomic_sub_fetch(&this->pending, 1, __ATOMIC_RELAXED);
+                    entry->dirty = false;
+                    entry->pending = false;
+                    entry->logged = false;
+                    shard->stats.writebacks += 1;
+                    if (written != NULL)
+                        *written += 1;
+                }
+
+                pthread_mutex_unlock(&shard->mutex);
+            }
+            return success;
+        }
+
+        std::streamsize BlockCache::length()
+        {
+            pthread_mutex_lock(&this->lengthMutex);
+            std::streamsize result = this->len;
+            pthread_mutex_unlock(&this->lengthMutex);
+            return result;
+        }
+
+        void BlockCache::extend(std::streamsize length)
+        {
+            pthread_mutex_lock(&this->lengthMutex);
+            if (length > this->len)
+                this->len = length;
+            pthread_mutex_unlock(&this->lengthMutex);
+        }
+
+        void BlockCache::truncate(std::streamsize length)
+        {
+            pthread_mutex_lock(&this->lengthMutex);
+            this->len = length;
+            pthread_mutex_unlock(&this->lengthMutex);
+
+            uint64_t first = length / BSIZE_FILE;
+            for (unsigned int i = 0; i < this->shards.size(); i += 1)
+            {
+                Shard * shard = this->shards[i];
+                pthread_mutex_lock(&shard->mutex);
+                for (unsigned int a = 0; a < shard->entries.size(); a += 1)
+                {
+                    Entry * entry = &shard->entries[a];
+                    if (!entry->valid || entry->block < first)
+                        continue;
+                    this->drop(shard, entry);
+                }
+                pthread_mutex_unlock(&shard->mutex);
+            }
+        }
+
+        void BlockCache::discard(std::streampos pos, std::streamsize length)
+        {
+            uint64_t first = (uint64_t) pos / BSIZE_FILE;
+            uint64_t last = ((uint64_t) pos + length + BSIZE_FILE - 1) / BSIZE_FILE;
+            for (unsigned int i = 0; i < this->shards.size(); i += 1)
+            {
+                Shard * shard = this->shards[i];
+                pthread_mutex_lock(&shard->mutex);
+                for (unsigned int a = 0; a < shard->entries.size(); a += 1)
+                {
+                    Entry * entry = &shard->entries[a];
+                    if (!entry->valid || entry->block < first || entry->block >= last)
+                        continue;
+                    this->drop(shard, entry);
+                }
+                pthread_mutex_unlock(&shard->mutex);
+            }
+        }
+
+        void BlockCache::setJournal(Journal * journal)
+        {
+            this->journal = journal;
+        }
+
+        unsigned int BlockCache::getPendingCount()
+        {
+            return __atomic_load_n(&this->pending, __ATOMIC_RELAXED);
+        }
+
+        void BlockCache::collect(std::vector < uint32_t > & positions, std::vector < char > & images)
+        {
+            for (unsigned int i = 0; i < this->shards.size(); i += 1)
+            {
+                Shard * shard = this->shards[i];
+                pthread_mutex_lock(&shard->mutex);
+                for (unsigned int a = 0; a < shard->entries.size(); a += 1)
+                {
+                    Entry * entry = &shard->entries[a];
+                    if (!entry->valid || !entry->pending)
+                        continue;
+                    positions.push_back((uint32_t) (entry->block * BSIZE_FILE));
+                    images.insert(images.end(), entry->data, entry->data + BSIZE_FILE);
+                    entry->collected = true;
+                }
+                pthread_mutex_unlock(&shard->mutex);
+            }
+        }
+
+        void BlockCache::markLogged(const std::vector < uint32_t > & positions)
+        {
+            for (unsigned int i = 0; i < positions.size(); i += 1)
+            {
+                uint64_t block = positions[i] / BSIZE_FILE;
+                Shard * shard = this->getShard(block);
+                pthread_mutex_lock(&shard->mutex);
+                std::unordered_map < uint64_t, unsigned int >::iterator it = shard->index.find(block);
+                if (it != shard->index.end() && shard->entries[it->second].pending &&
+                    shard->entries[it->second].collected)
+                {
+                    Entry * entry = &shard->entries[it->second];
+                    entry->pending = false;
+                    entry->logged = true;
+                    __atomic_sub_fetch(&this->pending, 1, __ATOMIC_RELAXED);
+                }
+                pthread_mutex_unlock(&shard->mutex);
+            }
+        }
+
+        BlockCacheStatistics BlockCache::getStatistics()
+        {
+            BlockCacheStatistics result;
+            memset(&result, 0, sizeof(BlockCacheStatistics));
+            for (unsigned int i = 0; i < this->shards.size(); i += 1)
+            {
+                Shard * shard = this->shards[i];
+                pthread_mutex_lock(&shard->mutex);
+                result.hits += shard->stats.hits;
+                result.misses += shard->stats.misses;
+                result.evictions += shard->stats.evictions;
+                result.writebacks += shard->stats.writebacks;
+                pthread_mutex_unlock(&shard->mutex);
+            }
+            return result;
+        }
+
+        BlockCache::Shard * BlockCache::getShard(uint64_t block)
+        {
+            return this->shards[block % this->shards.size()];
+        }
+
+        BlockCache::Entry * BlockCache::acquire(Shard * shard, uint64_t block, bool fill)
+        {
+            std::unordered_map < uint64_t, unsigned int >::iterator it = shard->index.find(block);
+            if (it != shard->index.end())
+            {
+                Entry * entry = &shard->entries[it->second];
+                entry->referenced = true;
+                shard->stats.hits += 1;
+                return entry;
+            }
+            shard->stats.misses += 1;
+
+            // Sweep the clock hand until we find an unused entry or one
+            // that has not been referenced since the last sweep.  Two
+            // full revolutions are always enough to find a victim, unless
+            // every block is waiting for the journal.
+            unsigned int slot = shard->hand;
+            bool found = false;
+            for (unsigned int i = 0; i < shard->entries.size() * 2 && !found; i += 1)
+            {
+                slot = shard->hand;
+                shard->hand = (shard->hand + 1) % shard->entries.size();
+                Entry * candidate = &shard->entries[slot];
+                if (!candidate->valid)
+                    found = true;
+                else if (candidate->pending)
+                    continue;
+                else if (!candidate->referenced)
+                    found = true;
+                else
+                    candidate->referenced = false;
+            }
+
+            // Blocks waiting for the journal must never be written home,
+            // and they may only be committed between operations, so the
+            // shard grows until the next commit instead.
+            if (!found)
+            {
+                Logging::showDebugW("BLOCKCACHE: Growing a shard, as every block in it is waiting for the journal.");
+                shard->extra.push_back(std::vector < char > (BSIZE_FILE));
+                Entry grown;
+                grown.block = 0;
+                grown.valid = false;
+                grown.data = &shard->extra.back()[0];
+                slot = shard->entries.size();
+                shard->entries.push_back(grown);
+            }
+
+            Entry * entry = &shard->entries[slot];
+            if (entry->valid)
+            {
+                if (entry->dirty && !this->writeBack(shard, entry))
+                    return NULL;
+                shard->index.erase(entry->block);
+                entry->valid = false;
+                shard->stats.evictions += 1;
+            }
+
+            if (fill)
+            {
+                std::streamsize res = this->stream->rawReadAt((std::streampos) (block * BSIZE_FILE), entry->data, BSIZE_FILE);
+                if (res < 0)
+                    return NULL;
+
+                // Anything past the end of the package reads as zero.
+                if (res < BSIZE_FILE)
+                    memset(entry->data + res, 0, BSIZE_FILE - res);
+            }
+
+            entry->block = block;
+            entry->valid = true;
+            entry->dirty = false;
+            entry->referenced = true;
+            entry->pending = false;
+            entry->logged = false;
+            entry->collected = false;
+            shard->index[block] = slot;
+            return entry;
+        }
+
+        bool BlockCache::writeBack(Shard * shard, Entry * entry)
+        {
+            // Don't write past the logical end of the package, otherwise
+            // a partially used final block would extend the file.
+            std::streamsize start = entry->block * BSIZE_FILE;
+            std::streamsize amount = std::min < std::streamsize > (BSIZE_FILE, this->length() - start);
+            if (amount > 0 && this->stream->rawWriteAt((std::streampos) start, entry->data, amount) != amount)
+            {
+                Logging::showErrorW("BLOCKCACHE: Unable to write back block at %lli.", (long long) start);
+                return false;
+            }
+
+            if (entry->pending)
+                __atomic_sub_fetch(&this->pending, 1, __ATOMIC_RELAXED);
+            entry->dirty = false;
+            entry->pending = false;
+            entry->logged = false;
+            shard->stats.writebacks += 1;
+            return true;
+        }
+
+        void BlockCache::drop(Shard * shard, Entry * entry)
+        {
+            if (entry->pending)
+                __atomic_sub_fetch(&this->pending, 1, __ATOMIC_RELAXED);
+            shard->index.erase(entry->block);
+            entry->valid = false;
+            entry->dirty = false;
+            entry->referenced = false;
+            entry->pending = false;
+            entry->logged = false;
+        }
+    }
+}
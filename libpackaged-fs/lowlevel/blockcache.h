@@ -0,0 +1,188 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_BLOCKCACHE
+#define CLASS_BLOCKCACHE
+
+#include <libpackaged-fs/config.h>
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <pthread.h>
+#include <libpackaged-fs/lowlevel/asyncio.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        class BlockStream;
+        class Journal;
+
+        struct BlockCacheStatistics
+        {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+            uint64_t writebacks;
+        };
+
+        //! A write-back cache of the 4096 byte blocks in a package.
+        /*!
+         * Blocks are spread over a number of independently locked
+         * shards (by block number) so that concurrent accesses to
+         * different blocks rarely contend.  Each shard holds a fixed
+         * number of blocks and uses the CLOCK algorithm to choose
+         * which block to evict when it is full.  Modified blocks are
+         * only written to the package when they are evicted or when
+         * flush() is called.
+         *
+         * When a journal is attached, modified metadata blocks are held
+         * in the cache (and skipped by eviction) until collect() has
+         * copied them into a transaction and markLogged() has been told
+         * that it was committed; a shard that fills up with them grows
+         * until the next commit, which is only made between operations.
+         * Other writes, such as file data, go straight to the package
+         * as before unless the journal still holds an older image of
+         * the block, which would otherwise be copied over them when the
+         * journal is replayed.
+         */
+        class BlockCache
+        {
+        public:
+            BlockCache(BlockStream * stream, std::streamsize length,
+                    unsigned int capacity = CACHE_BLOCKS, unsigned int shards = CACHE_SHARDS);
+            ~BlockCache();
+
+            //! Reads up to count bytes from the absolute position pos.
+            /*!
+             * Returns the number of bytes read, which is less than count
+             * when reading past the end of the package, or -1 if an I/O
+             * error occurred.
+             */
+            std::streamsize read(std::streampos pos, char *out, std::streamsize count);
+
+            //! Performs a batch of reads.
+            /*!
+             * Cached blocks are copied out directly; all of the other
+             * blocks are read from the package in a single batch without
+             * being added to the cache, so large sequential reads don't
+             * evict the metadata that is being worked on.  Returns false
+             * if any request failed.
+             */
+            bool readBatch(std::vector < BlockRequest > & requests);
+
+            //! Writes count bytes to the absolute position pos.
+            /*!
+             * The data is only stored in the cache; writing past the end
+             * of the package extends its logical length.  Unless journal
+             * is false, the blocks are held for the next transaction when
+             * a journal is attached.  Returns the number of bytes written
+             * or -1 if an I/O error occurred.
+             */
+            std::streamsize write(std::streampos pos, const char *data, std::streamsize count, bool journal = true);
+
+            //! Which dirty blocks flush() writes back.
+            enum FlushMode
+            {
+                FLUSH_ALL,          //!< Every dirty block.
+                FLUSH_CHECKPOINT,   //!< Every block that is not waiting for the journal.
+                FLUSH_DATA          //!< Only blocks that were never journaled.
+            };
+
+            //! Writes dirty blocks back to the package, adding the number
+            //! written to written if it is given.
+            bool flush(FlushMode mode = FLUSH_ALL, unsigned int * written = NULL);
+
+            //! Attaches the journal that metadata blocks are held for.
+            void setJournal(Journal * journal);
+
+            //! Returns the number of blocks waiting for the journal.
+            unsigned int getPendingCount();
+
+            //! Appends the position and contents of every block that is
+            //! waiting for the journal to positions and images.
+            void collect(std::vector < uint32_t > & positions, std::vector < char > & images);
+
+            //! Records that the blocks at positions have been committed to
+            //! the journal, so they may be written back (unless they were
+            //! modified again since they were collected).
+            void markLogged(const std::vector < uint32_t > & positions);
+
+            //! Returns the logical length of the package, including any
+            //! data that has not yet been written back.
+            std::streamsize length();
+
+            //! Raises the logical length of the package to at least
+            //! length (it is never reduced).
+            void extend(std::streamsize length);
+
+            //! Sets the logical length of the package to length (which
+            //! must be a multiple of the block size), dropping any cached
+            //! blocks past it without writing them back.
+            void truncate(std::streamsize length);
+
+            //! Drops any cached blocks in the given range without writing
+            //! them back.
+            void discard(std::streampos pos, std::streamsize length);
+
+            //! Returns the hit, miss, eviction and write-back counters
+            //! summed over all shards.
+            BlockCacheStatistics getStatistics();
+
+        private:
+            struct Entry
+            {
+                uint64_t block;
+                bool valid;
+                bool dirty;
+                bool referenced;
+                bool pending;   // Waiting for the journal.
+                bool logged;    // Current contents are in the journal.
+                bool collected; // Unchanged since collect() copied it.
+                char * data;
+            };
+
+            struct Shard
+            {
+                pthread_mutex_t mutex;
+                std::unordered_map < uint64_t, unsigned int > index;
+                std::vector < Entry > entries;
+                std::vector < char > buffer;
+                std::deque < std::vector < char > > extra; // Blocks added past capacity.
+                unsigned int hand;
+                BlockCacheStatistics stats;
+            };
+
+            BlockStream * stream;
+            Journal * journal;
+            unsigned int pending;
+            std::vector < Shard * > shards;
+            std::streamsize len;
+            pthread_mutex_t lengthMutex;
+
+            // Returns the shard responsible for the specified block.
+            Shard * getShard(uint64_t block);
+
+            // Returns the cached entry for the specified block, loading
+            // it from the package if required and evicting another block
+            // if the shard is full (blocks waiting for the journal are
+            // never evicted; if nothing else is left, the shard grows).
+            // When fill is false the caller is going to overwrite the
+            // entire block, so it is not read from disk.  The shard must
+            // be locked.  Returns NULL on I/O error.
+            Entry * acquire(Shard * shard, uint64_t block, bool fill);
+
+            // Writes a dirty entry back to the package.  The shard
+            // must be locked.
+            bool writeBack(Shard * shard, Entry * entry);
+
+            // Forgets a cached entry without writing it back.  The shard
+            // must be locked.
+            void drop(Shard * shard, Entry * entry);
+        };
+    }
+}
+
+#endif
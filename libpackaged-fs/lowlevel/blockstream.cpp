@@ -14,6 +14,9 @@
 #define _lseek ::lseek
 #define _write ::write
 #define _read ::read
+#define _pread ::pread
+#define _pwrite ::pwrite
+#define _fstat ::fstat
 #define _close ::close
 #else
 #include <io.h>
@@ -21,6 +24,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #ifndef WIN32
 #define CREATE_CRITICAL() this->mutex = new pthread_mutex_t; pthread_mutex_init(this->mutex, NULL);
@@ -37,7 +45,7 @@ namespace AppLib
 {
     namespace LowLevel
     {
-        BlockStream::BlockStream(std::string filename)
+        BlockStream::BlockStream(std::string filename, bool readonly)
         {
             CREATE_CRITICAL();
 
@@ -45,26 +53,614 @@ namespace AppLib
 
             this->opened = false;
             this->invalid = false;
-
-            this->fd = new std::fstream(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-            if (!this->fd->is_open())
+            this->readonly = readonly;
+            this->holes = true;
+            this->mapping = NULL;
+            this->mapped = 0;
+            this->cache = NULL;
+            this->journal = NULL;
+            this->async = NULL;
+            this->commits = 0;
+            pthread_mutex_init(&this->journalMutex, NULL);
+            this->posg = 0;
+            this->posp = 0;
+            this->state = std::ios::goodbit;
+
+            this->fd = _open(filename.c_str(), readonly ? O_RDONLY : O_RDWR);
+            if (this->fd < 0)
             {
                 Logging::showErrorW("Unable to open specified file as BlockStream.");
                 this->invalid = true;
                 this->opened = false;
-                this->clear(std::ios::badbit | std::ios::failbit);
-                return;
+                this->state = std::ios::badbit | std::ios::failbit;
             }
             else
             {
-                this->fd->exceptions(std::ifstream::badbit | std::ios::failbit | std::ios::eofbit);
                 this->invalid = false;
                 this->opened = true;
             }
 
+#ifndef WIN32
+            // Read-only packages can never change size underneath us, so
+            // map the whole image once.  If the mapping fails we still
+            // work, just through pread() instead.
+            struct stat info;
+            if (this->opened && this->readonly && _fstat(this->fd, &info) == 0 && info.st_size > 0)
+            {
+                void * addr = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+                if (addr != MAP_FAILED)
+                {
+                    this->mapping = static_cast < char *>(addr);
+                    this->mapped = info.st_size;
+                }
+                else
+                    Logging::showWarningW("Unable to map package into memory (errno %i); falling back to pread().", errno);
+            }
+#endif
+
+            // Writable packages are accessed through the block cache
+            // (read-only packages are already served from memory).
+            if (this->opened && !this->readonly && CACHE_BLOCKS > 0)
+                this->cache = new BlockCache(this, this->size());
+
+            // Batched reads of unmapped packages go through io_uring
+            // when the kernel lets us have one.
+            if (this->opened && this->mapping == NULL && ASYNCIO_QUEUE_DEPTH > 0)
+            {
+                this->async = new AsyncIO(this->fd);
+                if (!this->async->isAvailable())
+                {
+                    delete this->async;
+                    this->async = NULL;
+                }
+            }
+
             LEAVE_CRITICAL();
         }
 
+        BlockStream::~BlockStream()
+        {
+            if (this->opened)
+                this->close();
+            pthread_mutex_destroy(&this->journalMutex);
+        }
+
+        std::streamsize BlockStream::readAt(std::streampos pos, char *out, std::streamsize count)
+        {
+            if (this->invalid || !this->opened)
+                return -1;
+
+            if (this->mapping != NULL)
+            {
+                // Copy straight out of the mapped image.
+                std::streamsize offset = pos;
+                if (offset < 0 || offset >= this->mapped)
+                    return 0;
+                if (count > this->mapped - offset)
+                    count = this->mapped - offset;
+                memcpy(out, this->mapping + offset, count);
+                this->readOverlay(pos, out, count);
+                return count;
+            }
+
+            if (this->cache != NULL)
+                return this->cache->read(pos, out, count);
+
+            std::streamsize res = this->rawReadAt(pos, out, count);
+            if (res > 0)
+                this->readOverlay(pos, out, res);
+            return res;
+        }
+
+        std::streamsize BlockStream::rawReadAt(std::streampos pos, char *out, std::streamsize count)
+        {
+            // pread() may return less than requested (i.e. when interrupted
+            // by a signal), so loop until we have everything or hit EOF.
+            std::streamsize total = 0;
+            while (total < count)
+            {
+                ssize_t res = _pread(this->fd, out + total, count - total, (off_t) pos + total);
+                if (res < 0 && errno == EINTR)
+                    continue;
+                if (res < 0)
+                {
+                    Logging::showErrorW("I/O error occurred while reading from package (errno %i).", errno);
+                    return -1;
+                }
+                if (res == 0)
+                    break;
+                total += res;
+            }
+
+            return total;
+        }
+
+        std::streamsize BlockStream::writeAt(std::streampos pos, const char *data, std::streamsize count, bool journal)
+        {
+            if (this->invalid || !this->opened)
+                return -1;
+
+            if (this->readonly)
+            {
+                Logging::showErrorW("Attempted to write to a package opened read-only.");
+                return -1;
+            }
+
+            if (this->cache != NULL)
+            {
+                std::streamsize res = this->cache->write(pos, data, count, journal);
+                this->checkPending();
+                return res;
+            }
+
+            return this->rawWriteAt(pos, data, count);
+        }
+
+        std::streamsize BlockStream::rawWriteAt(std::streampos pos, const char *data, std::streamsize count)
+        {
+
+            std::streamsize total = 0;
+            while (total < count)
+            {
+                ssize_t res = _pwrite(this->fd, data + total, count - total, (off_t) pos + total);
+                if (res < 0 && errno == EINTR)
+                    continue;
+                if (res <= 0)
+                {
+                    Logging::showErrorW("I/O error occurred while writing to package (errno %i).", errno);
+                    return -1;
+                }
+                total += res;
+            }
+
+            return total;
+        }
+
+        bool BlockStream::readBatch(std::vector < BlockRequest > & requests)
+        {
+            if (this->invalid || !this->opened)
+            {
+                for (unsigned int i = 0; i < requests.size(); i += 1)
+                    requests[i].result = -1;
+                return false;
+            }
+
+            if (this->mapping != NULL)
+            {
+                for (unsigned int i = 0; i < requests.size(); i += 1)
+                    requests[i].result = this->readAt(requests[i].pos, requests[i].data, requests[i].count);
+                return true;
+            }
+
+            if (this->cache != NULL)
+                return this->cache->readBatch(requests);
+
+            bool success = this->rawBatch(requests, false);
+            for (unsigned int i = 0; i < requests.size(); i += 1)
+                if (requests[i].result > 0)
+                    this->readOverlay(requests[i].pos, requests[i].data, requests[i].result);
+            return success;
+        }
+
+        bool BlockStream::writeBatch(std::vector < BlockRequest > & requests, bool journal)
+        {
+            if (this->invalid || !this->opened || this->readonly)
+            {
+                if (this->readonly)
+                    Logging::showErrorW("Attempted to write to a package opened read-only.");
+                for (unsigned int i = 0; i < requests.size(); i += 1)
+                    requests[i].result = -1;
+                return false;
+            }
+
+            if (this->cache != NULL)
+            {
+                // Writes only touch the cache, so there is nothing to
+                // gain from batching them.
+                bool success = true;
+                for (unsigned int i = 0; i < requests.size(); i += 1)
+                {
+                    requests[i].result = this->cache->write(requests[i].pos, requests[i].data, requests[i].count, journal);
+                    if (requests[i].result < 0)
+                        success = false;
+                }
+                this->checkPending();
+                return success;
+            }
+
+            return this->rawBatch(requests, true);
+        }
+
+        bool BlockStream::rawBatch(std::vector < BlockRequest > & requests, bool write)
+        {
+            if (requests.size() == 0)
+                return true;
+            if (this->async == NULL || !this->async->submit(requests, write))
+                for (unsigned int i = 0; i < requests.size(); i += 1)
+                    requests[i].result = 0;
+
+            // io_uring doesn't retry short transfers for us, and a failed
+            // ring leaves everything to do, so finish the remainder of
+            // each request synchronously.
+            bool success = true;
+            for (unsigned int i = 0; i < requests.size(); i += 1)
+            {
+                BlockRequest & req = requests[i];
+                if (req.result < 0)
+                    req.result = 0;
+                if (req.result < req.count)
+                {
+                    std::streamsize res;
+                    if (write)
+                        res = this->rawWriteAt(req.pos + (std::streamoff) req.result,
+                                req.data + req.result, req.count - req.result);
+                    else
+                        res = this->rawReadAt(req.pos + (std::streamoff) req.result,
+                                req.data + req.result, req.count - req.result);
+                    if (res < 0)
+                    {
+                        req.result = -1;
+                        success = false;
+                        continue;
+                    }
+                    req.result += res;
+                }
+            }
+            return success;
+        }
+
+        std::streampos BlockStream::size()
+        {
+            if (this->invalid || !this->opened)
+                return 0;
+            if (this->mapping != NULL)
+                return this->mapped;
+            if (this->cache != NULL)
+                return this->cache->length();
+
+            struct stat info;
+            if (_fstat(this->fd, &info) != 0)
+                return 0;
+            return info.st_size;
+        }
+
+        bool BlockStream::extend(std::streampos length)
+        {
+            if (this->invalid || !this->opened || this->readonly)
+                return false;
+            if (length <= this->size())
+                return true;
+
+            // The cache may already hold blocks past the end of the file
+            // on disk, so grow the file itself from wherever it ends.
+            struct stat info;
+            if (_fstat(this->fd, &info) != 0)
+                return false;
+            if (length > info.st_size)
+            {
+#ifdef __linux__
+                int res = fallocate(this->fd, 0, info.st_size, (off_t) length - info.st_size);
+                if (res != 0 && errno != EOPNOTSUPP)
+                {
+                    Logging::showErrorW("Unable to reserve space in package (errno %i).", errno);
+                    return false;
+                }
+                if (res != 0 && ftruncate(this->fd, (off_t) length) != 0)
+#elif !defined(WIN32)
+                if (ftruncate(this->fd, (off_t) length) != 0)
+#else
+                if (_chsize_s(this->fd, (__int64) length) != 0)
+#endif
+                {
+                    Logging::showErrorW("Unable to extend package (errno %i).", errno);
+                    return false;
+                }
+            }
+
+            if (this->cache != NULL)
+                this->cache->extend(length);
+            return true;
+        }
+
+        bool BlockStream::truncate(std::streampos length)
+        {
+            if (this->invalid || !this->opened || this->readonly)
+                return false;
+            if (length >= this->size())
+                return true;
+
+            if (this->cache != NULL)
+                this->cache->truncate(length);
+#ifndef WIN32
+            if (ftruncate(this->fd, (off_t) length) != 0)
+#else
+            if (_chsize_s(this->fd, (__int64) length) != 0)
+#endif
+            {
+                Logging::showErrorW("Unable to shrink package (errno %i).", errno);
+                return false;
+            }
+            return true;
+        }
+
+        bool BlockStream::discard(std::streampos pos, std::streamsize length)
+        {
+            if (this->invalid || !this->opened || this->readonly || !this->holes)
+                return false;
+            if (length <= 0)
+                return true;
+
+            if (this->cache != NULL)
+                this->cache->discard(pos, length);
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+            if (fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) pos, (off_t) length) == 0)
+                return true;
+            if (errno == EOPNOTSUPP)
+            {
+                // Don't keep asking a filesystem that can't do it.
+                Logging::showDebugW("BLOCKSTREAM: Host filesystem can not punch holes.");
+                this->holes = false;
+            }
+            else
+                Logging::showErrorW("Unable to release space in package (errno %i).", errno);
+            return false;
+#else
+            this->holes = false;
+            return false;
+#endif
+        }
+
+        bool BlockStream::isReadOnly()
+        {
+            return this->readonly;
+        }
+
+        int BlockStream::getDescriptor()
+        {
+            return this->fd;
+        }
+
+        bool BlockStream::flush()
+        {
+            if (this->invalid || !this->opened)
+                return false;
+            if (this->cache == NULL)
+                return true;
+            if (this->journal != NULL)
+                return this->commit();
+
+            bool success = this->cache->flush();
+            if (!this->rawSync())
+                success = false;
+            return success;
+        }
+
+        bool BlockStream::openJournal(uint32_t pos, uint32_t blocks, std::vector < uint32_t > & replayed)
+        {
+            if (this->invalid || !this->opened || this->journal != NULL || blocks < 2)
+                return false;
+
+            Journal * journal = new Journal(this, pos, blocks);
+            if (this->readonly)
+            {
+                bool success = journal->load(this->overlay);
+                delete journal;
+                if (!success)
+                {
+                    this->overlay.clear();
+                    return false;
+                }
+                if (this->overlay.size() > 0)
+                    Logging::showInfoW("Reading %u blocks from the metadata journal that have not been applied; open the package for writing to apply them.",
+                            (unsigned int) this->overlay.size());
+                for (std::map < uint32_t, std::vector < char > >::iterator it = this->overlay.begin(); it != this->overlay.end(); it++)
+                    replayed.push_back(it->first);
+                return true;
+            }
+            if (journal->getCapacity() == 0)
+            {
+                delete journal;
+                return false;
+            }
+
+            // Nothing should have been cached from the journal itself, and
+            // anything cached from where the blocks were replayed to is
+            // out of date.
+            if (this->cache != NULL)
+                this->cache->discard(pos, (std::streamsize) blocks * BSIZE_FILE);
+            unsigned int first = replayed.size();
+            if (!journal->recover(replayed))
+            {
+                Logging::showErrorW("Unable to recover the metadata journal; changes will be written directly.");
+                delete journal;
+                return false;
+            }
+            if (this->cache == NULL)
+            {
+                delete journal;
+                return false;
+            }
+            for (unsigned int i = first; i < replayed.size(); i += 1)
+                this->cache->discard(replayed[i], BSIZE_FILE);
+
+            this->journal = journal;
+            this->cache->setJournal(journal);
+            return true;
+        }
+
+        bool BlockStream::hasJournal()
+        {
+            return this->journal != NULL;
+        }
+
+        bool BlockStream::hasOverlay()
+        {
+            return !this->overlay.empty();
+        }
+
+        void BlockStream::readOverlay(std::streampos pos, char *out, std::streamsize count)
+        {
+            if (this->overlay.empty())
+                return;
+            std::streamsize start = pos;
+            std::map < uint32_t, std::vector < char > >::iterator it = this->overlay.lower_bound((uint32_t) (start - start % BSIZE_FILE));
+            for (; it != this->overlay.end() && (std::streamsize) it->first < start + count; it++)
+            {
+                std::streamsize from = std::max < std::streamsize > (start, it->first);
+                std::streamsize to = std::min < std::streamsize > (start + count, (std::streamsize) it->first + BSIZE_FILE);
+                memcpy(out + (from - start), &it->second[from - it->first], to - from);
+            }
+        }
+
+        bool BlockStream::commit()
+        {
+            if (this->invalid || !this->opened)
+                return false;
+            if (this->journal == NULL)
+                return this->flush();
+
+            pthread_mutex_lock(&this->journalMutex);
+            bool success = this->commitLocked();
+            pthread_mutex_unlock(&this->journalMutex);
+            return success;
+        }
+
+        bool BlockStream::checkpoint()
+        {
+            if (this->invalid || !this->opened)
+                return false;
+            if (this->journal == NULL)
+                return this->flush();
+
+            pthread_mutex_lock(&this->journalMutex);
+            bool success = this->checkpointLocked();
+            pthread_mutex_unlock(&this->journalMutex);
+            return success;
+        }
+
+        bool BlockStream::hasPendingChanges()
+        {
+            return this->journal != NULL && this->cache->getPendingCount() > 0;
+        }
+
+        void BlockStream::setCommitHandler(std::function<void()> handler)
+        {
+            this->commitHandler = handler;
+        }
+
+        bool BlockStream::isCommitDue()
+        {
+            // Committing before half of the journal is taken up keeps
+            // bursts of operations from overflowing a transaction.
+            return this->journal != NULL &&
+                   this->cache->getPendingCount() >= this->journal->getCapacity() / 2;
+        }
+
+        void BlockStream::checkPending()
+        {
+            if (this->commitHandler && this->isCommitDue())
+                this->commitHandler();
+        }
+
+        unsigned int BlockStream::getJournalUsage()
+        {
+            if (this->journal == NULL)
+                return 0;
+            return this->journal->getUsage();
+        }
+
+        uint32_t BlockStream::getJournalCapacity()
+        {
+            if (this->journal == NULL)
+                return 0;
+            return this->journal->getCapacity();
+        }
+
+        uint64_t BlockStream::getCommitCount()
+        {
+            pthread_mutex_lock(&this->journalMutex);
+            uint64_t result = this->commits;
+            pthread_mutex_unlock(&this->journalMutex);
+            return result;
+        }
+
+        bool BlockStream::commitLocked()
+        {
+            std::vector < uint32_t > positions;
+            std::vector < char > images;
+            this->cache->collect(positions, images);
+
+            // File data goes straight home, but it must be there before
+            // any metadata that points at it is committed.
+            unsigned int written = 0;
+            if (!this->cache->flush(BlockCache::FLUSH_DATA, &written))
+                return false;
+            if (written > 0 && !this->rawSync())
+                return false;
+            if (positions.size() == 0)
+            {
+                this->commits += 1;
+                return true;
+            }
+
+            // Operations are kept small enough, and commits frequent
+            // enough, that the modifications always fit in the journal.
+            // Committing only some of them would not be atomic, so they
+            // are left waiting if they don't.
+            if (positions.size() > this->journal->getCapacity())
+            {
+                Logging::showErrorW("BLOCKSTREAM: %u modified blocks do not fit in the journal.", (unsigned int) positions.size());
+                return false;
+            }
+            if (!this->journal->hasRoom(positions.size()))
+            {
+                // Make room by writing the journal home.  Blocks that are
+                // about to be committed again still need their previous
+                // image to be home in case this transaction is lost.
+                if (!this->cache->flush(BlockCache::FLUSH_CHECKPOINT) || !this->journal->restore(positions) ||
+                    !this->rawSync() || !this->journal->reset())
+                    return false;
+            }
+
+            // The blocks stay waiting for the journal if this fails, so
+            // the next commit tries again.
+            if (!this->journal->append(positions, &images[0]) || !this->rawSync())
+                return false;
+            this->cache->markLogged(positions);
+            this->commits += 1;
+            return true;
+        }
+
+        bool BlockStream::checkpointLocked()
+        {
+            if (!this->commitLocked())
+                return false;
+            if (!this->cache->flush(BlockCache::FLUSH_CHECKPOINT) || !this->rawSync())
+                return false;
+            return this->journal->reset();
+        }
+
+        bool BlockStream::rawSync()
+        {
+#ifndef WIN32
+            if (fdatasync(this->fd) != 0)
+            {
+                Logging::showErrorW("Unable to sync package to disk (errno %i).", errno);
+                return false;
+            }
+#endif
+            return true;
+        }
+
+        BlockCacheStatistics BlockStream::getCacheStatistics()
+        {
+            BlockCacheStatistics result;
+            memset(&result, 0, sizeof(BlockCacheStatistics));
+            if (this->cache != NULL)
+                result = this->cache->getStatistics();
+            return result;
+        }
+
         void BlockStream::write(const char *data, std::streamsize count)
         {
             ENTER_CRITICAL();
@@ -73,10 +669,15 @@ namespace AppLib
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return;
             }
 
-            this->fd->write(data, count);
+            std::streamsize res = this->writeAt(this->posp, data, count);
+            if (res < 0)
+                this->clear(std::ios::badbit | std::ios::failbit);
+            else
+                this->posp += res;
 
             LEAVE_CRITICAL();
         }
@@ -89,11 +690,19 @@ namespace AppLib
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return 0;
             }
 
-            this->fd->readsome(out, count);
-            std::streamsize total = this->fd->gcount();
+            std::streamsize total = this->readAt(this->posg, out, count);
+            if (total < 0)
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                total = 0;
+            }
+            else if (total < count)
+                this->clear(std::ios::eofbit);
+            this->posg += total;
 
             LEAVE_CRITICAL();
 
@@ -104,7 +713,38 @@ namespace AppLib
         {
             ENTER_CRITICAL();
 
-            this->fd->close();
+            if (this->journal != NULL)
+            {
+                this->checkpoint();
+                JournalStatistics jstats = this->journal->getStatistics();
+                Logging::showDebugW("JOURNAL: %llu commits of %llu blocks, %llu checkpoints, %llu blocks replayed.",
+                        (unsigned long long) jstats.commits, (unsigned long long) jstats.blocks,
+                        (unsigned long long) jstats.checkpoints, (unsigned long long) jstats.replayed);
+                this->cache->setJournal(NULL);
+                delete this->journal;
+                this->journal = NULL;
+            }
+            if (this->cache != NULL)
+            {
+                this->flush();
+                BlockCacheStatistics stats = this->cache->getStatistics();
+                Logging::showDebugW("BLOCKCACHE: %llu hits, %llu misses, %llu evictions, %llu write-backs.",
+                        (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+                        (unsigned long long) stats.evictions, (unsigned long long) stats.writebacks);
+                delete this->cache;
+                this->cache = NULL;
+            }
+
+#ifndef WIN32
+            if (this->mapping != NULL)
+                munmap(this->mapping, this->mapped);
+#endif
+            this->mapping = NULL;
+            this->mapped = 0;
+            delete this->async;
+            this->async = NULL;
+            if (this->opened)
+                _close(this->fd);
             this->opened = false;
 
             LEAVE_CRITICAL();
@@ -118,10 +758,16 @@ namespace AppLib
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return;
             }
 
-            this->fd->seekp(pos, dir);
+            if (dir == std::ios_base::cur)
+                this->posp += pos;
+            else if (dir == std::ios_base::end)
+                this->posp = this->size() + pos;
+            else
+                this->posp = pos;
 
             LEAVE_CRITICAL();
         }
@@ -134,10 +780,16 @@ namespace AppLib
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return;
             }
 
-            this->fd->seekg(pos, dir);
+            if (dir == std::ios_base::cur)
+                this->posg += pos;
+            else if (dir == std::ios_base::end)
+                this->posg = this->size() + pos;
+            else
+                this->posg = pos;
 
             LEAVE_CRITICAL();
         }
@@ -150,10 +802,11 @@ namespace AppLib
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return 0;
             }
 
-            std::streampos pos = this->fd->tellp();
+            std::streampos pos = this->posp;
 
             LEAVE_CRITICAL();
 
@@ -168,10 +821,11 @@ namespace AppLib
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return 0;
             }
 
-            std::streampos pos = this->fd->tellg();
+            std::streampos pos = this->posg;
 
             LEAVE_CRITICAL();
 
@@ -180,42 +834,42 @@ namespace AppLib
 
         bool BlockStream::is_open()
         {
-            return this->fd->is_open();
+            return this->opened;
         }
 
         std::ios::iostate BlockStream::rdstate()
         {
-            return this->fd->rdstate();
+            return this->state;
         }
 
         void BlockStream::clear()
         {
-            this->fd->clear();
+            this->state = std::ios::goodbit;
         }
 
         void BlockStream::clear(std::ios::iostate state)
         {
-            this->fd->clear(state);
+            this->state = state;
         }
 
         bool BlockStream::good()
         {
-            return this->fd->good();
+            return (this->state == std::ios::goodbit);
         }
 
         bool BlockStream::bad()
         {
-            return this->fd->bad();
+            return ((this->state & std::ios::badbit) != 0);
         }
 
         bool BlockStream::eof()
         {
-            return this->fd->eof();
+            return ((this->state & std::ios::eofbit) != 0);
         }
 
         bool BlockStream::fail()
         {
-            return this->fd->fail();
+            return ((this->state & std::ios::failbit) != 0);
         }
     }
 }
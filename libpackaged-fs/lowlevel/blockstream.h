@@ -9,6 +9,12 @@
 #include <iostream>
 #include <libpackaged-fs/logging.h>
 #include <libpackaged-fs/lowlevel/endian.h>
+#include <libpackaged-fs/lowlevel/blockcache.h>
+#include <libpackaged-fs/lowlevel/journal.h>
+#include <libpackaged-fs/lowlevel/asyncio.h>
+#include <vector>
+#include <map>
+#include <functional>
 #include <errno.h>
 #include <pthread.h>
 
@@ -19,7 +25,181 @@ namespace AppLib
         class BlockStream
         {
               public:
-            BlockStream(std::string filename);
+            //! Opens the package at filename.
+            /*!
+             * When readonly is set the package is opened read-only and
+             * mapped into memory, so that positional reads become a copy
+             * out of the mapped image rather than a system call.  Writes
+             * to a read-only stream always fail.
+             */
+            BlockStream(std::string filename, bool readonly = false);
+            ~BlockStream();
+
+            //! Reads up to count bytes from the absolute position pos.
+            /*!
+             * Positional reads do not use or modify the stream cursor
+             * and do not take the stream lock, so any number of threads
+             * may read from the package at once.  On writable packages
+             * they are served from the block cache.  The return value is the
+             * number of bytes read (which is less than count at EOF), or
+             * -1 if an I/O error occurred.
+             */
+            std::streamsize readAt(std::streampos pos, char *out, std::streamsize count);
+
+            //! Writes count bytes to the absolute position pos.
+            /*!
+             * Writing past the end of the package implicitly extends it.
+             * When the package has a journal, the write becomes part of
+             * the next transaction unless journal is false (which should
+             * only be used for file data).  The return value is the
+             * number of bytes written, or -1 if an I/O error occurred.
+             */
+            std::streamsize writeAt(std::streampos pos, const char *data, std::streamsize count, bool journal = true);
+
+            //! Performs a batch of positional reads.
+            /*!
+             * On unmapped packages the blocks that are not already cached
+             * are read with a single io_uring submission where possible
+             * (falling back to pread() otherwise).  Each request's result
+             * is set as for readAt().  Returns false if any request
+             * failed.
+             */
+            bool readBatch(std::vector < BlockRequest > & requests);
+
+            //! Performs a batch of positional writes.
+            /*!
+             * Each request's result is set as for writeAt().  Returns
+             * false if any request failed.
+             */
+            bool writeBatch(std::vector < BlockRequest > & requests, bool journal = true);
+
+            //! Returns the current size of the underlying package file.
+            std::streampos size();
+
+            //! Grows the package to at least length bytes.
+            /*!
+             * The new space reads as zero.  It is reserved on the host
+             * filesystem with a single fallocate() where supported (and
+             * ftruncate() otherwise) rather than by writing it out.
+             * Returns false if the package could not be grown.
+             */
+            bool extend(std::streampos length);
+
+            //! Shrinks the package to length bytes.
+            /*!
+             * Anything past length (which must be a multiple of the block
+             * size) is discarded, including modifications that are still
+             * in the block cache.  Returns false if the package could not
+             * be shrunk.
+             */
+            bool truncate(std::streampos length);
+
+            //! Gives the space used by a range of the package back to the
+            //! host filesystem.
+            /*!
+             * The range (which must be block aligned) reads as zero
+             * afterwards and any cached blocks in it are dropped without
+             * being written back, but the length of the package is not
+             * changed.  This punches a hole with fallocate() where it is
+             * supported; returns false if it is not, or if the package
+             * is read-only.
+             */
+            bool discard(std::streampos pos, std::streamsize length);
+
+            //! Returns whether the package was opened read-only.
+            bool isReadOnly();
+
+            //! Returns the file descriptor of the package, so that
+            //! data can be handed to the kernel without copying it.
+            int getDescriptor();
+
+            //! Writes all cached modifications back to the package.
+            /*!
+             * Reads and writes on a writable package go through a block
+             * cache, so modifications are not guaranteed to be in the
+             * package until this is called (close() calls it as well).
+             * When the package has a journal this is the same as
+             * commit().  Returns false if any block could not be written
+             * back.
+             */
+            bool flush();
+
+            //! Starts using the journal in the blocks at pos.
+            /*!
+             * Any transactions that were committed but not checkpointed
+             * when the package was last written to are copied home first.
+             * Read-only packages can't be changed, so their blocks are
+             * kept in memory instead and read in place of what is home
+             * (the journal isn't used otherwise).  The positions of the
+             * blocks that were replayed are appended to replayed.
+             * Returns false if the journal could not be recovered, in
+             * which case the package is used without it (read-only
+             * packages can't be read consistently then).
+             */
+            bool openJournal(uint32_t pos, uint32_t blocks, std::vector < uint32_t > & replayed);
+
+            //! Returns whether modifications go through a journal.
+            bool hasJournal();
+
+            //! Returns whether some blocks of a read-only package are read
+            //! from its journal rather than from the package itself, in
+            //! which case its descriptor can't be read directly.
+            bool hasOverlay();
+
+            //! Makes the modifications made since the last commit durable
+            //! as a single transaction.
+            /*!
+             * File data is written back and synced first, then every
+             * other modified block is appended to the journal and
+             * synced, so a group of operations costs one sequential
+             * write rather than one random write per block.  The blocks
+             * are written home later, by eviction or by checkpoint().
+             * It must only be called between operations, and no other
+             * thread may modify the package while it runs.  Returns
+             * false on I/O error, or if there are more modifications
+             * than the journal can hold, leaving them to the next
+             * commit.
+             */
+            bool commit();
+
+            //! Commits, then writes every block in the journal home and
+            //! empties it.
+            bool checkpoint();
+
+            //! Returns whether any modifications are waiting to be
+            //! committed to the journal.
+            bool hasPendingChanges();
+
+            //! Returns whether enough modifications are waiting for the
+            //! journal that they should be committed before the next
+            //! operation starts.
+            bool isCommitDue();
+
+            //! Sets a function that is called after a write once enough
+            //! modifications are waiting for the journal that they
+            //! should be committed as soon as the current operation is
+            //! done.  It must not commit by itself.
+            void setCommitHandler(std::function<void()> handler);
+
+            //! Returns how much of the journal is used, as a percentage
+            //! (0 when there is no journal).
+            unsigned int getJournalUsage();
+
+            //! Returns the number of blocks a single transaction can hold
+            //! (0 when there is no journal).
+            uint32_t getJournalCapacity();
+
+            //! Returns the number of times modifications have been made
+            //! durable, so callers can tell whether a change made at some
+            //! point has since reached the package.
+            uint64_t getCommitCount();
+
+            //! Returns the block cache counters (all zero when the
+            //! package is not cached).
+            BlockCacheStatistics getCacheStatistics();
+
+            // Cursor-based functions, kept for callers that still
+            // walk the package sequentially.
             void write(const char *data, std::streamsize count);
              std::streamsize read(char *out, std::streamsize count);
             void close();
@@ -39,10 +219,57 @@ namespace AppLib
             bool fail();
 
               private:
-             std::fstream * fd;
+            friend class BlockCache;
+            friend class Journal;
+
+            // Uncached positional I/O against the package itself.
+            std::streamsize rawReadAt(std::streampos pos, char *out, std::streamsize count);
+            std::streamsize rawWriteAt(std::streampos pos, const char *data, std::streamsize count);
+
+            // Uncached batch I/O against the package itself, finishing
+            // any short transfers synchronously.
+            bool rawBatch(std::vector < BlockRequest > & requests, bool write);
+
+            // Syncs the data of the package to stable storage.
+            bool rawSync();
+
+            // Copies the blocks of the overlay that fall in a range that
+            // was read over what was read from the package.
+            void readOverlay(std::streampos pos, char *out, std::streamsize count);
+
+            // Performs commit() and checkpoint() with the journal lock
+            // held.
+            bool commitLocked();
+            bool checkpointLocked();
+
+            int fd;
             bool opened;
             bool invalid;
+            bool readonly;
+            bool holes;
+            char * mapping;
+            std::streamsize mapped;
+            BlockCache * cache;
+            Journal * journal;
+            AsyncIO * async;
+
+            // The blocks of the journal of a read-only package that were
+            // committed but never copied home.
+            std::map < uint32_t, std::vector < char > > overlay;
+            std::streampos posg;
+            std::streampos posp;
+            std::ios::iostate state;
             pthread_mutex_t * mutex;
+
+            // Serialises commits and checkpoints, and the number of them
+            // that have completed.
+            pthread_mutex_t journalMutex;
+            uint64_t commits;
+            std::function<void()> commitHandler;
+
+            // Calls the commit handler if enough modifications are
+            // waiting for the journal.
+            void checkPending();
         };
     }
 }
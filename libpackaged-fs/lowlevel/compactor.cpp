@@ -0,0 +1,387 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/lowlevel/compactor.h>
+#include <libpackaged-fs/lowlevel/inodelayout.h>
+#include <libpackaged-fs/logging.h>
+#include <algorithm>
+#include <string.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        Compactor::Compactor(FS * filesystem, FreeList * freelist, BlockStream * fd)
+        {
+            this->filesystem = filesystem;
+            this->freelist = freelist;
+            this->fd = fd;
+            this->phase = PHASE_FINISHED;
+            memset(&this->stats, 0, sizeof(CompactorStatistics));
+            this->nextid = 0;
+            this->moving = false;
+            this->movingid = 0;
+            this->movinggen = 0;
+            this->runpos = 0;
+            this->runlength = 0;
+            this->runused = 0;
+            this->tail = 0;
+        }
+
+        Compactor::~Compactor()
+        {
+            this->abandon();
+        }
+
+        bool Compactor::step(uint32_t budget)
+        {
+            if (this->phase == PHASE_FINISHED)
+            {
+                // Start a new pass.
+                this->phase = PHASE_DEFRAGMENT;
+                this->nextid = 1;
+                this->owners.clear();
+            }
+
+            uint32_t used = 0;
+            while (used < budget && this->phase != PHASE_FINISHED)
+            {
+                switch (this->phase)
+                {
+                    case PHASE_DEFRAGMENT:
+                        used += this->defragment(budget - used);
+                        break;
+                    case PHASE_MAP:
+                        used += this->map(budget - used);
+                        break;
+                    case PHASE_EVACUATE:
+                        used += this->evacuate(budget - used);
+                        break;
+                    case PHASE_SHRINK:
+                        this->shrink();
+                        this->owners.clear();
+                        this->stats.passes += 1;
+                        this->phase = PHASE_FINISHED;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return (this->phase == PHASE_FINISHED);
+        }
+
+        void Compactor::abandon()
+        {
+            if (!this->moving)
+                return;
+
+            std::vector < uint32_t > unused;
+            for (uint32_t i = this->runused; i < this->runlength; i += 1)
+                unused.push_back(this->runpos + i * BSIZE_FILE);
+            this->filesystem->resetBlocks(unused);
+            this->moving = false;
+        }
+
+        CompactorStatistics Compactor::getStatistics()
+        {
+            return this->stats;
+        }
+
+        uint32_t Compactor::defragment(uint32_t budget)
+        {
+            uint32_t used = 0;
+            while (used < budget)
+            {
+                if (!this->moving)
+                {
+                    if (this->nextid >= INODE_MAX)
+                    {
+                        this->phase = PHASE_MAP;
+                        this->nextid = 1;
+                        return used;
+                    }
+
+                    // Look for a file whose data isn't contiguous.
+                    uint16_t id = this->nextid;
+                    this->nextid += 1;
+                    uint32_t count = this->getFileBlockCount(id);
+                    if (count == 0)
+                        continue;
+                    used += 1;
+                    std::vector < uint32_t > blocks;
+                    if (this->filesystem->getFileBlocks(id, 0, count, blocks) != FSResult::E_SUCCESS)
+                        continue;
+                    bool contiguous = true;
+                    for (unsigned int i = 1; i < blocks.size() && contiguous; i += 1)
+                        contiguous = (blocks[i] == blocks[i - 1] + BSIZE_FILE);
+                    if (contiguous)
+                        continue;
+
+                    // Reserve a run for the whole file, as close to its
+                    // inode as possible.
+                    uint32_t ipos = this->filesystem->getINodePositionByID(id);
+                    uint32_t pos = this->freelist->allocateFreeRun(blocks.size(), ipos + BSIZE_FILE);
+                    if (pos == 0)
+                        continue;
+                    this->moving = true;
+                    this->movingid = id;
+                    this->movinggen = this->filesystem->getFileGeneration(id);
+                    this->runpos = pos;
+                    this->runlength = blocks.size();
+                    this->runused = 0;
+                    continue;
+                }
+
+                // If the file has been shrunk or deleted since the last
+                // step, the rest of the run may no longer be needed.
+                if (this->filesystem->getFileGeneration(this->movingid) != this->movinggen)
+                {
+                    this->abandon();
+                    continue;
+                }
+
+                // Move the next chunk of the file into the run.
+                uint32_t count = std::min < uint32_t > (budget - used, this->runlength - this->runused);
+                std::vector < uint32_t > blocks;
+                this->filesystem->getFileBlocks(this->movingid, this->runused, count, blocks);
+                if (blocks.size() == 0 || !this->copyBlocks(blocks, this->runpos + this->runused * BSIZE_FILE, false))
+                {
+                    this->abandon();
+                    continue;
+                }
+                std::vector < uint32_t > moved;
+                for (unsigned int i = 0; i < blocks.size(); i += 1)
+                    moved.push_back(this->runpos + (this->runused + i) * BSIZE_FILE);
+                if (this->filesystem->relocateFileBlocks(this->movingid, this->runused, moved) != FSResult::E_SUCCESS)
+                {
+                    this->abandon();
+                    continue;
+                }
+                this->filesystem->resetBlocks(blocks);
+                this->movinggen = this->filesystem->getFileGeneration(this->movingid);
+                this->runused += blocks.size();
+                this->stats.moved += blocks.size();
+                used += blocks.size();
+
+                if (this->runused == this->runlength)
+                {
+                    Logging::showDebugW("COMPACTOR: Defragmented inode %u into %u blocks at %u.",
+                            this->movingid, this->runlength, this->runpos);
+                    this->moving = false;
+                    this->stats.files += 1;
+                }
+            }
+            return used;
+        }
+
+        uint32_t Compactor::map(uint32_t budget)
+        {
+            uint32_t used = 0;
+            while (used < budget)
+            {
+                if (this->nextid >= INODE_MAX)
+                {
+                    this->phase = PHASE_EVACUATE;
+                    uint32_t size = (uint32_t) this->fd->size();
+                    this->tail = (size > OFFSET_DATA) ? size - (size - OFFSET_DATA) % BSIZE_FILE : OFFSET_DATA;
+                    return used;
+                }
+
+                // The root directory's position is also recorded in the
+                // FSInfo block, so it is never moved.
+                uint16_t id = this->nextid;
+                this->nextid += 1;
+                uint32_t ipos = this->filesystem->getINodePositionByID(id);
+                if (ipos == 0)
+                    continue;
+                used += 1;
+                Owner owner;
+                owner.id = id;
+                owner.inode = true;
+                owner.index = 0;
+                this->owners[ipos] = owner;
+
+                uint32_t count = this->getFileBlockCount(id);
+                std::vector < uint32_t > blocks;
+                if (count == 0 || this->filesystem->getFileBlocks(id, 0, count, blocks) != FSResult::E_SUCCESS)
+                    continue;
+                owner.inode = false;
+                for (unsigned int i = 0; i < blocks.size(); i += 1)
+                {
+                    owner.index = i;
+                    this->owners[blocks[i]] = owner;
+                }
+            }
+            return used;
+        }
+
+        uint32_t Compactor::evacuate(uint32_t budget)
+        {
+            uint32_t used = 0;
+            while (used < budget)
+            {
+                if (this->tail <= OFFSET_DATA)
+                {
+                    this->phase = PHASE_SHRINK;
+                    return used;
+                }
+                uint32_t pos = this->tail - BSIZE_FILE;
+                if (this->freelist->isBlockFree(pos))
+                {
+                    this->tail = pos;
+                    continue;
+                }
+
+                // Make sure that we know what the block belongs to, and
+                // that it still does.
+                std::unordered_map < uint32_t, Owner >::iterator it = this->owners.find(pos);
+                bool current = false;
+                if (it != this->owners.end() && it->second.inode)
+                    current = (this->filesystem->getINodePositionByID(it->second.id) == pos);
+                else if (it != this->owners.end())
+                {
+                    std::vector < uint32_t > blocks;
+                    this->filesystem->getFileBlocks(it->second.id, it->second.index, 1, blocks);
+                    current = (blocks.size() == 1 && blocks[0] == pos);
+                }
+                bool bitmap = (!current && this->freelist->isBitmapBlock(pos));
+                if (!current && !bitmap)
+                {
+                    this->phase = PHASE_SHRINK;
+                    return used;
+                }
+
+                // Data blocks are moved together with the blocks of the
+                // same file just before them, so that the file isn't
+                // broken up any further, if there's a run free for them.
+                uint32_t count = 1;
+                if (current && !it->second.inode)
+                {
+                    uint32_t limit = std::min < uint32_t > (budget - used, it->second.index + 1);
+                    while (count < limit)
+                    {
+                        std::unordered_map < uint32_t, Owner >::iterator prev = this->owners.find(pos - count * BSIZE_FILE);
+                        if (prev == this->owners.end() || prev->second.inode || prev->second.id != it->second.id ||
+                                prev->second.index != it->second.index - count)
+                            break;
+                        count += 1;
+                    }
+                    std::vector < uint32_t > blocks;
+                    this->filesystem->getFileBlocks(it->second.id, it->second.index - (count - 1), count, blocks);
+                    if (blocks.size() != count)
+                        count = 1;
+                    for (unsigned int i = 0; i < blocks.size() && count > 1; i += 1)
+                        if (blocks[i] != pos - (count - 1 - i) * BSIZE_FILE)
+                            count = 1;
+                }
+                uint32_t first = pos - (count - 1) * BSIZE_FILE;
+                uint32_t npos = this->takeLowerRun(count, first);
+                if (npos == 0 && count > 1)
+                {
+                    count = 1;
+                    first = pos;
+                    npos = this->takeLowerRun(1, pos);
+                }
+                if (npos == 0)
+                {
+                    this->phase = PHASE_SHRINK;
+                    return used;
+                }
+
+                std::vector < uint32_t > from;
+                std::vector < uint32_t > to;
+                for (uint32_t i = 0; i < count; i += 1)
+                {
+                    from.push_back(first + i * BSIZE_FILE);
+                    to.push_back(npos + i * BSIZE_FILE);
+                }
+                bool moved = false;
+                if (bitmap)
+                    moved = this->freelist->moveBitmapBlock(pos, npos);
+                else if (!this->copyBlocks(from, npos, it->second.inode))
+                    moved = false;
+                else if (it->second.inode)
+                    moved = (this->filesystem->relocateINode(it->second.id, npos) == FSResult::E_SUCCESS);
+                else
+                    moved = (this->filesystem->relocateFileBlocks(it->second.id, it->second.index - (count - 1), to) == FSResult::E_SUCCESS);
+                if (!moved)
+                {
+                    this->filesystem->resetBlocks(to);
+                    this->phase = PHASE_SHRINK;
+                    return used;
+                }
+                this->filesystem->resetBlocks(from);
+
+                if (!bitmap)
+                {
+                    Owner owner = it->second;
+                    uint32_t index = owner.index - (count - 1);
+                    for (uint32_t i = 0; i < count; i += 1)
+                    {
+                        this->owners.erase(from[i]);
+                        if (!owner.inode)
+                            owner.index = index + i;
+                        this->owners[to[i]] = owner;
+                    }
+                }
+                this->tail = first;
+                this->stats.moved += count;
+                used += count;
+            }
+            return used;
+        }
+
+        uint32_t Compactor::takeLowerRun(uint32_t count, uint32_t limit)
+        {
+            // Take the lowest run that is long enough, as long as it is
+            // entirely below limit.
+            uint32_t npos = this->freelist->allocateFreeRun(count, OFFSET_DATA);
+            if (npos != 0 && npos + count * BSIZE_FILE > limit)
+            {
+                std::vector < uint32_t > unused;
+                for (uint32_t i = 0; i < count; i += 1)
+                    unused.push_back(npos + i * BSIZE_FILE);
+                this->freelist->freeBlocks(unused);
+                return 0;
+            }
+            return npos;
+        }
+
+        void Compactor::shrink()
+        {
+            // The package may have changed since the tail was emptied,
+            // so this finds the free blocks at the end again.
+            this->stats.released += this->filesystem->truncateFreeTail();
+        }
+
+        uint32_t Compactor::getFileBlockCount(uint16_t id)
+        {
+            if (this->filesystem->getINodePositionByID(id) == 0)
+                return 0;
+            INode node = this->filesystem->getRealINodeByID(id);
+            if (node.type != INodeType::INT_FILEINFO && node.type != INodeType::INT_SYMLINK)
+                return 0;
+            if (!(node.flags & INodeLayout::File::FLAG_EXTENTS))
+                return 0;
+            return (node.dat_len + (uint64_t) BSIZE_FILE - 1) / BSIZE_FILE;
+        }
+
+        bool Compactor::copyBlocks(const std::vector < uint32_t > & from, uint32_t to, bool journal)
+        {
+            std::vector < char > data(from.size() * BSIZE_FILE);
+            std::vector < BlockRequest > requests(from.size());
+            for (unsigned int i = 0; i < from.size(); i += 1)
+            {
+                requests[i].pos = from[i];
+                requests[i].data = &data[i * BSIZE_FILE];
+                requests[i].count = BSIZE_FILE;
+                requests[i].result = 0;
+            }
+            if (!this->fd->readBatch(requests))
+                return false;
+
+            // The destination is contiguous, so it's written in one go.
+            std::streamsize length = data.size();
+            return (this->fd->writeAt(to, &data[0], length, journal) == length);
+        }
+    }
+}
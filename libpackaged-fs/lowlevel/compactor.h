@@ -0,0 +1,141 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_COMPACTOR
+#define CLASS_COMPACTOR
+
+#include <libpackaged-fs/config.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        class Compactor;
+    }
+}
+
+#include <vector>
+#include <unordered_map>
+#include <libpackaged-fs/lowlevel/blockstream.h>
+#include <libpackaged-fs/lowlevel/freelist.h>
+#include <libpackaged-fs/lowlevel/fs.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        struct CompactorStatistics
+        {
+            uint64_t passes;
+            uint64_t files;
+            uint64_t moved;
+            uint64_t released;
+        };
+
+        //! Defragments and shrinks a writable package a little at a time.
+        /*!
+         * Each pass goes through the package in three phases:
+         *
+         *  - Files whose data is split over several runs of blocks are
+         *    copied into a single free run.
+         *  - Blocks near the end of the package are moved into the
+         *    lowest free blocks, updating the lookup table or the file's
+         *    extents to match.
+         *  - The free blocks at the end of the package are cut off.
+         *
+         * The work is done in steps that each move (or inspect) at most a
+         * given number of blocks, so that a mounted package can be
+         * compacted in between other operations.  Nothing is assumed to
+         * stay the same between steps; a file that changes while it is
+         * being moved is simply left for the next pass.
+         *
+         * Only inodes (other than the root directory) and the data of
+         * extent-based files are moved.  Any other live block, such as a
+         * segment list or a free space bitmap block, stops the package
+         * from being shrunk past it.
+         */
+        class Compactor
+        {
+        public:
+            Compactor(FS * filesystem, FreeList * freelist, BlockStream * fd);
+            ~Compactor();
+
+            //! Performs up to budget units of work, where a unit is one
+            //! block copied or one inode inspected.  Returns true once
+            //! the current pass is complete; the next call starts a
+            //! new pass.
+            bool step(uint32_t budget);
+
+            //! Gives back the blocks reserved for a file that has only
+            //! been partly moved, leaving the rest of it where it is.
+            void abandon();
+
+            //! Returns the compaction counters.
+            CompactorStatistics getStatistics();
+
+        private:
+            enum Phase
+            {
+                PHASE_DEFRAGMENT,
+                PHASE_MAP,
+                PHASE_EVACUATE,
+                PHASE_SHRINK,
+                PHASE_FINISHED
+            };
+
+            // The owner of a live block: either the inode itself or one
+            // of the data blocks of a file.
+            struct Owner
+            {
+                uint16_t id;
+                bool inode;
+                uint32_t index;
+            };
+
+            FS * filesystem;
+            FreeList * freelist;
+            BlockStream * fd;
+            Phase phase;
+            CompactorStatistics stats;
+
+            // The next inode ID to look at when defragmenting or mapping.
+            uint32_t nextid;
+
+            // The file that is being moved into a new run, the run that
+            // was reserved for it, how many of its blocks have been moved
+            // and the file generation after the last of them was.
+            bool moving;
+            uint16_t movingid;
+            uint32_t movinggen;
+            uint32_t runpos;
+            uint32_t runlength;
+            uint32_t runused;
+
+            // The owners of the blocks that are in use, and the end of
+            // the part of the package that has not been emptied yet.
+            std::unordered_map < uint32_t, Owner > owners;
+            uint32_t tail;
+
+            // Performs each phase, returning the budget used.
+            uint32_t defragment(uint32_t budget);
+            uint32_t map(uint32_t budget);
+            uint32_t evacuate(uint32_t budget);
+            void shrink();
+
+            // Allocates count free blocks that lie entirely below the
+            // position limit, returning 0 if there is no such run.
+            uint32_t takeLowerRun(uint32_t count, uint32_t limit);
+
+            // Returns the number of data blocks of an extent-based file
+            // (or 0 if the inode isn't one).
+            uint32_t getFileBlockCount(uint16_t id);
+
+            // Copies each of the blocks in from to the blocks following
+            // the position to, in a single batch each way.  Only file
+            // data may be copied with journal unset; inodes have to go
+            // through the journal like any other metadata.
+            bool copyBlocks(const std::vector < uint32_t > & from, uint32_t to, bool journal);
+        };
+    }
+}
+
+#endif
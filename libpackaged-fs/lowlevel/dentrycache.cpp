@@ -0,0 +1,103 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/config.h>
+
+#include <string.h>
+#include <libpackaged-fs/lowlevel/dentrycache.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        DentryCache::DentryCache(size_t limit)
+        {
+            this->limit = limit;
+            this->count = 0;
+            memset(&this->stats, 0, sizeof(DentryCacheStatistics));
+            pthread_mutex_init(&this->mutex, NULL);
+        }
+
+        DentryCache::~DentryCache()
+        {
+            this->clear();
+            pthread_mutex_destroy(&this->mutex);
+        }
+
+        bool DentryCache::find(uint16_t parentid, const std::string& name, uint16_t& id)
+        {
+            pthread_mutex_lock(&this->mutex);
+            Directories::iterator dit = this->directories.find(parentid);
+            if (dit != this->directories.end())
+            {
+                Entries::iterator it = dit->second.find(name);
+                if (it != dit->second.end())
+                {
+                    id = it->second;
+                    this->stats.hits += 1;
+                    pthread_mutex_unlock(&this->mutex);
+                    return true;
+                }
+            }
+            this->stats.misses += 1;
+            pthread_mutex_unlock(&this->mutex);
+            return false;
+        }
+
+        void DentryCache::put(uint16_t parentid, const std::string& name, uint16_t id)
+        {
+            if (this->limit == 0)
+                return;
+
+            pthread_mutex_lock(&this->mutex);
+            if (this->count >= this->limit)
+            {
+                this->directories.clear();
+                this->count = 0;
+            }
+            std::pair < Entries::iterator, bool > result =
+                this->directories[parentid].insert(std::make_pair(name, id));
+            if (result.second)
+                this->count += 1;
+            else
+                result.first->second = id;
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DentryCache::remove(uint16_t parentid, const std::string& name)
+        {
+            pthread_mutex_lock(&this->mutex);
+            Directories::iterator dit = this->directories.find(parentid);
+            if (dit != this->directories.end())
+                this->count -= dit->second.erase(name);
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DentryCache::removeDirectory(uint16_t parentid)
+        {
+            pthread_mutex_lock(&this->mutex);
+            Directories::iterator dit = this->directories.find(parentid);
+            if (dit != this->directories.end())
+            {
+                this->count -= dit->second.size();
+                this->directories.erase(dit);
+            }
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DentryCache::clear()
+        {
+            pthread_mutex_lock(&this->mutex);
+            this->directories.clear();
+            this->count = 0;
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        DentryCacheStatistics DentryCache::getStatistics()
+        {
+            pthread_mutex_lock(&this->mutex);
+            DentryCacheStatistics result = this->stats;
+            pthread_mutex_unlock(&this->mutex);
+            return result;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_DENTRYCACHE
+#define CLASS_DENTRYCACHE
+
+#include <libpackaged-fs/config.h>
+
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+#include <stdint.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        struct DentryCacheStatistics
+        {
+            uint64_t hits;
+            uint64_t misses;
+        };
+
+        //! An in-memory cache of path components.
+        /*!
+         * Maps a directory inode ID and the name of an entry within it
+         * to the inode ID stored in the directory for that entry.  Names
+         * that do not exist are cached as well (with an inode ID of 0,
+         * which can never be a child since it is the root), so repeated
+         * lookups of missing paths are answered without reading the
+         * package.  The owner is responsible for removing entries when
+         * names are created, removed or renamed.  Once the cache holds
+         * more than its limit of entries it is simply emptied.
+         */
+        class DentryCache
+        {
+        public:
+            DentryCache(size_t limit = CACHE_DENTRIES);
+            ~DentryCache();
+
+            //! Copies the cached inode ID of the named entry to id (0 if
+            //! the entry is known not to exist).  Returns false if the
+            //! entry is not cached.
+            bool find(uint16_t parentid, const std::string& name, uint16_t& id);
+
+            //! Adds or replaces a cached entry.
+            void put(uint16_t parentid, const std::string& name, uint16_t id);
+
+            //! Drops a cached entry.
+            void remove(uint16_t parentid, const std::string& name);
+
+            //! Drops every cached entry within a directory.
+            void removeDirectory(uint16_t parentid);
+
+            //! Drops every cached entry.
+            void clear();
+
+            //! Returns the hit and miss counters.
+            DentryCacheStatistics getStatistics();
+
+        private:
+            typedef std::unordered_map < std::string, uint16_t > Entries;
+            typedef std::unordered_map < uint16_t, Entries > Directories;
+
+            size_t limit;
+            size_t count;
+            Directories directories;
+            DentryCacheStatistics stats;
+            pthread_mutex_t mutex;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,174 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/config.h>
+
+#include <libpackaged-fs/lowlevel/dirindex.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        DirectoryIndex::DirectoryIndex()
+        {
+            pthread_mutex_init(&this->mutex, NULL);
+        }
+
+        DirectoryIndex::~DirectoryIndex()
+        {
+            this->clear();
+            pthread_mutex_destroy(&this->mutex);
+        }
+
+        uint32_t DirectoryIndex::hash(const char * filename)
+        {
+            // 32-bit FNV-1a.
+            uint32_t result = 2166136261u;
+            for (int i = 0; i < 255 && filename[i] != 0; i += 1)
+            {
+                result ^= (uint8_t) filename[i];
+                result *= 16777619u;
+            }
+            return result;
+        }
+
+        bool DirectoryIndex::find(uint16_t parentid, uint32_t hash, std::vector < uint16_t > & out)
+        {
+            pthread_mutex_lock(&this->mutex);
+            Directories::iterator dit = this->directories.find(parentid);
+            if (dit == this->directories.end())
+            {
+                pthread_mutex_unlock(&this->mutex);
+                return false;
+            }
+
+            out.clear();
+            std::pair < Entries::iterator, Entries::iterator > range = dit->second.equal_range(hash);
+            for (Entries::iterator it = range.first; it != range.second; it++)
+                out.push_back(it->second);
+            pthread_mutex_unlock(&this->mutex);
+            return true;
+        }
+
+        void DirectoryIndex::create(uint16_t parentid, const std::vector < std::pair < uint16_t, uint32_t > > & entries)
+        {
+            // Build the new index before taking the lock.
+            Entries index;
+            index.reserve(entries.size());
+            for (unsigned int i = 0; i < entries.size(); i += 1)
+                index.insert(std::make_pair(entries[i].second, entries[i].first));
+
+            pthread_mutex_lock(&this->mutex);
+            Directories::iterator dit = this->directories.find(parentid);
+            if (dit != this->directories.end())
+            {
+                for (Entries::iterator it = dit->second.begin(); it != dit->second.end(); it++)
+                    this->children.erase(it->second);
+                dit->second.swap(index);
+            }
+            else
+                this->directories[parentid].swap(index);
+
+            // A child can only be in one directory at a time.
+            for (unsigned int i = 0; i < entries.size(); i += 1)
+            {
+                Children::iterator cit = this->children.find(entries[i].first);
+                if (cit != this->children.end() && cit->second.parentid != parentid)
+                    this->unlink(entries[i].first, cit->second);
+                Child & child = this->children[entries[i].first];
+                child.parentid = parentid;
+                child.hash = entries[i].second;
+            }
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DirectoryIndex::add(uint16_t parentid, uint16_t childid, uint32_t hash)
+        {
+            pthread_mutex_lock(&this->mutex);
+            Directories::iterator dit = this->directories.find(parentid);
+            if (dit != this->directories.end())
+            {
+                // A child can only be in one directory at a time.
+                Children::iterator cit = this->children.find(childid);
+                if (cit != this->children.end())
+                {
+                    this->unlink(childid, cit->second);
+                    this->children.erase(cit);
+                }
+
+                dit->second.insert(std::make_pair(hash, childid));
+                Child & child = this->children[childid];
+                child.parentid = parentid;
+                child.hash = hash;
+            }
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DirectoryIndex::remove(uint16_t parentid, uint16_t childid)
+        {
+            pthread_mutex_lock(&this->mutex);
+            Children::iterator cit = this->children.find(childid);
+            if (cit != this->children.end() && cit->second.parentid == parentid)
+            {
+                this->unlink(childid, cit->second);
+                this->children.erase(cit);
+            }
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DirectoryIndex::rename(uint16_t childid, uint32_t hash)
+        {
+            pthread_mutex_lock(&this->mutex);
+            Children::iterator cit = this->children.find(childid);
+            if (cit != this->children.end() && cit->second.hash != hash)
+            {
+                this->unlink(childid, cit->second);
+                cit->second.hash = hash;
+                this->directories[cit->second.parentid].insert(std::make_pair(hash, childid));
+            }
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DirectoryIndex::forget(uint16_t id)
+        {
+            pthread_mutex_lock(&this->mutex);
+            Directories::iterator dit = this->directories.find(id);
+            if (dit != this->directories.end())
+            {
+                for (Entries::iterator it = dit->second.begin(); it != dit->second.end(); it++)
+                    this->children.erase(it->second);
+                this->directories.erase(dit);
+            }
+            Children::iterator cit = this->children.find(id);
+            if (cit != this->children.end())
+            {
+                this->unlink(id, cit->second);
+                this->children.erase(cit);
+            }
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DirectoryIndex::clear()
+        {
+            pthread_mutex_lock(&this->mutex);
+            this->directories.clear();
+            this->children.clear();
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void DirectoryIndex::unlink(uint16_t childid, const Child & child)
+        {
+            Directories::iterator dit = this->directories.find(child.parentid);
+            if (dit == this->directories.end())
+                return;
+            std::pair < Entries::iterator, Entries::iterator > range = dit->second.equal_range(child.hash);
+            for (Entries::iterator it = range.first; it != range.second; it++)
+            {
+                if (it->second == childid)
+                {
+                    dit->second.erase(it);
+                    return;
+                }
+            }
+        }
+    }
+}
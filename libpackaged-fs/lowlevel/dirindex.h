@@ -0,0 +1,87 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_DIRINDEX
+#define CLASS_DIRINDEX
+
+#include <libpackaged-fs/config.h>
+
+#include <vector>
+#include <unordered_map>
+#include <pthread.h>
+#include <stdint.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! An in-memory index of the children of directories by filename.
+        /*!
+         * Each indexed directory maps the hash of its children's filenames
+         * to their inode IDs, so looking up a name only requires reading
+         * the inodes whose filename hash matches (normally just one) rather
+         * than every child of the directory.  Directories are indexed by FS
+         * the first time they are searched, and FS keeps the index current
+         * as children are added, removed and renamed.
+         */
+        class DirectoryIndex
+        {
+        public:
+            DirectoryIndex();
+            ~DirectoryIndex();
+
+            //! Returns the hash of a filename (which is read up to its
+            //! terminating NULL or 255 characters, whichever is first).
+            static uint32_t hash(const char * filename);
+
+            //! Copies the IDs of the children of a directory whose filenames
+            //! have the specified hash to out.  Returns false if the
+            //! directory has not been indexed.
+            bool find(uint16_t parentid, uint32_t hash, std::vector < uint16_t > & out);
+
+            //! Sets the index of a directory to the specified children (each
+            //! given with its filename hash), replacing any existing one.
+            //! The whole index is put in place at once, so other threads
+            //! never find it half built.
+            void create(uint16_t parentid, const std::vector < std::pair < uint16_t, uint32_t > > & entries);
+
+            //! Adds a child to the index of a directory.  Does nothing if
+            //! the directory has not been indexed.
+            void add(uint16_t parentid, uint16_t childid, uint32_t hash);
+
+            //! Removes a child from the index of a directory.
+            void remove(uint16_t parentid, uint16_t childid);
+
+            //! Changes the filename hash of a child, in whichever directory
+            //! index it is in.
+            void rename(uint16_t childid, uint32_t hash);
+
+            //! Drops an inode ID from the index, both as a directory and as
+            //! a child of a directory.
+            void forget(uint16_t id);
+
+            //! Drops every index.
+            void clear();
+
+        private:
+            struct Child
+            {
+                uint16_t parentid;
+                uint32_t hash;
+            };
+
+            typedef std::unordered_multimap < uint32_t, uint16_t > Entries;
+            typedef std::unordered_map < uint16_t, Entries > Directories;
+            typedef std::unordered_map < uint16_t, Child > Children;
+
+            Directories directories;
+            Children children;
+            pthread_mutex_t mutex;
+
+            // Removes a child from the index of its directory.  The index
+            // must be locked.
+            void unlink(uint16_t childid, const Child & child);
+        };
+    }
+}
+
+#endif
@@ -28,12 +28,13 @@ namespace AppLib
                 fd->read(data, size);
             else
             {
-                char *dStorage = (char *) malloc(size);
-                 fd->read(dStorage, size);
+                char dStorage[8];
+                char *storage = (size <= sizeof(dStorage)) ? dStorage : new char[size];
+                fd->read(storage, size);
                 for (unsigned int i = 0; i < size; i += 1)
-                {
-                    data[i] = dStorage[size - i];
-                }
+                    data[i] = storage[size - 1 - i];
+                if (storage != dStorage)
+                    delete[] storage;
             }
             if (fd->fail() && fd->eof())
                  fd->clear(std::ios::eofbit);
@@ -55,12 +56,13 @@ namespace AppLib
                 fd->write(data, size);
             else
             {
-                char *dStorage = (char *) malloc(size);
+                char dStorage[8];
+                char *storage = (size <= sizeof(dStorage)) ? dStorage : new char[size];
                 for (unsigned int i = 0; i < size; i += 1)
-                {
-                    dStorage[size - i] = data[i];
-                }
-                fd->write(dStorage, size);
+                    storage[size - 1 - i] = data[i];
+                fd->write(storage, size);
+                if (storage != dStorage)
+                    delete[] storage;
             }
             if (fd->fail() && fd->eof())
                 fd->clear(std::ios::eofbit);
@@ -81,19 +83,91 @@ namespace AppLib
             Endian::doW(fd, const_cast < char *>(data), size);
         }
 
-        void Endian::doR(std::iostream * fd, char *data, unsigned int size)
+        void Endian::doR(BlockStream * fd, std::streampos pos, char *data, unsigned int size)
+        {
+            std::streamsize res = fd->readAt(pos, data, size);
+            if (res < 0)
+                Logging::showErrorW("I/O error occurred while reading from file.");
+            else if (!Endian::little_endian)
+            {
+                for (unsigned int i = 0; i < size / 2; i += 1)
+                {
+                    char t = data[i];
+                    data[i] = data[size - 1 - i];
+                    data[size - 1 - i] = t;
+                }
+            }
+        }
+
+        void Endian::doW(BlockStream * fd, std::streampos pos, const char *data, unsigned int size)
         {
+            std::streamsize res = 0;
             if (Endian::little_endian)
-                fd->read(data, size);
+                res = fd->writeAt(pos, data, size);
             else
             {
-                char *dStorage = (char *) malloc(size);
-                fd->read(dStorage, size);
+                std::string dStorage(data, size);
                 for (unsigned int i = 0; i < size; i += 1)
+                    dStorage[i] = data[size - 1 - i];
+                res = fd->writeAt(pos, dStorage.c_str(), size);
+            }
+            if (res < 0)
+                Logging::showErrorW("I/O error occurred while writing to file.");
+        }
+
+        void Endian::doRArray(BlockStream * fd, std::streampos pos, char *data, unsigned int count, unsigned int size)
+        {
+            // Reads count contiguous values of size bytes each with a
+            // single read, then corrects each value's byte order.
+            std::streamsize res = fd->readAt(pos, data, count * size);
+            if (res < 0)
+                Logging::showErrorW("I/O error occurred while reading from file.");
+            else if (ENDIAN_HOST_BIG && size == 2)
+                Endian::swapArray(reinterpret_cast < uint16_t *>(data), count);
+            else if (ENDIAN_HOST_BIG && size == 4)
+                Endian::swapArray(reinterpret_cast < uint32_t *>(data), count);
+            else if (ENDIAN_HOST_BIG)
+            {
+                for (unsigned int e = 0; e < count * size; e += size)
                 {
-                    data[i] = dStorage[size - i];
+                    for (unsigned int i = 0; i < size / 2; i += 1)
+                    {
+                        char t = data[e + i];
+                        data[e + i] = data[e + size - 1 - i];
+                        data[e + size - 1 - i] = t;
+                    }
                 }
             }
+        }
+
+        void Endian::swapArray(uint16_t * data, unsigned int count)
+        {
+            // Written as a plain loop over whole elements so that the
+            // compiler can vectorize it into byte shuffles.
+            for (unsigned int i = 0; i < count; i += 1)
+                data[i] = Endian::swap(data[i]);
+        }
+
+        void Endian::swapArray(uint32_t * data, unsigned int count)
+        {
+            for (unsigned int i = 0; i < count; i += 1)
+                data[i] = Endian::swap(data[i]);
+        }
+
+        void Endian::doR(std::iostream * fd, char *data, unsigned int size)
+        {
+            if (Endian::little_endian)
+                fd->read(data, size);
+            else
+            {
+                char dStorage[8];
+                char *storage = (size <= sizeof(dStorage)) ? dStorage : new char[size];
+                fd->read(storage, size);
+                for (unsigned int i = 0; i < size; i += 1)
+                    data[i] = storage[size - 1 - i];
+                if (storage != dStorage)
+                    delete[] storage;
+            }
             if (fd->fail() && fd->eof())
                 fd->clear(std::ios::eofbit);
             else if (fd->fail() && fd->bad())
@@ -114,12 +188,13 @@ namespace AppLib
                 fd->write(data, size);
             else
             {
-                char *dStorage = (char *) malloc(size);
+                char dStorage[8];
+                char *storage = (size <= sizeof(dStorage)) ? dStorage : new char[size];
                 for (unsigned int i = 0; i < size; i += 1)
-                {
-                    dStorage[size - i] = data[i];
-                }
-                fd->write(dStorage, size);
+                    storage[size - 1 - i] = data[i];
+                fd->write(storage, size);
+                if (storage != dStorage)
+                    delete[] storage;
             }
             if (fd->fail() && fd->eof())
                 fd->clear(std::ios::eofbit);
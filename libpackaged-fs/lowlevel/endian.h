@@ -8,6 +8,17 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <stdint.h>
+#include <string.h>
+
+// Packages are always stored little endian, so values only need
+// swapping on big endian hosts.  This is known at compile time,
+// which lets the swaps below disappear entirely on x86.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ENDIAN_HOST_BIG 1
+#else
+#define ENDIAN_HOST_BIG 0
+#endif
 
 namespace AppLib
 {
@@ -23,6 +34,44 @@ namespace AppLib
                 static void doR(BlockStream * fd, char * data, unsigned int size);
                 static void doW(BlockStream * fd, char * data, unsigned int size);
                 static void doW(BlockStream * fd, const char * data, unsigned int size);
+                static void doR(BlockStream * fd, std::streampos pos, char * data, unsigned int size);
+                static void doW(BlockStream * fd, std::streampos pos, const char * data, unsigned int size);
+                static void doRArray(BlockStream * fd, std::streampos pos, char * data, unsigned int count, unsigned int size);
+
+                static constexpr uint8_t swap(uint8_t v) { return v; }
+                static constexpr uint16_t swap(uint16_t v) { return __builtin_bswap16(v); }
+                static constexpr uint32_t swap(uint32_t v) { return __builtin_bswap32(v); }
+                static constexpr uint64_t swap(uint64_t v) { return __builtin_bswap64(v); }
+
+                //! Converts a value between host and package byte order.
+                template < typename T > static constexpr T toDisk(T v)
+                {
+                    return ENDIAN_HOST_BIG ? Endian::swap(v) : v;
+                }
+                template < typename T > static constexpr T fromDisk(T v)
+                {
+                    return Endian::toDisk(v);
+                }
+
+                //! Decodes a value stored at data (which need not be aligned).
+                template < typename T > static T load(const char * data)
+                {
+                    T v;
+                    memcpy(&v, data, sizeof(T));
+                    return Endian::fromDisk(v);
+                }
+
+                //! Encodes a value into data (which need not be aligned).
+                template < typename T > static void store(char * data, T v)
+                {
+                    v = Endian::toDisk(v);
+                    memcpy(data, &v, sizeof(T));
+                }
+
+                //! Converts whole arrays between host and package byte order.
+                static void swapArray(uint16_t * data, unsigned int count);
+                static void swapArray(uint32_t * data, unsigned int count);
+
                 static void doR(std::iostream * fd, char * data, unsigned int size);
                 static void doW(std::iostream * fd, char * data, unsigned int size);
                 static void doW(std::iostream * fd, const char * data, unsigned int size);
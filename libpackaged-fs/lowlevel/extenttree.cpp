@@ -0,0 +1,262 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/config.h>
+
+#include <string.h>
+#include <algorithm>
+#include <libpackaged-fs/lowlevel/extenttree.h>
+#include <libpackaged-fs/lowlevel/inodelayout.h>
+#include <libpackaged-fs/lowlevel/endian.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        const unsigned int ExtentTree::ROOT_MAX = (BSIZE_FILE - INodeLayout::File::ROOT_ENTRIES) / INodeLayout::ExtentEntry::SIZE;
+        const unsigned int ExtentTree::LEAF_MAX = (BSIZE_FILE - INodeLayout::Extents::ENTRIES) / INodeLayout::ExtentEntry::SIZE;
+
+        ExtentTree::ExtentTree(FS * filesystem, BlockStream * fd)
+        {
+            this->filesystem = filesystem;
+            this->fd = fd;
+        }
+
+        FSResult::FSResult ExtentTree::load(uint32_t pos, std::vector < Extent > & out)
+        {
+            uint16_t depth = 0;
+            std::vector < Extent > root;
+            if (!this->readRoot(pos, depth, root))
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            if (depth == 0)
+            {
+                out.insert(out.end(), root.begin(), root.end());
+                return FSResult::E_SUCCESS;
+            }
+
+            // Read all of the extent blocks in one batch.
+            std::vector < char > leaves(root.size() * BSIZE_FILE);
+            std::vector < BlockRequest > requests;
+            requests.reserve(root.size());
+            for (unsigned int i = 0; i < root.size(); i += 1)
+            {
+                BlockRequest req;
+                req.pos = root[i].pos;
+                req.data = leaves.data() + i * BSIZE_FILE;
+                req.count = BSIZE_FILE;
+                req.result = 0;
+                requests.push_back(req);
+            }
+            if (!this->fd->readBatch(requests))
+                return FSResult::E_FAILURE_GENERAL;
+
+            for (unsigned int i = 0; i < root.size(); i += 1)
+            {
+                const char * leaf = leaves.data() + i * BSIZE_FILE;
+                uint16_t type = Endian::load < uint16_t > (leaf + INodeLayout::TYPE);
+                uint16_t count = Endian::load < uint16_t > (leaf + INodeLayout::Extents::COUNT);
+                if (type != INodeType::INT_EXTENTS || count > ExtentTree::LEAF_MAX)
+                    return FSResult::E_FAILURE_INODE_NOT_VALID;
+                ExtentTree::decode(leaf + INodeLayout::Extents::ENTRIES, count, out);
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        uint32_t ExtentTree::resolve(uint32_t pos, uint32_t block)
+        {
+            uint16_t depth = 0;
+            std::vector < Extent > entries;
+            if (!this->readRoot(pos, depth, entries))
+                return 0;
+            int i = ExtentTree::find(entries, block);
+            if (i < 0)
+                return 0;
+
+            if (depth == 1)
+            {
+                // Search the extent block that covers this part of the file.
+                char leaf[BSIZE_FILE];
+                if (this->fd->readAt(entries[i].pos, leaf, BSIZE_FILE) != BSIZE_FILE)
+                    return 0;
+                uint16_t count = Endian::load < uint16_t > (leaf + INodeLayout::Extents::COUNT);
+                if (count > ExtentTree::LEAF_MAX)
+                    return 0;
+                entries.clear();
+                ExtentTree::decode(leaf + INodeLayout::Extents::ENTRIES, count, entries);
+                i = ExtentTree::find(entries, block);
+                if (i < 0)
+                    return 0;
+            }
+
+            const Extent & extent = entries[i];
+            if (block >= extent.start + extent.length)
+                return 0;
+            return extent.pos + (block - extent.start) * BSIZE_FILE;
+        }
+
+        FSResult::FSResult ExtentTree::getTreeBlocks(uint32_t pos, std::vector < uint32_t > & out)
+        {
+            uint16_t depth = 0;
+            std::vector < Extent > root;
+            if (!this->readRoot(pos, depth, root))
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            if (depth == 1)
+            {
+                for (unsigned int i = 0; i < root.size(); i += 1)
+                    out.push_back(root[i].pos);
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult ExtentTree::store(uint32_t pos, const std::vector < Extent > & extents, size_t from)
+        {
+            using namespace INodeLayout;
+
+            uint16_t depth = 0;
+            std::vector < Extent > root;
+            if (!this->readRoot(pos, depth, root))
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            std::vector < uint32_t > leaves;
+            if (depth == 1)
+            {
+                for (unsigned int i = 0; i < root.size(); i += 1)
+                    leaves.push_back(root[i].pos);
+            }
+
+            char block[BSIZE_FILE];
+            if (extents.size() <= ExtentTree::ROOT_MAX)
+            {
+                // The extents fit in the root.  If they were in extent
+                // blocks before, all of them need writing.
+                if (depth != 0)
+                    from = 0;
+                from = std::min < size_t > (from, extents.size());
+                Endian::store < uint16_t > (block + 0, extents.size());
+                Endian::store < uint16_t > (block + 2, 0);
+                ExtentTree::encode(block + 4 + from * ExtentEntry::SIZE, extents, from, extents.size() - from);
+                if (this->fd->writeAt(pos + File::ROOT_COUNT, block, 4) != 4)
+                    return FSResult::E_FAILURE_GENERAL;
+                std::streamsize length = (extents.size() - from) * ExtentEntry::SIZE;
+                if (length > 0 && this->fd->writeAt(pos + File::ROOT_ENTRIES + from * ExtentEntry::SIZE,
+                            block + 4 + from * ExtentEntry::SIZE, length) != length)
+                    return FSResult::E_FAILURE_GENERAL;
+
+                for (unsigned int i = 0; i < leaves.size(); i += 1)
+                    this->filesystem->resetBlock(leaves[i]);
+                return FSResult::E_SUCCESS;
+            }
+
+            size_t needed = (extents.size() + ExtentTree::LEAF_MAX - 1) / ExtentTree::LEAF_MAX;
+            if (needed > ExtentTree::ROOT_MAX)
+                return FSResult::E_FAILURE_PARTIAL_TRUNCATION;
+
+            // Only the extent blocks holding changed extents are rewritten
+            // (which always includes any we are about to allocate).
+            size_t dirty = (depth == 1) ? std::min < size_t > (from / ExtentTree::LEAF_MAX, leaves.size()) : 0;
+            while (leaves.size() < needed)
+            {
+                uint32_t hint = (leaves.size() > 0) ? leaves.back() + BSIZE_FILE : pos + BSIZE_FILE;
+                uint32_t npos = this->filesystem->getFirstFreeBlock(INodeType::INT_EXTENTS, hint);
+                if (npos == 0)
+                    return FSResult::E_FAILURE_GENERAL;
+                leaves.push_back(npos);
+            }
+            while (leaves.size() > needed)
+            {
+                this->filesystem->resetBlock(leaves.back());
+                leaves.pop_back();
+            }
+
+            for (size_t l = dirty; l < needed; l += 1)
+            {
+                size_t first = l * ExtentTree::LEAF_MAX;
+                unsigned int count = std::min < size_t > (ExtentTree::LEAF_MAX, extents.size() - first);
+                memset(block, 0, BSIZE_FILE);
+                Endian::store < uint16_t > (block + INODEID, 0);
+                Endian::store < uint16_t > (block + TYPE, INodeType::INT_EXTENTS);
+                Endian::store < uint16_t > (block + Extents::COUNT, count);
+                ExtentTree::encode(block + Extents::ENTRIES, extents, first, count);
+                if (this->fd->writeAt(leaves[l], block, BSIZE_FILE) != BSIZE_FILE)
+                    return FSResult::E_FAILURE_GENERAL;
+            }
+
+            // Point the root at the extent blocks.
+            root.clear();
+            for (size_t l = 0; l < needed; l += 1)
+            {
+                Extent entry;
+                entry.start = extents[l * ExtentTree::LEAF_MAX].start;
+                entry.pos = leaves[l];
+                entry.length = 0;
+                root.push_back(entry);
+            }
+            Endian::store < uint16_t > (block + 0, root.size());
+            Endian::store < uint16_t > (block + 2, 1);
+            ExtentTree::encode(block + 4, root, 0, root.size());
+            std::streamsize length = 4 + root.size() * ExtentEntry::SIZE;
+            if (this->fd->writeAt(pos + File::ROOT_COUNT, block, length) != length)
+                return FSResult::E_FAILURE_GENERAL;
+            return FSResult::E_SUCCESS;
+        }
+
+        bool ExtentTree::readRoot(uint32_t pos, uint16_t& depth, std::vector < Extent > & entries)
+        {
+            char data[BSIZE_FILE - HSIZE_FILE];
+            if (this->fd->readAt(pos + INodeLayout::File::ROOT_COUNT, data, sizeof(data)) != sizeof(data))
+                return false;
+            uint16_t count = Endian::load < uint16_t > (data + 0);
+            depth = Endian::load < uint16_t > (data + 2);
+            if (count > ExtentTree::ROOT_MAX || depth > 1)
+                return false;
+            ExtentTree::decode(data + 4, count, entries);
+            return true;
+        }
+
+        void ExtentTree::decode(const char * data, unsigned int count, std::vector < Extent > & out)
+        {
+            using namespace INodeLayout;
+
+            for (unsigned int i = 0; i < count; i += 1)
+            {
+                const char * entry = data + i * ExtentEntry::SIZE;
+                Extent extent;
+                extent.start = Endian::load < uint32_t > (entry + ExtentEntry::START);
+                extent.pos = Endian::load < uint32_t > (entry + ExtentEntry::POS);
+                extent.length = Endian::load < uint32_t > (entry + ExtentEntry::LENGTH);
+                out.push_back(extent);
+            }
+        }
+
+        void ExtentTree::encode(char * data, const std::vector < Extent > & entries, size_t first, unsigned int count)
+        {
+            using namespace INodeLayout;
+
+            for (unsigned int i = 0; i < count; i += 1)
+            {
+                char * entry = data + i * ExtentEntry::SIZE;
+                Endian::store < uint32_t > (entry + ExtentEntry::START, entries[first + i].start);
+                Endian::store < uint32_t > (entry + ExtentEntry::POS, entries[first + i].pos);
+                Endian::store < uint32_t > (entry + ExtentEntry::LENGTH, entries[first + i].length);
+            }
+        }
+
+        int ExtentTree::find(const std::vector < Extent > & entries, uint32_t block)
+        {
+            // Binary search for the last entry starting at or before the block.
+            int low = 0;
+            int high = (int) entries.size() - 1;
+            int result = -1;
+            while (low <= high)
+            {
+                int mid = low + (high - low) / 2;
+                if (entries[mid].start <= block)
+                {
+                    result = mid;
+                    low = mid + 1;
+                }
+                else
+                    high = mid - 1;
+            }
+            return result;
+        }
+    }
+}
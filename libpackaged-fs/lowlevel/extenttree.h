@@ -0,0 +1,90 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_EXTENTTREE
+#define CLASS_EXTENTTREE
+
+#include <libpackaged-fs/config.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        class ExtentTree;
+    }
+}
+
+#include <vector>
+#include <libpackaged-fs/lowlevel/blockstream.h>
+#include <libpackaged-fs/lowlevel/fs.h>
+#include <libpackaged-fs/lowlevel/fsresult.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! A run of contiguous blocks in a file.
+        struct Extent
+        {
+            uint32_t start;  //!< The index of the first block in the file.
+            uint32_t pos;    //!< The position of the first block in the package.
+            uint32_t length; //!< The number of blocks.
+        };
+
+        //! Reads and writes the extent trees of extent-based files.
+        /*!
+         * The root of the tree lives in the file inode block after the
+         * header.  Up to ROOT_MAX extents are stored there directly;
+         * beyond that the root instead points to extent blocks holding
+         * up to LEAF_MAX extents each.  Files only ever grow or shrink at
+         * their end, so the tree never needs to be rebalanced.
+         */
+        class ExtentTree
+        {
+        public:
+            ExtentTree(FS * filesystem, BlockStream * fd);
+
+            //! The number of entries that fit in the root and in an
+            //! extent block.
+            static const unsigned int ROOT_MAX;
+            static const unsigned int LEAF_MAX;
+
+            //! Reads all of the extents of the file inode at pos, in order.
+            FSResult::FSResult load(uint32_t pos, std::vector < Extent > & out);
+
+            //! Returns the position of a block of the file inode at pos,
+            //! or 0 if the file does not have that many blocks.
+            uint32_t resolve(uint32_t pos, uint32_t block);
+
+            //! Appends the positions of the extent blocks used by the
+            //! tree of the file inode at pos (none if the extents are all
+            //! stored in the root).
+            FSResult::FSResult getTreeBlocks(uint32_t pos, std::vector < uint32_t > & out);
+
+            //! Writes the extents of the file inode at pos, allocating or
+            //! freeing extent blocks as required.
+            /*!
+             * Only the extents from index from onward are assumed to have
+             * changed since the tree was loaded.
+             */
+            FSResult::FSResult store(uint32_t pos, const std::vector < Extent > & extents, size_t from);
+
+        private:
+            FS * filesystem;
+            BlockStream * fd;
+
+            // Reads the root of the tree.
+            bool readRoot(uint32_t pos, uint16_t& depth, std::vector < Extent > & entries);
+
+            // Decodes count entries from data.
+            static void decode(const char * data, unsigned int count, std::vector < Extent > & out);
+
+            // Encodes count entries (starting at index first) into data.
+            static void encode(char * data, const std::vector < Extent > & entries, size_t first, unsigned int count);
+
+            // Returns the index of the entry containing the block, or -1.
+            static int find(const std::vector < Extent > & entries, uint32_t block);
+        };
+    }
+}
+
+#endif
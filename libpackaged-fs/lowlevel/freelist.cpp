@@ -1,298 +1,793 @@
 /* vim: set ts=4 sw=4 tw=0 et ai :*/
 
 #include <libpackaged-fs/lowlevel/freelist.h>
+#include <libpackaged-fs/lowlevel/inodelayout.h>
 #include <libpackaged-fs/lowlevel/fs.h>
 #include <math.h>
+#include <algorithm>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace AppLib
 {
     namespace LowLevel
     {
+        const uint32_t FreeList::WORDS_PER_BLOCK = (BSIZE_FILE - HSIZE_BITMAP) / 8;
+        const uint32_t FreeList::BITS_PER_BLOCK = FreeList::WORDS_PER_BLOCK * 64;
+
+        // Returns the index of the lowest set bit in a non-zero word.
+        static unsigned int lowestBit(uint64_t word)
+        {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward64(&index, word);
+            return index;
+#else
+            return __builtin_ctzll(word);
+#endif
+        }
+
+        // Returns the index of the highest set bit in a non-zero word.
+        static unsigned int highestBit(uint64_t word)
+        {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanReverse64(&index, word);
+            return index;
+#else
+            return 63 - __builtin_clzll(word);
+#endif
+        }
+
         FreeList::FreeList(FS * filesystem, BlockStream * fd)
         {
             this->filesystem = filesystem;
             this->fd = fd;
+            this->free_count = 0;
+            this->opened = false;
 
-            // Make a cache out of the on-disk data.
-            this->syncronizeCache();
-        }
+            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            if (fsinfo.pos_bitmap != 0)
+                this->loadBitmap(fsinfo.pos_bitmap);
+            else if (fsinfo.pos_freelist != 0)
+            {
+                // This package still uses a linked free list.  It is
+                // moved into the bitmap when it is opened for writing;
+                // otherwise it is only read into memory.
+                std::vector < uint32_t > positions;
+                this->readFreeList(fsinfo.pos_freelist, positions);
+                if (this->fd->isReadOnly())
+                {
+                    for (unsigned int i = 0; i < positions.size(); i += 1)
+                        this->setBit((positions[i] - OFFSET_DATA) / BSIZE_FILE, true);
+                    this->dirty.clear();
+                }
+                else
+                    this->migrateFreeList(positions);
+            }
+            if (this->fd->isReadOnly())
+                return;
 
-        uint32_t FreeList::allocateBlock()
-        {
-            // Check to see if the size of the position cache is 0, in which case
-            // we need to actually allocate a new block at the end of the file.
-            if (this->position_cache.size() == 0)
+            // The blocks of a package are written back in no particular
+            // order, so if it wasn't closed properly the last time it was
+            // written to, the bitmap may not match the inodes.
+            if (fsinfo.bmap_gen & 1)
             {
-                // Get the filesize.
-                std::streampos oldg = this->fd->tellg();
-                this->fd->seekg(0, std::ios::end);
-                uint32_t fsize = (uint32_t) this->fd->tellg();
-                 this->fd->seekg(oldg);
-
-                // Align the position on the upper 4096 boundary.
-                double fblocks = fsize / 4096.0f;
-                uint32_t alignedpos = ceil(fblocks) * 4096;
-
-                // Force the block to be consumed so that the next time
-                // we try to allocate a block, the seek-to-end-of-file
-                // will work as expected.
-                std::streampos oldp = this->fd->tellp();
-                const char* zero = "\0";
-                this->fd->seekp(alignedpos);
-                for (int i = 0; i < 4096; i += 1)
-                    this->fd->write(zero, 1);
-                this->fd->seekp(oldp);
-
-                Logging::showDebugW("FREELIST: Allocate (  new   ) block at %u.", alignedpos);
-
-                 return alignedpos;
+                Logging::showInfoW("The package was not closed cleanly; rebuilding the free space bitmap.");
+                this->rebuild();
             }
 
-            // Get the first unallocated block.
-            std::map < uint32_t, uint32_t >::iterator i = this->position_cache.begin();
+            // Mark the package as open before anything else is changed.
+            if (this->writeGeneration(fsinfo.bmap_gen | 1) && this->fd->flush())
+                this->opened = true;
+        }
 
-            // Update the position in the free block allocation table
-            // to be equal to 0 to indicate that the free block is taken.
-            std::streampos oldp = this->fd->tellp();
-            this->fd->seekp(i->first);
-            Endian::doW(this->fd, reinterpret_cast < char *>(&i->second), 4);
-            this->fd->seekp(oldp);
-            uint32_t res = i->second;
+        void FreeList::close()
+        {
+            if (!this->opened)
+                return;
+            this->opened = false;
+
+            // Only declare the bitmap up to date once it (and everything
+            // it describes) is on disk.
+            if (this->held.size() > 0 && this->fd->commit())
+                this->releaseCommitted();
+            this->flushBitmap();
+            if (!this->fd->flush())
+                return;
+            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            this->writeGeneration(fsinfo.bmap_gen + 1);
+        }
 
-            Logging::showDebugW("FREELIST: Allocate (existing) block at %u.", res);
+        uint32_t FreeList::allocateBlock(uint32_t hint)
+        {
+            this->releaseCommitted();
+
+            // Check to see if there are no free blocks, in which case we
+            // need to actually allocate a new block at the end of the file.
+            uint32_t index = 0;
+            bool found = false;
+            if (hint >= OFFSET_DATA)
+                found = this->findNearest((hint - OFFSET_DATA) / BSIZE_FILE, index);
+            else
+                found = this->findFirst(index);
+            if (!found)
+                return this->allocateAtEnd(1);
 
-            // Remove the entry from the position cache.
-            this->position_cache.erase(i);
+            // Take the first unallocated block.
+            uint32_t res = OFFSET_DATA + index * BSIZE_FILE;
+            this->takeRun(res, 1);
+
+            Logging::showDebugW("FREELIST: Allocate (existing) block at %u.", res);
 
             // Return the new writable position.
             return res;
         }
 
+        uint32_t FreeList::allocateRun(uint32_t count, uint32_t hint)
+        {
+            if (count == 0)
+                return 0;
+            this->releaseCommitted();
+
+            uint32_t pos = 0;
+            uint32_t length = 0;
+            if (!this->findRun(count, hint, pos, length))
+                return this->allocateAtEnd(count);
+
+            this->takeRun(pos, count);
+            Logging::showDebugW("FREELIST: Allocate (existing) run of %u blocks at %u.", count, pos);
+            return pos;
+        }
+
+        bool FreeList::allocateBlocks(uint32_t count, std::vector < uint32_t > & out, uint32_t hint)
+        {
+            this->releaseCommitted();
+            uint32_t minimum = std::min < uint32_t > (count, ALLOCATE_RUN_MIN);
+            while (count > 0)
+            {
+                uint32_t pos = 0;
+                uint32_t length = 0;
+                if (!this->findRun(count, hint, pos, length) && length < minimum)
+                {
+                    // Put everything that is left in one run at the end.
+                    pos = this->allocateAtEnd(count);
+                    if (pos == 0)
+                        return false;
+                    length = count;
+                }
+                else
+                {
+                    length = std::min < uint32_t > (length, count);
+                    this->takeRun(pos, length);
+                    Logging::showDebugW("FREELIST: Allocate (existing) run of %u blocks at %u.", length, pos);
+                }
+
+                for (uint32_t i = 0; i < length; i += 1)
+                    out.push_back(pos + i * BSIZE_FILE);
+                count -= length;
+                if (hint != 0)
+                    hint = pos + length * BSIZE_FILE;
+            }
+            return true;
+        }
+
+        uint32_t FreeList::allocateFreeRun(uint32_t count, uint32_t hint)
+        {
+            if (count == 0)
+                return 0;
+            this->releaseCommitted();
+
+            uint32_t pos = 0;
+            uint32_t length = 0;
+            if (!this->findRun(count, hint, pos, length))
+                return 0;
+
+            this->takeRun(pos, count);
+            Logging::showDebugW("FREELIST: Allocate (existing) run of %u blocks at %u.", count, pos);
+            return pos;
+        }
+
         void FreeList::freeBlock(uint32_t pos)
         {
-            // Get a new, blank writable index on the disk (and if
-            // we need to allocate a new block on disk for the freelist
-            // tell it to use the one we are free'ing).
-            uint32_t dpos = this->getIndexInList(0, pos);
-
-            // Although hacky, getIndexInList returns 1 to indicate that
-            // it used the provided availPos argument for it's new block.
-            // In that case, since getIndexInList immediately reallocated
-            // the new block, we're no longer actually going to free it
-            // (since it is now used).
-            if (dpos == 1)
+            std::vector < uint32_t > positions(1, pos);
+            this->freeBlocks(positions);
+        }
+
+        void FreeList::freeBlocks(const std::vector < uint32_t > & positions)
+        {
+            if (!this->fd->hasJournal())
             {
-                Logging::showDebugW("FREELIST: Reallocated block at %u for list use.", pos);
+                this->markFree(positions);
                 return;
             }
 
-            // If we can actually store the free'd block on disk, do so.
-            if (dpos != 0)
-            {
-                // Store the current position of the file descriptor.
-                std::streampos oldg = this->fd->tellg();
+            uint64_t commits = this->fd->getCommitCount();
+            for (unsigned int i = 0; i < positions.size(); i += 1)
+                this->held.push_back(std::pair < uint32_t, uint64_t > (positions[i], commits));
+        }
 
-                // Write to disk.
-                this->fd->seekp(dpos);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&pos), 4);
+        void FreeList::releaseCommitted()
+        {
+            if (this->held.size() == 0)
+                return;
 
-                // Restore the position of the file descriptor.
-                this->fd->seekg(oldg);
+            uint64_t commits = this->fd->getCommitCount();
+            std::vector < uint32_t > positions;
+            unsigned int kept = 0;
+            for (unsigned int i = 0; i < this->held.size(); i += 1)
+            {
+                if (this->held[i].second < commits)
+                    positions.push_back(this->held[i].first);
+                else
+                    this->held[kept++] = this->held[i];
+            }
+            this->held.resize(kept);
+            if (positions.size() > 0)
+                this->markFree(positions);
+        }
 
+        void FreeList::markFree(const std::vector < uint32_t > & positions)
+        {
+            // Make sure that the bitmap on disk is large enough to
+            // record all of the blocks.
+            uint32_t last = 0;
+            for (unsigned int i = 0; i < positions.size(); i += 1)
+                last = std::max < uint32_t > (last, positions[i]);
+            bool recorded = (last < OFFSET_DATA || this->extendBitmap((last - OFFSET_DATA) / BSIZE_FILE));
+
+            for (unsigned int i = 0; i < positions.size(); i += 1)
+            {
+                uint32_t pos = positions[i];
+                if (pos < OFFSET_DATA || pos % BSIZE_FILE != 0)
+                {
+                    Logging::showErrorW("FREELIST: Refusing to free %u, which is not the start of a block.", pos);
+                    continue;
+                }
+                uint32_t index = (pos - OFFSET_DATA) / BSIZE_FILE;
+                if (!recorded && index >= this->bitmap_blocks.size() * BITS_PER_BLOCK)
+                {
+                    Logging::showDebugW("FREELIST: Unable to record free'd block %u on disk.", pos);
+                    continue;
+                }
+                this->setBit(index, true);
                 Logging::showDebugW("FREELIST: Free block at %u.", pos);
             }
-            else
-                Logging::showDebugW("FREELIST: Unable to record free'd block %u on disk.", pos);
 
-            // Add the new free position to the cache.
-            this->position_cache.insert(std::map < uint32_t, uint32_t >::value_type(dpos, pos));
+            this->flushBitmap();
         }
 
-        uint32_t FreeList::getIndexInList(uint32_t pos)
+        bool FreeList::isBlockFree(uint32_t pos)
         {
-            return this->getIndexInList(pos, 0);
+            if (pos < OFFSET_DATA || pos % BSIZE_FILE != 0)
+                return false;
+            uint32_t index = (pos - OFFSET_DATA) / BSIZE_FILE;
+            if (index / 64 >= this->bitmap.size())
+                return false;
+            return (this->bitmap[index / 64] & ((uint64_t) 1 << (index % 64))) != 0;
         }
 
-        uint32_t FreeList::getIndexInList(uint32_t pos, uint32_t availPos)
+        void FreeList::truncate(uint32_t end)
         {
-            // Get the FSInfo inode by position.
-            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            if (end < OFFSET_DATA)
+                return;
+            uint32_t first = (end - OFFSET_DATA + BSIZE_FILE - 1) / BSIZE_FILE;
+            for (uint32_t w = first / 64; w < this->bitmap.size(); w += 1)
+            {
+                uint64_t word = this->bitmap[w];
+                if (w == first / 64)
+                    word &= ~(uint64_t) 0 << (first % 64);
+                for (; word != 0; word &= word - 1)
+                    this->setBit(w * 64 + lowestBit(word), false);
+            }
+            this->flushBitmap();
+
+            // Blocks that are still held are gone as well.
+            unsigned int kept = 0;
+            for (unsigned int i = 0; i < this->held.size(); i += 1)
+                if (this->held[i].first < end)
+                    this->held[kept++] = this->held[i];
+            this->held.resize(kept);
+        }
 
-            // Get the position of the first FreeList inode.
-            uint32_t fpos = fsinfo.pos_freelist;
-            uint32_t ipos = 0;
-            uint32_t tpos = 0;
+        void FreeList::setBit(uint32_t index, bool free)
+        {
+            uint32_t word = index / 64;
+            uint64_t mask = (uint64_t) 1 << (index % 64);
+            if (word >= this->bitmap.size())
+            {
+                if (!free)
+                    return;
 
-            // Store the current position of the file descriptor.
-            std::streampos oldg = this->fd->tellg();
+                // Grow the in-memory bitmap a whole region at a time.
+                uint32_t regions = word / WORDS_PER_BLOCK + 1;
+                this->bitmap.resize(regions * WORDS_PER_BLOCK, 0);
+                this->summary.resize(regions, 0);
+            }
 
-            // Loop through the FreeList inodes, searching for
-            // correct index.
-            while (fpos != 0)
+            bool current = (this->bitmap[word] & mask) != 0;
+            if (current == free)
+                return;
+            if (free)
+            {
+                this->bitmap[word] |= mask;
+                this->summary[word / WORDS_PER_BLOCK] += 1;
+                this->free_count += 1;
+            }
+            else
             {
-                for (int i = 8; i < 4096; i += 4)
+                this->bitmap[word] &= ~mask;
+                this->summary[word / WORDS_PER_BLOCK] -= 1;
+                this->free_count -= 1;
+            }
+            this->dirty.push_back(word);
+        }
+
+        bool FreeList::findFirst(uint32_t& index)
+        {
+            if (this->free_count == 0)
+                return false;
+
+            for (uint32_t r = 0; r < this->summary.size(); r += 1)
+            {
+                if (this->summary[r] == 0)
+                    continue;
+                for (uint32_t w = r * WORDS_PER_BLOCK; w < (r + 1) * WORDS_PER_BLOCK; w += 1)
                 {
-                    this->fd->seekg(fpos + i);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&tpos), 4);
-                    if (tpos == pos)
+                    if (this->bitmap[w] != 0)
                     {
-                        // Success, we've matched correctly.
-                        // Seek back to the original position.
-                        this->fd->seekg(oldg);
-
-                        // Return the correct position.
-                        return fpos + i;
+                        index = w * 64 + lowestBit(this->bitmap[w]);
+                        return true;
                     }
                 }
+            }
+            return false;
+        }
 
-                // Once we have scanned all the entries in our current FreeList block, we need
-                // to move onto the next one.
-                this->fd->seekg(fpos + 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&fpos), 4);
+        bool FreeList::findNearest(uint32_t target, uint32_t& index)
+        {
+            if (this->free_count == 0)
+                return false;
+
+            // Look in the word holding the target first, on either side
+            // of it.
+            uint32_t tw = std::min < uint32_t > (target / 64, this->bitmap.size() - 1);
+            if (tw != target / 64)
+                target = tw * 64 + 63;
+            uint64_t above = this->bitmap[tw] & (~(uint64_t) 0 << (target % 64));
+            uint64_t below = this->bitmap[tw] & ~above;
+            if (above != 0 && below != 0)
+            {
+                uint32_t up = tw * 64 + lowestBit(above);
+                uint32_t down = tw * 64 + highestBit(below);
+                index = (up - target <= target - down) ? up : down;
+                return true;
+            }
+            else if (above != 0 || below != 0)
+            {
+                index = tw * 64 + ((above != 0) ? lowestBit(above) : highestBit(below));
+                return true;
             }
 
-            // Special condition: If the pos is 0, and ipos is 0,
-            // then we need to allocate a new FreeList block for
-            // storing a new value.
-            if (pos == 0 && ipos == 0)
+            // Then move outwards a word at a time, always stepping on the
+            // side that is closer to the target and skipping over regions
+            // with no free blocks at all.
+            int64_t lo = (int64_t) tw - 1;
+            int64_t hi = (int64_t) tw + 1;
+            int64_t size = this->bitmap.size();
+            while (lo >= 0 || hi < size)
             {
-                // Create a new FreeList block.
-                uint32_t fpos = availPos;
-                if (fpos == 0)
-                    fpos = this->allocateBlock();
-                if (fpos == 0)
+                if (hi < size && (lo < 0 || hi - tw <= tw - lo))
                 {
-                    this->fd->seekg(oldg);
-                    return 0;
+                    if (this->summary[hi / WORDS_PER_BLOCK] == 0)
+                        hi = (hi / WORDS_PER_BLOCK + 1) * WORDS_PER_BLOCK;
+                    else if (this->bitmap[hi] != 0)
+                    {
+                        index = hi * 64 + lowestBit(this->bitmap[hi]);
+                        return true;
+                    }
+                    else
+                        hi += 1;
                 }
-                INode fnode(0, "", INodeType::INT_FREELIST);
-                FSResult::FSResult res = this->filesystem->writeINode(fpos, fnode);
-                if (res != FSResult::E_SUCCESS)
+                else
                 {
-                    this->fd->seekg(oldg);
-                    return 0;
+                    if (this->summary[lo / WORDS_PER_BLOCK] == 0)
+                        lo = (lo / WORDS_PER_BLOCK) * WORDS_PER_BLOCK - 1;
+                    else if (this->bitmap[lo] != 0)
+                    {
+                        index = lo * 64 + highestBit(this->bitmap[lo]);
+                        return true;
+                    }
+                    else
+                        lo -= 1;
                 }
+            }
+            return false;
+        }
 
-                // Now assign the new FreeList block as the next one in
-                // the list for the current last FreeList block.
-                uint32_t lpos = fsinfo.pos_freelist;
-                uint32_t llpos = lpos;
-                if (lpos == 0)
+        bool FreeList::findRun(uint32_t count, uint32_t hint, uint32_t& pos, uint32_t& length)
+        {
+            bool found = false;
+            pos = 0;
+            length = 0;
+            if (this->free_count == 0)
+                return false;
+
+            uint32_t start = 0;
+            uint32_t run = 0;
+            uint32_t w = 0;
+            while (w <= this->bitmap.size())
+            {
+                bool ended = false;
+                if (w == this->bitmap.size())
+                    ended = true;
+                else if (w % WORDS_PER_BLOCK == 0 && this->summary[w / WORDS_PER_BLOCK] == 0)
                 {
-                    // Update FSInfo inode.
-                    fsinfo.pos_freelist = fpos;
-
-                    this->fd->seekp(OFFSET_FSINFO);
-                    try
-                    {
-                        std::string data = fsinfo.getBinaryRepresentation();
-                        this->fd->write(data.c_str(), data.size());
-                    }
-                    catch(std::ifstream::failure e)
-                    {
-                        // End-of-file.
-                        this->fd->clear();
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
+                    // Skip over regions with no free blocks at all.
+                    ended = true;
+                    w += WORDS_PER_BLOCK - 1;
+                }
+                else if (this->bitmap[w] == ~(uint64_t) 0)
+                {
+                    if (run == 0)
+                        start = w * 64;
+                    run += 64;
                 }
+                else if (this->bitmap[w] == 0)
+                    ended = true;
                 else
                 {
-                    while (lpos != 0)
+                    // Measure the runs within this word bit by bit.
+                    for (unsigned int b = 0; b < 64; b += 1)
                     {
-                        llpos = lpos;
-
-                        // Get the next position.
-                        INode node = this->filesystem->getINodeByPosition(lpos);
-                        lpos = node.flst_next;
+                        if ((this->bitmap[w] & ((uint64_t) 1 << b)) != 0)
+                        {
+                            if (run == 0)
+                                start = w * 64 + b;
+                            run += 1;
+                            continue;
+                        }
+                        if (run != 0 && this->considerRun(start, run, count, hint, found, pos, length))
+                            return true;
+                        run = 0;
                     }
+                }
 
-                    // Update FreeList inode.
-                    INode onode = this->filesystem->getINodeByPosition(llpos);
-                    onode.flst_next = fpos;
-                    FSResult::FSResult res = this->filesystem->updateRawINode(onode, llpos);
-                    if (res != FSResult::E_SUCCESS)
-                    {
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
+                if (ended && run != 0)
+                {
+                    if (this->considerRun(start, run, count, hint, found, pos, length))
+                        return true;
+                    run = 0;
                 }
+                w += 1;
+            }
+            return found;
+        }
 
-                // Seek back to the original position.
-                this->fd->seekg(oldg);
+        bool FreeList::considerRun(uint32_t start, uint32_t run, uint32_t count, uint32_t hint,
+                bool& found, uint32_t& pos, uint32_t& length)
+        {
+            if (hint >= OFFSET_DATA && run >= count)
+            {
+                // The long enough run nearest to the hint, starting as
+                // close to it as the run allows.
+                uint32_t target = (hint - OFFSET_DATA) / BSIZE_FILE;
+                uint32_t first = start;
+                if (target > start)
+                    first = std::min < uint32_t > (target, start + run - count);
+                uint32_t distance = (first > target) ? first - target : target - first;
+                uint32_t best = (pos - OFFSET_DATA) / BSIZE_FILE;
+                if (!found || distance < ((best > target) ? best - target : target - best))
+                {
+                    found = true;
+                    pos = OFFSET_DATA + first * BSIZE_FILE;
+                    length = start + run - first;
+                }
 
-                // If we used the availPos as our new freelist index,
-                // return 1 instead of the normal value.
-                if (fpos == availPos)
-                    return 1;
-                else
-                    return fpos + HSIZE_FREELIST;
+                // A run right at the hint can't be bettered.
+                return distance == 0;
+            }
+            else if (hint < OFFSET_DATA && run >= count && (!found || run < length))
+            {
+                // The smallest run that is long enough.
+                found = true;
+                pos = OFFSET_DATA + start * BSIZE_FILE;
+                length = run;
+            }
+            else if (!found && run > length)
+            {
+                // The longest run so far.
+                pos = OFFSET_DATA + start * BSIZE_FILE;
+                length = run;
             }
 
-            // Seek back to the original position.
-            this->fd->seekg(oldg);
+            // An exact fit can't be bettered.
+            return found && length == count;
+        }
 
-            return 0;
+        void FreeList::takeRun(uint32_t pos, uint32_t count)
+        {
+            uint32_t index = (pos - OFFSET_DATA) / BSIZE_FILE;
+            for (uint32_t i = 0; i < count; i += 1)
+                this->setBit(index + i, false);
+            this->flushBitmap();
         }
 
-        bool FreeList::isBlockFree(uint32_t pos)
+        uint32_t FreeList::allocateAtEnd(uint32_t count)
         {
-            for (std::map < uint32_t, uint32_t >::iterator i = this->position_cache.begin(); i != this->position_cache.end(); i++)
+            // Get the filesize.
+            uint32_t fsize = (uint32_t) this->fd->size();
+
+            // Align the position on the upper 4096 boundary.
+            double fblocks = fsize / 4096.0f;
+            uint32_t alignedpos = ceil(fblocks) * 4096;
+            uint64_t end = alignedpos + (uint64_t) count * BSIZE_FILE;
+            if (end > 0xFFFFFFFF)
             {
-                if (i->first == pos)
-                    return true;
+                Logging::showErrorW("FREELIST: Package is too large to allocate %u more blocks.", count);
+                return 0;
             }
 
-            return false;
+            // Grow the package so that the next time we try to allocate
+            // a block, the end-of-file position will be as expected.
+            if (!this->fd->extend(end))
+                return 0;
+
+            Logging::showDebugW("FREELIST: Allocate (  new   ) run of %u blocks at %u.", count, alignedpos);
+
+            return alignedpos;
         }
 
-        INodeType::INodeType FreeList::getBlockType(uint32_t pos)
+        bool FreeList::extendBitmap(uint32_t index)
         {
-            return INodeType::INT_INVALID;
+            while (this->bitmap_blocks.size() * BITS_PER_BLOCK <= index)
+            {
+                // Use the first free block that is already recorded for
+                // the new bitmap block, or grow the package if there is none.
+                uint32_t first = 0;
+                uint32_t bpos = 0;
+                if (this->findFirst(first))
+                {
+                    bpos = OFFSET_DATA + first * BSIZE_FILE;
+                    this->takeRun(bpos, 1);
+                }
+                else
+                    bpos = this->allocateAtEnd(1);
+                if (bpos == 0)
+                    return false;
+
+                INode bnode(0, "", INodeType::INT_BITMAP);
+                if (this->filesystem->writeINode(bpos, bnode) != FSResult::E_SUCCESS)
+                    return false;
+
+                // Link the new block onto the end of the chain.
+                if (!this->linkBitmapBlock(this->bitmap_blocks.size(), bpos))
+                    return false;
+                this->bitmap_blocks.push_back(bpos);
+
+                // Anything already marked free in memory for this region
+                // (read from an old free list) must now be written out.
+                uint32_t region = this->bitmap_blocks.size() - 1;
+                if (region < this->summary.size() && this->summary[region] != 0)
+                {
+                    for (uint32_t w = region * WORDS_PER_BLOCK; w < (region + 1) * WORDS_PER_BLOCK; w += 1)
+                        if (this->bitmap[w] != 0)
+                            this->dirty.push_back(w);
+                }
+
+                Logging::showDebugW("FREELIST: Added bitmap block at %u.", bpos);
+            }
+            return true;
         }
 
-        void FreeList::syncronizeCache()
+        bool FreeList::linkBitmapBlock(uint32_t region, uint32_t pos)
         {
-            // Clear the cache.
-            this->position_cache.clear();
+            if (region == 0)
+            {
+                INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+                fsinfo.pos_bitmap = pos;
+                std::string data = fsinfo.getBinaryRepresentation();
+                return (this->fd->writeAt(OFFSET_FSINFO, data.c_str(), data.size()) == (std::streamsize) data.size());
+            }
 
-            // Get the FSInfo inode by position.
-            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            INode onode(0, "", INodeType::INT_BITMAP);
+            onode.flst_next = pos;
+            return (this->filesystem->updateRawINode(onode, this->bitmap_blocks[region - 1]) == FSResult::E_SUCCESS);
+        }
 
-            // Get the position of the first FreeList inode.
-            uint32_t fpos = fsinfo.pos_freelist;
-            uint32_t ipos = 0;
-            uint32_t tpos = 0;
+        bool FreeList::isBitmapBlock(uint32_t pos)
+        {
+            return (std::find(this->bitmap_blocks.begin(), this->bitmap_blocks.end(), pos) != this->bitmap_blocks.end());
+        }
+
+        bool FreeList::moveBitmapBlock(uint32_t pos, uint32_t npos)
+        {
+            std::vector < uint32_t >::iterator it = std::find(this->bitmap_blocks.begin(), this->bitmap_blocks.end(), pos);
+            if (it == this->bitmap_blocks.end())
+                return false;
+
+            // The bitmap on disk is always up to date, so the block can
+            // be copied as it is.
+            char block[BSIZE_FILE];
+            if (this->fd->readAt(pos, block, BSIZE_FILE) != BSIZE_FILE ||
+                    this->fd->writeAt(npos, block, BSIZE_FILE) != BSIZE_FILE)
+                return false;
+            if (!this->linkBitmapBlock(it - this->bitmap_blocks.begin(), npos))
+                return false;
+            *it = npos;
+
+            Logging::showDebugW("FREELIST: Moved bitmap block from %u to %u.", pos, npos);
+            return true;
+        }
 
-            // Check to make sure there is at least one freelist block.
-            if (fpos == 0)
+        void FreeList::flushBitmap()
+        {
+            if (this->dirty.size() == 0)
                 return;
+            std::sort(this->dirty.begin(), this->dirty.end());
+            this->dirty.erase(std::unique(this->dirty.begin(), this->dirty.end()), this->dirty.end());
+
+            // Encode the changed words (least significant byte first, so
+            // that the layout does not depend on the host) and write each
+            // range of adjacent words at once.
+            std::vector < char > data(this->dirty.size() * 8);
+            std::vector < BlockRequest > requests;
+            for (unsigned int i = 0; i < this->dirty.size(); i += 1)
+            {
+                uint32_t w = this->dirty[i];
+                if (w / WORDS_PER_BLOCK >= this->bitmap_blocks.size())
+                    continue;
+                for (unsigned int b = 0; b < 8; b += 1)
+                    data[i * 8 + b] = (char) (this->bitmap[w] >> (b * 8));
+
+                uint32_t dpos = this->bitmap_blocks[w / WORDS_PER_BLOCK] + HSIZE_BITMAP + (w % WORDS_PER_BLOCK) * 8;
+                if (requests.size() > 0 && requests.back().pos + requests.back().count == dpos)
+                {
+                    requests.back().count += 8;
+                    continue;
+                }
+                BlockRequest req;
+                req.pos = dpos;
+                req.data = &data[i * 8];
+                req.count = 8;
+                req.result = 0;
+                requests.push_back(req);
+            }
+            this->fd->writeBatch(requests);
+            this->dirty.clear();
+        }
 
-            // Store the current position of the file descriptor.
-            std::streampos oldg = this->fd->tellg();
+        void FreeList::loadBitmap(uint32_t pos)
+        {
+            char block[BSIZE_FILE];
+            uint32_t limit = (uint32_t) (this->fd->size() / BSIZE_FILE);
+            while (pos != 0 && this->bitmap_blocks.size() <= limit)
+            {
+                if (this->fd->readAt(pos, block, BSIZE_FILE) != BSIZE_FILE ||
+                        Endian::load < uint16_t > (block + INodeLayout::TYPE) != INodeType::INT_BITMAP)
+                {
+                    Logging::showErrorW("FREELIST: Free space bitmap block at %u is not valid.", pos);
+                    break;
+                }
+
+                uint32_t region = this->bitmap_blocks.size();
+                this->bitmap_blocks.push_back(pos);
+                this->bitmap.resize((region + 1) * WORDS_PER_BLOCK, 0);
+                this->summary.resize(region + 1, 0);
+                for (uint32_t i = 0; i < WORDS_PER_BLOCK; i += 1)
+                {
+                    uint64_t word = 0;
+                    for (unsigned int b = 0; b < 8; b += 1)
+                        word |= (uint64_t) (unsigned char) block[HSIZE_BITMAP + i * 8 + b] << (b * 8);
+                    this->bitmap[region * WORDS_PER_BLOCK + i] = word;
+                    for (; word != 0; word &= word - 1)
+                        this->summary[region] += 1;
+                }
+                this->free_count += this->summary[region];
 
-            // Loop through the FreeList inodes, adding non-zero values
-            // to the cache.
-            while (fpos != 0)
+                pos = Endian::load < uint32_t > (block + INodeLayout::Bitmap::BMAP_NEXT);
+            }
+        }
+
+        void FreeList::readFreeList(uint32_t pos, std::vector < uint32_t > & out)
+        {
+            uint32_t entries[(4096 - HSIZE_FREELIST) / 4];
+            uint32_t limit = (uint32_t) (this->fd->size() / BSIZE_FILE);
+
+            // Loop through the FreeList inodes, collecting the non-zero
+            // values as well as the FreeList blocks themselves.
+            for (uint32_t visited = 0; pos != 0 && visited <= limit; visited += 1)
             {
-                for (int i = 8; i < 4096; i += 4)
+                // Read all of the entries in this FreeList block at once.
+                Endian::doRArray(this->fd, pos + HSIZE_FREELIST, reinterpret_cast < char *>(&entries), (4096 - HSIZE_FREELIST) / 4, 4);
+                for (unsigned int i = 0; i < (4096 - HSIZE_FREELIST) / 4; i += 1)
                 {
-                    this->fd->seekg(fpos + i);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&tpos), 4);
-                    if (tpos != 0)
-                    {
-                        this->position_cache.insert(std::pair < uint32_t, uint32_t > (fpos + i, tpos));
-                    }
+                    if (entries[i] >= OFFSET_DATA && entries[i] % BSIZE_FILE == 0)
+                        out.push_back(entries[i]);
                 }
+                out.push_back(pos);
 
                 // Get the next position.
-                fpos = this->filesystem->getINodeByPosition(fpos).flst_next;
+                pos = this->filesystem->getINodeByPosition(pos).flst_next;
             }
+        }
 
-            // Seek back to the original position.
-            this->fd->seekg(oldg);
+        void FreeList::migrateFreeList(const std::vector < uint32_t > & positions)
+        {
+            // Record everything in the bitmap before the old list is
+            // detached, so that an interruption can only leak blocks.
+            this->markFree(positions);
 
-            // The cache has now been (re)built.
+            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            fsinfo.pos_freelist = 0;
+            std::string data = fsinfo.getBinaryRepresentation();
+            if (this->fd->writeAt(OFFSET_FSINFO, data.c_str(), data.size()) != (std::streamsize) data.size())
+            {
+                Logging::showErrorW("FREELIST: Unable to detach the old free list.");
+                return;
+            }
+
+            Logging::showInfoW("Moved %u free blocks from the free list into the free space bitmap.", (unsigned int) positions.size());
+        }
+
+        void FreeList::rebuild()
+        {
+            uint32_t size = (uint32_t) this->fd->size();
+            uint32_t blocks = (size > OFFSET_DATA) ? (size - OFFSET_DATA) / BSIZE_FILE : 0;
+            std::vector < bool > used(blocks, false);
+
+            // Everything that is reachable from the lookup table (or is
+            // part of the bitmap itself) is in use.
+            std::vector < uint32_t > positions(this->bitmap_blocks);
+            for (unsigned int id = 0; id < INODE_MAX; id += 1)
+            {
+                if (this->filesystem->getINodePositionByID(id) == 0)
+                    continue;
+                if (this->filesystem->getINodeBlocks(id, positions) != FSResult::E_SUCCESS)
+                    Logging::showWarningW("FREELIST: Unable to find all of the blocks of inode %u.", id);
+            }
+
+            // So is the metadata journal.
+            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            if (fsinfo.pos_journal != 0)
+                for (uint32_t i = 0; i < fsinfo.len_journal; i += 1)
+                    positions.push_back(fsinfo.pos_journal + i * BSIZE_FILE);
+
+            for (unsigned int i = 0; i < positions.size(); i += 1)
+            {
+                uint32_t pos = positions[i];
+                if (pos >= OFFSET_DATA && (pos - OFFSET_DATA) / BSIZE_FILE < blocks)
+                    used[(pos - OFFSET_DATA) / BSIZE_FILE] = true;
+            }
+
+            // Start again from an empty bitmap and free everything else.
+            this->truncate(OFFSET_DATA);
+            std::vector < uint32_t > free;
+            for (uint32_t i = 0; i < blocks; i += 1)
+                if (!used[i])
+                    free.push_back(OFFSET_DATA + i * BSIZE_FILE);
+            this->markFree(free);
+
+            Logging::showInfoW("Found %u free blocks in the package.", (unsigned int) free.size());
+        }
+
+        bool FreeList::writeGeneration(uint32_t generation)
+        {
+            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            fsinfo.bmap_gen = generation;
+            std::string data = fsinfo.getBinaryRepresentation();
+            if (this->fd->writeAt(OFFSET_FSINFO, data.c_str(), data.size()) != (std::streamsize) data.size())
+            {
+                Logging::showErrorW("FREELIST: Unable to update the free space bitmap generation.");
+                return false;
+            }
+            return true;
+        }
+
+        INodeType::INodeType FreeList::getBlockType(uint32_t pos)
+        {
+            return INodeType::INT_INVALID;
         }
     }
 }
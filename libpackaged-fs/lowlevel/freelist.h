@@ -16,7 +16,7 @@ namespace AppLib
 #include <string>
 #include <iostream>
 #include <fstream>
-#include <map>
+#include <vector>
 #include <libpackaged-fs/lowlevel/endian.h>
 #include <libpackaged-fs/lowlevel/fs.h>
 
@@ -31,16 +31,69 @@ namespace AppLib
 
             // Finds a free block, marks it as allocated in the free
             // space allocation table, and returns it's position for
-            // writing.
-            uint32_t allocateBlock();
+            // writing.  If a hint is given, the free block nearest to
+            // that position is used rather than the first one.
+            uint32_t allocateBlock(uint32_t hint = 0);
+
+            // Allocates count contiguous blocks and returns the position
+            // of the first one (or 0 on failure).  The smallest run of
+            // free blocks that is long enough is used (or with a hint,
+            // the one closest to it); if there isn't one, the package is
+            // grown to make room at the end.
+            uint32_t allocateRun(uint32_t count, uint32_t hint = 0);
+
+            // Allocates count blocks in as few runs as is practical and
+            // appends their positions, in order, to out.  Runs of free
+            // blocks are only used if they hold at least ALLOCATE_RUN_MIN
+            // blocks (or the whole request); anything else is allocated
+            // at the end of the package.  A hint places the first run as
+            // close to that position as possible, and each later run as
+            // close to the end of the one before.  Returns false if not
+            // all of the blocks could be allocated.
+            bool allocateBlocks(uint32_t count, std::vector < uint32_t > & out, uint32_t hint = 0);
+
+            // Allocates count contiguous blocks as allocateRun does, but
+            // only from blocks that are already free; returns 0 rather
+            // than growing the package if there is no run long enough.
+            uint32_t allocateFreeRun(uint32_t count, uint32_t hint = 0);
 
             // Frees a specified block, marking it as unallocated in
-            // the free space allocation table.
+            // the free space bitmap.
             void freeBlock(uint32_t pos);
 
+            // Frees all of the specified blocks, writing the changes to
+            // the free space bitmap in a single batch.  When the package
+            // has a journal, the blocks are not handed out again until
+            // the change that freed them has been committed, so that new
+            // data can't be written over blocks that are still in use if
+            // that change is lost.
+            void freeBlocks(const std::vector < uint32_t > & positions);
+
+            // Gives back the freed blocks that are being held until the
+            // journal has been committed, once it has.
+            void releaseCommitted();
+
             // Returns whether a specified position is free.
             bool isBlockFree(uint32_t pos);
 
+            // Forgets about the free blocks at or after the position end,
+            // once the package has been shrunk to end.
+            void truncate(uint32_t end);
+
+            // Returns whether the block at pos holds part of the free
+            // space bitmap.
+            bool isBitmapBlock(uint32_t pos);
+
+            // Moves the bitmap block at pos to the (already allocated)
+            // block at npos.  The old block is not freed.
+            bool moveBitmapBlock(uint32_t pos, uint32_t npos);
+
+            // Writes out the bitmap and records in the FSInfo block that
+            // it matches the package, so that it can be trusted the next
+            // time the package is opened.  Only the FS should call this,
+            // once everything else has been written.
+            void close();
+
             // Returns the specified type of an inode at the specified
             // position, returning INT_FREEBLOCK and INT_DATA in appropriate
             // circumstances.
@@ -50,33 +103,101 @@ namespace AppLib
             FS * filesystem;
             BlockStream *fd;
 
-            // Returns the position in the free space allocation table
-            // where a 32-bit position integer can be written, that
-            // currently matches pos.
-            uint32_t getIndexInList(uint32_t pos);
-
-            // Returns the position in the free space allocation table
-            // where a 32-bit position integer can be written, that
-            // currently matches pos.  Optionally providing an availPos
-            // which is free space that has not yet been marked as free
-            // (used as part of freeBlock to immediately repurpose free'd
-            // blocks for use as part of the FreeList structure).  In the
-            // event that this function reuses availPos for the freelist,
-            // it returns 1.
-            uint32_t getIndexInList(uint32_t pos, uint32_t availPos);
-
-            // An in-memory cache of the free space allocation table, so
-            // that fast lookups can be done to determine whether or not
-            // a block is free or not (without having to cycle through the
-            // entire free block allocation table).
-            //
-            // The first (key) value is the position that's free, the second
-            // value is the position on disk of the free allocation index
-            // (i.e. the result of getIndexInList for the specified position).
-            std::map < uint32_t, uint32_t > position_cache;
-
-            // Resyncronizes the cache based on what is on disk.
-            void syncronizeCache();
+            // The number of bitmap words stored in each bitmap block,
+            // and the number of blocks that they track.
+            static const uint32_t WORDS_PER_BLOCK;
+            static const uint32_t BITS_PER_BLOCK;
+
+            // An in-memory copy of the free space bitmap.  Each bit
+            // represents one block after OFFSET_DATA and is set when that
+            // block is free, so that checking a block is a single lookup.
+            // It is always a whole number of regions (the words stored in
+            // one bitmap block) long.
+            std::vector < uint64_t > bitmap;
+
+            // The number of free blocks in each region of the bitmap (and
+            // in total), so that searches can skip full regions outright.
+            std::vector < uint32_t > summary;
+            uint32_t free_count;
+
+            // Whether the package has been marked as open for writing.
+            bool opened;
+
+            // The positions of the bitmap blocks on disk, in order.
+            std::vector < uint32_t > bitmap_blocks;
+
+            // The bitmap words that have changed since they were last
+            // written to disk.
+            std::vector < uint32_t > dirty;
+
+            // Blocks that have been freed but not given back yet, with
+            // the number of journal commits made before they were freed.
+            std::vector < std::pair < uint32_t, uint64_t > > held;
+
+            // Marks the specified blocks as free, writing the changes to
+            // the free space bitmap in a single batch.
+            void markFree(const std::vector < uint32_t > & positions);
+
+            // Marks the block with the specified index as free or used
+            // in memory.
+            void setBit(uint32_t index, bool free);
+
+            // Finds the index of the first free block.
+            bool findFirst(uint32_t& index);
+
+            // Finds the index of the free block nearest to the block with
+            // the specified index, searching outwards in both directions.
+            bool findNearest(uint32_t target, uint32_t& index);
+
+            // Finds the smallest run of free blocks holding at least count
+            // blocks, or with a hint, the long enough run nearest to it.
+            // If there isn't one, returns false and sets pos and length
+            // to the longest run instead (length is 0 if there are no
+            // free blocks at all).
+            bool findRun(uint32_t count, uint32_t hint, uint32_t& pos, uint32_t& length);
+
+            // Compares a run found by findRun with the best so far,
+            // returning true if it can't be bettered.
+            bool considerRun(uint32_t start, uint32_t run, uint32_t count, uint32_t hint,
+                    bool& found, uint32_t& pos, uint32_t& length);
+
+            // Marks count free blocks starting at pos as allocated.
+            void takeRun(uint32_t pos, uint32_t count);
+
+            // Grows the package by count blocks and returns the position
+            // of the first one (or 0 on failure).
+            uint32_t allocateAtEnd(uint32_t count);
+
+            // Adds bitmap blocks until the bitmap on disk is long enough
+            // to record the block with the specified index.
+            bool extendBitmap(uint32_t index);
+
+            // Points the FSInfo block (for the first region) or the
+            // bitmap block before it at the bitmap block for a region.
+            bool linkBitmapBlock(uint32_t region, uint32_t pos);
+
+            // Writes the dirty words of the bitmap to disk in one batch.
+            void flushBitmap();
+
+            // Reads the free space bitmap, starting with the bitmap block
+            // at pos.
+            void loadBitmap(uint32_t pos);
+
+            // Collects the blocks recorded in (and used by) a linked free
+            // list from an older package, starting at the FreeList block
+            // at pos.
+            void readFreeList(uint32_t pos, std::vector < uint32_t > & out);
+
+            // Moves the blocks of a linked free list into the bitmap and
+            // detaches the list from the FSInfo block.
+            void migrateFreeList(const std::vector < uint32_t > & positions);
+
+            // Works out which blocks are free from the inodes in the
+            // lookup table, and writes the bitmap out again to match.
+            void rebuild();
+
+            // Stores a new bitmap generation in the FSInfo block.
+            bool writeGeneration(uint32_t generation);
         };
     }
 }
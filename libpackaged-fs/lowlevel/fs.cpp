@@ -8,10 +8,16 @@
 #include <libpackaged-fs/lowlevel/fs.h>
 #include <libpackaged-fs/logging.h>
 #include <libpackaged-fs/lowlevel/endian.h>
+#include <libpackaged-fs/lowlevel/inodelayout.h>
 #include <libpackaged-fs/lowlevel/util.h>
 #include <libpackaged-fs/lowlevel/blockstream.h>
 #include <libpackaged-fs/lowlevel/freelist.h>
+#include <libpackaged-fs/lowlevel/inodecache.h>
+#include <libpackaged-fs/lowlevel/dirindex.h>
+#include <libpackaged-fs/lowlevel/extenttree.h>
+#include <libpackaged-fs/lowlevel/compactor.h>
 #include <errno.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
 #include <vector>
@@ -20,7 +26,7 @@ namespace AppLib
 {
     namespace LowLevel
     {
-        FS::FS(LowLevel::BlockStream * fd)
+        FS::FS(LowLevel::BlockStream * fd, bool journal)
         {
             if (fd == NULL)
                 Logging::showDebugW("NULL file descriptor passed to FS constructor.");
@@ -31,7 +37,42 @@ namespace AppLib
             Endian::detectEndianness();
 
             this->fd = fd;
+            this->freelist = NULL;
+            this->inodecache = new INodeCache();
+            this->dirindex = new DirectoryIndex();
+            this->extents = new ExtentTree(this, fd);
+            this->compactor = NULL;
+            this->versioned = false;
+            memset(this->generations, 0, sizeof(this->generations));
+            memset(this->inodeGenerations, 0, sizeof(this->inodeGenerations));
+
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+            pthread_mutex_init(&this->allocator, &attr);
+            pthread_mutexattr_destroy(&attr);
+            for (unsigned int i = 0; i < INODE_LOCKS; i += 1)
+                pthread_rwlock_init(&this->inodeLocks[i], NULL);
+
+            // Nothing else can be trusted to make sense in a package of a
+            // newer format, including its journal.
+            if (!this->checkVersion())
+            {
+                this->fd = NULL;
+                return;
+            }
+            if (!this->recoverJournal())
+            {
+                this->fd = NULL;
+                return;
+            }
+            this->loadLookupTable();
+
+            // The free space bitmap may have to be rebuilt from the
+            // inodes, so it is loaded last.
             this->freelist = new FreeList(this, fd);
+            if (journal)
+                this->createJournal();
 
 #if 0 == 1
             // Check for text-mode stream, which will break binary packages.
@@ -64,6 +105,18 @@ namespace AppLib
 #endif
         }
 
+        FS::~FS()
+        {
+            delete this->compactor;
+            delete this->inodecache;
+            delete this->dirindex;
+            delete this->extents;
+            delete this->freelist;
+            for (unsigned int i = 0; i < INODE_LOCKS; i += 1)
+                pthread_rwlock_destroy(&this->inodeLocks[i]);
+            pthread_mutex_destroy(&this->allocator);
+        }
+
         bool FS::isValid()
         {
             return (this->fd != NULL);
@@ -73,24 +126,32 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Retrieve the position using our getINodePositionByID
-            // function.
-            uint32_t ipos = this->getINodePositionByID(id);
-            if (ipos == 0 || ipos < OFFSET_FSINFO)
-                return INode(0, "", INodeType::INT_INVALID);
-            return this->getINodeByPosition(ipos);
+            // Fetch the inode as stored and resolve it if it's a hardlink
+            // (which is what getINodeByPosition would do).
+            INode node = this->getRealINodeByID(id);
+            if (node.type == INodeType::INT_HARDLINK)
+                node = node.resolve(this);
+            return node;
         }
 
         INode FS::getRealINodeByID(uint16_t id)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
+            INode node;
+            uint32_t ipos = 0;
+            if (this->inodecache->get(id, node, ipos))
+                return node;
+
             // Retrieve the position using our getINodePositionByID
             // function.
-            uint32_t ipos = this->getINodePositionByID(id);
+            ipos = this->getINodePositionByID(id);
             if (ipos == 0 || ipos < OFFSET_FSINFO)
                 return INode(0, "", INodeType::INT_INVALID);
-            return this->getINodeByRealPosition(ipos);
+            node = this->getINodeByRealPosition(ipos);
+            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_DIRECTORY || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK)
+                this->inodecache->put(id, ipos, node);
+            return node;
         }
 
         INode FS::getINodeByPosition(uint32_t ipos)
@@ -110,82 +171,18 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            INode node(0, "", INodeType::INT_INVALID);
-
-            // Seek to the inode position
-            std::streampos old = this->fd->tellg();
-            this->fd->seekg(ipos);
-
-            // Read the data.
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.inodeid), 2);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.type), 2);
-            if (node.type == INodeType::INT_SEGINFO)
+            // Read the whole block once and decode the fields from memory.
+            char block[BSIZE_DIRECTORY > BSIZE_FILE ? BSIZE_DIRECTORY : BSIZE_FILE];
+            std::streamsize res = this->fd->readAt(ipos, block, sizeof(block));
+            if (res < 0)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.info_next), 4);
-
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
-
-                return node;
-            }
-            else if (node.type == INodeType::INT_FREELIST)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.flst_next), 4);
-
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
-
-                return node;
+                Logging::showErrorW("I/O error occurred while reading inode at %u.", ipos);
+                return INode(0, "", INodeType::INT_INVALID);
             }
-            else if (node.type == INodeType::INT_FSINFO)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.fs_name), 10);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_major), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_minor), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_revision), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_name), 256);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_ver), 32);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_desc), 1024);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_author), 256);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.pos_root), 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.pos_freelist), 4);
-
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
-
+            INode node = INode::decode(block, res);
+            if (node.type == INodeType::INT_SEGINFO || node.type == INodeType::INT_FREELIST || node.type == INodeType::INT_BITMAP || node.type == INodeType::INT_FSINFO)
                 return node;
-            }
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.filename), 256);
-            if (node.type != INodeType::INT_HARDLINK)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.uid), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.gid), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.mask), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.atime), 8);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.mtime), 8);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ctime), 8);
-            }
-            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_DEVICE)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.dev), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.rdev), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.nlink), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.blocks), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.dat_len), 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.info_next), 4);
-            }
-            else if (node.type == INodeType::INT_DIRECTORY)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.parent), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.children_count), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.children), DIRECTORY_CHILDREN_MAX * 2);
-            }
-            else if (node.type == INodeType::INT_HARDLINK)
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.realid), 2);
 
-            // Seek back to the original reading position.
-            this->fd->seekg(old);
-    
             // Ensure that if our node data is invalid, we return an invalid
             // INode instead of partial data.
             if (!node.verify())
@@ -194,7 +191,7 @@ namespace AppLib
             return node;
         }
 
-        FSResult::FSResult FS::writeINode(uint32_t pos, INode node)
+        FSResult::FSResult FS::writeINode(uint32_t pos, const INode& node)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -206,53 +203,48 @@ namespace AppLib
             // Check to make sure the inode ID is not already assigned.
             // TODO: This needs to be updated with a full list of inode types whose inode ID should
             //       be ignored.
-            if (node.type != INodeType::INT_SEGINFO && node.type != INodeType::INT_FREELIST && this->getINodePositionByID(node.inodeid) != 0)
+            if (node.type != INodeType::INT_SEGINFO && node.type != INodeType::INT_FREELIST && node.type != INodeType::INT_BITMAP && this->getINodePositionByID(node.inodeid) != 0)
                 return FSResult::E_FAILURE_INODE_ALREADY_ASSIGNED;
 
             // Do some sanity checks on the content.
             if (!node.verify())
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
-            std::streampos old = this->fd->tellp();
-            std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
-            if (this->fd->fail())
-                Logging::showErrorW("Write failure on write of new INode.");
-            if (this->fd->bad())
-                Logging::showErrorW("Write bad on write of new INode.");
-            if (this->fd->eof())
-                Logging::showErrorW("Write EOF on write of new INode.");
-            // TODO: Should we return with failure if any of the above if
-            // statements execute?
-
-            const char *z = "";	// a const char* always has a \0 terminator, which we use to write into the file.
+            if ((node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK) &&
+                    (node.flags & INodeLayout::File::FLAG_EXTENTS) && !this->raiseVersion())
+                return FSResult::E_FAILURE_GENERAL;
+
+            // Pad the representation out to the full block size so that
+            // the whole block is written in a single operation.
+            std::string data;
             // TODO: This needs to be updated with a full list of inode types.
-            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SEGINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_FREELIST || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK)
-            {
-                for (int i = 0; i < BSIZE_FILE - data.length(); i += 1)
-                    Endian::doW(this->fd, z, 1);
-            }
+            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SEGINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_FREELIST || node.type == INodeType::INT_BITMAP || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK)
+                data.resize(BSIZE_FILE, '\0');
             else if (node.type == INodeType::INT_DIRECTORY)
-            {
-                int target = BSIZE_DIRECTORY - data.length();
-                for (int i = 0; i < target; i += 1)
-                    Endian::doW(this->fd, z, 1);
-            }
+                data.resize(BSIZE_DIRECTORY, '\0');
             else
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
+            node.encode(&data[0]);
+            if (this->fd->writeAt(pos, data.c_str(), data.length()) != (std::streamsize) data.length())
+                Logging::showErrorW("Write failure on write of new INode.");
+            // TODO: Should we return with failure if the write fails?
+
             if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_DIRECTORY || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK)
             {
                 LowLevel::FSResult::FSResult sres = this->setINodePositionByID(node.inodeid, pos);
                 if (sres != LowLevel::FSResult::E_SUCCESS)
                     return sres;
+
+                // Cache the inode as it now is on disk.
+                this->inodecache->put(node.inodeid, pos, INode::decode(data.c_str(), data.length()));
             }
+            else
+                this->inodecache->removeAtPosition(pos);
             this->unreserveINodeID(node.inodeid);
-            Util::seekp_ex(this->fd, old);
             return FSResult::E_SUCCESS;
         }
 
-        FSResult::FSResult FS::updateRawINode(INode node, uint32_t pos)
+        FSResult::FSResult FS::updateRawINode(const INode& node, uint32_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -263,7 +255,7 @@ namespace AppLib
 
             // Ensure that this INode is a type that allows updating via
             // manual positioning.
-            if (node.type != INodeType::INT_FREELIST)
+            if (node.type != INodeType::INT_FREELIST && node.type != INodeType::INT_BITMAP)
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
             // Do some sanity checks on the content.
@@ -271,16 +263,14 @@ namespace AppLib
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
             // Do a very simple update of the data.
-            std::streampos old = this->fd->tellp();
             std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
-            Util::seekp_ex(this->fd, old);
+            this->fd->writeAt(pos, data.c_str(), data.length());
+            this->inodecache->removeAtPosition(pos);
             return FSResult::E_SUCCESS;
 
         }
 
-        FSResult::FSResult FS::updateINode(INode node)
+        FSResult::FSResult FS::updateINode(const INode& node)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -305,17 +295,17 @@ namespace AppLib
             if (!node.verify())
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
-            std::streampos old = this->fd->tellp();
             std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
+            this->fd->writeAt(pos, data.c_str(), data.length());
             // We do not write out the file data with zeros
             // as in writeINode because we want to keep the
             // content.
             LowLevel::FSResult::FSResult sres = this->setINodePositionByID(node.inodeid, pos);
             if (sres != LowLevel::FSResult::E_SUCCESS)
                 return sres;
-            Util::seekp_ex(this->fd, old);
+            INode stored = INode::decode(data.c_str(), data.length());
+            this->dirindex->rename(node.inodeid, DirectoryIndex::hash(stored.filename));
+            this->inodecache->put(node.inodeid, pos, stored);
             return FSResult::E_SUCCESS;
         }
 
@@ -323,38 +313,23 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            this->fd->clear();
-            std::streampos old = this->fd->tellg();
-            uint32_t newp = OFFSET_LOOKUP + (id * 4);
-            this->fd->seekg(newp);
-            uint32_t ipos = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-            this->fd->seekg(old);
-            return ipos;
+            return this->lookup[id];
         }
 
         uint16_t FS::getFirstFreeINodeNumber()
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            this->fd->clear();
-            std::streampos old = this->fd->tellg();
-            this->fd->seekg(OFFSET_LOOKUP);
-            uint32_t ipos = 0;
-            uint16_t count = 0;
-            uint16_t ret = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-            while ((ipos != 0 && count < 65535) || std::find(this->reservedINodes.begin(), this->reservedINodes.end(), count) != this->reservedINodes.end())
+            // Search for the first ID that is neither assigned in the lookup
+            // table nor reserved.  ID 0 is always the root inode, so it can
+            // never be returned here and doubles as the failure value.
+            for (unsigned int w = 0; w < INODE_BITMAP_WORDS; w += 1)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-                count += 1;
+                uint64_t free = ~(this->inodesUsed[w] | this->inodesReserved[w]);
+                if (free != 0)
+                    return (uint16_t)(w * 64 + __builtin_ctzll(free));
             }
-            if (count == 65535 && ipos != 0)
-                ret = 0;
-            else
-                ret = count;
-            this->fd->seekg(old);
-            return ret;
+            return 0;
         }
 
         FSResult::FSResult FS::setINodePositionByID(uint16_t id, uint32_t pos)
@@ -369,19 +344,60 @@ namespace AppLib
                     return res;
             }
 
-            std::streampos old = this->fd->tellp();
-            Util::seekp_ex(this->fd, OFFSET_LOOKUP + (id * 4));
-            Endian::doW(this->fd, reinterpret_cast < char *>(&pos), 4);
-            Util::seekp_ex(this->fd, old);
+            Endian::doW(this->fd, OFFSET_LOOKUP + (id * 4), reinterpret_cast < char *>(&pos), 4);
+            this->lookup[id] = pos;
+            this->generations[id] += 1;
+            // Other inodes in the same word may be updated at the same
+            // time (under their own inode locks).
+            if (pos != 0)
+                __atomic_fetch_or(&this->inodesUsed[id / 64], 1ULL << (id % 64), __ATOMIC_RELAXED);
+            else
+            {
+                __atomic_fetch_and(&this->inodesUsed[id / 64], ~(1ULL << (id % 64)), __ATOMIC_RELAXED);
+                __atomic_add_fetch(&this->inodeGenerations[id], 1, __ATOMIC_RELAXED);
+                this->dirindex->forget(id);
+            }
+            this->inodecache->remove(id);
             return FSResult::E_SUCCESS;
         }
 
-        uint32_t FS::getFirstFreeBlock(INodeType::INodeType type)
+        void FS::loadLookupTable()
+        {
+            if (this->fd == NULL)
+                return;
+
+            // Read the whole lookup table in one go and convert it to host
+            // order.  Anything we can't read (e.g. a truncated package) is
+            // treated as unassigned.
+            char * data = new char[LENGTH_LOOKUP];
+            std::streamsize count = this->fd->readAt(OFFSET_LOOKUP, data, LENGTH_LOOKUP);
+            if (count < 0)
+                count = 0;
+            if (count != LENGTH_LOOKUP)
+                Logging::showErrorW("Unable to read the full inode lookup table.");
+            memset(this->inodesUsed, 0, sizeof(this->inodesUsed));
+            memset(this->inodesReserved, 0, sizeof(this->inodesReserved));
+            for (unsigned int id = 0; id < INODE_MAX; id += 1)
+            {
+                if ((id + 1) * 4 <= count)
+                    this->lookup[id] = Endian::load < uint32_t > (data + id * 4);
+                else
+                    this->lookup[id] = 0;
+                if (this->lookup[id] != 0)
+                    this->inodesUsed[id / 64] |= (1ULL << (id % 64));
+            }
+            delete[] data;
+        }
+
+        uint32_t FS::getFirstFreeBlock(INodeType::INodeType type, uint32_t hint)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             // Use the FreeList class to return a new free block.
-            return this->freelist->allocateBlock();
+            pthread_mutex_lock(&this->allocator);
+            uint32_t pos = this->freelist->allocateBlock(hint);
+            pthread_mutex_unlock(&this->allocator);
+            return pos;
         }
 
         bool FS::isBlockFree(uint32_t pos)
@@ -389,7 +405,10 @@ namespace AppLib
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             // Use the FreeList class to test whether the block is free.
-            return this->freelist->isBlockFree(pos);
+            pthread_mutex_lock(&this->allocator);
+            bool free = this->freelist->isBlockFree(pos);
+            pthread_mutex_unlock(&this->allocator);
+            return free;
         }
 
         FSResult::FSResult FS::addChildToDirectoryINode(uint16_t parentid, uint16_t childid)
@@ -399,57 +418,37 @@ namespace AppLib
             if (parentid == childid)
                 return FSResult::E_FAILURE_GENERAL;
 
-            signed int type_offset = 2;
-            signed int children_count_offset = 292;
-            signed int children_offset = 294;
+            signed int type_offset = INodeLayout::TYPE;
+            signed int children_count_offset = INodeLayout::Directory::CHILDREN_COUNT;
+            signed int children_offset = INodeLayout::Directory::CHILDREN;
             uint32_t pos = this->getINodePositionByID(parentid);
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
 
             // Read to make sure it's a directory.
             uint16_t parent_type = (uint16_t) INodeType::INT_UNSET;
-            this->fd->seekg(pos + type_offset);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&parent_type), 2);
+            Endian::doR(this->fd, pos + type_offset, reinterpret_cast < char *>(&parent_type), 2);
             if (parent_type != INodeType::INT_DIRECTORY)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
                 return FSResult::E_FAILURE_NOT_A_DIRECTORY;
-            }
 
-            // Now seek to the start of the list of directory children.
-            this->fd->seekg(pos + children_offset);
-            Util::seekp_ex(this->fd, pos + children_offset);
+            // Read the whole list of directory children at once.
+            uint16_t children[DIRECTORY_CHILDREN_MAX] = { 0 };
+            Endian::doRArray(this->fd, pos + children_offset, reinterpret_cast < char *>(&children), DIRECTORY_CHILDREN_MAX, 2);
 
             // Find the first available child slot.
-            uint16_t ccinode = 0;
             uint16_t count = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-            while (ccinode != 0 && count < DIRECTORY_CHILDREN_MAX - 1)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
+            while (children[count] != 0 && count < DIRECTORY_CHILDREN_MAX - 1)
                 count += 1;
-            }
-            if (count == DIRECTORY_CHILDREN_MAX - 1 && ccinode != 0)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            if (count == DIRECTORY_CHILDREN_MAX - 1 && children[count] != 0)
                 return FSResult::E_FAILURE_MAXIMUM_CHILDREN_REACHED;
-            }
             else
             {
-                uint32_t writeg = this->fd->tellg();
-                Util::seekp_ex(this->fd, writeg - 2);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&childid), 2);
+                Endian::doW(this->fd, pos + children_offset + (count * 2), reinterpret_cast < char *>(&childid), 2);
+                this->dirindex->add(parentid, childid, DirectoryIndex::hash(this->getRealINodeByID(childid).filename));
 
                 uint16_t children_count_current = 0;
-                this->fd->seekg(pos + children_count_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
+                Endian::doR(this->fd, pos + children_count_offset, reinterpret_cast < char *>(&children_count_current), 2);
                 children_count_current += 1;
-                Util::seekp_ex(this->fd, pos + children_count_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+                Endian::doW(this->fd, pos + children_count_offset, reinterpret_cast < char *>(&children_count_current), 2);
+                this->inodecache->modify(parentid, [&](INode& node) { node.children_count = children_count_current; });
 
                 // Update times.
                 this->updateTimes(parentid, false, true, true);
@@ -462,58 +461,38 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int type_offset = 2;
-            signed int children_count_offset = 292;
-            signed int children_offset = 294;
+            signed int type_offset = INodeLayout::TYPE;
+            signed int children_count_offset = INodeLayout::Directory::CHILDREN_COUNT;
+            signed int children_offset = INodeLayout::Directory::CHILDREN;
             uint32_t pos = this->getINodePositionByID(parentid);
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
 
             // Read to make sure it's a directory.
             uint16_t parent_type = (uint16_t) INodeType::INT_UNSET;
-            this->fd->seekg(pos + type_offset);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&parent_type), 2);
+            Endian::doR(this->fd, pos + type_offset, reinterpret_cast < char *>(&parent_type), 2);
             if (parent_type != INodeType::INT_DIRECTORY)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
                 return FSResult::E_FAILURE_NOT_A_DIRECTORY;
-            }
 
-            // Now seek to the start of the list of directory children.
-            this->fd->seekg(pos + children_offset);
-            Util::seekp_ex(this->fd, pos + children_offset);
+            // Read the whole list of directory children at once.
+            uint16_t children[DIRECTORY_CHILDREN_MAX] = { 0 };
+            Endian::doRArray(this->fd, pos + children_offset, reinterpret_cast < char *>(&children), DIRECTORY_CHILDREN_MAX, 2);
 
             // Find the slot that the child inode is in.
-            uint16_t ccinode = 0;
             uint16_t count = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-            while (ccinode != childid && count < DIRECTORY_CHILDREN_MAX - 1)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
+            while (children[count] != childid && count < DIRECTORY_CHILDREN_MAX - 1)
                 count += 1;
-            }
-            if (count == DIRECTORY_CHILDREN_MAX - 1 && ccinode != childid)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            if (count == DIRECTORY_CHILDREN_MAX - 1 && children[count] != childid)
                 return FSResult::E_FAILURE_INVALID_FILENAME;
-            }
             else
             {
-                uint32_t writeg = this->fd->tellg();
-                Util::seekp_ex(this->fd, writeg - 2);
                 uint16_t zeroid = 0;
-                Endian::doW(this->fd, reinterpret_cast < char *>(&zeroid), 2);
+                Endian::doW(this->fd, pos + children_offset + (count * 2), reinterpret_cast < char *>(&zeroid), 2);
+                this->dirindex->remove(parentid, childid);
 
                 uint16_t children_count_current = 0;
-                this->fd->seekg(pos + children_count_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
+                Endian::doR(this->fd, pos + children_count_offset, reinterpret_cast < char *>(&children_count_current), 2);
                 children_count_current -= 1;
-                Util::seekp_ex(this->fd, pos + children_count_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+                Endian::doW(this->fd, pos + children_count_offset, reinterpret_cast < char *>(&children_count_current), 2);
+                this->inodecache->modify(parentid, [&](INode& node) { node.children_count = children_count_current; });
 
                 // Update times.
                 this->updateTimes(parentid, false, true, true);
@@ -522,50 +501,76 @@ namespace AppLib
             }
         }
 
-        FSResult::FSResult FS::filenameIsUnique(uint16_t parentid, std::string filename)
+        FSResult::FSResult FS::filenameIsUnique(uint16_t parentid, const std::string& filename)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            std::vector < INode > inodechildren = this->getChildrenOfDirectory(parentid);
-            for (unsigned int i = 0; i < inodechildren.size(); i += 1)
-            {
-                if (filename == inodechildren[i].filename)
-                {
-                    return FSResult::E_FAILURE_NOT_UNIQUE;
-                }
-            }
+            if (this->getChildOfDirectory(parentid, filename).type != INodeType::INT_INVALID)
+                return FSResult::E_FAILURE_NOT_UNIQUE;
             return FSResult::E_SUCCESS;	// Indicates unique.
         }
 
+        std::vector < uint16_t > FS::getChildIDsOfDirectory(uint16_t parentid)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            std::vector < uint16_t > result;
+            uint32_t pos = this->getINodePositionByID(parentid);
+            if (pos == 0)
+                return result;
+
+            // Read the header fields and the whole list of children at once.
+            char header[INodeLayout::Directory::CHILDREN];
+            if (this->fd->readAt(pos, header, sizeof(header)) != (std::streamsize) sizeof(header) ||
+                    Endian::load < uint16_t > (header + INodeLayout::TYPE) != INodeType::INT_DIRECTORY)
+                return result;
+            uint16_t children_count = Endian::load < uint16_t > (header + INodeLayout::Directory::CHILDREN_COUNT);
+            if (children_count == 0)
+                return result;
+
+            uint16_t children[DIRECTORY_CHILDREN_MAX] = { 0 };
+            Endian::doRArray(this->fd, pos + INodeLayout::Directory::CHILDREN, reinterpret_cast < char *>(&children), DIRECTORY_CHILDREN_MAX, 2);
+            result.reserve(children_count);
+            for (unsigned int i = 0; i < DIRECTORY_CHILDREN_MAX && result.size() < children_count; i += 1)
+                if (children[i] != 0)
+                    result.push_back(children[i]);
+            return result;
+        }
+
+        std::vector < uint16_t > FS::getChildSlotsOfDirectory(uint16_t parentid, uint16_t start)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            std::vector < uint16_t > result;
+            uint32_t pos = this->getINodePositionByID(parentid);
+            if (pos == 0 || start >= DIRECTORY_CHILDREN_MAX)
+                return result;
+
+            uint16_t type = (uint16_t) INodeType::INT_UNSET;
+            Endian::doR(this->fd, pos + INodeLayout::TYPE, reinterpret_cast < char *>(&type), 2);
+            if (type != INodeType::INT_DIRECTORY)
+                return result;
+
+            // Read the rest of the list of children at once.
+            result.resize(DIRECTORY_CHILDREN_MAX - start);
+            Endian::doRArray(this->fd, pos + INodeLayout::Directory::CHILDREN + (start * 2),
+                    reinterpret_cast < char *>(&result[0]), result.size(), 2);
+            return result;
+        }
+
         std::vector < INode > FS::getChildrenOfDirectory(uint16_t parentid)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             std::vector < INode > inodechildren;
-            INode node = this->getINodeByID(parentid);
-            if (node.type != INodeType::INT_DIRECTORY)
+            std::vector < uint16_t > children = this->getChildIDsOfDirectory(parentid);
+            inodechildren.reserve(children.size());
+            for (unsigned int i = 0; i < children.size(); i += 1)
             {
-                return inodechildren;
-            }
-
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
-            {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
+                INode cnode = this->getINodeByID(children[i]);
+                if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
                 {
-                    continue;
-                }
-                else
-                {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
-                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
-                    {
-                        inodechildren.insert(inodechildren.end(), cnode);
-                    }
+                    inodechildren.push_back(std::move(cnode));
                 }
             }
 
@@ -576,32 +581,17 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            INode node = this->getINodeByID(parentid);
-            if (node.type == INodeType::INT_INVALID)
-            {
-                return INode(0, "", INodeType::INT_INVALID);
-            }
-
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
+            std::vector < uint16_t > children = this->getChildIDsOfDirectory(parentid);
+            for (unsigned int i = 0; i < children.size(); i += 1)
             {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
-                {
+                if (children[i] != childid)
                     continue;
-                }
-                else
+                INode cnode = this->getINodeByID(children[i]);
+                if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
                 {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
-                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
+                    if (cnode.inodeid == childid)
                     {
-                        if (cnode.inodeid == childid)
-                        {
-                            return cnode;
-                        }
+                        return cnode;
                     }
                 }
             }
@@ -609,35 +599,65 @@ namespace AppLib
             return INode(0, "", INodeType::INT_INVALID);
         }
 
-        INode FS::getChildOfDirectory(uint16_t parentid, std::string filename)
+        INode FS::getChildOfDirectory(uint16_t parentid, const std::string& filename)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            INode node = this->getINodeByID(parentid);
-            if (node.type == INodeType::INT_INVALID)
+            uint16_t id = this->getChildIDOfDirectory(parentid, filename);
+            if (id == 0)
                 return INode(0, "", INodeType::INT_INVALID);
+            return this->getINodeByID(id);
+        }
 
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
+        uint16_t FS::getChildIDOfDirectory(uint16_t parentid, const std::string& filename)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            // Only the children whose filename has the same hash need to
+            // be read and compared.
+            uint32_t hash = DirectoryIndex::hash(filename.c_str());
+            std::vector < uint16_t > children;
+            if (!this->dirindex->find(parentid, hash, children))
             {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
-                {
-                    continue;
-                }
-                else
-                {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
-                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
-                        if (filename == cnode.filename)
-                            return cnode;
-                }
+                if (this->indexDirectory(parentid) != FSResult::E_SUCCESS ||
+                        !this->dirindex->find(parentid, hash, children))
+                    return 0;
+            }
+            for (unsigned int i = 0; i < children.size(); i += 1)
+            {
+                // Compare against the filename stored in the child's own
+                // inode (for hardlinks, that is the name of the link).
+                INode cnode = this->getRealINodeByID(children[i]);
+                if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
+                    if (filename == cnode.filename)
+                        return children[i];
             }
 
-            return INode(0, "", INodeType::INT_INVALID);
+            return 0;
+        }
+
+        FSResult::FSResult FS::indexDirectory(uint16_t parentid)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            if (this->getRealINodeByID(parentid).type != INodeType::INT_DIRECTORY)
+                return FSResult::E_FAILURE_NOT_A_DIRECTORY;
+
+            // Index the children by the filename stored in their own inode
+            // (for hardlinks, that is the name of the link itself).  Other
+            // threads may be looking the directory up (or indexing it) at
+            // the same time, so the index is only handed over once it is
+            // complete.
+            std::vector < uint16_t > children = this->getChildIDsOfDirectory(parentid);
+            std::vector < std::pair < uint16_t, uint32_t > > entries;
+            entries.reserve(children.size());
+            for (unsigned int i = 0; i < children.size(); i += 1)
+            {
+                INode cnode = this->getRealINodeByID(children[i]);
+                entries.push_back(std::make_pair(children[i], DirectoryIndex::hash(cnode.filename)));
+            }
+            this->dirindex->create(parentid, entries);
+            return FSResult::E_SUCCESS;
         }
 
         FSResult::FSResult FS::setFileContents(uint16_t id, const char *data, uint32_t len)
@@ -699,34 +719,28 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_blocks_offset = 296;
-            signed int file_len_offset = 298;
-
-            this->fd->clear();
-
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            signed int file_blocks_offset = INodeLayout::File::BLOCKS;
+            signed int file_len_offset = INodeLayout::File::DAT_LEN;
 
             // Get the type directly.
             uint16_t type_raw = (uint16_t) INodeType::INT_INVALID;
-            this->fd->seekg(pos + 2);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&type_raw), 2);
+            Endian::doR(this->fd, pos + INodeLayout::TYPE, reinterpret_cast < char *>(&type_raw), 2);
 
             if (type_raw == INodeType::INT_FILEINFO || type_raw == INodeType::INT_SYMLINK)
             {
-                Util::seekp_ex(this->fd, pos + file_len_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&len), 4);
-                Util::seekp_ex(this->fd, pos + file_blocks_offset);
-                uint16_t blocks = ceil(len / (double) BSIZE_FILE);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&blocks), 2);
-                Util::seekp_ex(this->fd, oldp);
-                this->fd->seekg(oldg);
-                this->fd->seekp(oldp);
+                Endian::doW(this->fd, pos + file_len_offset, reinterpret_cast < char *>(&len), 4);
+                uint32_t blocks = ceil(len / (double) BSIZE_FILE);
+                uint16_t blocks_stored = std::min < uint32_t > (blocks, 0xFFFF);
+                Endian::doW(this->fd, pos + file_blocks_offset, reinterpret_cast < char *>(&blocks_stored), 2);
+                this->inodecache->modifyAtPosition(pos, [&](INode& node)
+                {
+                    node.dat_len = len;
+                    node.blocks = blocks;
+                });
                 return FSResult::E_SUCCESS;
             }
             else
             {
-                this->fd->seekg(oldg);
                 return FSResult::E_FAILURE_INVALID_POSITION;
             }
         }
@@ -735,11 +749,7 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_info_next_offset = 302;
-
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            signed int file_info_next_offset = INodeLayout::File::INFO_NEXT;
 
             // Get the base position of the specified inode.
             uint32_t bpos = this->getINodePositionByID(id);
@@ -748,15 +758,17 @@ namespace AppLib
             {
                 return FSResult::E_FAILURE_NOT_A_FILE;
             }
+            if (node.flags & INodeLayout::File::FLAG_EXTENTS)
+            {
+                // Extent files have no segment list to link.
+                return FSResult::E_FAILURE_NOT_IMPLEMENTED;
+            }
             if (bpos == pos)
             {
                 // We're setting the position of the first segment
                 // in the file.
-                std::streampos oldp = this->fd->tellp();
-                this->fd->seekg(bpos + file_info_next_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&seg_next), 4);
-                this->fd->seekp(oldp);
-                this->fd->seekg(oldg);
+                Endian::doW(this->fd, bpos + file_info_next_offset, reinterpret_cast < char *>(&seg_next), 4);
+                this->inodecache->modify(id, [&](INode& node) { node.info_next = seg_next; });
                 return FSResult::E_SUCCESS;
             }
 
@@ -769,9 +781,8 @@ namespace AppLib
             {
                 for (int i = hsize; i < BSIZE_FILE; i += 4)
                 {
-                    this->fd->seekg(bpos + i);
                     spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
+                    Endian::doR(this->fd, bpos + i, reinterpret_cast < char *>(&spos), 4);
                     if (spos == 0)
                     {
                         // End of segment list.  Return 0.
@@ -785,11 +796,7 @@ namespace AppLib
                     else if (gnext)
                     {
                         // Replace the segment value.
-                        std::streampos oldp = this->fd->tellp();
-                        this->fd->seekp(bpos + i);
-                        Endian::doW(this->fd, reinterpret_cast < char *>(&seg_next), 4);
-                        this->fd->seekp(oldp);
-                        this->fd->seekg(oldg);
+                        Endian::doW(this->fd, bpos + i, reinterpret_cast < char *>(&seg_next), 4);
                         return FSResult::E_SUCCESS;
                     }
                 }
@@ -802,7 +809,6 @@ namespace AppLib
 
             // Unable to locate the current segment within the
             // specified file ID.
-            this->fd->seekg(oldg);
             return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
         }
 
@@ -810,12 +816,26 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
-
             // Get the base position of the specified inode.
             uint32_t bpos = this->getINodePositionByID(id);
+            if (this->getINodeByPosition(bpos).flags & INodeLayout::File::FLAG_EXTENTS)
+            {
+                // Find the extent holding the block; the next block is
+                // either right after it or the start of the next extent.
+                std::vector < Extent > extents;
+                if (this->extents->load(bpos, extents) != FSResult::E_SUCCESS)
+                    return 0;
+                for (unsigned int i = 0; i < extents.size(); i += 1)
+                {
+                    uint64_t end = extents[i].pos + (uint64_t) extents[i].length * BSIZE_FILE;
+                    if (pos < extents[i].pos || pos >= end)
+                        continue;
+                    if (pos + BSIZE_FILE < end)
+                        return pos + BSIZE_FILE;
+                    return (i + 1 < extents.size()) ? extents[i + 1].pos : 0;
+                }
+                return 0;
+            }
 
             // Now loop through all of the segment positions.
             bool gnext = false;
@@ -826,13 +846,11 @@ namespace AppLib
             {
                 for (int i = hsize; i < BSIZE_FILE; i += 4)
                 {
-                    this->fd->seekg(bpos + i);
                     spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
+                    Endian::doR(this->fd, bpos + i, reinterpret_cast < char *>(&spos), 4);
                     if (spos == 0)
                     {
                         // End of segment list.  Return 0.
-                        this->fd->seekg(oldg);
                         return 0;
                     }
                     else if (spos == pos)
@@ -843,7 +861,6 @@ namespace AppLib
                     else if (gnext)
                     {
                         // Return the next segment value.
-                        this->fd->seekg(oldg);
                         return spos;
                     }
                 }
@@ -856,16 +873,113 @@ namespace AppLib
 
             // Unable to locate the current segment within the
             // specified file ID.
-            this->fd->seekg(oldg);
             return 0;
         }
 
+        FSResult::FSResult FS::getFileBlocks(uint16_t id, uint32_t start, uint32_t count, std::vector < uint32_t > & out)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            // Get the base position of the specified inode.
+            uint32_t bpos = this->getINodePositionByID(id);
+            if (bpos == 0)
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+
+            if (this->getINodeByPosition(bpos).flags & INodeLayout::File::FLAG_EXTENTS)
+            {
+                std::vector < Extent > extents;
+                FSResult::FSResult res = this->extents->load(bpos, extents);
+                if (res != FSResult::E_SUCCESS)
+                    return res;
+                for (unsigned int i = 0; i < extents.size() && count > 0; i += 1)
+                {
+                    const Extent & extent = extents[i];
+                    if (extent.start + extent.length <= start)
+                        continue;
+                    for (uint32_t b = std::max < uint32_t > (start, extent.start); b < extent.start + extent.length && count > 0; b += 1)
+                    {
+                        out.push_back(extent.pos + (b - extent.start) * BSIZE_FILE);
+                        count -= 1;
+                    }
+                }
+                return FSResult::E_SUCCESS;
+            }
+
+            // Walk the segment lists the same way the writers lay them
+            // out, reading each list of positions in one go.
+            uint32_t segs[BSIZE_FILE / 4];
+            uint32_t bcount = 0;
+            uint32_t ipos = bpos;
+            uint32_t hsize = HSIZE_FILE;
+            while (ipos != 0 && count > 0)
+            {
+                unsigned int total = (BSIZE_FILE - hsize) / 4;
+                Endian::doRArray(this->fd, bpos + hsize, reinterpret_cast < char *>(&segs), total, 4);
+                for (unsigned int i = 0; i < total; i += 1)
+                {
+                    if (segs[i] == 0)
+                        return FSResult::E_SUCCESS;
+                    if (bcount >= start)
+                    {
+                        out.push_back(segs[i]);
+                        count -= 1;
+                        if (count == 0)
+                            return FSResult::E_SUCCESS;
+                    }
+                    bcount += 1;
+                }
+                hsize = HSIZE_SEGINFO;
+                INode inode = this->getINodeByPosition(ipos);
+                ipos = inode.info_next;
+            }
+
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::getINodeBlocks(uint16_t id, std::vector < uint32_t > & out)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            uint32_t bpos = this->getINodePositionByID(id);
+            if (bpos == 0)
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            out.push_back(bpos);
+
+            INode node = this->getINodeByPosition(bpos);
+            if (node.type != INodeType::INT_FILEINFO && node.type != INodeType::INT_SYMLINK)
+                return FSResult::E_SUCCESS;
+            if (node.flags & INodeLayout::File::FLAG_EXTENTS)
+            {
+                FSResult::FSResult res = this->extents->getTreeBlocks(bpos, out);
+                if (res != FSResult::E_SUCCESS)
+                    return res;
+            }
+            else
+            {
+                // Follow the chain of segment list blocks, making sure a
+                // damaged chain can't loop forever.
+                uint32_t limit = (uint32_t) (this->fd->size() / BSIZE_FILE);
+                uint32_t ipos = node.info_next;
+                for (uint32_t visited = 0; ipos != 0 && visited <= limit; visited += 1)
+                {
+                    INode inode = this->getINodeByPosition(ipos);
+                    if (inode.type != INodeType::INT_SEGINFO)
+                        return FSResult::E_FAILURE_INODE_NOT_VALID;
+                    out.push_back(ipos);
+                    ipos = inode.info_next;
+                }
+            }
+            return this->getFileBlocks(id, 0, 0xFFFFFFFF, out);
+        }
+
         FSResult::FSResult FS::resetBlock(uint32_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
+            pthread_mutex_lock(&this->allocator);
             if (this->freelist->isBlockFree(pos) || pos % 4096 != 0)
             {
+                pthread_mutex_unlock(&this->allocator);
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
             }
 
@@ -883,20 +997,282 @@ namespace AppLib
             // Block must be marked as unused through the
             // free list allocation class.
             this->freelist->freeBlock(pos);
+            this->inodecache->removeAtPosition(pos);
+            this->queueDiscard(pos);
+            pthread_mutex_unlock(&this->allocator);
 
             return FSResult::E_SUCCESS;
         }
 
-        uint32_t FS::resolvePositionInFile(uint16_t inodeid, uint32_t pos)
+        FSResult::FSResult FS::resetBlocks(const std::vector < uint32_t > & positions)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            std::vector < uint32_t > valid;
+            valid.reserve(positions.size());
+            pthread_mutex_lock(&this->allocator);
+            for (unsigned int i = 0; i < positions.size(); i += 1)
+            {
+                if (this->freelist->isBlockFree(positions[i]) || positions[i] % 4096 != 0)
+                    continue;
+                valid.push_back(positions[i]);
+                this->inodecache->removeAtPosition(positions[i]);
+            }
+
+            // Mark them all as unused in one update of the free space bitmap.
+            this->freelist->freeBlocks(valid);
+            for (unsigned int i = 0; i < valid.size(); i += 1)
+                this->queueDiscard(valid[i]);
+            pthread_mutex_unlock(&this->allocator);
+
+            if (valid.size() != positions.size())
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            return FSResult::E_SUCCESS;
+        }
+
+        void FS::discardFreeBlocks()
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            pthread_mutex_lock(&this->allocator);
+            if (this->discards.size() == 0)
+            {
+                pthread_mutex_unlock(&this->allocator);
+                return;
+            }
+
+            // Keep the batch for later if the changes that freed it can't
+            // be written back (see truncateFreeTail).
+            if (!this->fd->hasJournal() && !this->fd->flush())
+            {
+                pthread_mutex_unlock(&this->allocator);
+                return;
+            }
+            std::vector < uint32_t > positions;
+            positions.swap(this->discards);
+
+            // Blocks at the end of the package are released by cutting
+            // them off; holes are punched for the rest, one per run.
+            this->truncateFreeTail();
+            uint32_t end = (uint32_t) this->fd->size();
+            std::sort(positions.begin(), positions.end());
+            uint32_t start = 0;
+            uint32_t length = 0;
+            for (unsigned int i = 0; i < positions.size(); i += 1)
+            {
+                uint32_t pos = positions[i];
+                if (pos >= end || !this->freelist->isBlockFree(pos))
+                    continue;
+                if (length > 0 && pos < start + length)
+                    continue;
+                if (length > 0 && pos == start + length)
+                {
+                    length += BSIZE_FILE;
+                    continue;
+                }
+                if (length > 0 && !this->fd->discard(start, length))
+                {
+                    length = 0;
+                    break;
+                }
+                start = pos;
+                length = BSIZE_FILE;
+            }
+            if (length > 0)
+                this->fd->discard(start, length);
+            pthread_mutex_unlock(&this->allocator);
+        }
+
+        uint32_t FS::truncateFreeTail()
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            pthread_mutex_lock(&this->allocator);
+
+            // The changes that freed the blocks have to reach the package
+            // before their contents are thrown away, or a crash could
+            // leave inodes pointing at holes.  With a journal, blocks
+            // freed since it was last committed aren't free until it has
+            // been; without one, the block cache is written back.
+            if (this->fd->hasJournal())
+            {
+                if (this->fd->commit())
+                    this->freelist->releaseCommitted();
+            }
+            else if (!this->fd->flush())
+            {
+                pthread_mutex_unlock(&this->allocator);
+                return 0;
+            }
+
+            uint32_t size = (uint32_t) this->fd->size();
+            uint32_t end = (size > OFFSET_DATA) ? size - (size - OFFSET_DATA) % BSIZE_FILE : OFFSET_DATA;
+            while (end > OFFSET_DATA && this->freelist->isBlockFree(end - BSIZE_FILE))
+                end -= BSIZE_FILE;
+
+            // The first bitmap block is created at the end of the package
+            // when the first block is freed, so move bitmap blocks down
+            // into free space rather than letting them pin the end.
+            while (end > OFFSET_DATA && this->freelist->isBitmapBlock(end - BSIZE_FILE))
+            {
+                uint32_t npos = this->freelist->allocateFreeRun(1, OFFSET_DATA);
+                if (npos == 0)
+                    break;
+                if (npos > end - BSIZE_FILE || !this->freelist->moveBitmapBlock(end - BSIZE_FILE, npos))
+                {
+                    this->freelist->freeBlock(npos);
+                    break;
+                }
+                this->freelist->freeBlock(end - BSIZE_FILE);
+                while (end > OFFSET_DATA && this->freelist->isBlockFree(end - BSIZE_FILE))
+                    end -= BSIZE_FILE;
+            }
+            if (end >= size)
+            {
+                pthread_mutex_unlock(&this->allocator);
+                return 0;
+            }
+
+            // Write the journal home first, so that nothing in it can be
+            // replayed past the new end of the package.
+            if (this->fd->hasJournal())
+                this->fd->checkpoint();
+            this->freelist->truncate(end);
+            bool truncated = this->fd->truncate(end);
+            pthread_mutex_unlock(&this->allocator);
+            if (!truncated)
+                return 0;
+            Logging::showDebugW("FS: Shrunk package from %u to %u bytes.", size, end);
+            return size - end;
+        }
+
+        void FS::queueDiscard(uint32_t pos)
+        {
+            // The allocator lock is held by the callers.  Releasing the
+            // batch commits the journal, which mustn't happen halfway
+            // through an operation, so packages with a journal wait for
+            // discardFreeBlocks to be called.
+            if (DISCARD_BATCH == 0 || this->fd->isReadOnly())
+                return;
+            this->discards.push_back(pos);
+            if (this->discards.size() >= DISCARD_BATCH && !this->fd->hasJournal())
+                this->discardFreeBlocks();
+        }
+
+        bool FS::checkVersion()
+        {
+            INode fsinfo = this->getINodeByPosition(OFFSET_FSINFO);
+            if (fsinfo.ver_major > FORMAT_VERSION_MAJOR ||
+                    (fsinfo.ver_major == FORMAT_VERSION_MAJOR && fsinfo.ver_minor > FORMAT_VERSION_MINOR))
+            {
+                Logging::showErrorW("The package uses version %u.%u of the package format, but only versions",
+                        fsinfo.ver_major, fsinfo.ver_minor);
+                Logging::showErrorO("up to %u.%u can be opened.", FORMAT_VERSION_MAJOR, FORMAT_VERSION_MINOR);
+                return false;
+            }
+            this->versioned = (fsinfo.ver_major == FORMAT_VERSION_MAJOR && fsinfo.ver_minor == FORMAT_VERSION_MINOR);
+            return true;
+        }
+
+        bool FS::raiseVersion()
+        {
+            if (__atomic_load_n(&this->versioned, __ATOMIC_ACQUIRE))
+                return true;
+
+            // Files may be created or emptied on several threads at once.
+            pthread_mutex_lock(&this->allocator);
+            bool success = true;
+            if (!this->versioned)
+            {
+                INode fsinfo = this->getINodeByPosition(OFFSET_FSINFO);
+                fsinfo.ver_major = FORMAT_VERSION_MAJOR;
+                fsinfo.ver_minor = FORMAT_VERSION_MINOR;
+                fsinfo.ver_revision = 0;
+                std::string data = fsinfo.getBinaryRepresentation();
+                success = (this->fd->writeAt(OFFSET_FSINFO, data.c_str(), data.size()) == (std::streamsize) data.size());
+                if (success)
+                {
+                    this->inodecache->removeAtPosition(OFFSET_FSINFO);
+                    __atomic_store_n(&this->versioned, true, __ATOMIC_RELEASE);
+                    Logging::showDebugW("FS: Raised the package format to version %u.%u.",
+                            FORMAT_VERSION_MAJOR, FORMAT_VERSION_MINOR);
+                }
+                else
+                    Logging::showErrorW("Unable to raise the version of the package format.");
+            }
+            pthread_mutex_unlock(&this->allocator);
+            return success;
+        }
+
+        bool FS::recoverJournal()
+        {
+            INode fsinfo = this->getINodeByPosition(OFFSET_FSINFO);
+            if (fsinfo.pos_journal == 0 || fsinfo.len_journal == 0)
+                return true;
+
+            // Writable packages carry on without a journal that can't be
+            // recovered, but read-only ones would show stale metadata.
+            std::vector < uint32_t > replayed;
+            bool opened = this->fd->openJournal(fsinfo.pos_journal, fsinfo.len_journal, replayed);
+            if (replayed.size() > 0)
+                this->inodecache->clear();
+            if (!opened && this->fd->isReadOnly())
+            {
+                Logging::showErrorW("Unable to read the metadata journal of the package.");
+                return false;
+            }
+            return true;
+        }
+
+        void FS::createJournal()
+        {
+            if (JOURNAL_BLOCKS < 3 || CACHE_BLOCKS == 0 || this->fd->isReadOnly() || this->fd->hasJournal())
+                return;
+            INode fsinfo = this->getINodeByPosition(OFFSET_FSINFO);
+            if (fsinfo.pos_journal != 0)
+                return;
+
+            // A smaller journal only means committing more often, so it
+            // is kept in proportion to the package.
+            uint32_t blocks = (uint32_t) (this->fd->size() / BSIZE_FILE / JOURNAL_RATIO);
+            blocks = std::min < uint32_t > (JOURNAL_BLOCKS, std::max < uint32_t > (JOURNAL_BLOCKS_MIN, blocks));
+
+            // The blocks are set up as a journal when it is opened, so
+            // only the space and the FSInfo block need to be on disk
+            // first.
+            uint32_t pos = this->freelist->allocateRun(blocks, OFFSET_DATA);
+            if (pos == 0)
+            {
+                Logging::showWarningW("Unable to allocate space for the metadata journal.");
+                return;
+            }
+            fsinfo.pos_journal = pos;
+            fsinfo.len_journal = blocks;
+            std::string data = fsinfo.getBinaryRepresentation();
+            if (this->fd->writeAt(OFFSET_FSINFO, data.c_str(), data.size()) != (std::streamsize) data.size() ||
+                    !this->fd->flush())
+            {
+                Logging::showWarningW("Unable to record the position of the metadata journal.");
+                return;
+            }
+            this->inodecache->clear();
+
+            std::vector < uint32_t > replayed;
+            if (this->fd->openJournal(pos, blocks, replayed))
+                Logging::showInfoW("Added a metadata journal of %u KB to the package.", blocks * (BSIZE_FILE / 1024));
+        }
+
+        uint32_t FS::resolvePositionInFile(uint16_t inodeid, uint32_t pos)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             // Get the base position of the specified inode.
             uint32_t bpos = this->getINodePositionByID(inodeid);
+            if (this->getINodeByPosition(bpos).flags & INodeLayout::File::FLAG_EXTENTS)
+            {
+                uint32_t spos = this->extents->resolve(bpos, pos / BSIZE_FILE);
+                return (spos == 0) ? 0 : spos + (pos % BSIZE_FILE);
+            }
 
             // Now loop through all of the segment positions.
             uint32_t bcount = 0;
@@ -907,14 +1283,12 @@ namespace AppLib
             {
                 for (int i = hsize; i < BSIZE_FILE; i += 4)
                 {
-                    this->fd->seekg(bpos + i);
                     spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
+                    Endian::doR(this->fd, bpos + i, reinterpret_cast < char *>(&spos), 4);
                     if (spos == 0)
                     {
                         // Invalid segment position (i.e. there are
                         // no more segments available).
-                        this->fd->seekg(oldg);
                         return 0;
                     }
 
@@ -927,13 +1301,11 @@ namespace AppLib
                     else if (bcount < pos && bcount + 4096 > pos)
                     {
                         // This is our target block.
-                        this->fd->seekg(oldg);
                         return spos + (pos - bcount);
                     }
                     else
                     {
                         // We're past our target block.
-                        this->fd->seekg(oldg);
                         return 0;
                     }
                 }
@@ -945,11 +1317,10 @@ namespace AppLib
             }
 
             // Unable to locate the position within the file.
-            this->fd->seekg(oldg);
             return 0;
         }
 
-        int32_t FS::resolvePathnameToINodeID(std::string path)
+        int32_t FS::resolvePathnameToINodeID(const std::string& path)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -999,13 +1370,111 @@ namespace AppLib
             return id;
         }
 
-        FSResult::FSResult FS::truncateFile(uint16_t inodeid, uint32_t len)
+        FSResult::FSResult FS::relocateFileBlocks(uint16_t id, uint32_t start, const std::vector < uint32_t > & positions)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            uint32_t bpos = this->getINodePositionByID(id);
+            if (bpos == 0)
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            if (!(this->getINodeByPosition(bpos).flags & INodeLayout::File::FLAG_EXTENTS))
+                return FSResult::E_FAILURE_NOT_IMPLEMENTED;
+
+            // Split the extents around the relocated blocks, then merge
+            // any that have become adjacent.
+            std::vector < Extent > extents;
+            FSResult::FSResult res = this->extents->load(bpos, extents);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+            uint32_t end = start + positions.size();
+            std::vector < Extent > result;
+            for (unsigned int i = 0; i < extents.size(); i += 1)
+            {
+                const Extent & extent = extents[i];
+                for (uint32_t b = extent.start; b < extent.start + extent.length; b += 1)
+                {
+                    uint32_t pos = (b >= start && b < end) ? positions[b - start] : extent.pos + (b - extent.start) * BSIZE_FILE;
+                    if (!result.empty() && result.back().start + result.back().length == b &&
+                            result.back().pos + (uint64_t) result.back().length * BSIZE_FILE == pos)
+                    {
+                        result.back().length += 1;
+                        continue;
+                    }
+                    Extent next;
+                    next.start = b;
+                    next.pos = pos;
+                    next.length = 1;
+                    result.push_back(next);
+                }
+            }
+
+            res = this->extents->store(bpos, result, 0);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+            this->generations[id] += 1;
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::relocateINode(uint16_t id, uint32_t pos)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            // The root directory is also referenced by the FSInfo block.
+            uint32_t old = this->getINodePositionByID(id);
+            if (old == 0)
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            if (id == 0)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+
+            char block[BSIZE_FILE];
+            if (this->fd->readAt(old, block, BSIZE_FILE) != BSIZE_FILE ||
+                    this->fd->writeAt(pos, block, BSIZE_FILE) != BSIZE_FILE)
+                return FSResult::E_FAILURE_GENERAL;
+            FSResult::FSResult res = this->setINodePositionByID(id, pos);
+            this->inodecache->removeAtPosition(old);
+            return res;
+        }
+
+        bool FS::compact(uint32_t budget)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            if (this->fd->isReadOnly())
+                return true;
+            if (this->compactor == NULL)
+                this->compactor = new Compactor(this, this->freelist, this->fd);
+
+            // The compactor uses the free list directly.
+            pthread_mutex_lock(&this->allocator);
+            bool finished = this->compactor->step(budget);
+            pthread_mutex_unlock(&this->allocator);
+            return finished;
+        }
+
+        CompactorStatistics FS::getCompactorStatistics()
+        {
+            if (this->compactor == NULL)
+            {
+                CompactorStatistics stats;
+                memset(&stats, 0, sizeof(CompactorStatistics));
+                return stats;
+            }
+            return this->compactor->getStatistics();
+        }
+
+        uint32_t FS::getFileGeneration(uint16_t id)
+        {
+            return this->generations[id];
+        }
+
+        uint32_t FS::getINodeGeneration(uint16_t id)
+        {
+            return __atomic_load_n(&this->inodeGenerations[id], __ATOMIC_RELAXED);
+        }
+
+        FSResult::FSResult FS::truncateFile(uint16_t inodeid, uint32_t len, std::vector < uint32_t > * blocks)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             // Get the base position of the specified inode.
             uint32_t bpos = this->getINodePositionByID(inodeid);
@@ -1016,6 +1485,9 @@ namespace AppLib
                 node.type != INodeType::INT_SYMLINK)
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
+            if (node.flags & INodeLayout::File::FLAG_EXTENTS)
+                return this->truncateExtentFile(inodeid, bpos, node, len, blocks);
+
             if (node.dat_len == len)
                 return FSResult::E_SUCCESS;
             else if (node.dat_len > len)
@@ -1033,9 +1505,8 @@ namespace AppLib
                 {
                     for (int i = hsize; i < BSIZE_FILE; i += 4)
                     {
-                        this->fd->seekg(bpos + i);
                         spos = 0;
-                        Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
+                        Endian::doR(this->fd, bpos + i, reinterpret_cast < char *>(&spos), 4);
                         if (spos == 0)
                         {
                             // We've run out of segments to erase.
@@ -1047,8 +1518,7 @@ namespace AppLib
                         {
                             // First remove the block from the file segment list.
                             uint32_t zeropos = 0;
-                            this->fd->seekp(bpos + i);
-                            Endian::doW(this->fd, reinterpret_cast < char *>(&zeropos), 4);
+                            Endian::doW(this->fd, bpos + i, reinterpret_cast < char *>(&zeropos), 4);
 
                             // Next use resetBlock to erase the data in it (this also
                             // frees it in the FreeList).
@@ -1063,14 +1533,18 @@ namespace AppLib
                         INode inode = this->getINodeByPosition(ipos);
                         if (inode.type != INodeType::INT_SEGINFO)
                         {
-                            this->fd->seekg(oldg);
-                            this->fd->seekp(oldp);
                             return FSResult::E_FAILURE_INODE_NOT_VALID;
                         }
                         ipos = inode.info_next;
                     }
                 }
 
+                // The deleted blocks may be reused by any file, so every
+                // other map of this file is now stale.
+                this->generations[inodeid] += 1;
+                if (blocks != NULL && blocks->size() > node.blocks - blocks_to_delete)
+                    blocks->resize(node.blocks - blocks_to_delete);
+
                 // Now set the file's data length.
                 FSResult::FSResult res = this->setFileLengthDirect(bpos, len);
                 if (res != FSResult::E_SUCCESS)
@@ -1081,9 +1555,18 @@ namespace AppLib
                 if (res != FSResult::E_SUCCESS)
                     return res;
 
+                // An empty file has nothing left in its segment list, so
+                // switch it over to an (empty) extent tree.
+                if (len == 0 && this->raiseVersion())
+                {
+                    char root[4] = { 0 };
+                    uint16_t flags = node.flags | INodeLayout::File::FLAG_EXTENTS;
+                    this->fd->writeAt(bpos + INodeLayout::File::ROOT_COUNT, root, sizeof(root));
+                    Endian::doW(this->fd, bpos + INodeLayout::File::FLAGS, reinterpret_cast < char *>(&flags), 2);
+                    this->inodecache->modifyAtPosition(bpos, [&](INode& node) { node.flags = flags; });
+                }
+
                 // We successfully truncated the file.
-                this->fd->seekg(oldg);
-                this->fd->seekp(oldp);
                 return FSResult::E_SUCCESS;
             }
             else if (node.dat_len < len)
@@ -1101,30 +1584,36 @@ namespace AppLib
                 // Now loop through all of the segment positions.
                 uint32_t bcount = 0;
                 uint32_t spos = 0;
+                uint32_t lpos = 0;
                 uint32_t ipos = bpos;
                 uint32_t hsize = HSIZE_FILE;
                 while (ipos != 0)
                 {
                     for (int i = hsize; i < BSIZE_FILE; i += 4)
                     {
-                        this->fd->seekg(bpos + i);
                         spos = 0;
-                        Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
+                        Endian::doR(this->fd, bpos + i, reinterpret_cast < char *>(&spos), 4);
                         if (spos != 0)
                         {
                             // We don't want to touch this position since it already
                             // points to an existing segment.
+                            lpos = spos;
                             continue;
                         }
 
                         if (bcount < blocks_to_add)
                         {
-                            // Allocate a new block.
-                            uint32_t npos = this->freelist->allocateBlock();
+                            // Allocate a new block, as close as possible to
+                            // the one before it in the file.
+                            pthread_mutex_lock(&this->allocator);
+                            uint32_t npos = this->freelist->allocateBlock((lpos != 0) ? lpos + BSIZE_FILE : bpos);
+                            pthread_mutex_unlock(&this->allocator);
+                            lpos = npos;
 
                             // Now add it to the file segment list.
-                            this->fd->seekp(bpos + i);
-                            Endian::doW(this->fd, reinterpret_cast < char *>(&npos), 4);
+                            Endian::doW(this->fd, bpos + i, reinterpret_cast < char *>(&npos), 4);
+                            if (blocks != NULL)
+                                blocks->push_back(npos);
                         }
                         else
                         {
@@ -1140,8 +1629,6 @@ namespace AppLib
                         INode inode = this->getINodeByPosition(ipos);
                         if (inode.type != INodeType::INT_SEGINFO)
                         {
-                            this->fd->seekg(oldg);
-                            this->fd->seekp(oldp);
                             return FSResult::E_FAILURE_INODE_NOT_VALID;
                         }
                         ipos = inode.info_next;
@@ -1154,8 +1641,6 @@ namespace AppLib
                     return res;
 
                 // We successfully truncated the file.
-                this->fd->seekg(oldg);
-                this->fd->seekp(oldp);
                 return FSResult::E_SUCCESS;
             }
 
@@ -1163,18 +1648,106 @@ namespace AppLib
             return FSResult::E_FAILURE_UNKNOWN;
         }
 
+        FSResult::FSResult FS::truncateExtentFile(uint16_t inodeid, uint32_t bpos, const INode& node,
+                uint32_t len, std::vector < uint32_t > * blocks)
+        {
+            std::vector < Extent > extents;
+            FSResult::FSResult res = this->extents->load(bpos, extents);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+
+            uint32_t have = 0;
+            for (unsigned int i = 0; i < extents.size(); i += 1)
+                have += extents[i].length;
+            uint32_t want = (len + (uint64_t) BSIZE_FILE - 1) / BSIZE_FILE;
+            size_t from = extents.empty() ? 0 : extents.size() - 1;
+
+            if (want < have)
+            {
+                // The freed blocks may be reused by any file, so every
+                // other map of this file is now stale.
+                this->generations[inodeid] += 1;
+                if (blocks != NULL && blocks->size() > want)
+                    blocks->resize(want);
+
+                // Free blocks from the end of the file.
+                std::vector < uint32_t > dropped;
+                while (have > want)
+                {
+                    Extent & last = extents.back();
+                    uint32_t drop = std::min < uint32_t > (last.length, have - want);
+                    for (uint32_t i = 0; i < drop; i += 1)
+                        dropped.push_back(last.pos + (last.length - 1 - i) * BSIZE_FILE);
+                    last.length -= drop;
+                    have -= drop;
+                    if (last.length == 0)
+                        extents.pop_back();
+                }
+                this->resetBlocks(dropped);
+                from = extents.empty() ? 0 : extents.size() - 1;
+            }
+            else if (want > have)
+            {
+                // Add blocks to the end of the file in as few runs as the
+                // free list allows, extending the last extent whenever a
+                // new block directly follows it.
+                std::vector < uint32_t > fresh;
+                uint32_t hint = extents.empty() ? bpos : extents.back().pos + extents.back().length * BSIZE_FILE;
+                pthread_mutex_lock(&this->allocator);
+                this->freelist->allocateBlocks(want - have, fresh, hint);
+                pthread_mutex_unlock(&this->allocator);
+                size_t limit = (size_t) ExtentTree::ROOT_MAX * ExtentTree::LEAF_MAX;
+                for (unsigned int i = 0; i < fresh.size(); i += 1)
+                {
+                    uint32_t npos = fresh[i];
+                    if (!extents.empty() && extents.back().pos + (uint64_t) extents.back().length * BSIZE_FILE == npos)
+                        extents.back().length += 1;
+                    else if (extents.size() < limit)
+                    {
+                        Extent extent;
+                        extent.start = have;
+                        extent.pos = npos;
+                        extent.length = 1;
+                        extents.push_back(extent);
+                    }
+                    else
+                    {
+                        // The file is too fragmented for the tree, so give
+                        // back the blocks that can't be addressed.
+                        pthread_mutex_lock(&this->allocator);
+                        for (unsigned int j = i; j < fresh.size(); j += 1)
+                            this->freelist->freeBlock(fresh[j]);
+                        pthread_mutex_unlock(&this->allocator);
+                        break;
+                    }
+                    if (blocks != NULL)
+                        blocks->push_back(npos);
+                    have += 1;
+                }
+            }
+
+            res = this->extents->store(bpos, extents, from);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+
+            // If we couldn't allocate everything, keep what we did.
+            if (have < want)
+            {
+                this->setFileLengthDirect(bpos, std::max < uint32_t > (node.dat_len, have * BSIZE_FILE));
+                return FSResult::E_FAILURE_PARTIAL_TRUNCATION;
+            }
+            return this->setFileLengthDirect(bpos, len);
+        }
+
         FSResult::FSResult FS::allocateInfoListBlocks(uint32_t pos, uint32_t len)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_info_next_offset = 302;
-            signed int info_info_next_offset = 4;
+            signed int file_info_next_offset = INodeLayout::File::INFO_NEXT;
+            signed int info_info_next_offset = INodeLayout::SegInfo::INFO_NEXT;
             signed int segments_in_file_block = (BSIZE_FILE - HSIZE_FILE) / 4;
             signed int segments_in_info_block = (BSIZE_FILE - HSIZE_SEGINFO) / 4;
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
 
             // Get the INode.
             INode node = this->getINodeByPosition(pos);
@@ -1220,13 +1793,11 @@ namespace AppLib
                 // the list using I/O).
                 std::vector < uint32_t > list_positions;
                 uint32_t lpos = 0;
-                this->fd->seekg(pos + file_info_next_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
+                Endian::doR(this->fd, pos + file_info_next_offset, reinterpret_cast < char *>(&lpos), 4);
                 while (lpos != 0)
                 {
                     list_positions.insert(list_positions.begin(), lpos);
-                    this->fd->seekg(lpos + info_info_next_offset);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
+                    Endian::doR(this->fd, lpos + info_info_next_offset, reinterpret_cast < char *>(&lpos), 4);
                 }
 
                 // Now delete the info list blocks.
@@ -1247,9 +1818,9 @@ namespace AppLib
                     }
 
                     // Erase the link from the previous info block to this one.
-                    this->fd->seekp(ppos + poff);
                     uint32_t zeropos = 0;
-                    Endian::doW(this->fd, reinterpret_cast < char *>(&zeropos), 4);
+                    Endian::doW(this->fd, ppos + poff, reinterpret_cast < char *>(&zeropos), 4);
+                    this->inodecache->removeAtPosition(ppos);
 
                     // Now erase the block.
                     this->resetBlock(dpos);
@@ -1265,20 +1836,20 @@ namespace AppLib
                 // allocated block.
                 uint32_t lpos = 0;
                 uint32_t ppos = 0;
-                this->fd->seekg(pos + file_info_next_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
+                Endian::doR(this->fd, pos + file_info_next_offset, reinterpret_cast < char *>(&lpos), 4);
                 while (lpos != 0)
                 {
                     ppos = lpos;
-                    this->fd->seekg(lpos + info_info_next_offset);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
+                    Endian::doR(this->fd, lpos + info_info_next_offset, reinterpret_cast < char *>(&lpos), 4);
                 }
 
                 // Now allocate as many blocks as we need.
                 while (tilcount > cilcount)
                 {
-                    // Get a new block.
-                    uint32_t npos = this->freelist->allocateBlock();
+                    // Get a new block, next to the previous one if possible.
+                    pthread_mutex_lock(&this->allocator);
+                    uint32_t npos = this->freelist->allocateBlock(((ppos != 0) ? ppos : pos) + BSIZE_FILE);
+                    pthread_mutex_unlock(&this->allocator);
 
                     // Set a link from the previous block to the new one.
                     uint32_t poff = 0;
@@ -1290,8 +1861,8 @@ namespace AppLib
                     else
                         poff = info_info_next_offset;
 
-                    this->fd->seekp(ppos + poff);
-                    Endian::doW(this->fd, reinterpret_cast < char *>(&npos), 4);
+                    Endian::doW(this->fd, ppos + poff, reinterpret_cast < char *>(&npos), 4);
+                    this->inodecache->removeAtPosition(ppos);
 
                     ppos = npos;
                     cilcount += 1;
@@ -1322,55 +1893,45 @@ namespace AppLib
                 return temporary_position;
 
             uint32_t block_position = OFFSET_DATA + 2;
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            std::streampos end = this->fd->size();
 
             // Run through each of the blocks and check to see whether
             // they are a temporary block or not.
-            this->fd->seekg(block_position);
             uint16_t type_stor = INodeType::INT_UNSET;
-            uint32_t cpos = this->fd->tellg();
-            while (!this->fd->eof() && cpos == block_position && !this->freelist->isBlockFree(cpos))
+            while (block_position < end && !this->freelist->isBlockFree(block_position))
             {
                 // FIXME: What the hell is this doing??!?!
-                Endian::doR(this->fd, reinterpret_cast < char *>(&type_stor), 2);
+                Endian::doR(this->fd, block_position, reinterpret_cast < char *>(&type_stor), 2);
                 switch (type_stor)
                 {
                     case INodeType::INT_DIRECTORY:
                         block_position += BSIZE_DIRECTORY;
-                        this->fd->seekg(block_position);
                         break;
                     case INodeType::INT_FILEINFO:
                     case INodeType::INT_SEGINFO:
                         block_position += BSIZE_FILE;
-                        this->fd->seekg(block_position);
                         break;
                     case INodeType::INT_INVALID:
-                        this->fd->seekg(oldg);
                         return 0;
                     case INodeType::INT_TEMPORARY:
-                        this->fd->seekg(oldg);
                         temporary_position = block_position + 2;
                         return block_position + 2;
                     case INodeType::INT_UNSET:
                         break;
                     default:
-                        this->fd->seekg(oldg);
                         return 0;
                 }
             }
-            this->fd->seekg(oldg);
 
             // No temporary block allocated; allocate a new one.
             uint32_t newpos = this->getFirstFreeBlock(INodeType::INT_FILEINFO);
             if (newpos == 0)
                 return 0;
-            Util::seekp_ex(this->fd, newpos);
             uint16_t zeroid = 0;
             uint16_t tempid = INodeType::INT_TEMPORARY;
-            Endian::doW(this->fd, reinterpret_cast < char *>(&zeroid), 2);
-            Endian::doW(this->fd, reinterpret_cast < char *>(&tempid), 2);
-            Util::seekp_ex(this->fd, oldp);
+            Endian::doW(this->fd, newpos, reinterpret_cast < char *>(&zeroid), 2);
+            Endian::doW(this->fd, newpos + INodeLayout::TYPE, reinterpret_cast < char *>(&tempid), 2);
+            this->inodecache->removeAtPosition(newpos);
             newpos += 4;
             temporary_position = newpos;
             return newpos;
@@ -1380,21 +1941,34 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
+            INodeCacheStatistics stats = this->inodecache->getStatistics();
+            Logging::showDebugW("INODECACHE: %llu hits, %llu misses, %llu evictions.",
+                    (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+                    (unsigned long long) stats.evictions);
+            this->inodecache->clear();
+            this->dirindex->clear();
+            if (this->compactor != NULL)
+                this->compactor->abandon();
+            this->discardFreeBlocks();
+            this->freelist->close();
+
             // Close the file stream.
             this->fd->close();
         }
 
+        INodeCacheStatistics FS::getINodeCacheStatistics()
+        {
+            return this->inodecache->getStatistics();
+        }
+
         void FS::reserveINodeID(uint16_t id)
         {
-            this->reservedINodes.insert(this->reservedINodes.end(), id);
+            this->inodesReserved[id / 64] |= (1ULL << (id % 64));
         }
 
         void FS::unreserveINodeID(uint16_t id)
         {
-            std::vector<uint16_t>::iterator it =
-                std::find(this->reservedINodes.begin(), this->reservedINodes.end(), id);
-            if (it != this->reservedINodes.end())
-                this->reservedINodes.erase(it);
+            this->inodesReserved[id / 64] &= ~(1ULL << (id % 64));
         }
 
         LowLevel::FSResult::FSResult FS::checkINodePositionIsValid(int pos)
@@ -1431,5 +2005,18 @@ namespace AppLib
                 node.ctime = APPFS_TIME();
             this->updateINode(node);
         }
+
+        void FS::lockINode(uint16_t id, bool exclusive)
+        {
+            if (exclusive)
+                pthread_rwlock_wrlock(&this->inodeLocks[id % INODE_LOCKS]);
+            else
+                pthread_rwlock_rdlock(&this->inodeLocks[id % INODE_LOCKS]);
+        }
+
+        void FS::unlockINode(uint16_t id)
+        {
+            pthread_rwlock_unlock(&this->inodeLocks[id % INODE_LOCKS]);
+        }
     }
 }
@@ -10,6 +10,12 @@ namespace AppLib
     namespace LowLevel
     {
         class FS;
+        class INodeCache;
+        class DirectoryIndex;
+        class ExtentTree;
+        class Compactor;
+        struct INodeCacheStatistics;
+        struct CompactorStatistics;
     }
 }
 
@@ -19,6 +25,7 @@ namespace AppLib
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <pthread.h>
 #include <libpackaged-fs/lowlevel/endian.h>
 #include <libpackaged-fs/fsfile.h>
 #include <libpackaged-fs/lowlevel/blockstream.h>
@@ -33,7 +40,10 @@ namespace AppLib
         class FS
         {
         public:
-            FS(LowLevel::BlockStream * fd);
+            //! Opens the package in fd.  Unless journal is false, a
+            //! writable package that has no metadata journal is given one.
+            FS(LowLevel::BlockStream * fd, bool journal = true);
+            ~FS();
 
             //! Returns whether the file descriptor is valid.  If this
             //! is false, and you call one of the functions in the class
@@ -44,14 +54,14 @@ namespace AppLib
 
             //! Writes an INode to the specified position and then
             //! updates the inode lookup table.
-            FSResult::FSResult writeINode(uint32_t pos, INode node);
+            FSResult::FSResult writeINode(uint32_t pos, const INode& node);
 
             //! Updates an INode.  The node must exist in the inode
             //! position lookup table.
-            FSResult::FSResult updateINode(INode node);
+            FSResult::FSResult updateINode(const INode& node);
 
             //! Updates a raw INode (such as a freelist block).
-            FSResult::FSResult updateRawINode(INode node, uint32_t pos);
+            FSResult::FSResult updateRawINode(const INode& node, uint32_t pos);
 
             //! Retrieves an INode by an ID.
             INode getINodeByID(uint16_t id);
@@ -81,8 +91,11 @@ namespace AppLib
             //! INT_FILE or INT_DIRECTORY to indicate the number of sequential free
             //! blocks to find.  A return value of 0 indicates that the file was either
             //! at the maximum filesize, or the function could not otherwise find
-            //! a free block.
-            uint32_t getFirstFreeBlock(INodeType::INodeType type);
+            //! a free block.  If a hint position is given (such as the parent
+            //! directory's inode, or the block after the last one in a file), the
+            //! free block closest to it is used instead, to keep related blocks
+            //! together in the package.
+            uint32_t getFirstFreeBlock(INodeType::INodeType type, uint32_t hint = 0);
 
             //! Find the first free inode number and return it.  A return value of 0
             //! indicates that there are no free inode numbers available (we can use
@@ -104,7 +117,17 @@ namespace AppLib
             //! Returns whether or not a specified filename is unique
             //! inside a directory.  E_SUCCESS indicates unique, E_FAILURE_NOT_UNIQUE
             //! indicates not unique.
-            FSResult::FSResult filenameIsUnique(uint16_t parentid, std::string filename);
+            FSResult::FSResult filenameIsUnique(uint16_t parentid, const std::string& filename);
+
+            //! Returns the IDs of the children of the specified directory
+            //! (empty if it is not a directory), read straight from disk.
+            std::vector < uint16_t > getChildIDsOfDirectory(uint16_t parentid);
+
+            //! Returns the child slots of the specified directory from
+            //! slot start onwards, with 0 for empty slots (or nothing if
+            //! it is not a directory).  A child keeps its slot until it
+            //! is removed, so slots can be used to resume a listing.
+            std::vector < uint16_t > getChildSlotsOfDirectory(uint16_t parentid, uint16_t start);
 
             //! Returns an std::vector<INode> list of children within
             //! the specified directory.
@@ -114,10 +137,16 @@ namespace AppLib
              * INode id (or filename) within the specified directory.  Returns an
              * inode with type INodeType::INT_INVALID if it is unable to find
              * the specified child, or if the parent inode is invalid (i.e. not
-             * a directory).
+             * a directory).  Lookups by filename go through an in-memory index
+             * of the directory, which is built the first time it is searched.
              */
             INode getChildOfDirectory(uint16_t parentid, uint16_t childid);
-            INode getChildOfDirectory(uint16_t parentid, std::string filename);
+            INode getChildOfDirectory(uint16_t parentid, const std::string& filename);
+
+            //! Returns the ID stored in the specified directory for the child
+            //! with the specified filename, without resolving hardlinks.  A
+            //! return value of 0 indicates that there is no such child.
+            uint16_t getChildIDOfDirectory(uint16_t parentid, const std::string& filename);
 
             //! Sets a file's contents (replacing the current contents).
             FSResult::FSResult setFileContents(uint16_t id, const char *data, uint32_t len);
@@ -137,6 +166,26 @@ namespace AppLib
             //! This function returns the position of the next block for file data after the current block.
             uint32_t getFileNextBlock(uint16_t id, uint32_t pos);
 
+            //! Resolves a range of a file's data blocks to their positions in the disk image.
+            /*!
+             * Appends the positions of up to count data blocks, starting
+             * with the block at index start within the file, to out.
+             * Each segment list block (or the whole extent tree) is read
+             * with a single call, so a
+             * whole read can be resolved before any data is transferred.
+             * Fewer than count positions are appended if the file has
+             * fewer blocks allocated.
+             */
+            FSResult::FSResult getFileBlocks(uint16_t id, uint32_t start, uint32_t count, std::vector < uint32_t > & out);
+
+            //! Appends the positions of all of the blocks used by an inode.
+            /*!
+             * This is the inode block itself and, for files and symlinks,
+             * their data blocks along with the segment list or extent
+             * blocks that address them.  Hardlinks are not resolved.
+             */
+            FSResult::FSResult getINodeBlocks(uint16_t id, std::vector < uint32_t > & out);
+
             //! Erase a specified block, marking it as free in the free list.
             /*!
              * @note This simply erases BSIZE_FILE bytes from the specified
@@ -145,14 +194,74 @@ namespace AppLib
              */
             FSResult::FSResult resetBlock(uint32_t pos);
 
+            //! Erases all of the specified blocks, as resetBlock does, but
+            //! records them in the free space bitmap with a single write.
+            FSResult::FSResult resetBlocks(const std::vector < uint32_t > & positions);
+
+            //! Gives the space of the blocks freed so far back to the host
+            //! filesystem.
+            /*!
+             * Blocks are collected as they are freed and released in
+             * batches of DISCARD_BATCH, skipping any that have been used
+             * again in the meantime.  When the package has a journal they
+             * are only released when this is called, since it commits the
+             * changes that freed them first; otherwise the block cache is
+             * written back first.  This also cuts off the free blocks at
+             * the end of the package.  close() calls it as well.
+             */
+            void discardFreeBlocks();
+
+            //! Shrinks the package to exclude the free blocks at the end
+            //! of it, returning the number of bytes released.
+            uint32_t truncateFreeTail();
+
             //! Resolves a position in a file to a position in the disk image.
             uint32_t resolvePositionInFile(uint16_t inodeid, uint32_t pos);
 
             //! Resolve a pathname into an inode id.
-            int32_t resolvePathnameToINodeID(std::string path);
+            int32_t resolvePathnameToINodeID(const std::string& path);
 
             //! Sets the length of a file, allocating or erasing blocks / data where necessary.
-            FSResult::FSResult truncateFile(uint16_t inodeid, uint32_t len);
+            /*!
+             * If blocks is given, it must hold the positions of all of the
+             * file's data blocks; it is updated to match the new length.
+             */
+            FSResult::FSResult truncateFile(uint16_t inodeid, uint32_t len, std::vector < uint32_t > * blocks = NULL);
+
+            //! Points data blocks of a file at new positions.
+            /*!
+             * The blocks of the file starting at index start are set to the
+             * positions given, which must already be allocated and hold a
+             * copy of the data.  Only extent-based files are supported.
+             * The old blocks are not freed.
+             */
+            FSResult::FSResult relocateFileBlocks(uint16_t id, uint32_t start, const std::vector < uint32_t > & positions);
+
+            //! Copies an inode to the (already allocated) block at pos and
+            //! updates the lookup table to match.  The old block is not freed.
+            FSResult::FSResult relocateINode(uint16_t id, uint32_t pos);
+
+            //! Performs a step of defragmenting and shrinking the package.
+            /*!
+             * At most budget blocks are moved (or inodes inspected) by each
+             * call, so this may be called in between other operations on
+             * the package.  Returns true once a full pass has been completed;
+             * the next call starts another.  Does nothing on read-only packages.
+             */
+            bool compact(uint32_t budget);
+
+            //! Returns the compaction counters.
+            CompactorStatistics getCompactorStatistics();
+
+            //! Returns a counter that changes whenever the data blocks of a
+            //! file are freed or reassigned, so that a block map of the file
+            //! held elsewhere can tell when it is stale.
+            uint32_t getFileGeneration(uint16_t id);
+
+            //! Returns a counter that changes whenever an inode ID is freed,
+            //! so that an inode that is later given the same ID can be told
+            //! apart from the one that had it before.
+            uint32_t getINodeGeneration(uint16_t id);
 
             //! Allocates or frees enough blocks so that there is enough segment list blocks
             //! available to address all of the segments.
@@ -185,6 +294,9 @@ namespace AppLib
             //! Closes the filesystem.
             void close();
 
+            //! Returns the inode cache counters.
+            INodeCacheStatistics getINodeCacheStatistics();
+
             //! Reserves an INode ID for future use without require the INode to actually be
             //! written to disk.
             void reserveINodeID(uint16_t id);
@@ -195,6 +307,18 @@ namespace AppLib
             //! Update times on an inode.
             void updateTimes(uint16_t id, bool atime, bool mtime, bool ctime);
 
+            //! Locks an inode for reading (shared) or writing (exclusive).
+            /*!
+             * Nothing in this class takes these locks itself; they are
+             * for callers that access the same inode from several
+             * threads.  Inodes share INODE_LOCKS locks between them, so
+             * a thread must not hold more than one at a time.
+             */
+            void lockINode(uint16_t id, bool exclusive);
+
+            //! Releases a lock taken with lockINode.
+            void unlockINode(uint16_t id);
+
             //! Checks whether the specified position is valid.
             static LowLevel::FSResult::FSResult checkINodePositionIsValid(int pos);
 
@@ -205,7 +329,68 @@ namespace AppLib
         private:
             LowLevel::BlockStream * fd;
             LowLevel::FreeList * freelist;
-            std::vector<uint16_t> reservedINodes;
+            LowLevel::INodeCache * inodecache;
+            LowLevel::DirectoryIndex * dirindex;
+            LowLevel::ExtentTree * extents;
+            LowLevel::Compactor * compactor;
+
+            // Serializes use of the free list and the queue of blocks to
+            // discard, so that files can grow and shrink on several
+            // threads at once.  It is recursive since freeing blocks can
+            // cut off the end of the package, which allocates again.
+            pthread_mutex_t allocator;
+
+            // The locks handed out by lockINode.
+            pthread_rwlock_t inodeLocks[INODE_LOCKS];
+
+            // The inode lookup table (in host byte order) and bitmaps of
+            // the IDs that are assigned in it and that are reserved.
+            uint32_t lookup[INODE_MAX];
+            uint64_t inodesUsed[INODE_BITMAP_WORDS];
+            uint64_t inodesReserved[INODE_BITMAP_WORDS];
+
+            // The generation of each file's block layout, and of each
+            // inode ID.
+            uint32_t generations[INODE_MAX];
+            uint32_t inodeGenerations[INODE_MAX];
+
+            // The blocks freed since their space was last released.
+            std::vector < uint32_t > discards;
+
+            // Whether the FSInfo block already has the format version that
+            // extent trees need.
+            bool versioned;
+
+            // Returns false (after logging why) if the package has a newer
+            // format version than this library can read.
+            bool checkVersion();
+
+            // Raises the format version of the package, before a file that
+            // uses an extent tree is first written to it.
+            bool raiseVersion();
+
+            // Records a freed block to be released by discardFreeBlocks,
+            // releasing the batch once it is full.
+            void queueDiscard(uint32_t pos);
+
+            // Reads the inode lookup table into memory.
+            void loadLookupTable();
+
+            // Replays the metadata journal and starts using it, and on
+            // writable packages without one, sets one up.  The journal
+            // has to be replayed before anything else is read, but can
+            // only be created once the free space bitmap is loaded.
+            // Returns false if the package can't be read without the
+            // journal, but it couldn't be read.
+            bool recoverJournal();
+            void createJournal();
+
+            // Builds the filename index of a directory's children.
+            FSResult::FSResult indexDirectory(uint16_t parentid);
+
+            // Sets the length of an extent-based file.
+            FSResult::FSResult truncateExtentFile(uint16_t inodeid, uint32_t bpos, const INode& node,
+                    uint32_t len, std::vector < uint32_t > * blocks);
         };
     }
 }
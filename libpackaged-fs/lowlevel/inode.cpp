@@ -4,11 +4,25 @@
 
 #include <libpackaged-fs/lowlevel/inodetype.h>
 #include <libpackaged-fs/lowlevel/inode.h>
+#include <libpackaged-fs/lowlevel/inodelayout.h>
+#include <libpackaged-fs/lowlevel/endian.h>
+#include <string.h>
+#include <algorithm>
 
 namespace AppLib
 {
     namespace LowLevel
     {
+        INodeFSInfo::INodeFSInfo()
+        {
+            for (uint16_t i = 0; i < 10; i += 1)
+                this->fs_name[i] = FS_NAME[i];
+            memset(this->app_name, 0, sizeof(this->app_name));
+            memset(this->app_ver, 0, sizeof(this->app_ver));
+            memset(this->app_desc, 0, sizeof(this->app_desc));
+            memset(this->app_author, 0, sizeof(this->app_author));
+        }
+
         INode::INode(uint16_t id, const char *filename, INodeType::INodeType type, uint16_t uid, uint16_t gid, uint16_t mask, uint64_t atime, uint64_t mtime, uint64_t ctime)
         {
             this->inodeid = id;
@@ -22,6 +36,7 @@ namespace AppLib
             this->ctime = ctime;
             this->dat_len = 0;
             this->info_next = 0;
+            this->flags = 0;
             this->flst_next = 0;
             this->realid = 0;
             this->parent = 0;
@@ -30,25 +45,17 @@ namespace AppLib
             this->rdev = 0;
             this->nlink = 1;	// we only have one reference to this object
             this->blocks = 0;
-            for (uint16_t i = 0; i < DIRECTORY_CHILDREN_MAX; i += 1)
-                this->children[i] = 0;
 
             // FSInfo only
-            for (uint16_t i = 0; i < 10; i += 1)
-                this->fs_name[i] = FS_NAME[i];
             this->ver_major = 0;
             this->ver_minor = 0;
             this->ver_revision = 0;
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_name[i] = '\0';
-            for (uint16_t i = 0; i < 32; i += 1)
-                this->app_ver[i] = '\0';
-            for (uint16_t i = 0; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_author[i] = '\0';
             this->pos_root = 0;
             this->pos_freelist = 0;
+            this->pos_bitmap = 0;
+            this->bmap_gen = 0;
+            this->pos_journal = 0;
+            this->len_journal = 0;
         }
 
         INode::INode(uint16_t id, const char *filename, INodeType::INodeType type)
@@ -64,6 +71,7 @@ namespace AppLib
             this->ctime = 0;
             this->dat_len = 0;
             this->info_next = 0;
+            this->flags = 0;
             this->flst_next = 0;
             this->realid = 0;
             this->parent = 0;
@@ -72,92 +80,261 @@ namespace AppLib
             this->rdev = 0;
             this->nlink = 1;	// we only have one reference to this object
             this->blocks = 0;
-            for (uint16_t i = 0; i < DIRECTORY_CHILDREN_MAX; i += 1)
-                this->children[i] = 0;
 
             // FSInfo only
-            for (uint16_t i = 0; i < 10; i += 1)
-                this->fs_name[i] = FS_NAME[i];
             this->ver_major = 0;
             this->ver_minor = 0;
             this->ver_revision = 0;
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_name[i] = '\0';
-            for (uint16_t i = 0; i < 32; i += 1)
-                this->app_ver[i] = '\0';
-            for (uint16_t i = 0; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_author[i] = '\0';
             this->pos_root = 0;
             this->pos_freelist = 0;
+            this->pos_bitmap = 0;
+            this->bmap_gen = 0;
+            this->pos_journal = 0;
+            this->len_journal = 0;
+        }
+
+        INode::INode(const INode& other)
+        {
+            *this = other;
+        }
+
+        INode& INode::operator=(const INode& other)
+        {
+            if (this == &other)
+                return *this;
+            this->inodeid = other.inodeid;
+            memcpy(this->filename, other.filename, sizeof(this->filename));
+            this->type = other.type;
+            this->uid = other.uid;
+            this->gid = other.gid;
+            this->mask = other.mask;
+            this->atime = other.atime;
+            this->mtime = other.mtime;
+            this->ctime = other.ctime;
+            this->parent = other.parent;
+            this->children_count = other.children_count;
+            this->dev = other.dev;
+            this->rdev = other.rdev;
+            this->nlink = other.nlink;
+            this->blocks = other.blocks;
+            this->dat_len = other.dat_len;
+            this->info_next = other.info_next;
+            this->flags = other.flags;
+            this->flst_next = other.flst_next;
+            this->realid = other.realid;
+            this->realfilename = other.realfilename;
+            this->ver_major = other.ver_major;
+            this->ver_minor = other.ver_minor;
+            this->ver_revision = other.ver_revision;
+            this->pos_root = other.pos_root;
+            this->pos_freelist = other.pos_freelist;
+            this->pos_bitmap = other.pos_bitmap;
+            this->bmap_gen = other.bmap_gen;
+            this->pos_journal = other.pos_journal;
+            this->len_journal = other.len_journal;
+            if (other.fsinfo)
+                this->fsinfo.reset(new INodeFSInfo(*other.fsinfo));
+            else
+                this->fsinfo.reset();
+            return *this;
         }
 
         INode::~INode()
         {
         }
 
-        std::string INode::getBinaryRepresentation()
+        std::string INode::getBinaryRepresentation() const
+        {
+            std::string binary_rep(this->getBinaryLength(), '\0');
+            this->encode(&binary_rep[0]);
+            return binary_rep;
+        }
+
+        unsigned int INode::getBinaryLength() const
         {
-            std::stringstream binary_rep;
-            Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->inodeid), 2);
-            Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->type), 2);
+            switch (this->type)
+            {
+                case INodeType::INT_SEGINFO:
+                    return INodeLayout::SegInfo::LENGTH;
+                case INodeType::INT_FREELIST:
+                    return INodeLayout::FreeList::LENGTH;
+                case INodeType::INT_BITMAP:
+                    return INodeLayout::Bitmap::LENGTH;
+                case INodeType::INT_FSINFO:
+                    return INodeLayout::FSInfo::LENGTH;
+                case INodeType::INT_FILEINFO:
+                case INodeType::INT_SYMLINK:
+                case INodeType::INT_DEVICE:
+                    return INodeLayout::File::LENGTH;
+                case INodeType::INT_DIRECTORY:
+                    return INodeLayout::Directory::CHILDREN;
+                case INodeType::INT_HARDLINK:
+                    return INodeLayout::HardLink::LENGTH;
+                default:
+                    return INodeLayout::CTIME + 8;
+            }
+        }
+
+        void INode::encode(char *out) const
+        {
+            using namespace INodeLayout;
+
+            memset(out, 0, this->getBinaryLength());
+            Endian::store < uint16_t > (out + INODEID, this->inodeid);
+            Endian::store < uint16_t > (out + TYPE, this->type);
             if (this->type == INodeType::INT_SEGINFO)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->info_next), 4);
-                 return binary_rep.str();
+                Endian::store < uint32_t > (out + SegInfo::INFO_NEXT, this->info_next);
+                return;
             }
             else if (this->type == INodeType::INT_FREELIST)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->flst_next), 4);
-                return binary_rep.str();
+                Endian::store < uint32_t > (out + FreeList::FLST_NEXT, this->flst_next);
+                return;
+            }
+            else if (this->type == INodeType::INT_BITMAP)
+            {
+                Endian::store < uint32_t > (out + Bitmap::BMAP_NEXT, this->flst_next);
+                return;
             }
             else if (this->type == INodeType::INT_FSINFO)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->fs_name), 10);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_major), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_minor), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_revision), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_name), 256);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_ver), 32);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_desc), 1024);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_author), 256);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->pos_root), 4);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->pos_freelist), 4);
-                return binary_rep.str();
+                const INodeFSInfo& info = this->getFSInfo();
+                memcpy(out + FSInfo::NAME, info.fs_name, 10);
+                Endian::store < uint16_t > (out + FSInfo::VER_MAJOR, this->ver_major);
+                Endian::store < uint16_t > (out + FSInfo::VER_MINOR, this->ver_minor);
+                Endian::store < uint16_t > (out + FSInfo::VER_REVISION, this->ver_revision);
+                memcpy(out + FSInfo::APP_NAME, info.app_name, 256);
+                memcpy(out + FSInfo::APP_VER, info.app_ver, 32);
+                memcpy(out + FSInfo::APP_DESC, info.app_desc, 1024);
+                memcpy(out + FSInfo::APP_AUTHOR, info.app_author, 256);
+                Endian::store < uint32_t > (out + FSInfo::POS_ROOT, this->pos_root);
+                Endian::store < uint32_t > (out + FSInfo::POS_FREELIST, this->pos_freelist);
+                Endian::store < uint32_t > (out + FSInfo::POS_BITMAP, this->pos_bitmap);
+                Endian::store < uint32_t > (out + FSInfo::BMAP_GEN, this->bmap_gen);
+                Endian::store < uint32_t > (out + FSInfo::POS_JOURNAL, this->pos_journal);
+                Endian::store < uint32_t > (out + FSInfo::LEN_JOURNAL, this->len_journal);
+                return;
             }
             if ((this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_DEVICE) && this->realid != 0)
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->realfilename), 256);
+                memcpy(out + FILENAME, this->realfilename.c_str(), std::min < size_t > (this->realfilename.length(), FILENAME_LENGTH - 1));
             else
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->filename), 256);
+                memcpy(out + FILENAME, this->filename, FILENAME_LENGTH);
 
             if (this->type != INodeType::INT_HARDLINK)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->uid), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->gid), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->mask), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->atime), 8);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->mtime), 8);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ctime), 8);
+                Endian::store < uint16_t > (out + UID, this->uid);
+                Endian::store < uint16_t > (out + GID, this->gid);
+                Endian::store < uint16_t > (out + MASK, this->mask);
+                Endian::store < uint64_t > (out + ATIME, this->atime);
+                Endian::store < uint64_t > (out + MTIME, this->mtime);
+                Endian::store < uint64_t > (out + CTIME, this->ctime);
             }
             if (this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_SYMLINK || this->type == INodeType::INT_DEVICE)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->dev), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->rdev), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->nlink), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->blocks), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->dat_len), 4);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->info_next), 4);
+                Endian::store < uint16_t > (out + File::DEV, this->dev);
+                Endian::store < uint16_t > (out + File::RDEV, this->rdev);
+                Endian::store < uint16_t > (out + File::NLINK, this->nlink);
+                Endian::store < uint16_t > (out + File::BLOCKS, std::min < uint32_t > (this->blocks, 0xFFFF));
+                Endian::store < uint32_t > (out + File::DAT_LEN, this->dat_len);
+                Endian::store < uint32_t > (out + File::INFO_NEXT, this->info_next);
+                Endian::store < uint16_t > (out + File::FLAGS, this->flags);
             }
             else if (this->type == INodeType::INT_DIRECTORY)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->parent), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->children_count), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->children), DIRECTORY_CHILDREN_MAX * 2);
+                Endian::store < uint16_t > (out + Directory::PARENT, this->parent);
+                Endian::store < uint16_t > (out + Directory::CHILDREN_COUNT, this->children_count);
             }
             else if (this->type == INodeType::INT_HARDLINK)
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->realid), 2);
-            return binary_rep.str();
+                Endian::store < uint16_t > (out + HardLink::REALID, this->realid);
+        }
+
+        INode INode::decode(const char *data, unsigned int length)
+        {
+            using namespace INodeLayout;
+
+            // Work from a zero padded copy so that short buffers (e.g. at
+            // the end of a package) decode the same way short reads did.
+            char block[BSIZE_DIRECTORY > BSIZE_FILE ? BSIZE_DIRECTORY : BSIZE_FILE];
+            if (length > sizeof(block))
+                length = sizeof(block);
+            if (length < sizeof(block))
+            {
+                memcpy(block, data, length);
+                memset(block + length, 0, sizeof(block) - length);
+                data = block;
+            }
+
+            INode node(0, "", INodeType::INT_INVALID);
+            node.inodeid = Endian::load < uint16_t > (data + INODEID);
+            node.type = (INodeType::INodeType) Endian::load < uint16_t > (data + TYPE);
+            if (node.type == INodeType::INT_SEGINFO)
+            {
+                node.info_next = Endian::load < uint32_t > (data + SegInfo::INFO_NEXT);
+                return node;
+            }
+            else if (node.type == INodeType::INT_FREELIST)
+            {
+                node.flst_next = Endian::load < uint32_t > (data + FreeList::FLST_NEXT);
+                return node;
+            }
+            else if (node.type == INodeType::INT_BITMAP)
+            {
+                node.flst_next = Endian::load < uint32_t > (data + Bitmap::BMAP_NEXT);
+                return node;
+            }
+            else if (node.type == INodeType::INT_FSINFO)
+            {
+                INodeFSInfo& info = node.editFSInfo();
+                memcpy(info.fs_name, data + FSInfo::NAME, 10);
+                node.ver_major = Endian::load < uint16_t > (data + FSInfo::VER_MAJOR);
+                node.ver_minor = Endian::load < uint16_t > (data + FSInfo::VER_MINOR);
+                node.ver_revision = Endian::load < uint16_t > (data + FSInfo::VER_REVISION);
+                memcpy(info.app_name, data + FSInfo::APP_NAME, 256);
+                memcpy(info.app_ver, data + FSInfo::APP_VER, 32);
+                memcpy(info.app_desc, data + FSInfo::APP_DESC, 1024);
+                memcpy(info.app_author, data + FSInfo::APP_AUTHOR, 256);
+                node.pos_root = Endian::load < uint32_t > (data + FSInfo::POS_ROOT);
+                node.pos_freelist = Endian::load < uint32_t > (data + FSInfo::POS_FREELIST);
+                node.pos_bitmap = Endian::load < uint32_t > (data + FSInfo::POS_BITMAP);
+                node.bmap_gen = Endian::load < uint32_t > (data + FSInfo::BMAP_GEN);
+                node.pos_journal = Endian::load < uint32_t > (data + FSInfo::POS_JOURNAL);
+                node.len_journal = Endian::load < uint32_t > (data + FSInfo::LEN_JOURNAL);
+                return node;
+            }
+            memcpy(node.filename, data + FILENAME, FILENAME_LENGTH);
+            if (node.type != INodeType::INT_HARDLINK)
+            {
+                node.uid = Endian::load < uint16_t > (data + UID);
+                node.gid = Endian::load < uint16_t > (data + GID);
+                node.mask = Endian::load < uint16_t > (data + MASK);
+                node.atime = Endian::load < uint64_t > (data + ATIME);
+                node.mtime = Endian::load < uint64_t > (data + MTIME);
+                node.ctime = Endian::load < uint64_t > (data + CTIME);
+            }
+            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_DEVICE)
+            {
+                node.dev = Endian::load < uint16_t > (data + File::DEV);
+                node.rdev = Endian::load < uint16_t > (data + File::RDEV);
+                node.nlink = Endian::load < uint16_t > (data + File::NLINK);
+                node.blocks = Endian::load < uint16_t > (data + File::BLOCKS);
+                node.dat_len = Endian::load < uint32_t > (data + File::DAT_LEN);
+                node.info_next = Endian::load < uint32_t > (data + File::INFO_NEXT);
+                node.flags = Endian::load < uint16_t > (data + File::FLAGS);
+
+                // Extent files can have more blocks than the field holds.
+                if (node.flags & File::FLAG_EXTENTS)
+                    node.blocks = (node.dat_len + BSIZE_FILE - 1) / BSIZE_FILE;
+            }
+            else if (node.type == INodeType::INT_DIRECTORY)
+            {
+                node.parent = Endian::load < uint16_t > (data + Directory::PARENT);
+                node.children_count = Endian::load < uint16_t > (data + Directory::CHILDREN_COUNT);
+            }
+            else if (node.type == INodeType::INT_HARDLINK)
+                node.realid = Endian::load < uint16_t > (data + HardLink::REALID);
+
+            return node;
         }
 
         void INode::setFilename(const char *name, const char *real)
@@ -167,64 +344,79 @@ namespace AppLib
                 this->filename[i] = name[i];
             for (uint16_t i = size; i < 256; i += 1)
                 this->filename[i] = '\0';
-            uint16_t rsize = (strlen(real) < 255) ? strlen(real) : 255;
-            for (uint16_t i = 0; i < rsize; i += 1)
-                this->realfilename[i] = real[i];
-            for (uint16_t i = size; i < 256; i += 1)
-                this->realfilename[i] = '\0';
+            this->realfilename.assign(real, strnlen(real, 255));
         }
 
         void INode::setAppName(const char *name)
         {
+            INodeFSInfo& info = this->editFSInfo();
             uint16_t size = (strlen(name) < 255) ? strlen(name) : 255;
             for (uint16_t i = 0; i < size; i += 1)
-                this->app_name[i] = name[i];
+                info.app_name[i] = name[i];
             for (uint16_t i = size; i < 256; i += 1)
-                this->app_name[i] = '\0';
+                info.app_name[i] = '\0';
         }
 
         void INode::setAppVersion(const char *name)
         {
+            INodeFSInfo& info = this->editFSInfo();
             uint16_t size = (strlen(name) < 31) ? strlen(name) : 31;
             for (uint16_t i = 0; i < size; i += 1)
-                this->app_ver[i] = name[i];
+                info.app_ver[i] = name[i];
             for (uint16_t i = size; i < 32; i += 1)
-                this->app_ver[i] = '\0';
+                info.app_ver[i] = '\0';
         }
 
         void INode::setAppDesc(const char *name)
         {
+            INodeFSInfo& info = this->editFSInfo();
             uint16_t size = (strlen(name) < 1023) ? strlen(name) : 1023;
             for (uint16_t i = 0; i < size; i += 1)
-                this->app_desc[i] = name[i];
+                info.app_desc[i] = name[i];
             for (uint16_t i = size; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
+                info.app_desc[i] = '\0';
         }
 
         void INode::setAppAuthor(const char *name)
         {
+            INodeFSInfo& info = this->editFSInfo();
             uint16_t size = (strlen(name) < 255) ? strlen(name) : 255;
             for (uint16_t i = 0; i < size; i += 1)
-                this->app_author[i] = name[i];
+                info.app_author[i] = name[i];
             for (uint16_t i = size; i < 256; i += 1)
-                this->app_author[i] = '\0';
+                info.app_author[i] = '\0';
+        }
+
+        const INodeFSInfo& INode::getFSInfo() const
+        {
+            static const INodeFSInfo empty;
+            if (this->fsinfo)
+                return *this->fsinfo;
+            return empty;
+        }
+
+        INodeFSInfo& INode::editFSInfo()
+        {
+            if (!this->fsinfo)
+                this->fsinfo.reset(new INodeFSInfo());
+            return *this->fsinfo;
         }
 
-        bool INode::verify()
+        bool INode::verify() const
         {
             if (this->filename[0] == 0 && (this->type == INodeType::INT_DIRECTORY || this->type == INodeType::INT_FILEINFO) && this->inodeid != 0)
                 return false;
             return true;
         }
 
-        INode INode::resolve(FS* filesystem)
+        INode INode::resolve(FS* filesystem) const
         {
             if (this->type == INodeType::INT_HARDLINK && this->realid != 0)
             {
                 Logging::showDebugW("Resolving hardlink %u to %u.", this->inodeid, this->realid);
                 INode node = filesystem->getINodeByID(this->realid);
                 node.realid = this->inodeid;
-                INode::copyFilename(node.filename, node.realfilename);
+                node.realfilename.assign(node.filename, strnlen(node.filename, 255));
                 INode::copyFilename(this->filename, node.filename);
                 return node;
             }
@@ -233,14 +425,14 @@ namespace AppLib
                 Logging::showDebugW("Resolving fileinfo %u back to hardlink %u.", this->inodeid, this->realid);
                 INode node = filesystem->getRealINodeByID(this->realid);
                 node.realid = this->inodeid;
-                INode::copyFilename(this->filename, node.realfilename);
+                node.realfilename.assign(this->filename, strnlen(this->filename, 255));
                 return node;
             }
             else
                 return *this;
         }
 
-        void INode::copyFilename(char from[256], char to[256])
+        void INode::copyFilename(const char from[256], char to[256])
         {
             for (int i = 0; i < 256; i += 1)
                 to[i] = 0;
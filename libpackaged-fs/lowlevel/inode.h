@@ -14,6 +14,7 @@ namespace AppLib
 }
 
 #include <string>
+#include <memory>
 #include <libpackaged-fs/lowlevel/inodetype.h>
 #include <libpackaged-fs/lowlevel/fs.h>
 
@@ -21,6 +22,27 @@ namespace AppLib
 {
     namespace LowLevel
     {
+        //! The application metadata stored only in the FSInfo inode.
+        struct INodeFSInfo
+        {
+            char fs_name[10];
+            char app_name[256];
+            char app_ver[32];
+            char app_desc[1024];
+            char app_author[256];
+
+            INodeFSInfo();
+        };
+
+        //! The in-memory representation of an inode.
+        /*!
+         * Only the fields shared by the common inode types are stored
+         * inline, keeping the object small enough to pass around and
+         * copy on every path lookup.  The FSInfo application metadata
+         * is allocated separately, and only for FSInfo inodes (see
+         * getFSInfo()).  Directory children are never loaded with the
+         * inode; use FS::getChildIDsOfDirectory() when they are needed.
+         */
         class INode
         {
         public:
@@ -33,49 +55,86 @@ namespace AppLib
             uint64_t atime;
             uint64_t mtime;
             uint64_t ctime;
+
+            // Directories only
             uint16_t parent;
-            uint16_t children[DIRECTORY_CHILDREN_MAX];
             uint16_t children_count;
+
+            // Files, symlinks and devices only
             uint16_t dev;
             uint16_t rdev;
             uint16_t nlink;
-            uint16_t blocks;
+            uint32_t blocks; //!< Only the low 16 bits are stored for segment list files.
             uint32_t dat_len;
             uint32_t info_next;
+            uint16_t flags;
+
+            // Free lists and free space bitmaps only
             uint32_t flst_next;
+
+            // Hardlinks only
             uint16_t realid;
-            char realfilename[256]; //!< In-memory only (never written to disk).
+            std::string realfilename; //!< In-memory only (never written to disk).
 
             // FSInfo only
-            char fs_name[10];
             uint16_t ver_major;
             uint16_t ver_minor;
             uint16_t ver_revision;
-            char app_name[256];
-            char app_ver[32];
-            char app_desc[1024];
-            char app_author[256];
             uint32_t pos_root;
             uint32_t pos_freelist;
+            uint32_t pos_bitmap;
+            uint32_t bmap_gen; //!< Odd while the package is open for writing.
+            uint32_t pos_journal;
+            uint32_t len_journal; //!< Number of blocks in the journal.
 
             INode(uint16_t id, const char *filename, INodeType::INodeType type, uint16_t uid, uint16_t gid, uint16_t mask, uint64_t atime, uint64_t mtime, uint64_t ctime);
             INode(uint16_t id = 0, const char *filename = "", INodeType::INodeType type = INodeType::INT_UNSET);
+            INode(const INode& other);
+            INode(INode&& other) = default;
             ~INode();
-            std::string getBinaryRepresentation();
+            INode& operator=(const INode& other);
+            INode& operator=(INode&& other) = default;
+
+            std::string getBinaryRepresentation() const;
+
+            //! Returns the number of bytes used by the on-disk representation.
+            /*!
+             * For directories this only covers the header; the list of
+             * children is maintained on disk by FS directly.
+             */
+            unsigned int getBinaryLength() const;
+
+            //! Writes the on-disk representation (getBinaryLength() bytes) to out.
+            void encode(char *out) const;
+
+            //! Decodes an inode from a buffer holding its on-disk
+            //! representation.  Bytes past length are treated as zero.
+            static INode decode(const char *data, unsigned int length);
+
             void setFilename(const char *name, const char *real = "");
             void setAppName(const char *name);
             void setAppVersion(const char *name);
             void setAppDesc(const char *name);
             void setAppAuthor(const char *name);
 
+            //! Returns the FSInfo application metadata (empty for any
+            //! other kind of inode).
+            const INodeFSInfo& getFSInfo() const;
+
             //! Ensures that the node data is valid.
-            bool verify();
+            bool verify() const;
 
             //! Resolves a hardlink to the real file.
-            INode resolve(FS* filesystem);
+            INode resolve(FS* filesystem) const;
 
         private:
-            static void copyFilename(char from[256], char to[256]);
+            std::unique_ptr < INodeFSInfo > fsinfo;
+
+            // Returns the FSInfo metadata for modification, allocating
+            // it if required.
+            INodeFSInfo& editFSInfo();
+
+            static void copyFilename(const char from[256], char to[256]);
         };
     }
 }
@@ -0,0 +1,150 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/config.h>
+
+#include <string.h>
+#include <libpackaged-fs/lowlevel/inodecache.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        INodeCache::INodeCache(size_t budget)
+        {
+            this->budget = budget;
+            this->used = 0;
+            memset(&this->stats, 0, sizeof(INodeCacheStatistics));
+            pthread_mutex_init(&this->mutex, NULL);
+        }
+
+        INodeCache::~INodeCache()
+        {
+            this->clear();
+            pthread_mutex_destroy(&this->mutex);
+        }
+
+        bool INodeCache::get(uint16_t id, INode& out, uint32_t& pos)
+        {
+            pthread_mutex_lock(&this->mutex);
+            std::unordered_map < uint16_t, Entry >::iterator it = this->entries.find(id);
+            if (it == this->entries.end())
+            {
+                this->stats.misses += 1;
+                pthread_mutex_unlock(&this->mutex);
+                return false;
+            }
+
+            // Move the entry to the front of the LRU list.
+            this->ages.splice(this->ages.begin(), this->ages, it->second.age);
+            out = it->second.node;
+            pos = it->second.pos;
+            this->stats.hits += 1;
+            pthread_mutex_unlock(&this->mutex);
+            return true;
+        }
+
+        void INodeCache::put(uint16_t id, uint32_t pos, const INode& node)
+        {
+            if (this->budget == 0)
+                return;
+
+            pthread_mutex_lock(&this->mutex);
+            std::unordered_map < uint16_t, Entry >::iterator it = this->entries.find(id);
+            if (it != this->entries.end())
+                this->erase(it);
+
+            // Another ID may still think it lives at this position (e.g.
+            // the block was freed and reused), so drop that entry too.
+            std::unordered_map < uint32_t, uint16_t >::iterator pit = this->positions.find(pos);
+            if (pit != this->positions.end())
+                this->erase(this->entries.find(pit->second));
+
+            Entry & entry = this->entries[id];
+            entry.pos = pos;
+            entry.node = node;
+            entry.cost = INodeCache::getCost(node);
+            this->ages.push_front(id);
+            entry.age = this->ages.begin();
+            this->positions[pos] = id;
+            this->used += entry.cost;
+
+            // Evict the least recently used entries until we are back
+            // under budget (always keeping the entry we just added).
+            while (this->used > this->budget && this->ages.size() > 1)
+            {
+                this->erase(this->entries.find(this->ages.back()));
+                this->stats.evictions += 1;
+            }
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void INodeCache::modify(uint16_t id, const std::function < void (INode&) > & change)
+        {
+            pthread_mutex_lock(&this->mutex);
+            std::unordered_map < uint16_t, Entry >::iterator it = this->entries.find(id);
+            if (it != this->entries.end())
+                change(it->second.node);
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void INodeCache::modifyAtPosition(uint32_t pos, const std::function < void (INode&) > & change)
+        {
+            pthread_mutex_lock(&this->mutex);
+            std::unordered_map < uint32_t, uint16_t >::iterator pit = this->positions.find(pos);
+            if (pit != this->positions.end())
+                change(this->entries.find(pit->second)->second.node);
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void INodeCache::remove(uint16_t id)
+        {
+            pthread_mutex_lock(&this->mutex);
+            std::unordered_map < uint16_t, Entry >::iterator it = this->entries.find(id);
+            if (it != this->entries.end())
+                this->erase(it);
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void INodeCache::removeAtPosition(uint32_t pos)
+        {
+            pthread_mutex_lock(&this->mutex);
+            std::unordered_map < uint32_t, uint16_t >::iterator pit = this->positions.find(pos);
+            if (pit != this->positions.end())
+                this->erase(this->entries.find(pit->second));
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        void INodeCache::clear()
+        {
+            pthread_mutex_lock(&this->mutex);
+            this->entries.clear();
+            this->positions.clear();
+            this->ages.clear();
+            this->used = 0;
+            pthread_mutex_unlock(&this->mutex);
+        }
+
+        INodeCacheStatistics INodeCache::getStatistics()
+        {
+            pthread_mutex_lock(&this->mutex);
+            INodeCacheStatistics result = this->stats;
+            pthread_mutex_unlock(&this->mutex);
+            return result;
+        }
+
+        void INodeCache::erase(std::unordered_map < uint16_t, Entry >::iterator it)
+        {
+            this->used -= it->second.cost;
+            this->positions.erase(it->second.pos);
+            this->ages.erase(it->second.age);
+            this->entries.erase(it);
+        }
+
+        size_t INodeCache::getCost(const INode& node)
+        {
+            // The entry itself plus the map, position index and LRU list
+            // nodes that point at it.
+            return sizeof(Entry) + node.realfilename.capacity() + 96;
+        }
+    }
+}
@@ -0,0 +1,89 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_INODECACHE
+#define CLASS_INODECACHE
+
+#include <libpackaged-fs/config.h>
+
+#include <list>
+#include <functional>
+#include <unordered_map>
+#include <pthread.h>
+#include <libpackaged-fs/lowlevel/inode.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        struct INodeCacheStatistics
+        {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+        };
+
+        //! An in-memory cache of inodes, keyed by inode ID.
+        /*!
+         * Each entry holds the inode exactly as it is stored on disk
+         * (hardlinks are not resolved) together with its position in
+         * the package.  FS writes every change to an inode through to
+         * the cache as well as the package, so a cached entry is always
+         * current.  The least recently used entries are evicted once
+         * the cache grows past its memory budget.
+         */
+        class INodeCache
+        {
+        public:
+            INodeCache(size_t budget = CACHE_INODES_SIZE);
+            ~INodeCache();
+
+            //! Copies the cached inode and its position to out and pos.
+            //! Returns false if the inode is not cached.
+            bool get(uint16_t id, INode& out, uint32_t& pos);
+
+            //! Adds or replaces the cached copy of an inode.
+            void put(uint16_t id, uint32_t pos, const INode& node);
+
+            //! Applies a change to a cached inode (identified either by
+            //! ID or by position).  Does nothing if it is not cached.
+            void modify(uint16_t id, const std::function < void (INode&) > & change);
+            void modifyAtPosition(uint32_t pos, const std::function < void (INode&) > & change);
+
+            //! Drops a cached inode (identified either by ID or by
+            //! position).
+            void remove(uint16_t id);
+            void removeAtPosition(uint32_t pos);
+
+            //! Drops every cached inode.
+            void clear();
+
+            //! Returns the hit, miss and eviction counters.
+            INodeCacheStatistics getStatistics();
+
+        private:
+            struct Entry
+            {
+                uint32_t pos;
+                INode node;
+                size_t cost;
+                std::list < uint16_t >::iterator age;
+            };
+
+            size_t budget;
+            size_t used;
+            std::unordered_map < uint16_t, Entry > entries;
+            std::unordered_map < uint32_t, uint16_t > positions;
+            std::list < uint16_t > ages;
+            INodeCacheStatistics stats;
+            pthread_mutex_t mutex;
+
+            // Removes an entry.  The cache must be locked.
+            void erase(std::unordered_map < uint16_t, Entry >::iterator it);
+
+            // Returns the approximate memory used by an entry.
+            static size_t getCost(const INode& node);
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,146 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_INODELAYOUT
+#define CLASS_LOWLEVEL_INODELAYOUT
+
+#include <libpackaged-fs/config.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        // WARN: These are the byte offsets of each field within the
+        //       inode blocks stored in AppFS packages.  Like the values
+        //       in INodeType, changing any of them will break the
+        //       ability to read existing packages.
+        namespace INodeLayout
+        {
+            // Fields shared by every inode.
+            constexpr unsigned int INODEID = 0;
+            constexpr unsigned int TYPE = 2;
+
+            // Fields shared by files, directories, symlinks, devices
+            // and hardlinks.
+            constexpr unsigned int FILENAME = 4;
+            constexpr unsigned int FILENAME_LENGTH = 256;
+
+            // Fields shared by everything above except hardlinks.
+            constexpr unsigned int UID = 260;
+            constexpr unsigned int GID = 262;
+            constexpr unsigned int MASK = 264;
+            constexpr unsigned int ATIME = 266;
+            constexpr unsigned int MTIME = 274;
+            constexpr unsigned int CTIME = 282;
+
+            // Files, symlinks and devices.
+            namespace File
+            {
+                constexpr unsigned int DEV = 290;
+                constexpr unsigned int RDEV = 292;
+                constexpr unsigned int NLINK = 294;
+                constexpr unsigned int BLOCKS = 296;
+                constexpr unsigned int DAT_LEN = 298;
+                constexpr unsigned int INFO_NEXT = 302;
+                constexpr unsigned int FLAGS = 306;
+                constexpr unsigned int LENGTH = 308;
+
+                // The bits stored in FLAGS.  FLAG_EXTENTS means the rest
+                // of the block holds the root of an extent tree rather
+                // than a segment list.
+                constexpr uint16_t FLAG_EXTENTS = 0x0001;
+
+                // The root of the extent tree.  ROOT_DEPTH is 0 when the
+                // entries are the file's extents and 1 when each entry
+                // points to an extent block instead.
+                constexpr unsigned int ROOT_COUNT = HSIZE_FILE;
+                constexpr unsigned int ROOT_DEPTH = HSIZE_FILE + 2;
+                constexpr unsigned int ROOT_ENTRIES = HSIZE_FILE + 4;
+            }
+
+            // An entry in an extent tree: the index of the first block in
+            // the file it covers, the position of that block and the
+            // number of blocks.  In the root of a depth 1 tree, POS is the
+            // position of an extent block and LENGTH is unused.
+            namespace ExtentEntry
+            {
+                constexpr unsigned int START = 0;
+                constexpr unsigned int POS = 4;
+                constexpr unsigned int LENGTH = 8;
+                constexpr unsigned int SIZE = 12;
+            }
+
+            // Extent blocks (the leaves of a depth 1 extent tree).
+            namespace Extents
+            {
+                constexpr unsigned int COUNT = 4;
+                constexpr unsigned int ENTRIES = HSIZE_EXTENTS;
+            }
+
+            // Directories.
+            namespace Directory
+            {
+                constexpr unsigned int PARENT = 290;
+                constexpr unsigned int CHILDREN_COUNT = 292;
+                constexpr unsigned int CHILDREN = 294;
+                constexpr unsigned int LENGTH = CHILDREN + DIRECTORY_CHILDREN_MAX * 2;
+            }
+
+            // Hardlinks.
+            namespace HardLink
+            {
+                constexpr unsigned int REALID = 260;
+                constexpr unsigned int LENGTH = 262;
+            }
+
+            // Segment information blocks.
+            namespace SegInfo
+            {
+                constexpr unsigned int INFO_NEXT = 4;
+                constexpr unsigned int LENGTH = 8;
+            }
+
+            // Free space allocation blocks.
+            namespace FreeList
+            {
+                constexpr unsigned int FLST_NEXT = 4;
+                constexpr unsigned int LENGTH = 8;
+            }
+
+            // Free space bitmap blocks.  The bitmap follows the header,
+            // one bit per block in the least significant bit first order.
+            namespace Bitmap
+            {
+                constexpr unsigned int BMAP_NEXT = 4;
+                constexpr unsigned int LENGTH = HSIZE_BITMAP;
+            }
+
+            // The filesystem information block.
+            namespace FSInfo
+            {
+                constexpr unsigned int NAME = 4;  // fs_name
+                constexpr unsigned int VER_MAJOR = 14;
+                constexpr unsigned int VER_MINOR = 16;
+                constexpr unsigned int VER_REVISION = 18;
+                constexpr unsigned int APP_NAME = 20;
+                constexpr unsigned int APP_VER = 276;
+                constexpr unsigned int APP_DESC = 308;
+                constexpr unsigned int APP_AUTHOR = 1332;
+                constexpr unsigned int POS_ROOT = 1588;
+                constexpr unsigned int POS_FREELIST = 1592;
+                constexpr unsigned int POS_BITMAP = 1596;
+                constexpr unsigned int BMAP_GEN = 1600;
+                constexpr unsigned int POS_JOURNAL = 1604;
+                constexpr unsigned int LEN_JOURNAL = 1608;
+                constexpr unsigned int LENGTH = 1612;
+            }
+
+            static_assert(File::LENGTH <= HSIZE_FILE, "File inode fields overlap the segment list.");
+            static_assert(Extents::COUNT + 2 <= HSIZE_EXTENTS, "Extent block fields overlap the extents.");
+            static_assert(Directory::CHILDREN == HSIZE_DIRECTORY, "Directory children must follow the header.");
+            static_assert(Directory::LENGTH <= BSIZE_DIRECTORY, "Directory inode does not fit in its block.");
+            static_assert(FSInfo::LENGTH <= LENGTH_FSINFO, "FSInfo inode does not fit in its block.");
+        }
+    }
+}
+
+#endif
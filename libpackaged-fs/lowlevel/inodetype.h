@@ -24,6 +24,8 @@ namespace AppLib
                 INT_FILEINFO = 1,
                 // Segment Information Block
                 INT_SEGINFO = 2,
+                // Extent Block
+                INT_EXTENTS = 11,
                 // Data Block (unused in disk images)
                 INT_DATA = 254,
 
@@ -39,8 +41,10 @@ namespace AppLib
 
                 // Temporary Block
                 INT_TEMPORARY = 6,
-                // Free Space Allocation Block
+                // Free Space Allocation Block (only in older packages)
                 INT_FREELIST = 7,
+                // Free Space Bitmap Block
+                INT_BITMAP = 12,
                 // Filesystem Information Block
                 INT_FSINFO = 8,
 
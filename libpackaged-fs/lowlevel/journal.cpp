@@ -0,0 +1,353 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/config.h>
+
+#include <algorithm>
+#include <string.h>
+#include <libpackaged-fs/logging.h>
+#include <libpackaged-fs/lowlevel/endian.h>
+#include <libpackaged-fs/lowlevel/journal.h>
+#include <libpackaged-fs/lowlevel/blockstream.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        const char Journal::MAGIC_SUPER[8] = { 'A', 'F', 'S', 'J', 'R', 'N', 'L', 0 };
+        const char Journal::MAGIC_HEADER[8] = { 'A', 'F', 'S', 'J', 'T', 'X', 'N', 0 };
+        const unsigned int Journal::POS_SEQUENCE = 8;
+        const unsigned int Journal::POS_COUNT = 16;
+        const unsigned int Journal::POS_FLAGS = 20;
+        const unsigned int Journal::POS_CHECKSUM = 24;
+        const unsigned int Journal::POS_POSITIONS = 32;
+        const unsigned int Journal::ENTRIES = (BSIZE_FILE - Journal::POS_POSITIONS) / 4;
+        const uint32_t Journal::FLAG_CONTINUED = 1;
+
+        Journal::Journal(BlockStream * stream, uint32_t pos, uint32_t blocks)
+        {
+            this->stream = stream;
+            this->pos = pos;
+            this->blocks = blocks;
+            this->sequence = 1;
+            this->head = 1;
+            pthread_mutex_init(&this->mutex, NULL);
+            memset(&this->stats, 0, sizeof(JournalStatistics));
+        }
+
+        Journal::~Journal()
+        {
+            pthread_mutex_destroy(&this->mutex);
+        }
+
+        bool Journal::recover(std::vector < uint32_t > & replayed)
+        {
+            pthread_mutex_lock(&this->mutex);
+            std::map < uint32_t, uint32_t > images;
+            bool unfinished = false;
+            int found = this->scan(images, unfinished);
+            if (found < 0)
+            {
+                Logging::showDebugW("JOURNAL: Setting up a journal of %u blocks at %u.", this->blocks, this->pos);
+                this->sequence = 1;
+                bool success = this->writeSuper(this->sequence);
+                pthread_mutex_unlock(&this->mutex);
+                return success;
+            }
+            if (found == 0)
+            {
+                bool success = !unfinished || this->writeSuper(this->sequence);
+                pthread_mutex_unlock(&this->mutex);
+                return success;
+            }
+
+            // Only the newest image of each block matters, and the
+            // transactions were complete, so the order they are copied
+            // home in doesn't.
+            Logging::showInfoW("Replaying %i transactions (%u blocks) from the metadata journal.",
+                    found, (unsigned int) images.size());
+            std::vector < char > block(BSIZE_FILE);
+            bool success = true;
+            for (std::map < uint32_t, uint32_t >::iterator it = images.begin(); it != images.end(); it++)
+            {
+                std::streampos from = (std::streampos) this->pos + (std::streamoff) it->second * BSIZE_FILE;
+                if (this->stream->rawReadAt(from, &block[0], BSIZE_FILE) != BSIZE_FILE ||
+                    this->stream->rawWriteAt(it->first, &block[0], BSIZE_FILE) != BSIZE_FILE)
+                {
+                    Logging::showErrorW("JOURNAL: Unable to replay the block at %u.", it->first);
+                    success = false;
+                    continue;
+                }
+                replayed.push_back(it->first);
+            }
+            this->stats.replayed += replayed.size();
+
+            // Keep the transactions until they are definitely home.
+            if (!success || !this->stream->rawSync())
+            {
+                pthread_mutex_unlock(&this->mutex);
+                return false;
+            }
+            success = this->writeSuper(this->sequence);
+            this->head = 1;
+            this->live.clear();
+            pthread_mutex_unlock(&this->mutex);
+            return success;
+        }
+
+        bool Journal::load(std::map < uint32_t, std::vector < char > > & images)
+        {
+            pthread_mutex_lock(&this->mutex);
+            std::map < uint32_t, uint32_t > found;
+            bool unfinished = false;
+            bool success = true;
+            if (this->scan(found, unfinished) > 0)
+            {
+                for (std::map < uint32_t, uint32_t >::iterator it = found.begin(); it != found.end(); it++)
+                {
+                    std::vector < char > & block = images[it->first];
+                    block.resize(BSIZE_FILE);
+                    std::streampos from = (std::streampos) this->pos + (std::streamoff) it->second * BSIZE_FILE;
+                    if (this->stream->rawReadAt(from, &block[0], BSIZE_FILE) != BSIZE_FILE)
+                    {
+                        Logging::showErrorW("JOURNAL: Unable to read the block at %u.", it->first);
+                        success = false;
+                        break;
+                    }
+                }
+            }
+            pthread_mutex_unlock(&this->mutex);
+            return success;
+        }
+
+        uint32_t Journal::getCapacity()
+        {
+            // Every ENTRIES blocks (or part thereof) need a header, and
+            // the first block of the region is not available.
+            if (this->blocks < 2)
+                return 0;
+            uint32_t space = this->blocks - 1;
+            return space - (space + ENTRIES) / (ENTRIES + 1);
+        }
+
+        bool Journal::hasRoom(uint32_t count)
+        {
+            pthread_mutex_lock(&this->mutex);
+            bool result = (this->head + Journal::getFootprint(count) <= this->blocks);
+            pthread_mutex_unlock(&this->mutex);
+            return result;
+        }
+
+        bool Journal::isLive(uint32_t pos)
+        {
+            pthread_mutex_lock(&this->mutex);
+            bool result = (this->live.find(pos) != this->live.end());
+            pthread_mutex_unlock(&this->mutex);
+            return result;
+        }
+
+        bool Journal::append(const std::vector < uint32_t > & positions, const char * images)
+        {
+            uint32_t count = positions.size();
+            if (count == 0)
+                return true;
+
+            pthread_mutex_lock(&this->mutex);
+            if (this->head + Journal::getFootprint(count) > this->blocks)
+            {
+                pthread_mutex_unlock(&this->mutex);
+                return false;
+            }
+
+            // Each piece is a header followed by the images it lists.
+            // Nothing is recorded until every piece has been written, so
+            // a failed append is simply written over by the next one.
+            uint32_t head = this->head;
+            uint64_t sequence = this->sequence;
+            std::vector < char > header(BSIZE_FILE);
+            for (uint32_t first = 0; first < count; first += ENTRIES)
+            {
+                uint32_t amount = std::min < uint32_t > (ENTRIES, count - first);
+                const char * data = images + (size_t) first * BSIZE_FILE;
+                std::streamsize length = (std::streamsize) amount * BSIZE_FILE;
+
+                memset(&header[0], 0, BSIZE_FILE);
+                memcpy(&header[0], MAGIC_HEADER, sizeof(MAGIC_HEADER));
+                Endian::store < uint64_t > (&header[0] + POS_SEQUENCE, sequence);
+                Endian::store < uint32_t > (&header[0] + POS_COUNT, amount);
+                Endian::store < uint32_t > (&header[0] + POS_FLAGS, (first + amount < count) ? FLAG_CONTINUED : 0);
+                for (uint32_t i = 0; i < amount; i += 1)
+                    Endian::store < uint32_t > (&header[0] + POS_POSITIONS + i * 4, positions[first + i]);
+                uint64_t hash = Journal::checksum(&header[0], BSIZE_FILE);
+                Endian::store < uint64_t > (&header[0] + POS_CHECKSUM, Journal::checksum(data, length, hash));
+
+                std::streampos to = (std::streampos) this->pos + (std::streamoff) head * BSIZE_FILE;
+                if (this->stream->rawWriteAt(to, &header[0], BSIZE_FILE) != BSIZE_FILE ||
+                    this->stream->rawWriteAt(to + (std::streamoff) BSIZE_FILE, data, length) != length)
+                {
+                    Logging::showErrorW("JOURNAL: Unable to write a transaction of %u blocks.", count);
+                    pthread_mutex_unlock(&this->mutex);
+                    return false;
+                }
+                for (uint32_t i = 0; i < amount; i += 1)
+                    this->live[positions[first + i]] = head + 1 + i;
+                head += 1 + amount;
+                sequence += 1;
+            }
+
+            this->head = head;
+            this->sequence = sequence;
+            this->stats.commits += 1;
+            this->stats.blocks += count;
+            pthread_mutex_unlock(&this->mutex);
+            return true;
+        }
+
+        bool Journal::restore(const std::vector < uint32_t > & positions)
+        {
+            pthread_mutex_lock(&this->mutex);
+            std::vector < char > block(BSIZE_FILE);
+            bool success = true;
+            for (unsigned int i = 0; i < positions.size(); i += 1)
+            {
+                std::unordered_map < uint32_t, uint32_t >::iterator it = this->live.find(positions[i]);
+                if (it == this->live.end())
+                    continue;
+                std::streampos from = (std::streampos) this->pos + (std::streamoff) it->second * BSIZE_FILE;
+                if (this->stream->rawReadAt(from, &block[0], BSIZE_FILE) != BSIZE_FILE ||
+                    this->stream->rawWriteAt(it->first, &block[0], BSIZE_FILE) != BSIZE_FILE)
+                {
+                    Logging::showErrorW("JOURNAL: Unable to write the block at %u home.", it->first);
+                    success = false;
+                }
+            }
+            pthread_mutex_unlock(&this->mutex);
+            return success;
+        }
+
+        bool Journal::reset()
+        {
+            pthread_mutex_lock(&this->mutex);
+            if (this->head == 1)
+            {
+                pthread_mutex_unlock(&this->mutex);
+                return true;
+            }
+
+            // Bumping the sequence number in the first block is enough to
+            // make every transaction after it stale.
+            bool success = this->writeSuper(this->sequence);
+            if (success)
+            {
+                this->head = 1;
+                this->live.clear();
+                this->stats.checkpoints += 1;
+            }
+            pthread_mutex_unlock(&this->mutex);
+            return success;
+        }
+
+        unsigned int Journal::getUsage()
+        {
+            pthread_mutex_lock(&this->mutex);
+            unsigned int result = (this->blocks == 0) ? 100 : (unsigned int) ((uint64_t) this->head * 100 / this->blocks);
+            pthread_mutex_unlock(&this->mutex);
+            return result;
+        }
+
+        JournalStatistics Journal::getStatistics()
+        {
+            pthread_mutex_lock(&this->mutex);
+            JournalStatistics result = this->stats;
+            pthread_mutex_unlock(&this->mutex);
+            return result;
+        }
+
+        int Journal::scan(std::map < uint32_t, uint32_t > & images, bool & unfinished)
+        {
+            std::vector < char > buffer(BSIZE_FILE);
+            std::streamsize res = this->stream->rawReadAt(this->pos, &buffer[0], BSIZE_FILE);
+            if (res != BSIZE_FILE || memcmp(&buffer[0], MAGIC_SUPER, sizeof(MAGIC_SUPER)) != 0)
+                return -1;
+            uint64_t sequence = Endian::load < uint64_t > (&buffer[0] + POS_SEQUENCE);
+
+            // Stop at the first block that isn't the header of the next
+            // transaction, or at a transaction that was not completely
+            // written.  The pieces of a transaction are only taken once
+            // its last piece has been read.
+            int found = 0;
+            uint32_t index = 1;
+            std::vector < std::pair < uint32_t, uint32_t > > pieces;
+            while (index + 1 < this->blocks)
+            {
+                std::streampos at = (std::streampos) this->pos + (std::streamoff) index * BSIZE_FILE;
+                buffer.resize(BSIZE_FILE);
+                if (this->stream->rawReadAt(at, &buffer[0], BSIZE_FILE) != BSIZE_FILE)
+                    break;
+                if (memcmp(&buffer[0], MAGIC_HEADER, sizeof(MAGIC_HEADER)) != 0 ||
+                    Endian::load < uint64_t > (&buffer[0] + POS_SEQUENCE) != sequence)
+                    break;
+                uint32_t count = Endian::load < uint32_t > (&buffer[0] + POS_COUNT);
+                uint32_t flags = Endian::load < uint32_t > (&buffer[0] + POS_FLAGS);
+                if (count == 0 || count > ENTRIES || index + 1 + count > this->blocks)
+                    break;
+
+                buffer.resize((size_t) (count + 1) * BSIZE_FILE);
+                std::streamsize length = (std::streamsize) count * BSIZE_FILE;
+                if (this->stream->rawReadAt(at + (std::streamoff) BSIZE_FILE, &buffer[BSIZE_FILE], length) != length)
+                    break;
+                uint64_t expected = Endian::load < uint64_t > (&buffer[0] + POS_CHECKSUM);
+                Endian::store < uint64_t > (&buffer[0] + POS_CHECKSUM, 0);
+                if (Journal::checksum(&buffer[0], buffer.size()) != expected)
+                    break;
+
+                for (uint32_t i = 0; i < count; i += 1)
+                    pieces.push_back(std::make_pair(Endian::load < uint32_t > (&buffer[0] + POS_POSITIONS + i * 4), index + 1 + i));
+                index += 1 + count;
+                sequence += 1;
+                if ((flags & FLAG_CONTINUED) != 0)
+                    continue;
+
+                for (unsigned int i = 0; i < pieces.size(); i += 1)
+                    images[pieces[i].first] = pieces[i].second;
+                pieces.clear();
+                found += 1;
+            }
+
+            // The pieces of a transaction that was cut short stay valid
+            // on their own, so the sequence number is moved past them.
+            unfinished = (pieces.size() > 0);
+            this->sequence = sequence;
+            return found;
+        }
+
+        bool Journal::writeSuper(uint64_t sequence)
+        {
+            std::vector < char > block(BSIZE_FILE, 0);
+            memcpy(&block[0], MAGIC_SUPER, sizeof(MAGIC_SUPER));
+            Endian::store < uint64_t > (&block[0] + POS_SEQUENCE, sequence);
+            if (this->stream->rawWriteAt(this->pos, &block[0], BSIZE_FILE) != BSIZE_FILE || !this->stream->rawSync())
+            {
+                Logging::showErrorW("JOURNAL: Unable to update the start of the journal.");
+                return false;
+            }
+            return true;
+        }
+
+        uint32_t Journal::getFootprint(uint32_t count)
+        {
+            return count + (count + ENTRIES - 1) / ENTRIES;
+        }
+
+        uint64_t Journal::checksum(const char * data, size_t length, uint64_t hash)
+        {
+            // 64-bit FNV-1a; it only has to catch transactions that were
+            // cut short by a crash.
+            for (size_t i = 0; i < length; i += 1)
+            {
+                hash ^= (unsigned char) data[i];
+                hash *= 1099511628211ULL;
+            }
+            return hash;
+        }
+    }
+}
@@ -0,0 +1,150 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_JOURNAL
+#define CLASS_JOURNAL
+
+#include <libpackaged-fs/config.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <pthread.h>
+#include <stdint.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        class BlockStream;
+
+        struct JournalStatistics
+        {
+            uint64_t commits;
+            uint64_t blocks;
+            uint64_t checkpoints;
+            uint64_t replayed;
+        };
+
+        //! A write-ahead log of the metadata blocks of a package.
+        /*!
+         * The journal occupies a fixed run of blocks in the package.  The
+         * first block holds the sequence number of the first transaction
+         * that is valid; transactions are appended one after another
+         * behind it, each as a header block (listing where each of the
+         * following blocks belongs, and a checksum over all of them) and
+         * the new contents of those blocks.  A transaction with more
+         * blocks than one header can list is written as several such
+         * pieces, each marked as continued except for the last.  A
+         * transaction only counts once all of it has been written, so
+         * after a crash either every block of a transaction or none of
+         * them is copied home.
+         *
+         * The journal itself only reads and writes its own region; the
+         * owning BlockStream decides what goes into each transaction,
+         * syncs the package and writes blocks home before reset() is
+         * called.  All of the blocks in the journal are the same size
+         * and alignment as those of the block cache.
+         */
+        class Journal
+        {
+        public:
+            Journal(BlockStream * stream, uint32_t pos, uint32_t blocks);
+            ~Journal();
+
+            //! Copies the blocks of every complete transaction home
+            //! (syncing the package afterwards) and empties the journal,
+            //! or sets the region up if it does not hold a journal yet.
+            //! The positions of the blocks that were copied are appended
+            //! to replayed.  Returns false on I/O error.
+            bool recover(std::vector < uint32_t > & replayed);
+
+            //! Reads the newest image of every block in the complete
+            //! transactions into images without changing the journal,
+            //! for packages that are opened read-only.  Returns false on
+            //! I/O error.
+            bool load(std::map < uint32_t, std::vector < char > > & images);
+
+            //! Returns the largest number of blocks a single transaction
+            //! can hold (when the journal is empty).
+            uint32_t getCapacity();
+
+            //! Returns whether a transaction of count blocks fits in the
+            //! space that is left.
+            bool hasRoom(uint32_t count);
+
+            //! Returns whether the journal holds an image of the block at
+            //! pos that may not have been written home yet.
+            bool isLive(uint32_t pos);
+
+            //! Writes a transaction holding the images of the blocks at
+            //! each of positions, which follow one another in images.
+            //! The caller syncs the package.  Returns false on I/O error
+            //! or if the transaction does not fit.
+            bool append(const std::vector < uint32_t > & positions, const char * images);
+
+            //! Writes the newest image in the journal of each of the
+            //! given blocks home, so that the journal can be emptied while
+            //! newer contents of those blocks have not been committed yet.
+            bool restore(const std::vector < uint32_t > & positions);
+
+            //! Empties the journal, once everything in it has been written
+            //! home and synced.  Returns false on I/O error.
+            bool reset();
+
+            //! Returns how much of the journal is used, as a percentage.
+            unsigned int getUsage();
+
+            //! Returns the journal counters.
+            JournalStatistics getStatistics();
+
+        private:
+            // The layout of the first block and of each header block.
+            static const char MAGIC_SUPER[8];
+            static const char MAGIC_HEADER[8];
+            static const unsigned int POS_SEQUENCE;
+            static const unsigned int POS_COUNT;
+            static const unsigned int POS_FLAGS;
+            static const unsigned int POS_CHECKSUM;
+            static const unsigned int POS_POSITIONS;
+            static const unsigned int ENTRIES;
+            static const uint32_t FLAG_CONTINUED;
+
+            BlockStream * stream;
+            uint32_t pos;
+            uint32_t blocks;
+            pthread_mutex_t mutex;
+            JournalStatistics stats;
+
+            // The sequence number of the next transaction, and the index
+            // of the block it will be written to.
+            uint64_t sequence;
+            uint32_t head;
+
+            // The blocks that have images in the journal, mapped to the
+            // index of the newest one.
+            std::unordered_map < uint32_t, uint32_t > live;
+
+            // Reads the complete transactions into images (mapping each
+            // block to the index of its newest image), returning the
+            // number found or -1 if the region does not hold a journal.
+            // Sets unfinished if they are followed by some of the pieces
+            // of a transaction that was never completed.
+            int scan(std::map < uint32_t, uint32_t > & images, bool & unfinished);
+
+            // Writes the first block with the given sequence number and
+            // syncs it.
+            bool writeSuper(uint64_t sequence);
+
+            // Returns the number of blocks a transaction of count blocks
+            // takes up in the journal, including its headers.
+            static uint32_t getFootprint(uint32_t count);
+
+            // Returns the checksum of a piece of a transaction, carrying
+            // on from hash when it is split over several buffers.
+            static uint64_t checksum(const char * data, size_t length, uint64_t hash = 14695981039346656037ULL);
+        };
+    }
+}
+
+#endif
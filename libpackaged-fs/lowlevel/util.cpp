@@ -154,8 +154,11 @@ namespace AppLib
             fsnode.setAppDesc(appdesc);
             fsnode.setAppAuthor(appauthor);
             fsnode.pos_root = OFFSET_DATA;
-            fsnode.pos_freelist = 0; // The first FreeList block will automatically be
+            fsnode.pos_freelist = 0; // Only used by older packages.
+            fsnode.pos_bitmap = 0; // The first bitmap block will automatically be
                          // created when the first block is freed.
+            fsnode.pos_journal = 0; // The journal is created when the package
+                         // is first opened for writing.
             std::string fsnode_towrite = fsnode.getBinaryRepresentation();
             nfd->write(fsnode_towrite.c_str(), fsnode_towrite.size());
             for (int i = fsnode_towrite.size(); i < LENGTH_FSINFO; i += 1)
@@ -2,7 +2,7 @@
 
 #include <libpackaged-fs/logging.h>
 #include <libpackaged-fs/lowlevel/util.h>
-#include <libpackaged-fs/internal/fuselink.h>
+#include <libpackaged-fs/internal/fuselowlevel.h>
 #include <libpackaged-fs/environment.h>
 #include "config.h"
 #include "funcdefs.h"
@@ -121,7 +121,7 @@ int appfs_stage2(int argc, char *argv[])
     global_disk_path += argv[0];
 
     // Now mount and run the application.
-    AppLib::FUSE::Mounter * mnt = new AppLib::FUSE::Mounter(global_disk_path.c_str(), global_mount_path.c_str(), true, false, appfs_continue);
+    AppLib::FUSE::LowLevelMounter * mnt = new AppLib::FUSE::LowLevelMounter(global_disk_path.c_str(), global_mount_path.c_str(), true, false, false, appfs_continue);
     int ret = mnt->getResult();
 
     if (ret != 0)
@@ -3,6 +3,7 @@
 #include <libpackaged-fs/logging.h>
 #include <libpackaged-fs/fsfile.h>
 #include <libpackaged-fs/lowlevel/fs.h>
+#include <libpackaged-fs/lowlevel/compactor.h>
 #include <algorithm>
 #include <string>
 #include <vector>
@@ -43,6 +44,7 @@ void GetChildren(std::vector<std::string>);
 void DoSegments(std::vector<std::string>);
 void DoClean(std::vector<std::string>);
 void DoShow(std::vector<std::string>);
+void DoCompact(std::vector<std::string>);
 std::pair<std::vector<uint32_t>, std::vector<uint32_t> > GetDataBlocks(uint32_t pos);
 std::string ReadLine();
 std::vector<std::string> ParseCommand(std::string cmd);
@@ -69,6 +71,7 @@ int main(int argc, char *argv[])
     Program::AvailableCommands["segments"] = &DoSegments;
     Program::AvailableCommands["clean"] = &DoClean;
     Program::AvailableCommands["show"] = &DoShow;
+    Program::AvailableCommands["compact"] = &DoCompact;
 
     // Set the type names up.
     SetTypeNames();
@@ -84,20 +87,29 @@ int main(int argc, char *argv[])
 
     // Open the package.
     Program::FS = new AppLib::LowLevel::FS(Program::FSStream);
+    if (!Program::FS->isValid())
+    {
+        AppLib::Logging::showErrorW("Unable to open the specified file as a package.");
+        return 1;
+    }
 
     // Package is now open.  Show the initial filesystem information and
     // start the main application loop.
     AppLib::LowLevel::INode node = Program::FS->getINodeByPosition(OFFSET_FSINFO);
     AppLib::Logging::showInfoW("INode ID: %i", node.inodeid);
     AppLib::Logging::showInfoO("INode Type: %i", node.type);
-    AppLib::Logging::showInfoO("Filesystem Name: %s", node.fs_name);
+    AppLib::Logging::showInfoO("Filesystem Name: %s", node.getFSInfo().fs_name);
     AppLib::Logging::showInfoO("Filesystem Version: %i.%i.%i", node.ver_major, node.ver_minor, node.ver_revision);
-    AppLib::Logging::showInfoO("Application Name: %s", node.app_name);
-    AppLib::Logging::showInfoO("Application Version: %s", node.app_ver);
-    AppLib::Logging::showInfoO("Application Description: %s", node.app_desc);
-    AppLib::Logging::showInfoO("Application Author: %s", node.app_author);
-    AppLib::Logging::showInfoO("Position of root directory INode: %p", node.pos_root);
-    AppLib::Logging::showInfoO("Position of freelist INode: %p", node.pos_freelist);
+    AppLib::Logging::showInfoO("Application Name: %s", node.getFSInfo().app_name);
+    AppLib::Logging::showInfoO("Application Version: %s", node.getFSInfo().app_ver);
+    AppLib::Logging::showInfoO("Application Description: %s", node.getFSInfo().app_desc);
+    AppLib::Logging::showInfoO("Application Author: %s", node.getFSInfo().app_author);
+    AppLib::Logging::showInfoO("Position of root directory INode: %u", node.pos_root);
+    AppLib::Logging::showInfoO("Position of freelist INode: %u", node.pos_freelist);
+    AppLib::Logging::showInfoO("Position of free space bitmap INode: %u", node.pos_bitmap);
+    AppLib::Logging::showInfoO("Free space bitmap generation: %u%s", node.bmap_gen,
+            (node.bmap_gen & 1) ? " (not cleanly closed)" : "");
+    AppLib::Logging::showInfoO("Position of metadata journal: %u (%u blocks)", node.pos_journal, node.len_journal);
     
     while (true)
     {
@@ -117,7 +129,11 @@ int main(int argc, char *argv[])
         }
         
         if (command[0] == "exit")
+        {
+            // Write back anything changed by 'clean'.
+            Program::FS->close();
             return 0;
+        }
 
         for (std::map<std::string, Program::CommandFunc>::iterator iter = Program::AvailableCommands.begin(); iter != Program::AvailableCommands.end(); iter++)
         {
@@ -143,6 +159,8 @@ void DoHelp(std::vector<std::string> cmd)
     printf("show <block num>    - Shows the binary representation of a block.\n");
     printf("segments            - Displays a representation of the types of each block in the package.\n");
     printf("clean               - Removes any temporary or invalid blocks in the package.\n");
+    printf("compact [blocks]    - Defragments files and shrinks the package.  If a number of blocks is\n");
+    printf("                      given, only moves that many (run it again to continue).\n");
 }
 
 /// <summary>
@@ -180,79 +198,74 @@ void DoSegments(std::vector<std::string> cmd)
     printf("_ = free block          F = file info       S = segment info\n");
     printf("# = data                D = directory       L = symbolic link\n");
     printf("T = temporary data      %% = freelist        H = hard link\n");
-    printf("I = filesystem info     ? = invalid           = unset\n");
+    printf("I = filesystem info     B = bitmap          ? = invalid\n");
+    printf("  = unset\n");
     printf("! = inaccessible (will be removed by the clean operation)\n");
     printf("\n");
-    printf("Header blocks: %i\n", headerblocks.size());
-    printf("Data blocks: %i\n", datablocks.size());
+    printf("Header blocks: %zu\n", headerblocks.size());
+    printf("Data blocks: %zu\n", datablocks.size());
     printf("\n");
     printf("/===============================================================\\\n");
     printf("|");
     uint32_t pos = OFFSET_FSINFO;
     int i = 0;
-    while (true)
+    uint32_t end = (uint32_t) Program::FSStream->size();
+    while (pos < end)
     {
-        try
+        AppLib::LowLevel::INode node = Program::FS->getINodeByPosition(pos);
+
+        if (i == 16)
         {
-            AppLib::LowLevel::INode node = Program::FS->getINodeByPosition(pos);
+            printf("\n");
+            printf("+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+\n");
+            printf("|");
+            i = 1;
+        }
+        else
+            i += 1;
 
-            if (i == 16)
-            {
-                printf("\n");
-                printf("+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+\n");
-                printf("|");
-                i = 1;
-            }
-            else
-                i += 1;
+        if (Program::FS->isBlockFree(pos))
+            printf(" _ |");
+        else
+        {
+            bool data = false;
+            bool header = false;
+            for (int a = 0; a < datablocks.size(); a += 1)
+                if (datablocks[a] == pos)
+                {
+                    data = true;
+                    break;
+                }
+            for (int a = 0; a < headerblocks.size(); a += 1)
+                if (headerblocks[a] == pos)
+                {
+                    header = true;
+                    break;
+                }
 
-            if (Program::FS->isBlockFree(pos))
-                printf(" _ |");
+            if (data)
+                printf(" # |");
+            else if (node.type < 0 || node.type > 255 || Program::TypeChars[node.type] == 0)
+                printf(" ? |");
+            else if (header || (node.type != AppLib::LowLevel::INodeType::INT_FILEINFO && node.type != AppLib::LowLevel::INodeType::INT_DIRECTORY))
+                printf(" %c |", Program::TypeChars[node.type]);
             else
-            {
-                bool data = false;
-                bool header = false;
-                for (int a = 0; a < datablocks.size(); a += 1)
-                    if (datablocks[a] == pos)
-                    {
-                        data = true;
-                        break;
-                    }
-                for (int a = 0; a < headerblocks.size(); a += 1)
-                    if (headerblocks[a] == pos)
-                    {
-                        header = true;
-                        break;
-                    }
+                printf(" %c!|", Program::TypeChars[node.type]);
+        }
 
-                if (data)
-                    printf(" # |");
-                else if (node.type < 0 || node.type > 255 || Program::TypeChars[node.type] == 0)
-                    printf(" ? |");
-                else if (header || (node.type != AppLib::LowLevel::INodeType::INT_FILEINFO && node.type != AppLib::LowLevel::INodeType::INT_DIRECTORY))
-                    printf(" %c |", Program::TypeChars[node.type]);
-                else
-                    printf(" %c!|", Program::TypeChars[node.type]);
-            }
+        pos += BSIZE_FILE;
+    }
 
-            pos += BSIZE_FILE;
-        }
-        catch (std::ifstream::failure e)
-        {
-            // End-of-file.
-            Program::FSStream->clear();
-            if (i == 16) printf("\n");
-            for (int a = i + 1; a <= 16; a += 1)
-            {
-                if (a == 16)
-                    printf("   |\n");
-                else
-                    printf("    ");
-            }
-            printf("\\===============================================================/\n");
-            return;
-        }
+    // End-of-file.
+    if (i == 16) printf("\n");
+    for (int a = i + 1; a <= 16; a += 1)
+    {
+        if (a == 16)
+            printf("   |\n");
+        else
+            printf("    ");
     }
+    printf("\\===============================================================/\n");
 }
 
 /// <summary>
@@ -274,90 +287,116 @@ void DoClean(std::vector<std::string> cmd)
     int cleaned_files = 0;
     int cleaned_directories = 0;
     int i = 0;
-    while (true)
+    uint32_t end = (uint32_t) Program::FSStream->size();
+    while (pos < end)
     {
-        try
+        AppLib::LowLevel::INode node = Program::FS->getINodeByPosition(pos);
+
+        if (!Program::FS->isBlockFree(pos))
         {
-            AppLib::LowLevel::INode node = Program::FS->getINodeByPosition(pos);
+            bool data = false;
+            bool header = false;
+            for (int a = 0; a < datablocks.size(); a += 1)
+                if (datablocks[a] == pos)
+                {
+                    data = true;
+                    break;
+                }
+            for (int a = 0; a < headerblocks.size(); a += 1)
+                if (headerblocks[a] == pos)
+                {
+                    header = true;
+                    break;
+                }
 
-            if (!Program::FS->isBlockFree(pos))
+            if (!data && !header)
             {
-                bool data = false;
-                bool header = false;
-                for (int a = 0; a < datablocks.size(); a += 1)
-                    if (datablocks[a] == pos)
+                // Check to see if we should 'free' it in the filesystem.
+                switch (node.type)
+                {
+                case AppLib::LowLevel::INodeType::INT_TEMPORARY:
+                    if (Program::FS->resetBlock(pos) == AppLib::LowLevel::FSResult::E_SUCCESS)
                     {
-                        data = true;
-                        break;
+                        cleaned += 1;
+                        cleaned_temporary += 1;
                     }
-                for (int a = 0; a < headerblocks.size(); a += 1)
-                    if (headerblocks[a] == pos)
+                    else
+                        failed += 1;
+                    break;
+                case AppLib::LowLevel::INodeType::INT_INVALID:
+                    if (Program::FS->resetBlock(pos) == AppLib::LowLevel::FSResult::E_SUCCESS)
                     {
-                        header = true;
-                        break;
+                        cleaned += 1;
+                        cleaned_invalid += 1;;
                     }
-
-                if (!data && !header)
-                {
-                    // Check to see if we should 'free' it in the filesystem.
-                    switch (node.type)
+                    else
+                        failed += 1;
+                    break;
+                case AppLib::LowLevel::INodeType::INT_FILEINFO:
+                    if (Program::FS->resetBlock(pos) == AppLib::LowLevel::FSResult::E_SUCCESS)
+                    {
+                        cleaned += 1;
+                        cleaned_files += 1;;
+                    }
+                    else
+                        failed += 1;
+                    break;
+                case AppLib::LowLevel::INodeType::INT_DIRECTORY:
+                    if (Program::FS->resetBlock(pos) == AppLib::LowLevel::FSResult::E_SUCCESS)
                     {
-                    case AppLib::LowLevel::INodeType::INT_TEMPORARY:
-                        if (Program::FS->resetBlock(pos) == AppLib::LowLevel::FSResult::E_SUCCESS)
-                        {
-                            cleaned += 1;
-                            cleaned_temporary += 1;
-                        }
-                        else
-                            failed += 1;
-                        break;
-                    case AppLib::LowLevel::INodeType::INT_INVALID:
-                        if (Program::FS->resetBlock(pos) == AppLib::LowLevel::FSResult::E_SUCCESS)
-                        {
-                            cleaned += 1;
-                            cleaned_invalid += 1;;
-                        }
-                        else
-                            failed += 1;
-                        break;
-                    case AppLib::LowLevel::INodeType::INT_FILEINFO:
-                        if (Program::FS->resetBlock(pos) == AppLib::LowLevel::FSResult::E_SUCCESS)
-                        {
-                            cleaned += 1;
-                            cleaned_files += 1;;
-                        }
-                        else
-                            failed += 1;
-                        break;
-                    case AppLib::LowLevel::INodeType::INT_DIRECTORY:
-                        if (Program::FS->resetBlock(pos) == AppLib::LowLevel::FSResult::E_SUCCESS)
-                        {
-                            cleaned += 1;
-                            cleaned_directories += 1;;
-                        }
-                        else
-                            failed += 1;
-                        break;
-                    default:
-                        // Do nothing?
-                        break;
+                        cleaned += 1;
+                        cleaned_directories += 1;;
                     }
+                    else
+                        failed += 1;
+                    break;
+                default:
+                    // Do nothing?
+                    break;
                 }
             }
-
-            pos += BSIZE_FILE;
-        }
-        catch (std::ifstream::failure e)
-        {
-            // End-of-file.
-            Program::FSStream->clear();
-            printf("Cleaned %i blocks (%i temporary, %i invalid, %i files, %i directories).\n",
-                cleaned, cleaned_temporary, cleaned_invalid, cleaned_files, cleaned_directories);
-            if (failed > 0)
-                printf("%i blocks could not be freed during cleaning.\n", failed);
-            return;
         }
+
+        pos += BSIZE_FILE;
+    }
+
+    // End-of-file.
+    printf("Cleaned %i blocks (%i temporary, %i invalid, %i files, %i directories).\n",
+        cleaned, cleaned_temporary, cleaned_invalid, cleaned_files, cleaned_directories);
+    if (failed > 0)
+        printf("%i blocks could not be freed during cleaning.\n", failed);
+}
+
+/// <summary>
+/// Defragments files and moves blocks out of the end of the package so that it can be shrunk.
+/// </summary>
+void DoCompact(std::vector<std::string> cmd)
+{
+    if (!CheckArguments("compact", cmd, 0, 1)) return;
+
+    uint32_t before = (uint32_t) Program::FSStream->size();
+    AppLib::LowLevel::CompactorStatistics start = Program::FS->getCompactorStatistics();
+    bool finished;
+    if (cmd.size() == 2)
+    {
+        std::istringstream ss(cmd[1]);
+        uint32_t budget = 0;
+        ss >> budget;
+        finished = Program::FS->compact(budget);
     }
+    else
+    {
+        while (!Program::FS->compact(COMPACT_BUDGET))
+            ;
+        finished = true;
+    }
+    AppLib::LowLevel::CompactorStatistics end = Program::FS->getCompactorStatistics();
+
+    printf("Moved %llu blocks (%llu files defragmented).\n",
+        (unsigned long long) (end.moved - start.moved), (unsigned long long) (end.files - start.files));
+    printf("Package size: %u bytes (was %u bytes).\n", (uint32_t) Program::FSStream->size(), before);
+    if (!finished)
+        printf("Compaction is not finished yet.\n");
 }
 
 /// <summary>
@@ -382,8 +421,7 @@ void DoShow(std::vector<std::string> cmd)
     for (int i = 0; i < BSIZE_FILE; i++)
     {
         char hd;
-        Program::FSStream->seekg(pos + i);
-        AppLib::LowLevel::Endian::doR(Program::FSStream, &hd, 1);
+        AppLib::LowLevel::Endian::doR(Program::FSStream, pos + i, &hd, 1);
         printf("%02X ", (unsigned char)hd);
         if (hd < 32 || hd == 127)
             charcache << "  ";
@@ -447,19 +485,11 @@ std::pair<std::vector<uint32_t>, std::vector<uint32_t> > GetDataBlocks(uint32_t
         case AppLib::LowLevel::INodeType::INT_FILEINFO:
             bpos = Program::FS->getINodePositionByID(children[i].inodeid);
             headers.insert(headers.begin(), bpos);
-            int spos;
-            for (int a = HSIZE_FILE; a < BSIZE_FILE; a += 4)
             {
-                Program::FSStream->seekg(bpos + a);
-                spos = 0;
-                AppLib::LowLevel::Endian::doR(Program::FSStream, reinterpret_cast<char *>(&spos), 4);
-
-                if (spos == 0)				
-                    break;
-                else
-                {
-                    positions.insert(positions.begin(), spos);
-                }
+                // This works for both segment list and extent files.
+                std::vector<uint32_t> blocks;
+                Program::FS->getFileBlocks(children[i].inodeid, 0, children[i].blocks, blocks);
+                positions.insert(positions.begin(), blocks.rbegin(), blocks.rend());
             }
             break;
         default:
@@ -592,12 +622,14 @@ void SetTypeNames()
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_FREEBLOCK] = "free";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_FILEINFO] = "file info";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_SEGINFO] = "segment info";
+    Program::TypeNames[AppLib::LowLevel::INodeType::INT_EXTENTS] = "extent block";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_DATA] = "data";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_DIRECTORY] = "directory";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_SYMLINK] = "symbolic link";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_DEVICE] = "device";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_TEMPORARY] = "temporary data";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_FREELIST] = "freelist block";
+    Program::TypeNames[AppLib::LowLevel::INodeType::INT_BITMAP] = "free space bitmap";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_FSINFO] = "filesystem info";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_INVALID] = "invalid";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_UNSET] = "unset";
@@ -605,12 +637,14 @@ void SetTypeNames()
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_FREEBLOCK] = '_';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_FILEINFO] = 'F';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_SEGINFO] = 'S';
+    Program::TypeChars[AppLib::LowLevel::INodeType::INT_EXTENTS] = 'E';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_DATA] = '#';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_DIRECTORY] = 'D';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_SYMLINK] = 'L';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_DEVICE] = 'D';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_TEMPORARY] = 'T';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_FREELIST] = '%';
+    Program::TypeChars[AppLib::LowLevel::INodeType::INT_BITMAP] = 'B';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_FSINFO] = 'I';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_INVALID] = '?';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_UNSET] = ' ';
@@ -2,6 +2,7 @@
 
 #include <libpackaged-fs/logging.h>
 #include <libpackaged-fs/internal/fuselink.h>
+#include <libpackaged-fs/internal/fuselowlevel.h>
 #include "config.h"
 #include "funcdefs.h"
 
@@ -19,14 +20,19 @@ int appmount_start(int argc, char *argv[])
     struct arg_lit *is_readonly = arg_lit0("r", "read-only", "mount the file readonly");
     struct arg_lit *is_debug = arg_lit0("d", "debug", "show debugging information");
     struct arg_lit *is_allow_other = arg_lit0("o", "allow-other", "allow other users to access mounted application");
+    struct arg_lit *is_high_level = arg_lit0(NULL, "high-level", "use the path-based FUSE interface");
+    struct arg_lit *is_compact = arg_lit0("c", "compact", "defragment and shrink the package while it is idle");
+    struct arg_dbl *attr_timeout = arg_dbl0(NULL, "attr-timeout", "<seconds>", "how long the kernel may cache attributes");
+    struct arg_dbl *entry_timeout = arg_dbl0(NULL, "entry-timeout", "<seconds>", "how long the kernel may cache directory entries");
+    struct arg_dbl *negative_timeout = arg_dbl0(NULL, "negative-timeout", "<seconds>", "how long the kernel may cache missing entries");
     struct arg_file *disk_image = arg_file1(NULL, NULL, "diskimage", "the image to read the data from");
     struct arg_file *mount_point = arg_file1(NULL, NULL, "mountpoint", "the directory to mount the image to");
     struct arg_lit *show_help = arg_lit0("h", "help", "show the help message");
     struct arg_end *end = arg_end(20);
 #ifdef DEBUG
-    void *argtable[] = { is_debug, is_allow_other, disk_image, mount_point, show_help, end };
+    void *argtable[] = { is_readonly, is_debug, is_allow_other, is_high_level, is_compact, attr_timeout, entry_timeout, negative_timeout, disk_image, mount_point, show_help, end };
 #else
-    void *argtable[] = { is_allow_other, disk_image, mount_point, show_help, end };
+    void *argtable[] = { is_readonly, is_allow_other, is_high_level, is_compact, attr_timeout, entry_timeout, negative_timeout, disk_image, mount_point, show_help, end };
 #endif
 
     // Check to see if the argument definitions were allocated
@@ -100,8 +106,26 @@ int appmount_start(int argc, char *argv[])
     AppLib::Logging::showInfoO("while mounted and that no other operations can be performed");
     AppLib::Logging::showInfoO("on it while this is the case.");
 
-    AppLib::FUSE::Mounter * mnt = new AppLib::FUSE::Mounter(disk_path, mount_path, true, is_allow_other->count, appmount_continue);
-    int ret = mnt->getResult();
+    // Timeouts that weren't given are left to the mounter.
+    AppLib::FUSE::FUSETimeouts timeouts;
+    if (attr_timeout->count)
+        timeouts.attr = attr_timeout->dval[0];
+    if (entry_timeout->count)
+        timeouts.entry = entry_timeout->dval[0];
+    if (negative_timeout->count)
+        timeouts.negative = negative_timeout->dval[0];
+
+    int ret;
+    if (is_high_level->count)
+    {
+        AppLib::FUSE::Mounter * mnt = new AppLib::FUSE::Mounter(disk_path, mount_path, true, is_allow_other->count, is_readonly->count, appmount_continue, timeouts);
+        ret = mnt->getResult();
+    }
+    else
+    {
+        AppLib::FUSE::LowLevelMounter * mnt = new AppLib::FUSE::LowLevelMounter(disk_path, mount_path, true, is_allow_other->count, is_readonly->count, appmount_continue, is_compact->count, timeouts);
+        ret = mnt->getResult();
+    }
 
     if (ret != 0)
     {
@@ -0,0 +1,381 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libpackaged-fs/logging.h>
+#include <libpackaged-fs/fsfile.h>
+#include <libpackaged-fs/lowlevel/fs.h>
+#include <libpackaged-fs/lowlevel/util.h>
+#include <libpackaged-fs/lowlevel/inodelayout.h>
+#include <argtable2.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <fstream>
+#include <sys/stat.h>
+
+// The number of bytes copied at a time when moving file data.
+#define REPACK_CHUNK (BSIZE_FILE * 64)
+
+namespace Program
+{
+    AppLib::LowLevel::BlockStream * SourceStream;
+    AppLib::LowLevel::FS * Source;
+    AppLib::LowLevel::BlockStream * TargetStream;
+    AppLib::LowLevel::FS * Target;
+
+    // The inodes of the source package, in the order they are to be
+    // laid out in the new package.
+    std::vector<uint16_t> Directories;
+    std::vector<uint16_t> Files;
+}
+
+bool CollectINodes();
+std::vector<uint16_t> GetDataOrder(const char * accessorder);
+bool CopyBootstrap();
+bool CopyDirectory(uint16_t id);
+bool CopyFile(uint16_t id);
+bool CopyChildren(uint16_t id);
+bool CopyData(uint16_t id);
+bool RestoreTimes(uint16_t id);
+
+int main(int argc, char *argv[])
+{
+    AppLib::Logging::setApplicationName("apprepack");
+#ifdef DEBUG
+    AppLib::Logging::debug = true;
+#endif
+
+    // Parse the arguments provided.
+    struct arg_file *access_order = arg_file0("a", "access-order", "<list>", "place the data of the files listed (one path per line) first, in that order");
+    struct arg_file *source_image = arg_file1(NULL, NULL, "source", "the package to read the data from");
+    struct arg_file *target_image = arg_file1(NULL, NULL, "target", "the package to create");
+    struct arg_lit *show_help = arg_lit0("h", "help", "show the help message");
+    struct arg_end *end = arg_end(20);
+    void *argtable[] = { access_order, source_image, target_image, show_help, end };
+
+    // Check to see if the argument definitions were allocated
+    // correctly.
+    if (arg_nullcheck(argtable))
+    {
+        AppLib::Logging::showErrorW("Insufficient memory.");
+        return 1;
+    }
+
+    // Now parse the arguments.
+    int nerrors = arg_parse(argc, argv, argtable);
+    if (nerrors > 0 || show_help->count == 1)
+    {
+        printf("Usage: apprepack");
+        arg_print_syntax(stdout, argtable, "\n");
+        if (show_help->count == 1)
+        {
+            printf("Rewrites a package so that its data can be read sequentially.\n\n");
+            arg_print_glossary(stdout, argtable, "    %-25s %s\n");
+            return 0;
+        }
+        arg_print_errors(stdout, end, "apprepack");
+        return 1;
+    }
+    std::string source_path = source_image->filename[0];
+    std::string target_path = target_image->filename[0];
+
+    // Make sure that we're not about to overwrite the package we're
+    // reading from.
+    struct stat source_info, target_info;
+    if (stat(source_path.c_str(), &source_info) != 0)
+    {
+        AppLib::Logging::showErrorW("Unable to find package '%s'.", source_path.c_str());
+        return 1;
+    }
+    if (stat(target_path.c_str(), &target_info) == 0 &&
+            source_info.st_dev == target_info.st_dev &&
+            source_info.st_ino == target_info.st_ino)
+    {
+        AppLib::Logging::showErrorW("The new package can not replace the one being repacked.");
+        return 1;
+    }
+
+    // Open the existing package.
+    Program::SourceStream = new AppLib::LowLevel::BlockStream(source_path, true);
+    if (!Program::SourceStream->is_open())
+    {
+        AppLib::Logging::showErrorW("Unable to open specified file as a block stream.  Make");
+        AppLib::Logging::showErrorO("sure the file is not currently in use.");
+        return 1;
+    }
+    Program::Source = new AppLib::LowLevel::FS(Program::SourceStream);
+    if (!Program::Source->isValid())
+    {
+        AppLib::Logging::showErrorW("Unable to open '%s' as a package.", source_path.c_str());
+        return 1;
+    }
+
+    // Work out where everything is going to go before creating
+    // the new package.
+    if (!CollectINodes())
+        return 1;
+    std::vector<uint16_t> order = GetDataOrder(access_order->count ? access_order->filename[0] : NULL);
+
+    // Create the new package with the same application information.
+    AppLib::LowLevel::INode fsinfo = Program::Source->getINodeByPosition(OFFSET_FSINFO);
+    if (!AppLib::LowLevel::Util::createPackage(target_path, fsinfo.getFSInfo().app_name,
+                fsinfo.getFSInfo().app_ver, fsinfo.getFSInfo().app_desc, fsinfo.getFSInfo().app_author))
+    {
+        AppLib::Logging::showErrorW("Unable to create new package '%s'.", target_path.c_str());
+        return 1;
+    }
+    chmod(target_path.c_str(), source_info.st_mode & 07777);
+    Program::TargetStream = new AppLib::LowLevel::BlockStream(target_path);
+    if (!Program::TargetStream->is_open())
+    {
+        AppLib::Logging::showErrorW("Unable to open new package '%s'.", target_path.c_str());
+        return 1;
+    }
+    // A journal would sit between the FSInfo block and the inodes,
+    // and is only needed once the package is mounted for writing.
+    Program::Target = new AppLib::LowLevel::FS(Program::TargetStream, false);
+
+    // Nothing has been freed in the new package, so each block is
+    // allocated at the end of it.  Writing the inodes and then the
+    // data in order therefore lays the package out in that order.
+    bool success = CopyBootstrap();
+    for (unsigned int i = 0; i < Program::Directories.size() && success; i += 1)
+        success = CopyDirectory(Program::Directories[i]);
+    for (unsigned int i = 0; i < Program::Files.size() && success; i += 1)
+        success = CopyFile(Program::Files[i]);
+    for (unsigned int i = 0; i < Program::Directories.size() && success; i += 1)
+        success = CopyChildren(Program::Directories[i]);
+    for (unsigned int i = 0; i < order.size() && success; i += 1)
+        success = CopyData(order[i]);
+
+    // Adding children and data updates the times, so put them back.
+    for (unsigned int i = 0; i < Program::Directories.size() && success; i += 1)
+        success = RestoreTimes(Program::Directories[i]);
+    for (unsigned int i = 0; i < Program::Files.size() && success; i += 1)
+        success = RestoreTimes(Program::Files[i]);
+
+    Program::Target->close();
+    Program::Source->close();
+    if (!success)
+    {
+        AppLib::Logging::showErrorW("Unable to repack '%s'.", source_path.c_str());
+        return 1;
+    }
+
+    AppLib::Logging::showInfoW("Repacked %u directories and %u files into '%s'.",
+            (unsigned int) Program::Directories.size(), (unsigned int) Program::Files.size(),
+            target_path.c_str());
+    return 0;
+}
+
+bool CollectINodes()
+{
+    // Walk the tree breadth-first from the root, so that the inodes of
+    // each directory end up next to each other.
+    std::set<uint16_t> seen;
+    std::deque<uint16_t> pending;
+    pending.push_back(0);
+    seen.insert(0);
+    Program::Directories.push_back(0);
+    while (pending.size() > 0)
+    {
+        uint16_t id = pending.front();
+        pending.pop_front();
+
+        std::vector<uint16_t> children = Program::Source->getChildIDsOfDirectory(id);
+        for (unsigned int i = 0; i < children.size(); i += 1)
+        {
+            if (!seen.insert(children[i]).second)
+                continue;
+            AppLib::LowLevel::INode node = Program::Source->getRealINodeByID(children[i]);
+            if (node.type == AppLib::LowLevel::INodeType::INT_DIRECTORY)
+            {
+                Program::Directories.push_back(children[i]);
+                pending.push_back(children[i]);
+            }
+            else if (node.type == AppLib::LowLevel::INodeType::INT_INVALID)
+            {
+                AppLib::Logging::showErrorW("Unable to read inode %u.", children[i]);
+                return false;
+            }
+            else
+                Program::Files.push_back(children[i]);
+        }
+    }
+
+    // Hardlinks may refer to a file that is no longer in any directory,
+    // which still has to be copied.
+    for (unsigned int i = 0; i < Program::Files.size(); i += 1)
+    {
+        AppLib::LowLevel::INode node = Program::Source->getRealINodeByID(Program::Files[i]);
+        if (node.type == AppLib::LowLevel::INodeType::INT_HARDLINK && seen.insert(node.realid).second)
+            Program::Files.push_back(node.realid);
+    }
+
+    return true;
+}
+
+std::vector<uint16_t> GetDataOrder(const char * accessorder)
+{
+    std::vector<uint16_t> order;
+    std::set<uint16_t> placed;
+
+    // Files named in the access order list go first.
+    if (accessorder != NULL)
+    {
+        std::ifstream list(accessorder);
+        if (!list.is_open())
+            AppLib::Logging::showWarningW("Unable to read access order list '%s'; ignoring it.", accessorder);
+        std::string path;
+        while (std::getline(list, path))
+        {
+            if (path.length() == 0)
+                continue;
+            int32_t id = Program::Source->resolvePathnameToINodeID(path);
+            if (id < 0)
+            {
+                AppLib::Logging::showWarningW("'%s' is not in the package; ignoring it.", path.c_str());
+                continue;
+            }
+            id = Program::Source->getINodeByID(id).inodeid;
+            if (placed.insert(id).second)
+                order.push_back(id);
+        }
+    }
+
+    // Then everything else, in the same order as the inodes.
+    for (unsigned int i = 0; i < Program::Files.size(); i += 1)
+        if (placed.insert(Program::Files[i]).second)
+            order.push_back(Program::Files[i]);
+
+    return order;
+}
+
+bool CopyBootstrap()
+{
+    std::vector<char> data(LENGTH_BOOTSTRAP);
+    if (Program::SourceStream->readAt(OFFSET_BOOTSTRAP, &data[0], LENGTH_BOOTSTRAP) != LENGTH_BOOTSTRAP ||
+            Program::TargetStream->writeAt(OFFSET_BOOTSTRAP, &data[0], LENGTH_BOOTSTRAP) != LENGTH_BOOTSTRAP)
+    {
+        AppLib::Logging::showErrorW("Unable to copy the bootstrap.");
+        return false;
+    }
+    return true;
+}
+
+bool CopyDirectory(uint16_t id)
+{
+    // The children are added afterwards, once all of them exist.
+    AppLib::LowLevel::INode node = Program::Source->getRealINodeByID(id);
+    node.children_count = 0;
+
+    // The root directory has already been created with the package.
+    AppLib::LowLevel::FSResult::FSResult res;
+    if (id == 0)
+        res = Program::Target->updateINode(node);
+    else
+    {
+        uint32_t pos = Program::Target->getFirstFreeBlock(AppLib::LowLevel::INodeType::INT_DIRECTORY);
+        res = Program::Target->writeINode(pos, node);
+    }
+    if (res != AppLib::LowLevel::FSResult::E_SUCCESS)
+    {
+        AppLib::Logging::showErrorW("Unable to write directory inode %u.", id);
+        return false;
+    }
+    return true;
+}
+
+bool CopyFile(uint16_t id)
+{
+    // The data is written afterwards, so the new inode starts out empty
+    // (and uses extents, whatever the original did).
+    AppLib::LowLevel::INode node = Program::Source->getRealINodeByID(id);
+    if (node.type == AppLib::LowLevel::INodeType::INT_FILEINFO ||
+            node.type == AppLib::LowLevel::INodeType::INT_SYMLINK)
+    {
+        node.dat_len = 0;
+        node.blocks = 0;
+        node.info_next = 0;
+        node.flags = AppLib::LowLevel::INodeLayout::File::FLAG_EXTENTS;
+    }
+
+    uint32_t pos = Program::Target->getFirstFreeBlock(AppLib::LowLevel::INodeType::INT_FILEINFO);
+    if (Program::Target->writeINode(pos, node) != AppLib::LowLevel::FSResult::E_SUCCESS)
+    {
+        AppLib::Logging::showErrorW("Unable to write inode %u.", id);
+        return false;
+    }
+    return true;
+}
+
+bool CopyChildren(uint16_t id)
+{
+    std::vector<uint16_t> children = Program::Source->getChildIDsOfDirectory(id);
+    for (unsigned int i = 0; i < children.size(); i += 1)
+    {
+        if (Program::Target->addChildToDirectoryINode(id, children[i]) != AppLib::LowLevel::FSResult::E_SUCCESS)
+        {
+            AppLib::Logging::showErrorW("Unable to add inode %u to directory %u.", children[i], id);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CopyData(uint16_t id)
+{
+    AppLib::LowLevel::INode node = Program::Source->getRealINodeByID(id);
+    if ((node.type != AppLib::LowLevel::INodeType::INT_FILEINFO &&
+                node.type != AppLib::LowLevel::INodeType::INT_SYMLINK) ||
+            node.dat_len == 0)
+        return true;
+
+    // Allocate all of the file's blocks at once so that they form a
+    // single run, then fill them in.
+    if (Program::Target->truncateFile(id, node.dat_len) != AppLib::LowLevel::FSResult::E_SUCCESS)
+    {
+        AppLib::Logging::showErrorW("Unable to allocate %u bytes for inode %u.", node.dat_len, id);
+        return false;
+    }
+
+    AppLib::FSFile in(Program::Source, Program::SourceStream, id);
+    AppLib::FSFile out(Program::Target, Program::TargetStream, id);
+    in.open(std::ios_base::in);
+    out.open(std::ios_base::out);
+    std::vector<char> data(REPACK_CHUNK);
+    uint32_t remaining = node.dat_len;
+    while (remaining > 0 && in.good() && out.good())
+    {
+        std::streamsize count = in.read(&data[0], std::min<uint32_t>(remaining, REPACK_CHUNK));
+        if (count <= 0)
+            break;
+        out.write(&data[0], count);
+        remaining -= count;
+    }
+    in.close();
+    out.close();
+
+    if (remaining > 0 || out.fail())
+    {
+        AppLib::Logging::showErrorW("Unable to copy the data of inode %u.", id);
+        return false;
+    }
+    return true;
+}
+
+bool RestoreTimes(uint16_t id)
+{
+    AppLib::LowLevel::INode original = Program::Source->getRealINodeByID(id);
+    AppLib::LowLevel::INode node = Program::Target->getRealINodeByID(id);
+    node.atime = original.atime;
+    node.mtime = original.mtime;
+    node.ctime = original.ctime;
+    if (Program::Target->updateINode(node) != AppLib::LowLevel::FSResult::E_SUCCESS)
+    {
+        AppLib::Logging::showErrorW("Unable to update inode %u.", id);
+        return false;
+    }
+    return true;
+}